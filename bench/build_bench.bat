@@ -0,0 +1,5 @@
+@echo off
+rem Builds the hot-function microbenchmark. Run from a VS developer prompt; use
+rem the x86 prompt to match the proxy DLL.
+cd /d "%~dp0"
+cl /nologo /O2 /EHsc /std:c++17 proxy_bench.cpp /Fe:proxy_bench.exe
@@ -0,0 +1,6 @@
+#!/bin/sh
+# Builds the hot-function microbenchmark on Linux/macOS.
+set -e
+cd "$(dirname "$0")"
+CXX=${CXX:-g++}
+$CXX -O2 -std=c++17 -Wall -o proxy_bench proxy_bench.cpp
@@ -0,0 +1,477 @@
+/**
+ * proxy_bench - Microbenchmarks for the proxy's hot functions
+ *
+ * Times the functions the proxy runs per upload, per draw and per frame,
+ * compiled from the same headers the proxy uses (proxy_math.h,
+ * camera_detect.h, draw_batch.h, proxy_log.h). Every benchmark walks a
+ * fixed-seed input set: warm-up passes first, then timed samples, each one a
+ * full pass over the set reported as ns per call. The thread is pinned to one
+ * CPU so samples don't migrate between cores.
+ *
+ * Results go to stdout as a table and to a JSON file with one benchmark per
+ * line in a fixed order and no timestamps, so two commits' results diff
+ * cleanly. Each entry carries a checksum of the outputs, which changes when a
+ * function's behavior does.
+ *
+ * Usage: proxy_bench [-o results.json] [-samples N] [-warmup N] [-cpu N] [-filter substring]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+#include "../proxy_math.h"
+#include "../proxy_log.h"
+#include "../camera_detect.h"
+#include "../draw_batch.h"
+
+static const int kInputs = 1024;
+
+// Deterministic stream, seeded per input set
+struct Rng {
+    uint64_t state;
+    explicit Rng(uint64_t seed) : state(seed) {}
+    uint64_t Next() { return HashMix64(state += 0x9e3779b97f4a7c15ULL); }
+    float Uniform(float lo, float hi) { return lo + (hi - lo) * (float)(Next() >> 40) / (float)(1 << 24); }
+};
+
+// View matrix as the proxy sees it in c5-c8: rotation rows, then [T, 1]
+static void RandomView(Rng& rng, float translation, float* m) {
+    // Random unit quaternion -> rotation rows
+    float q[4], len = 0.0f;
+    for (int i = 0; i < 4; i++) {
+        q[i] = rng.Uniform(-1.0f, 1.0f);
+        len += q[i] * q[i];
+    }
+    len = sqrtf(len);
+    for (int i = 0; i < 4; i++) q[i] /= len;
+    float x = q[0], y = q[1], z = q[2], w = q[3];
+    float r[9] = {
+        1 - 2 * (y * y + z * z), 2 * (x * y + z * w), 2 * (x * z - y * w),
+        2 * (x * y - z * w), 1 - 2 * (x * x + z * z), 2 * (y * z + x * w),
+        2 * (x * z + y * w), 2 * (y * z - x * w), 1 - 2 * (x * x + y * y)
+    };
+    for (int row = 0; row < 3; row++) {
+        m[row * 4 + 0] = r[row * 3 + 0];
+        m[row * 4 + 1] = r[row * 3 + 1];
+        m[row * 4 + 2] = r[row * 3 + 2];
+        m[row * 4 + 3] = 0.0f;
+    }
+    m[12] = rng.Uniform(-translation, translation);
+    m[13] = rng.Uniform(-translation, translation);
+    m[14] = rng.Uniform(-translation, translation);
+    m[15] = 1.0f;
+}
+
+// Mixed matrices like the register windows the proxy inspects
+struct MatrixInputs {
+    std::vector<D3DMATRIX> m;
+
+    MatrixInputs() : m(kInputs) {
+        Rng rng(1);
+        for (int i = 0; i < kInputs; i++) {
+            float* f = &m[i]._11;
+            switch (i % 5) {
+                case 0: case 1: RandomView(rng, 5000.0f, f); break;
+                case 2: CreateProjectionMatrix(&m[i], rng.Uniform(0.5f, 2.0f), 16.0f / 9.0f, 10.0f, 100000.0f); break;
+                case 3: {
+                    D3DMATRIX view, proj;
+                    RandomView(rng, 5000.0f, &view._11);
+                    CreateProjectionMatrix(&proj, 1.5708f, 16.0f / 9.0f, 10.0f, 100000.0f);
+                    MultiplyMatrix(&m[i], view, proj);
+                    break;
+                }
+                default:
+                    for (int k = 0; k < 16; k++) f[k] = rng.Uniform(-100.0f, 100.0f);
+                    break;
+            }
+        }
+    }
+};
+
+// One SetVertexShaderConstantF call: UE3 uploads c0-c8 for the main camera, c0-c3 per object
+struct Upload {
+    unsigned start;
+    unsigned count;
+    float data[9 * 4];
+};
+
+struct UploadInputs {
+    std::vector<Upload> uploads;
+    float eye[3];
+
+    UploadInputs() : uploads(kInputs) {
+        Rng rng(2);
+        float mainView[16];
+        RandomView(rng, 5000.0f, mainView);
+        EyeFromView(mainView, eye);
+        for (int i = 0; i < kInputs; i++) {
+            Upload& u = uploads[i];
+            for (int k = 0; k < 36; k++) u.data[k] = rng.Uniform(-1.0f, 1.0f);
+            switch (i % 8) {
+                case 0:     // Main camera
+                    u.start = 0;
+                    u.count = 9;
+                    memcpy(u.data + 20, mainView, sizeof(mainView));
+                    break;
+                case 1:     // Shadow or reflection camera
+                    u.start = 0;
+                    u.count = 9;
+                    RandomView(rng, 5000.0f, u.data + 20);
+                    break;
+                case 2:     // UI view near the origin
+                    u.start = 0;
+                    u.count = 9;
+                    RandomView(rng, 10.0f, u.data + 20);
+                    break;
+                default:    // Per-object MVP
+                    u.start = 0;
+                    u.count = 4;
+                    break;
+            }
+        }
+    }
+};
+
+static MatrixInputs* g_matrices;
+static UploadInputs* g_uploads;
+static FILE* g_logSink;
+
+// The c5-c8 path in SetVertexShaderConstantF, in the proxy's order; eye = locked PS eye or null
+static uint64_t DetectUploads(const float* eye) {
+    DetectParams params;
+    uint64_t sum = 0;
+    D3DMATRIX mvp;
+    for (const Upload& u : g_uploads->uploads) {
+        if (u.start <= 5 && u.start + u.count >= 9) {
+            const float* view = u.data + (5 - u.start) * 4;
+            ViewVerdict verdict = VIEW_WORLD;
+            bool atEye = eye && ViewSitsAtEye(view, eye, params);
+            if (!atEye) verdict = ClassifyViewMatrix(view, params);
+            if (eye && !atEye && verdict == VIEW_WORLD) verdict = VIEW_REJECT;   // Secondary camera
+            sum = sum * 31 + verdict;
+        }
+        if (u.start == 0 && u.count >= 4) {
+            TransposeFromRegisters(&mvp, u.data);
+            sum += (uint64_t)(mvp._44 != 0.0f);
+        }
+    }
+    return sum;
+}
+
+static uint64_t BenchLooksLikeMatrix() {
+    uint64_t sum = 0;
+    for (const D3DMATRIX& m : g_matrices->m) sum = sum * 31 + LooksLikeMatrix(&m._11);
+    return sum;
+}
+
+static uint64_t BenchLooksLikeView() {
+    uint64_t sum = 0;
+    for (const D3DMATRIX& m : g_matrices->m) sum = sum * 31 + LooksLikeView(m);
+    return sum;
+}
+
+static uint64_t BenchLooksLikeProjection() {
+    uint64_t sum = 0;
+    for (const D3DMATRIX& m : g_matrices->m) sum = sum * 31 + LooksLikeProjection(m, 0.1f, 2.5f);
+    return sum;
+}
+
+static uint64_t BenchClassifyViewMatrix() {
+    DetectParams params;
+    uint64_t sum = 0;
+    for (const D3DMATRIX& m : g_matrices->m) sum = sum * 31 + ClassifyViewMatrix(&m._11, params);
+    return sum;
+}
+
+static uint64_t BenchExtractView() {
+    uint64_t sum = 0;
+    D3DMATRIX view;
+    for (const D3DMATRIX& m : g_matrices->m) {
+        ExtractViewFromViewProjection(m, &view);
+        uint32_t bits;
+        memcpy(&bits, &view._41, sizeof(bits));
+        sum = sum * 31 + bits;
+    }
+    return sum;
+}
+
+static uint64_t BenchCreateProjection() {
+    uint64_t sum = 0;
+    D3DMATRIX proj;
+    for (int i = 0; i < kInputs; i++) {
+        CreateProjectionMatrix(&proj, 0.5f + i * (1.5f / kInputs), 16.0f / 9.0f, 10.0f, 100000.0f);
+        uint32_t bits;
+        memcpy(&bits, &proj._22, sizeof(bits));
+        sum = sum * 31 + bits;
+    }
+    return sum;
+}
+
+static uint64_t BenchInvertMatrix() {
+    uint64_t sum = 0;
+    D3DMATRIX inv;
+    for (const D3DMATRIX& m : g_matrices->m) sum = sum * 31 + InvertMatrix(&inv, m);
+    return sum;
+}
+
+// World reconstruction per draw: MVP x (View x Proj)^-1
+static uint64_t BenchWorldReconstruction() {
+    uint64_t sum = 0;
+    D3DMATRIX world;
+    const D3DMATRIX& viewProjInv = g_matrices->m[3];
+    for (const D3DMATRIX& m : g_matrices->m) {
+        MultiplyMatrix(&world, m, viewProjInv);
+        uint32_t bits;
+        memcpy(&bits, &world._41, sizeof(bits));
+        sum = sum * 31 + bits;
+    }
+    return sum;
+}
+
+static uint64_t BenchDetectFull() { return DetectUploads(nullptr); }
+static uint64_t BenchDetectEye() { return DetectUploads(g_uploads->eye); }
+
+// Present: frame history update and the median the hitch detector reads
+static uint64_t BenchPresentBookkeeping() {
+    static FrameTimeHistory history;
+    Rng rng(3);
+    uint64_t sum = 0;
+    for (int i = 0; i < kInputs; i++) {
+        history.Add(rng.Uniform(14.0f, 20.0f));
+        float median = history.Median();
+        uint32_t bits;
+        memcpy(&bits, &median, sizeof(bits));
+        sum = sum * 31 + (bits >> 8);
+    }
+    return sum;
+}
+
+// Geometry ID per draw
+static uint64_t BenchGeometryId() {
+    uint64_t h = 0;
+    for (int i = 0; i < kInputs; i++) {
+        h = HashMix64(h ^ (uint64_t)i);
+        h = HashMix64(h ^ ((uint64_t)i << 32 | 36));
+    }
+    return h;
+}
+
+static void ClassifyInputs(FrameArena& arena, DrawBatch& batch, FrustumPlanes& planes) {
+    arena.Init(1 << 20);
+    batch.Reserve(arena, kInputs);
+    Rng rng(4);
+    for (int i = 0; i < kInputs; i++) {
+        float c[3] = { rng.Uniform(-20000, 20000), rng.Uniform(-20000, 20000), rng.Uniform(-20000, 20000) };
+        float e[3] = { rng.Uniform(50, 1000), rng.Uniform(50, 1000), rng.Uniform(50, 1000) };
+        batch.Push(c, e, (uint64_t)i, 0);
+    }
+    D3DMATRIX proj;
+    CreateProjectionMatrix(&proj, 1.5708f, 16.0f / 9.0f, 10.0f, 100000.0f);
+    ExtractFrustumPlanes(&proj._11, &planes);
+}
+
+static uint64_t BenchClassifyBatch() {
+    static FrameArena arena;
+    static DrawBatch batch;
+    static FrustumPlanes planes;
+    if (!batch.count) ClassifyInputs(arena, batch, planes);
+    ClassifyBatch(planes, batch);
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < batch.count; i++) sum = sum * 31 + batch.visibility[i];
+    return sum;
+}
+
+// True when box i touches a plane to within rounding of the plane test's terms
+static bool OnPlaneBoundary(const FrustumPlanes& f, const DrawBatch& b, uint32_t i) {
+    for (int p = 0; p < 6; p++) {
+        float x = f.nx[p] * b.cx[i], y = f.ny[p] * b.cy[i], z = f.nz[p] * b.cz[i];
+        float dist = x + y + z + f.d[p];
+        float radius = fabsf(f.nx[p]) * b.ex[i] + fabsf(f.ny[p]) * b.ey[i] + fabsf(f.nz[p]) * b.ez[i];
+        float scale = fabsf(x) + fabsf(y) + fabsf(z) + fabsf(f.d[p]) + radius;
+        float slack = 1.0e-5f * scale;
+        if (fabsf(dist - radius) <= slack || fabsf(dist + radius) <= slack) return true;
+    }
+    return false;
+}
+
+// The SIMD kernel against the scalar reference, on the benchmark's boxes plus boxes placed
+// to just touch a plane. Disagreements are allowed only on a plane boundary.
+static int CheckClassifyBatch() {
+    FrameArena arena;
+    DrawBatch batch;
+    FrustumPlanes planes;
+    ClassifyInputs(arena, batch, planes);
+    batch.Reserve(arena, kInputs * 2);
+    Rng rng(5);
+    for (int i = 0; i < kInputs; i++) {
+        int p = i % 6;
+        float c[3] = { rng.Uniform(-20000, 20000), rng.Uniform(-20000, 20000), rng.Uniform(10, 50000) };
+        float dist = planes.nx[p] * c[0] + planes.ny[p] * c[1] + planes.nz[p] * c[2] + planes.d[p];
+        float sum = fabsf(planes.nx[p]) + fabsf(planes.ny[p]) + fabsf(planes.nz[p]);
+        float e = sum > 0.0f ? fabsf(dist) / sum : 0.0f;
+        float extent[3] = { e, e, e };
+        batch.Push(c, extent, (uint64_t)(kInputs + i), 0);
+    }
+
+    ClassifyBatchScalar(planes, batch);
+    std::vector<uint8_t> scalar(batch.visibility, batch.visibility + batch.count);
+    ClassifyBatch(planes, batch);
+    int mismatches = 0, boundary = 0;
+    for (uint32_t i = 0; i < batch.count; i++) {
+        if (batch.visibility[i] == scalar[i]) continue;
+        if (OnPlaneBoundary(planes, batch, i)) {
+            boundary++;
+        } else {
+            fprintf(stderr, "ClassifyBatch: box %u is %d, scalar path says %d\n", i, batch.visibility[i], scalar[i]);
+            mismatches++;
+        }
+    }
+    printf("ClassifyBatch vs scalar: %u boxes, %d differ on a plane boundary, %d mismatched\n\n",
+           batch.count, boundary, mismatches);
+    return mismatches;
+}
+
+static void LogLine(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    WriteLogLine(g_logSink, fmt, args);
+    va_end(args);
+}
+
+// A status dump line, formatted and flushed like LogMsg
+static uint64_t BenchLogMsg() {
+    for (int i = 0; i < 64; i++) {
+        LogLine("  Frame time: last %.2f ms, median %.2f ms", 16.0f + i * 0.01f, 16.5f);
+    }
+    rewind(g_logSink);
+    return 64;
+}
+
+struct Benchmark {
+    const char* name;
+    int calls;                      // Calls per pass, for ns per call
+    uint64_t (*run)();
+};
+
+static const Benchmark kBenchmarks[] = {
+    { "LooksLikeMatrix", kInputs, BenchLooksLikeMatrix },
+    { "LooksLikeView", kInputs, BenchLooksLikeView },
+    { "LooksLikeProjection", kInputs, BenchLooksLikeProjection },
+    { "ClassifyViewMatrix", kInputs, BenchClassifyViewMatrix },
+    { "ExtractViewFromViewProjection", kInputs, BenchExtractView },
+    { "CreateProjectionMatrix", kInputs, BenchCreateProjection },
+    { "InvertMatrix", kInputs, BenchInvertMatrix },
+    { "WorldReconstruction", kInputs, BenchWorldReconstruction },
+    { "SetVertexShaderConstantF.detect", kInputs, BenchDetectFull },
+    { "SetVertexShaderConstantF.detect_eye", kInputs, BenchDetectEye },
+    { "Present.bookkeeping", kInputs, BenchPresentBookkeeping },
+    { "GeometryId", kInputs, BenchGeometryId },
+    { "ClassifyBatch", kInputs, BenchClassifyBatch },
+    { "LogMsg", 64, BenchLogMsg },
+};
+
+struct Result {
+    const char* name;
+    int calls;
+    uint64_t checksum;
+    double minNs, p50Ns, p90Ns, p99Ns;
+};
+
+static bool PinToCpu(int cpu) {
+#ifdef _WIN32
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#endif
+}
+
+static double Percentile(const std::vector<double>& sorted, double p) {
+    size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+int main(int argc, char** argv) {
+    const char* outPath = "bench_results.json";
+    const char* filter = nullptr;
+    int samples = 200, warmup = 20, cpu = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) outPath = argv[++i];
+        else if (!strcmp(argv[i], "-samples") && i + 1 < argc) samples = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-warmup") && i + 1 < argc) warmup = std::max(0, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-cpu") && i + 1 < argc) cpu = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-filter") && i + 1 < argc) filter = argv[++i];
+        else {
+            fprintf(stderr, "usage: %s [-o results.json] [-samples N] [-warmup N] [-cpu N] [-filter substring]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!PinToCpu(cpu)) fprintf(stderr, "warning: could not pin to CPU %d, samples may migrate\n", cpu);
+
+    g_matrices = new MatrixInputs();
+    g_uploads = new UploadInputs();
+    g_logSink = tmpfile();
+    if (!g_logSink) {
+        fprintf(stderr, "cannot create a temporary file for the LogMsg benchmark\n");
+        return 1;
+    }
+
+    // Bring the core out of its idle clock before the first sample
+    auto spinUntil = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+    volatile uint64_t spin = 0;
+    while (std::chrono::steady_clock::now() < spinUntil) spin = spin + BenchGeometryId();
+
+    if ((!filter || strstr("ClassifyBatch", filter)) && CheckClassifyBatch()) return 1;
+
+    std::vector<Result> results;
+    printf("%-36s %8s %10s %10s %10s %10s\n", "benchmark", "calls", "min ns", "p50 ns", "p90 ns", "p99 ns");
+    for (const Benchmark& b : kBenchmarks) {
+        if (filter && !strstr(b.name, filter)) continue;
+        uint64_t checksum = 0;
+        for (int w = 0; w < warmup; w++) b.run();
+
+        std::vector<double> ns(samples);
+        for (int s = 0; s < samples; s++) {
+            auto start = std::chrono::steady_clock::now();
+            checksum = b.run();
+            auto end = std::chrono::steady_clock::now();
+            ns[s] = std::chrono::duration<double, std::nano>(end - start).count() / b.calls;
+        }
+        std::sort(ns.begin(), ns.end());
+        Result r = { b.name, b.calls, checksum, ns.front(), Percentile(ns, 0.5), Percentile(ns, 0.9), Percentile(ns, 0.99) };
+        results.push_back(r);
+        printf("%-36s %8d %10.2f %10.2f %10.2f %10.2f\n", r.name, r.calls, r.minNs, r.p50Ns, r.p90Ns, r.p99Ns);
+    }
+
+    FILE* f = fopen(outPath, "w");
+    if (!f) {
+        fprintf(stderr, "%s: cannot write results\n", outPath);
+        return 1;
+    }
+    fprintf(f, "{\n  \"schema\": 1,\n  \"samples\": %d,\n  \"warmup\": %d,\n  \"benchmarks\": [\n", samples, warmup);
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"calls\": %d, \"checksum\": \"%016llx\", \"min_ns\": %.2f, \"p50_ns\": %.2f, \"p90_ns\": %.2f, \"p99_ns\": %.2f}%s\n",
+                r.name, r.calls, (unsigned long long)r.checksum, r.minNs, r.p50Ns, r.p90Ns, r.p99Ns,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+    printf("\nResults written to %s\n", outPath);
+    return 0;
+}
@@ -0,0 +1,71 @@
+/**
+ * camera_detect.h - View matrix detection core
+ *
+ * Portable (no Windows/D3D dependencies) so the proxy and the offline tools
+ * under tools/ run the exact same test on the exact same data.
+ *
+ * Mirror's Edge uploads the view matrix to c5-c8 as rows:
+ *   c5-c7 = rotation rows (w = 0), c8 = [Tx, Ty, Tz, 1]
+ */
+
+#pragma once
+
+#include <cmath>
+
+struct DetectParams {
+    float normTolerance = 0.15f;    // |row length - 1| allowed for each rotation row
+    float wTolerance = 0.01f;       // |w - expected| allowed for c5-c8.w
+    float minTranslation = 50.0f;   // Below this the matrix is a UI/screen-space view
+};
+
+enum ViewVerdict {
+    VIEW_REJECT = 0,                // Not a view matrix
+    VIEW_SMALL_TRANSLATION,         // View-shaped but too close to the origin (UI)
+    VIEW_WORLD                      // 3D camera
+};
+
+// m = 16 floats as uploaded (4 registers); translation receives |T| when non-null
+inline ViewVerdict ClassifyViewMatrix(const float* m, const DetectParams& p, float* translation = nullptr) {
+    float row0len = sqrtf(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+    float row1len = sqrtf(m[4] * m[4] + m[5] * m[5] + m[6] * m[6]);
+    float row2len = sqrtf(m[8] * m[8] + m[9] * m[9] + m[10] * m[10]);
+
+    // Orthonormal rotation (all row lengths ~1.0) and valid w components
+    bool isValidView = (fabsf(row0len - 1.0f) < p.normTolerance) &&
+                       (fabsf(row1len - 1.0f) < p.normTolerance) &&
+                       (fabsf(row2len - 1.0f) < p.normTolerance) &&
+                       (fabsf(m[3]) < p.wTolerance) &&          // c5.w = 0
+                       (fabsf(m[7]) < p.wTolerance) &&          // c6.w = 0
+                       (fabsf(m[11]) < p.wTolerance) &&         // c7.w = 0
+                       (fabsf(m[15] - 1.0f) < p.wTolerance);    // c8.w = 1
+    if (!isValidView) return VIEW_REJECT;
+
+    float transMag = sqrtf(m[12] * m[12] + m[13] * m[13] + m[14] * m[14]);
+    if (translation) *translation = transMag;
+    return transMag > p.minTranslation ? VIEW_WORLD : VIEW_SMALL_TRANSLATION;
+}
+
+// Camera world position of a c5-c8 view: solves eye x R + T = 0, rows of R
+// orthogonal up to the detector's scale tolerance
+inline void EyeFromView(const float* m, float* eye) {
+    for (int j = 0; j < 3; j++) {
+        const float* row = m + j * 4;
+        float len2 = row[0] * row[0] + row[1] * row[1] + row[2] * row[2];
+        eye[j] = len2 > 0.0f ? -(m[12] * row[0] + m[13] * row[1] + m[14] * row[2]) / len2 : 0.0f;
+    }
+}
+
+// Distance allowed between two eye positions, looser far from the origin
+inline float EyeTolerance(const float* eye) {
+    return 1.0f + 1.0e-4f * (fabsf(eye[0]) + fabsf(eye[1]) + fabsf(eye[2]));
+}
+
+// True when the view maps eye to the view-space origin, i.e. the camera sits there
+inline bool ViewSitsAtEye(const float* m, const float* eye, const DetectParams& p) {
+    if (fabsf(m[15] - 1.0f) >= p.wTolerance) return false;
+    float x = eye[0] * m[0] + eye[1] * m[4] + eye[2] * m[8] + m[12];
+    float y = eye[0] * m[1] + eye[1] * m[5] + eye[2] * m[9] + m[13];
+    float z = eye[0] * m[2] + eye[1] * m[6] + eye[2] * m[10] + m[14];
+    float tol = EyeTolerance(eye);
+    return x * x + y * y + z * z < tol * tol;
+}
@@ -0,0 +1,154 @@
+/**
+ * capture_format.h - Constant-upload capture files
+ *
+ * Written by the proxy when CaptureConstants=1, read by the tools under tools/.
+ * Portable: the reader builds on Windows and POSIX.
+ *
+ * File layout: CaptureHeader, then a stream of records. Each record is a
+ * CaptureRecordHeader followed by count * 16 bytes of float4 payload
+ * (CAP_VS_CONSTANTS only). All values are little-endian.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#pragma pack(push, 1)
+struct CaptureHeader {
+    char magic[8];                  // "MECAPT01"
+    uint32_t version;               // 1
+    uint32_t reserved;
+};
+
+struct CaptureRecordHeader {
+    uint8_t type;                   // CaptureRecordType
+    uint8_t reserved;
+    uint16_t count;                 // CAP_VS_CONSTANTS: float4 registers in the payload
+    uint32_t arg;                   // See CaptureRecordType
+};
+#pragma pack(pop)
+
+enum CaptureRecordType {
+    CAP_FRAME = 1,                  // Present; arg = frame number just finished
+    CAP_VERTEX_SHADER = 2,          // SetVertexShader; arg = shader identity (0 = none)
+    CAP_VS_CONSTANTS = 3,           // SetVertexShaderConstantF; arg = start register
+    CAP_DRAW = 4                    // Any draw call; arg = primitive count
+};
+
+static const char kCaptureMagic[8] = { 'M', 'E', 'C', 'A', 'P', 'T', '0', '1' };
+
+struct CaptureRecord {
+    CaptureRecordType type;
+    uint32_t arg;
+    uint32_t count;
+    const float* data;              // count * 4 floats, points into the mapping
+};
+
+#ifndef CAPTURE_WRITER_ONLY
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Memory-mapped capture reader. The whole file is mapped read-only and walked
+ * sequentially; payload pointers stay valid until Close. Build the tools as
+ * 64-bit to map multi-GB captures.
+ */
+class CaptureReader {
+private:
+    const uint8_t* m_base = nullptr;
+    uint64_t m_size = 0;
+    uint64_t m_pos = 0;
+#ifdef _WIN32
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#else
+    int m_fd = -1;
+#endif
+
+public:
+    ~CaptureReader() { Close(); }
+
+    bool Open(const char* path) {
+        Close();
+#ifdef _WIN32
+        m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart < (LONGLONG)sizeof(CaptureHeader)) {
+            Close();
+            return false;
+        }
+        m_size = (uint64_t)size.QuadPart;
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_mapping) m_base = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+        m_fd = open(path, O_RDONLY);
+        if (m_fd < 0) return false;
+        struct stat st;
+        if (fstat(m_fd, &st) != 0 || st.st_size < (off_t)sizeof(CaptureHeader)) {
+            Close();
+            return false;
+        }
+        m_size = (uint64_t)st.st_size;
+        void* p = mmap(nullptr, (size_t)m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (p != MAP_FAILED) {
+            m_base = (const uint8_t*)p;
+            madvise(p, (size_t)m_size, MADV_SEQUENTIAL);
+        }
+#endif
+        if (!m_base || memcmp(m_base, kCaptureMagic, sizeof(kCaptureMagic)) != 0) {
+            Close();
+            return false;
+        }
+        m_pos = sizeof(CaptureHeader);
+        return true;
+    }
+
+    void Close() {
+#ifdef _WIN32
+        if (m_base) UnmapViewOfFile(m_base);
+        if (m_mapping) CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+        m_mapping = nullptr;
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_base) munmap((void*)m_base, (size_t)m_size);
+        if (m_fd >= 0) close(m_fd);
+        m_fd = -1;
+#endif
+        m_base = nullptr;
+        m_size = 0;
+        m_pos = 0;
+    }
+
+    uint64_t Size() const { return m_size; }
+    void Rewind() { m_pos = sizeof(CaptureHeader); }
+
+    // False at end of file or on a truncated trailing record (capture cut short)
+    bool Next(CaptureRecord* r) {
+        if (m_pos + sizeof(CaptureRecordHeader) > m_size) return false;
+        CaptureRecordHeader h;
+        memcpy(&h, m_base + m_pos, sizeof(h));
+        uint64_t payload = h.type == CAP_VS_CONSTANTS ? (uint64_t)h.count * 16 : 0;
+        if (m_pos + sizeof(h) + payload > m_size) return false;
+        r->type = (CaptureRecordType)h.type;
+        r->arg = h.arg;
+        r->count = h.type == CAP_VS_CONSTANTS ? h.count : 0;
+        r->data = (const float*)(m_base + m_pos + sizeof(h));
+        m_pos += sizeof(h) + payload;
+        return true;
+    }
+};
+
+#endif // CAPTURE_WRITER_ONLY
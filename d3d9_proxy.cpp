@@ -23,12 +23,31 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <d3d9.h>
+#include <intrin.h>
 #include <cstdio>
 #include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <vector>
+
+#include "camera_detect.h"
+#include "draw_batch.h"
+#include "proxy_math.h"
+#include "proxy_log.h"
+#include "gpu_timer.h"
+#define CAPTURE_WRITER_ONLY
+#include "capture_format.h"
 
 #pragma comment(lib, "user32.lib")
 
 // Configuration
+// Texture compression allowlist entry, width/height 0 = any
+struct CompressRule {
+    int format;
+    UINT width;
+    UINT height;
+};
+
 struct ProxyConfig {
     // Mirror's Edge confirmed layout:
     // c5-c8 = View matrix (rotation rows + translation)
@@ -43,6 +62,104 @@ struct ProxyConfig {
     // Reduced logging now that registers are known
     bool logAllConstants = false;    // Disable verbose logging
     bool autoDetectMatrices = false; // Disable - we know the layout now
+
+    // Flight recorder: ring of recent calls, dumped to disk when a frame hitches
+    bool flightRecorder = true;
+    int flightRecorderEvents = 262144;  // Ring capacity (rounded up to a power of two)
+    int flightRecorderFrames = 60;      // Frames of history written per dump
+    float hitchMultiple = 2.5f;         // Hitch = frame time > this x running median
+    int flightRecorderMaxDumps = 8;     // Per session, to bound disk use
+
+    // Per-draw World reconstruction from c0-c3 (WorldViewProjection)
+    bool reconstructWorld = false;
+    bool stabilizeWorld = true;
+    float worldSnapEpsilon = 0.0005f;   // Relative per-element tolerance for snapping
+
+    // Menu/pause detection: cap the frame rate while nothing 3D is moving
+    int idleFrameCap = 0;               // FPS while idle, 0 = disabled
+    int idleDetectFrames = 90;          // Consecutive idle-looking frames before capping
+    float idleUIFraction = 0.9f;        // Share of non-world draws that counts as "UI dominated"
+
+    // Allocate intermediate raster targets that the path tracer discards at reduced size
+    bool shrinkRenderTargets = false;
+    float shrinkScale = 0.5f;
+    int shrinkMinSize = 256;            // Only targets at least this wide and tall
+    bool shrinkDepthStencil = false;    // Depth must never be smaller than its color target
+    int shrinkFormats[16] = { D3DFMT_A16B16G16R16F, D3DFMT_A8R8G8B8, D3DFMT_X8R8G8B8, D3DFMT_G16R16F, D3DFMT_R32F };
+    int shrinkFormatCount = 5;
+    UINT shrinkSizes[16][2] = {};       // Width x height allowlist; nothing shrinks while empty
+    int shrinkSizeCount = 0;
+
+    // CPU BC1/BC3 compression of static A8R8G8B8/X8R8G8B8 textures
+    bool compressTextures = false;
+    CompressRule compressAllow[32] = { { D3DFMT_A8R8G8B8, 0, 0 }, { D3DFMT_X8R8G8B8, 0, 0 } };
+    int compressAllowCount = 2;
+
+    // Managed textures the game stopped binding: lowered priority, then evicted under memory pressure
+    bool textureResidency = false;
+    int residencyLowerFrames = 1800;    // Idle frames before the priority drops
+    int residencyEvictFrames = 3600;    // Idle frames before a texture may be evicted
+    int residencyBudgetMB = 256;        // Evict while GetAvailableTextureMem reports less than this
+
+    // Vertex/index buffer usage and pool corrections learned from earlier runs' locks
+    bool bufferPolicy = false;
+
+    // Create an Ex runtime and device behind the plain interfaces, emulating the managed pool
+    bool upgradeEx = false;
+    int exMaxFrameLatency = 0;          // SetMaximumFrameLatency, 0 = runtime default
+    int exGPUThreadPriority = 0;        // SetGPUThreadPriority, -7..7, 0 = unchanged
+
+    // Static index buffers: 32->16-bit narrowing and vertex cache reordering
+    bool optimizeIndexBuffers = false;
+
+    // Compacted static vertex buffers holding only what the fixed-function path reads
+    bool slimVertexStreams = false;
+
+    // GPU frame timing through timestamp queries, read back this many frames later
+    bool gpuTiming = true;
+    int gpuTimingLatency = 3;
+
+    // 32-bit address space monitor
+    int addressSpaceIntervalMs = 5000;  // 0 = disabled
+    float addressSpaceWarnMB = 256.0f;  // Warn when the largest free block drops below this
+
+    // View matrix test thresholds (camera_detect.h)
+    DetectParams detect;
+    bool pixelShaderEye = true;         // Learn UE3's PS camera position register and check views against it
+
+    // Constant-upload capture for the offline tools (capture_format.h)
+    bool captureConstants = false;
+    int captureFrames = 1800;           // Frames to record, 0 = until exit
+
+    // On-screen HUD drawn by the proxy, toggled with a virtual-key code
+    bool hud = false;
+    int hudKey = 0x79;                  // VK_F10, 0 = no hotkey
+
+    // Create the device without D3DCREATE_MULTITHREADED when no run on record needed it
+    bool stripMultithreaded = false;
+
+    // Share one real object between byte-identical shaders / vertex declarations
+    bool internShaders = true;
+
+    // Record each pass's world draws as SoA boxes and classify them against the camera in batches
+    bool batchDraws = false;
+
+    // Call Remix's Direct3DCreate9 on a background thread as soon as the proxy loads
+    bool speculativeInit = false;
+
+    // Maintenance (cache writes, capture flushes, compaction) run in idle time or frame slack
+    float maintenanceBudgetMs = 2.0f;   // Most a non-idle frame spends on it, 0 = idle windows only
+    int maintenanceTargetFps = 60;      // Slack is measured against this frame time
+
+    // D3DPERF event names tracked as a pass stack; forwarding dropped while no tool listens
+    bool perfEvents = false;
+    bool skipPerfForwarding = true;
+
+    // Draw filter rule file next to the executable, empty = no rules
+    char drawRules[MAX_PATH] = "";
+
+    // Reuse last frame's per-draw results for draws issued in the same order
+    bool predictDraws = false;
 };
 
 static ProxyConfig g_config;
@@ -77,149 +194,6051 @@ void LogMsg(const char* fmt, ...) {
 
     va_list args;
     va_start(args, fmt);
-    vfprintf(g_logFile, fmt, args);
-    fprintf(g_logFile, "\n");
-    fflush(g_logFile);
+    WriteLogLine(g_logFile, fmt, args);
     va_end(args);
 }
 
-// Check if matrix values are valid
-bool LooksLikeMatrix(const float* data) {
-    float sum = 0;
-    for (int i = 0; i < 16; i++) {
-        if (!isfinite(data[i])) return false;
-        sum += fabsf(data[i]);
-    }
-    if (sum < 0.001f || sum > 100000.0f) return false;
-    return true;
+// Timing helpers
+static LARGE_INTEGER g_qpcFreq = {};
+
+static inline LONGLONG QpcNow() {
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
 }
 
-// Extract FOV from projection matrix
-float ExtractFOV(const D3DMATRIX& proj) {
-    if (fabsf(proj._22) < 0.001f) return 0;
-    return 2.0f * atanf(1.0f / proj._22);
+static inline double QpcToMs(LONGLONG ticks) {
+    return (double)ticks * 1000.0 / (double)g_qpcFreq.QuadPart;
 }
 
-// Check if matrix looks like projection
-bool LooksLikeProjection(const D3DMATRIX& m) {
-    // Check for typical projection structure
-    if (fabsf(m._12) > 0.01f || fabsf(m._13) > 0.01f || fabsf(m._14) > 0.01f) return false;
-    if (fabsf(m._21) > 0.01f || fabsf(m._23) > 0.01f || fabsf(m._24) > 0.01f) return false;
-    if (fabsf(m._31) > 0.01f || fabsf(m._32) > 0.01f) return false;
-    if (fabsf(m._11) < 0.01f || fabsf(m._22) < 0.01f) return false;
+// Method that produced a flight recorder entry
+enum FlightMethod {
+    FR_PRESENT = 1,
+    FR_BEGIN_SCENE,
+    FR_END_SCENE,
+    FR_SET_VS_CONSTANTS,
+    FR_DRAW_PRIMITIVE,
+    FR_DRAW_INDEXED_PRIMITIVE,
+    FR_DRAW_PRIMITIVE_UP,
+    FR_DRAW_INDEXED_PRIMITIVE_UP,
+    FR_SET_RENDER_TARGET,
+    FR_CLEAR
+};
 
-    float fov = ExtractFOV(m);
-    if (fov < g_config.minFOV || fov > g_config.maxFOV) return false;
+// What the c5-c8 view check decided for a constant upload
+enum CameraDecision {
+    CAM_NONE = 0,           // Upload did not cover c5-c8
+    CAM_ACCEPTED,           // Became this frame's camera
+    CAM_NOT_VIEW,           // Failed the orthonormal / w checks
+    CAM_SMALL_TRANSLATION,  // View-shaped, but UI-like (translation <= 50)
+    CAM_ALREADY_CAPTURED,   // Valid, but this frame's camera was already taken
+    CAM_SECONDARY           // World view whose eye is not the pixel shader camera position
+};
 
-    return true;
-}
+// Coarse draw classification from the most recent c5-c8 upload
+enum DrawClass {
+    DRAW_CLASS_UNKNOWN = 0, // No c5-c8 upload seen yet this frame
+    DRAW_CLASS_WORLD,       // Last c5-c8 upload was a 3D camera
+    DRAW_CLASS_UI,          // Last c5-c8 upload was view-shaped but UI-like
+    DRAW_CLASS_SHADOW,      // Shadow depth D3DPERF event, or a secondary camera (seen from a light)
+    DRAW_CLASS_COUNT
+};
 
-// Create a standard perspective projection matrix
-void CreateProjectionMatrix(D3DMATRIX* out, float fovY, float aspect, float zNear, float zFar) {
-    float yScale = 1.0f / tanf(fovY / 2.0f);
-    float xScale = yScale / aspect;
-    memset(out, 0, sizeof(D3DMATRIX));
-    out->_11 = xScale;
-    out->_22 = yScale;
-    out->_33 = zFar / (zFar - zNear);
-    out->_34 = 1.0f;
-    out->_43 = -zNear * zFar / (zFar - zNear);
-}
+// Rendering pass named by the enclosing D3DPERF events
+enum PerfPass {
+    PERF_PASS_NONE = 0,     // No event open, or none of the open events names a pass
+    PERF_PASS_SHADOW_DEPTH,
+    PERF_PASS_DEPTH_PREPASS,
+    PERF_PASS_BASE,
+    PERF_PASS_LIGHTING,
+    PERF_PASS_TRANSLUCENCY,
+    PERF_PASS_POST_PROCESS,
+    PERF_PASS_UI,
+    PERF_PASS_COUNT
+};
 
-// Create an identity matrix
-void CreateIdentityMatrix(D3DMATRIX* out) {
-    memset(out, 0, sizeof(D3DMATRIX));
-    out->_11 = out->_22 = out->_33 = out->_44 = 1.0f;
-}
+static const char* kPerfPassNames[PERF_PASS_COUNT] = {
+    "none", "shadow", "prepass", "base", "lighting", "translucency", "post", "ui"
+};
+
+#pragma pack(push, 1)
+// One flight recorder entry (16 bytes)
+struct FlightRecord {
+    DWORD frame;
+    DWORD tsc;          // rdtsc ticks since this frame's Present (low 32 bits)
+    BYTE method;        // FlightMethod
+    BYTE drawClass;     // DrawClass
+    BYTE camera;        // CameraDecision
+    BYTE pass;          // PerfPass
+    DWORD arg;          // Primitive count, start register or render target index
+};
 
-// Check if matrix looks like view matrix (orthonormal rotation + translation)
-bool LooksLikeView(const D3DMATRIX& m) {
-    float row0len = sqrtf(m._11*m._11 + m._12*m._12 + m._13*m._13);
-    float row1len = sqrtf(m._21*m._21 + m._22*m._22 + m._23*m._23);
-    float row2len = sqrtf(m._31*m._31 + m._32*m._32 + m._33*m._33);
+// Header of a camera_proxy_hitch_*.trace file, followed by recordCount FlightRecords
+struct FlightTraceHeader {
+    char magic[8];      // "MEFLTRC1"
+    DWORD recordSize;
+    DWORD recordCount;
+    DWORD hitchFrame;
+    DWORD framesCaptured;
+    float frameMs;
+    float medianMs;
+    float tscPerMs;     // Converts FlightRecord::tsc to milliseconds
+};
+#pragma pack(pop)
 
-    if (fabsf(row0len - 1.0f) > 0.1f) return false;
-    if (fabsf(row1len - 1.0f) > 0.1f) return false;
-    if (fabsf(row2len - 1.0f) > 0.1f) return false;
+/**
+ * D3DPERF event tracker - UE3 brackets its passes with D3DPERF_BeginEvent /
+ * EndEvent ("ShadowDepths", "BasePass", "Translucency", ...). Names are
+ * interned to small ids on first sight and kept on a stack; each level carries
+ * the pass its own name implies or, failing that, its parent's, so draws deep
+ * inside a pass still know which one they belong to.
+ *
+ * While D3DPERF_GetStatus reports that no capture tool is attached, the
+ * events have no listener and forwarding them to the runtime is skipped. The
+ * first kCalibrationCalls calls are always forwarded and timed, which is what
+ * the saved time is reported against.
+ */
+class PerfEventTracker {
+private:
+    static const int kMaxNames = 256;
+    static const int kTableSize = 512;
+    static const int kMaxDepth = 32;
+    static const int kNameChars = 48;
+    static const DWORD kCalibrationCalls = 1024;
 
-    if (fabsf(m._14) > 0.01f || fabsf(m._24) > 0.01f || fabsf(m._34) > 0.01f) return false;
-    if (fabsf(m._44 - 1.0f) > 0.01f) return false;
+    struct Name {
+        DWORD hash;
+        WCHAR text[kNameChars];     // Truncated copy, compared on lookup
+        BYTE pass;                  // PerfPass the name implies on its own
+    };
 
-    return true;
-}
+    Name m_names[kMaxNames];        // Id 0 is the overflow bucket, never matched
+    int m_nameCount = 1;
+    WORD m_table[kTableSize] = {};  // Open addressing over name ids, 0 = empty
 
-// Check if matrix could be ViewProjection (has projection-like characteristics but rotation too)
-bool LooksLikeViewProjection(const D3DMATRIX& m) {
-    // ViewProj will have large values due to projection multiplication
-    // Check for non-zero values in typical projection positions
-    if (fabsf(m._34) < 0.5f) return false;  // Perspective divide indicator
-    if (fabsf(m._44) > 0.1f) return false;  // Should be ~0 for perspective
+    WORD m_stackIds[kMaxDepth];
+    BYTE m_stackPass[kMaxDepth];
+    int m_depth = 0;
+    int m_maxDepth = 0;
 
-    // Should have some rotation component
-    float magnitude = sqrtf(m._11*m._11 + m._12*m._12 + m._13*m._13);
-    if (magnitude < 0.1f) return false;
+    bool m_skipping = false;
+    DWORD m_timedCalls = 0;
+    unsigned __int64 m_timedTicks = 0;
+    LONGLONG m_statusQpc = 0;
+    unsigned __int64 m_statusTsc = 0;
 
-    return true;
-}
+    static DWORD HashName(LPCWSTR name) {
+        DWORD h = 2166136261u;
+        for (int i = 0; i < kNameChars - 1 && name[i]; i++) {
+            h = (h ^ (WORD)name[i]) * 16777619u;
+        }
+        return h;
+    }
 
-// Try to extract View from ViewProjection by removing projection component
-void ExtractViewFromViewProjection(const D3DMATRIX& vp, D3DMATRIX* viewOut) {
-    CreateIdentityMatrix(viewOut);
+    static bool SameName(const WCHAR* stored, LPCWSTR name) {
+        for (int i = 0; i < kNameChars - 1; i++) {
+            if (stored[i] != name[i]) return false;
+            if (!name[i]) return true;
+        }
+        return true;
+    }
 
-    // The ViewProjection combines View and Projection
-    // We need to approximately invert the projection influence
-    // For a typical projection, _11 and _22 contain the FOV scaling
+    static const int kMaxWords = 8;
+    static const int kWordChars = 16;
 
-    float r0len = sqrtf(vp._11*vp._11 + vp._12*vp._12 + vp._13*vp._13);
-    float r1len = sqrtf(vp._21*vp._21 + vp._22*vp._22 + vp._23*vp._23);
-    float r2len = sqrtf(vp._31*vp._31 + vp._32*vp._32 + vp._33*vp._33);
+    // Lowercase words of an event name, split at case changes, digits and punctuation:
+    // "ShadowDepths" -> shadow depths, "UIScene" -> ui scene, "Post_Process" -> post process
+    static int SplitWords(LPCWSTR name, char words[kMaxWords][kWordChars]) {
+        int count = 0, len = 0;
+        for (int i = 0; i < kNameChars - 1 && name[i]; i++) {
+            WCHAR c = name[i], next = name[i + 1];
+            bool upper = c >= 'A' && c <= 'Z';
+            bool alpha = upper || (c >= 'a' && c <= 'z');
+            if (!alpha) {
+                len = 0;            // Digits and punctuation only separate
+                continue;
+            }
+            // A capital starts a word after a lowercase letter, or before one in an acronym ("UIScene")
+            bool prevLower = i > 0 && name[i - 1] >= 'a' && name[i - 1] <= 'z';
+            bool prevUpper = i > 0 && name[i - 1] >= 'A' && name[i - 1] <= 'Z';
+            bool nextLower = next >= 'a' && next <= 'z';
+            if (upper && len > 0 && (prevLower || (prevUpper && nextLower))) len = 0;
+            if (len == 0) {
+                if (count == kMaxWords) break;
+                count++;
+            }
+            if (len < kWordChars - 1) {
+                words[count - 1][len++] = upper ? (char)(c + 32) : (char)c;
+                words[count - 1][len] = 0;
+            }
+        }
+        return count;
+    }
 
-    if (r0len > 0.001f && r1len > 0.001f && r2len > 0.001f) {
-        // Normalize to approximate rotation
-        viewOut->_11 = vp._11 / r0len; viewOut->_12 = vp._12 / r0len; viewOut->_13 = vp._13 / r0len;
-        viewOut->_21 = vp._21 / r1len; viewOut->_22 = vp._22 / r1len; viewOut->_23 = vp._23 / r1len;
-        viewOut->_31 = vp._31 / r2len; viewOut->_32 = vp._32 / r2len; viewOut->_33 = vp._33 / r2len;
+    // Whole-word match of UE3 draw event names; first rule wins. Substrings misfire on
+    // names like "Highlight" or "Editor"
+    static PerfPass PassForName(LPCWSTR name) {
+        char words[kMaxWords][kWordChars];
+        int count = SplitWords(name, words);
+        auto has = [&](const char* w) {
+            for (int i = 0; i < count; i++) {
+                if (strcmp(words[i], w) == 0) return true;
+            }
+            return false;
+        };
+        auto pair = [&](const char* a, const char* b) {
+            for (int i = 0; i + 1 < count; i++) {
+                if (strcmp(words[i], a) == 0 && strcmp(words[i + 1], b) == 0) return true;
+            }
+            return false;
+        };
 
-        // Translation approximation
-        viewOut->_41 = vp._14 / r0len;
-        viewOut->_42 = vp._24 / r1len;
-        viewOut->_43 = vp._34 / r2len;
+        if (pair("shadow", "depth") || pair("shadow", "depths") || pair("shadows", "depth") ||
+            pair("shadows", "depths")) return PERF_PASS_SHADOW_DEPTH;
+        if (has("prepass") || pair("pre", "pass") || pair("depth", "only") || pair("depths", "only")) return PERF_PASS_DEPTH_PREPASS;
+        if (has("basepass") || pair("base", "pass")) return PERF_PASS_BASE;
+        if (has("translucency") || has("translucent") || has("distortion")) return PERF_PASS_TRANSLUCENCY;
+        if (has("postprocess") || pair("post", "process") || pair("uber", "post") || has("bloom") || has("dof")) return PERF_PASS_POST_PROCESS;
+        if (has("light") || has("lights") || has("lighting") || has("fog") || has("shadow") || has("shadows")) return PERF_PASS_LIGHTING;
+        if (has("canvas") || has("hud") || has("scaleform") || has("ui")) return PERF_PASS_UI;
+        return PERF_PASS_NONE;
     }
-}
 
-// Forward declarations
-class WrappedD3D9Device;
-class WrappedD3D9;
+    WORD Intern(LPCWSTR name) {
+        if (!name) return 0;
+        DWORD hash = HashName(name);
+        DWORD slot = hash & (kTableSize - 1);
+        while (WORD id = m_table[slot]) {
+            if (m_names[id].hash == hash && SameName(m_names[id].text, name)) return id;
+            slot = (slot + 1) & (kTableSize - 1);
+        }
+        if (m_nameCount >= kMaxNames) return 0;
+
+        WORD id = (WORD)m_nameCount++;
+        Name& n = m_names[id];
+        char lower[kNameChars];
+        int i = 0;
+        for (; i < kNameChars - 1 && name[i]; i++) {
+            n.text[i] = name[i];
+            WCHAR c = name[i];
+            lower[i] = (c >= 'A' && c <= 'Z') ? (char)(c + 32) : (c < 128 ? (char)c : '?');
+        }
+        n.text[i] = 0;
+        lower[i] = 0;
+        n.hash = hash;
+        n.pass = (BYTE)PassForName(name);
+        m_table[slot] = id;
+        LogMsg("D3DPERF: event %d \"%s\" -> %s", id, lower, kPerfPassNames[n.pass]);
+        return id;
+    }
+
+public:
+    int drawsByPass[PERF_PASS_COUNT] = {};
+    DWORD forwardedCalls = 0;
+    DWORD skippedCalls = 0;
+    int unbalancedFrames = 0;
+
+    PerfEventTracker() {
+        memset(&m_names[0], 0, sizeof(Name));
+    }
+
+    inline PerfPass CurrentPass() const {
+        if (m_depth <= 0) return PERF_PASS_NONE;
+        return (PerfPass)m_stackPass[(m_depth < kMaxDepth ? m_depth : kMaxDepth) - 1];
+    }
+
+    // Returns the level the new event opened at
+    int Begin(LPCWSTR name) {
+        int level = m_depth;
+        if (m_depth < kMaxDepth) {
+            WORD id = Intern(name);
+            BYTE pass = m_names[id].pass;
+            if (pass == PERF_PASS_NONE && m_depth > 0) pass = m_stackPass[m_depth - 1];
+            m_stackIds[m_depth] = id;
+            m_stackPass[m_depth] = pass;
+        }
+        m_depth++;
+        if (m_depth > m_maxDepth) m_maxDepth = m_depth;
+        return level;
+    }
+
+    // Returns the level left open
+    int End() {
+        if (m_depth > 0) m_depth--;
+        return m_depth;
+    }
+
+    // True when a Begin/End/SetMarker/SetRegion should not reach the runtime
+    inline bool SkipForward() const { return m_skipping; }
+
+    inline unsigned __int64 ForwardStart() const { return __rdtsc(); }
+    inline void ForwardEnd(unsigned __int64 start) {
+        m_timedTicks += __rdtsc() - start;
+        m_timedCalls++;
+        forwardedCalls++;
+    }
+
+    // Called once per Present; events must not span frames
+    void EndFrame() {
+        if (!m_statusQpc) {
+            m_statusQpc = QpcNow();
+            m_statusTsc = __rdtsc();
+        }
+        if (m_depth != 0) {
+            unbalancedFrames++;
+            m_depth = 0;
+        }
+        bool listener = g_origD3DPERF_GetStatus && g_origD3DPERF_GetStatus() != 0;
+        bool skip = g_config.skipPerfForwarding && !listener && m_timedCalls >= kCalibrationCalls;
+        if (skip != m_skipping) {
+            LogMsg("D3DPERF: forwarding %s at frame %d", skip ? "skipped (no capture tool attached)" : "resumed", g_frameCount);
+            m_skipping = skip;
+        }
+    }
+
+    void LogStatus(int frames) {
+        LONGLONG qpc = QpcNow();
+        unsigned __int64 tsc = __rdtsc();
+        double tscPerNs = m_statusQpc ? (double)(tsc - m_statusTsc) / (QpcToMs(qpc - m_statusQpc) * 1.0e6) : 0.0;
+        m_statusQpc = qpc;
+        m_statusTsc = tsc;
+
+        LogMsg("  PerfEvents: %d names, max depth %d, %d unbalanced frames; draws/frame shadow %.0f prepass %.0f base %.0f lighting %.0f translucency %.0f post %.0f ui %.0f none %.0f",
+               m_nameCount - 1, m_maxDepth, unbalancedFrames,
+               drawsByPass[PERF_PASS_SHADOW_DEPTH] / (double)frames, drawsByPass[PERF_PASS_DEPTH_PREPASS] / (double)frames,
+               drawsByPass[PERF_PASS_BASE] / (double)frames, drawsByPass[PERF_PASS_LIGHTING] / (double)frames,
+               drawsByPass[PERF_PASS_TRANSLUCENCY] / (double)frames, drawsByPass[PERF_PASS_POST_PROCESS] / (double)frames,
+               drawsByPass[PERF_PASS_UI] / (double)frames, drawsByPass[PERF_PASS_NONE] / (double)frames);
+        if (tscPerNs > 0.0 && m_timedCalls) {
+            double nsPerCall = (double)m_timedTicks / m_timedCalls / tscPerNs;
+            LogMsg("  PerfEvents: %s, %.0f calls/frame forwarded, %.0f skipped, %.1f ns/call, %.3f ms/frame saved",
+                   m_skipping ? "forwarding skipped" : "forwarding", forwardedCalls / (double)frames,
+                   skippedCalls / (double)frames, nsPerCall, skippedCalls * nsPerCall / 1.0e6 / frames);
+        }
+        memset(drawsByPass, 0, sizeof(drawsByPass));
+        forwardedCalls = skippedCalls = 0;
+        unbalancedFrames = 0;
+    }
+};
+
+static PerfEventTracker g_perfEvents;
 
 /**
- * Wrapped IDirect3DDevice9 - intercepts SetVertexShaderConstantF
+ * Flight recorder - fixed-memory ring of compact call records.
+ *
+ * Always running when enabled. At Present, a frame slower than
+ * hitchMultiple x the running median snapshots the last N frames of the
+ * ring, and a worker thread writes the snapshot out so Present never
+ * touches the disk.
+ *
+ * Push may be called from any thread: each record claims its slot with an
+ * interlocked increment, so racing calls land in different slots. A dump
+ * taken while another thread is mid-Push may hold one half-written record.
  */
-class WrappedD3D9Device : public IDirect3DDevice9 {
+class FlightRecorder {
 private:
-    IDirect3DDevice9* m_real;
-    D3DMATRIX m_lastViewMatrix;
-    D3DMATRIX m_lastProjMatrix;
-    D3DMATRIX m_pendingViewMatrix;  // Captured during frame
-    bool m_hasView = false;
-    bool m_hasProj = false;
-    bool m_pendingViewUpdate = false;  // Flag for once-per-frame update
-    bool m_capturedThisFrame = false;  // Only capture FIRST camera per frame
-    int m_constantLogThrottle = 0;
-    int m_loggedThisFrame = 0;
+    FlightRecord* m_ring = nullptr;
+    DWORD m_mask = 0;
+    volatile LONG m_head = 0;
+    DWORD m_frameHead = 0;          // m_head at the start of the frame
+    unsigned __int64 m_frameTsc = 0;
+    float m_tscPerMs = 0.0f;        // Measured once in Calibrate
+
+    // Snapshot handed to the writer thread
+    FlightRecord* m_snapshot = nullptr;
+    FlightTraceHeader m_snapshotHeader = {};
+    HANDLE m_wakeEvent = nullptr;
+    HANDLE m_stoppedEvent = nullptr;
+    HANDLE m_thread = nullptr;
+    volatile LONG m_writerBusy = 0;
+    volatile LONG m_shutdown = 0;
+
+    // Overhead accounting, turned into a share of frame time only in LogStatus
+    double m_nsPerRecord = 0.0;
+    unsigned __int64 m_records = 0;
+    double m_frameMsTotal = 0.0;
+    int m_dumps = 0;
+    int m_dumpsDropped = 0;
+    int m_lastDumpFrame = -100000;
+
+    static DWORD WINAPI WriterThread(LPVOID param) {
+        FlightRecorder* self = (FlightRecorder*)param;
+        while (WaitForSingleObject(self->m_wakeEvent, INFINITE) == WAIT_OBJECT_0) {
+            if (self->m_shutdown) break;
+            self->WriteSnapshot();
+            InterlockedExchange(&self->m_writerBusy, 0);
+        }
+        // Last thing the thread touches; Shutdown frees everything once this is set
+        SetEvent(self->m_stoppedEvent);
+        return 0;
+    }
+
+    void WriteSnapshot() {
+        char name[64];
+        sprintf(name, "camera_proxy_hitch_%06u.trace", (unsigned)m_snapshotHeader.hitchFrame);
+        FILE* f = fopen(name, "wb");
+        if (!f) {
+            LogMsg("FlightRecorder: failed to open %s", name);
+            return;
+        }
+        fwrite(&m_snapshotHeader, sizeof(m_snapshotHeader), 1, f);
+        fwrite(m_snapshot, sizeof(FlightRecord), m_snapshotHeader.recordCount, f);
+        fclose(f);
+        LogMsg("FlightRecorder: wrote %s (%u records, %.2f ms vs median %.2f ms)", name,
+               (unsigned)m_snapshotHeader.recordCount, m_snapshotHeader.frameMs, m_snapshotHeader.medianMs);
+    }
+
+    // Once at Init: time Push() against the real ring so the reported overhead is measured,
+    // not guessed, and take the rdtsc rate from the same run so Present doesn't have to
+    void Calibrate() {
+        const int N = 65536;
+        unsigned __int64 tscStart = __rdtsc();
+        LONGLONG start = QpcNow();
+        for (int i = 0; i < N; i++) {
+            Push(FR_DRAW_INDEXED_PRIMITIVE, DRAW_CLASS_WORLD, CAM_NONE, (DWORD)i);
+        }
+        LONGLONG end = QpcNow();
+        double ms = QpcToMs(end - start);
+        m_nsPerRecord = ms * 1.0e6 / N;
+        if (ms > 0.0) m_tscPerMs = (float)((double)(__rdtsc() - tscStart) / ms);
+        m_head = 0;
+        m_frameHead = 0;
+        memset(m_ring, 0, (m_mask + 1) * sizeof(FlightRecord));
+    }
+
+public:
+    bool Init(int capacity) {
+        DWORD size = 1024;
+        while (size < (DWORD)capacity && size < (1u << 24)) size <<= 1;
+
+        m_ring = (FlightRecord*)calloc(size, sizeof(FlightRecord));
+        m_snapshot = (FlightRecord*)malloc(size * sizeof(FlightRecord));
+        m_wakeEvent = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+        m_stoppedEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        if (!m_ring || !m_snapshot || !m_wakeEvent || !m_stoppedEvent) {
+            Shutdown(false);
+            return false;
+        }
+        m_mask = size - 1;
+        m_frameTsc = __rdtsc();
+        Calibrate();
+        LogMsg("FlightRecorder: %u records (%u KB), %.1f ns/record", (unsigned)size,
+               (unsigned)(size * sizeof(FlightRecord) / 1024), m_nsPerRecord);
+        return true;
+    }
+
+    // Call before the log closes. Under the loader lock the writer can't exit, but it can
+    // finish its dump and signal m_stoppedEvent, so that is what gets waited on. At process
+    // exit the writer has already been terminated and there is nothing to wait for.
+    void Shutdown(bool processExit) {
+        if (m_thread) {
+            InterlockedExchange(&m_shutdown, 1);
+            SetEvent(m_wakeEvent);
+            if (!processExit) WaitForSingleObject(m_stoppedEvent, INFINITE);
+            CloseHandle(m_thread);
+            m_thread = nullptr;
+        }
+        if (m_wakeEvent) CloseHandle(m_wakeEvent);
+        if (m_stoppedEvent) CloseHandle(m_stoppedEvent);
+        free(m_ring);
+        free(m_snapshot);
+        m_wakeEvent = nullptr;
+        m_stoppedEvent = nullptr;
+        m_ring = nullptr;
+        m_snapshot = nullptr;
+    }
+
+    bool Enabled() const { return m_ring != nullptr; }
+
+    inline void Push(int method, int drawClass, int camera, DWORD arg) {
+        if (!m_ring) return;
+        DWORD slot = (DWORD)InterlockedIncrement(&m_head) - 1;
+        FlightRecord& r = m_ring[slot & m_mask];
+        r.frame = (DWORD)g_frameCount;
+        r.tsc = (DWORD)(__rdtsc() - m_frameTsc);
+        r.method = (BYTE)method;
+        r.drawClass = (BYTE)drawClass;
+        r.camera = (BYTE)camera;
+        r.pass = (BYTE)g_perfEvents.CurrentPass();
+        r.arg = arg;
+    }
+
+    // Called once per Present with the frame that just finished
+    void EndFrame(float frameMs, float medianMs, int historyFrames) {
+        if (!m_ring) return;
+
+        DWORD head = (DWORD)m_head;
+        m_records += head - m_frameHead;
+        m_frameHead = head;
+        if (frameMs > 0.0f) m_frameMsTotal += frameMs;
+
+        bool hitch = historyFrames >= FrameTimeHistory::SIZE &&
+                     medianMs > 0.0f &&
+                     frameMs > medianMs * g_config.hitchMultiple &&
+                     g_frameCount - m_lastDumpFrame > g_config.flightRecorderFrames;
+        if (hitch && m_dumps < g_config.flightRecorderMaxDumps) {
+            if (m_writerBusy) {
+                m_dumpsDropped++;
+            } else {
+                Snapshot(frameMs, medianMs);
+            }
+        }
+
+        m_frameTsc = __rdtsc();
+    }
+
+    void Snapshot(float frameMs, float medianMs) {
+        DWORD firstFrame = (DWORD)g_frameCount - (DWORD)g_config.flightRecorderFrames + 1;
+        DWORD head = (DWORD)m_head;
+        DWORD count = 0;
+        while (count <= m_mask && count < head) {
+            const FlightRecord& r = m_ring[(head - 1 - count) & m_mask];
+            if ((int)(r.frame - firstFrame) < 0) break;
+            count++;
+        }
+        DWORD start = head - count;
+        for (DWORD i = 0; i < count; i++) {
+            m_snapshot[i] = m_ring[(start + i) & m_mask];
+        }
+
+        memcpy(m_snapshotHeader.magic, "MEFLTRC1", 8);
+        m_snapshotHeader.recordSize = sizeof(FlightRecord);
+        m_snapshotHeader.recordCount = count;
+        m_snapshotHeader.hitchFrame = (DWORD)g_frameCount;
+        m_snapshotHeader.framesCaptured = (DWORD)g_config.flightRecorderFrames;
+        m_snapshotHeader.frameMs = frameMs;
+        m_snapshotHeader.medianMs = medianMs;
+        m_snapshotHeader.tscPerMs = m_tscPerMs;
+
+        if (!m_thread) {
+            m_thread = CreateThread(nullptr, 0, WriterThread, this, 0, nullptr);
+            if (!m_thread) return;
+            SetThreadPriority(m_thread, THREAD_PRIORITY_BELOW_NORMAL);
+        }
+        InterlockedExchange(&m_writerBusy, 1);
+        SetEvent(m_wakeEvent);
+        m_dumps++;
+        m_lastDumpFrame = g_frameCount;
+    }
+
+    void LogStatus() {
+        if (!m_ring) return;
+        double overhead = m_frameMsTotal > 0.0 ? m_records * m_nsPerRecord / (m_frameMsTotal * 1.0e6) * 100.0 : 0.0;
+        LogMsg("  FlightRecorder: %.1f ns/record, overhead %.3f%% of frame time, dumps %d (dropped %d)",
+               m_nsPerRecord, overhead, m_dumps, m_dumpsDropped);
+        if (overhead > 1.0) {
+            LogMsg("  FlightRecorder: WARNING overhead above 1%% budget");
+        }
+        m_records = 0;
+        m_frameMsTotal = 0.0;
+    }
+};
+
+static FlightRecorder g_flight;
+
+/**
+ * Address space monitor - the game is a 32-bit process that also hosts the
+ * Remix bridge client, and long sessions die from fragmentation rather than
+ * from running out of memory. A low-priority thread walks VirtualQuery every
+ * few seconds and warns while the largest free block is below the threshold.
+ */
+class AddressSpaceMonitor {
+public:
+    struct Sample {
+        double committedMB;
+        double reservedMB;
+        double freeMB;
+        double largestFreeMB;
+        double fragmentation;   // 1 - largest free / total free: 0 = one block, ->1 = shattered
+        double walkMs;
+        int regions;
+    };
+
+private:
+    CRITICAL_SECTION m_lock;
+    Sample m_latest = {};
+    double m_minLargestFreeMB = 0.0;
+    int m_samples = 0;
+    bool m_warned = false;
+    HANDLE m_stopEvent = nullptr;
+    HANDLE m_stoppedEvent = nullptr;
+    HANDLE m_thread = nullptr;
+    DWORD m_intervalMs = 5000;
+    double m_warnMB = 256.0;
+
+    static DWORD WINAPI MonitorThread(LPVOID param) {
+        AddressSpaceMonitor* self = (AddressSpaceMonitor*)param;
+        do {
+            self->TakeSample();
+        } while (WaitForSingleObject(self->m_stopEvent, self->m_intervalMs) == WAIT_TIMEOUT);
+        SetEvent(self->m_stoppedEvent);
+        return 0;
+    }
+
+    void TakeSample() {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        LONGLONG start = QpcNow();
+
+        Sample s = {};
+        const BYTE* addr = (const BYTE*)si.lpMinimumApplicationAddress;
+        const BYTE* end = (const BYTE*)si.lpMaximumApplicationAddress;
+        MEMORY_BASIC_INFORMATION mbi;
+        while (addr < end && VirtualQuery(addr, &mbi, sizeof(mbi)) == sizeof(mbi)) {
+            double mb = mbi.RegionSize / (1024.0 * 1024.0);
+            if (mbi.State == MEM_COMMIT) s.committedMB += mb;
+            else if (mbi.State == MEM_RESERVE) s.reservedMB += mb;
+            else if (mbi.State == MEM_FREE) {
+                s.freeMB += mb;
+                if (mb > s.largestFreeMB) s.largestFreeMB = mb;
+            }
+            s.regions++;
+            addr = (const BYTE*)mbi.BaseAddress + mbi.RegionSize;
+        }
+        s.fragmentation = s.freeMB > 0.0 ? 1.0 - s.largestFreeMB / s.freeMB : 0.0;
+        s.walkMs = QpcToMs(QpcNow() - start);
+
+        EnterCriticalSection(&m_lock);
+        m_latest = s;
+        if (m_samples == 0 || s.largestFreeMB < m_minLargestFreeMB) m_minLargestFreeMB = s.largestFreeMB;
+        m_samples++;
+        LeaveCriticalSection(&m_lock);
+
+        // Warn once per crossing, not every sample
+        if (s.largestFreeMB < m_warnMB && !m_warned) {
+            LogMsg("ADDRESS SPACE: WARNING largest free block %.1f MB below %.0f MB (free %.1f MB, fragmentation %.2f)",
+                   s.largestFreeMB, m_warnMB, s.freeMB, s.fragmentation);
+            m_warned = true;
+        } else if (s.largestFreeMB >= m_warnMB * 1.25 && m_warned) {
+            LogMsg("ADDRESS SPACE: largest free block recovered to %.1f MB", s.largestFreeMB);
+            m_warned = false;
+        }
+    }
+
+public:
+    AddressSpaceMonitor() { InitializeCriticalSection(&m_lock); }
+
+    bool Start(int intervalMs, double warnMB) {
+        m_intervalMs = (DWORD)(std::max)(intervalMs, 250);
+        m_warnMB = warnMB;
+        m_stopEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        m_stoppedEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        if (!m_stopEvent || !m_stoppedEvent) return false;
+        m_thread = CreateThread(nullptr, 0, MonitorThread, this, 0, nullptr);
+        if (!m_thread) return false;
+        SetThreadPriority(m_thread, THREAD_PRIORITY_LOWEST);
+        return true;
+    }
+
+    // Call before the log closes. The thread can't exit under the loader lock, so wait for it
+    // to finish its walk and signal instead; at process exit it is already gone
+    void Stop(bool processExit) {
+        if (m_stopEvent) SetEvent(m_stopEvent);
+        if (m_thread) {
+            if (!processExit) WaitForSingleObject(m_stoppedEvent, INFINITE);
+            CloseHandle(m_thread);
+            m_thread = nullptr;
+        }
+        if (m_stopEvent) CloseHandle(m_stopEvent);
+        if (m_stoppedEvent) CloseHandle(m_stoppedEvent);
+        m_stopEvent = nullptr;
+        m_stoppedEvent = nullptr;
+    }
+
+    // Latest sample for the HUD; false until the first walk finishes
+    bool Latest(Sample* out, bool* low) {
+        if (!m_thread) return false;
+        EnterCriticalSection(&m_lock);
+        *out = m_latest;
+        int samples = m_samples;
+        LeaveCriticalSection(&m_lock);
+        *low = out->largestFreeMB < m_warnMB;
+        return samples > 0;
+    }
+
+    void LogStatus() {
+        if (!m_thread) return;
+        EnterCriticalSection(&m_lock);
+        Sample s = m_latest;
+        double minLargest = m_minLargestFreeMB;
+        int samples = m_samples;
+        LeaveCriticalSection(&m_lock);
+        if (samples == 0) return;
+        LogMsg("  AddressSpace: committed %.0f MB, reserved %.0f MB, free %.0f MB, largest free %.1f MB (session min %.1f), fragmentation %.2f, %d regions walked in %.2f ms",
+               s.committedMB, s.reservedMB, s.freeMB, s.largestFreeMB, minLargest, s.fragmentation, s.regions, s.walkMs);
+    }
+};
+
+static AddressSpaceMonitor g_addressSpace;
+
+// Work the scheduler runs outside gameplay frames, in priority order
+enum MaintenanceTask {
+    MAINT_CACHE_WRITE = 0,          // Persistent cache entries set since the last write
+    MAINT_CAPTURE_FLUSH,            // Buffered capture records out to disk
+    MAINT_SLIM_COMPACT,             // Slim declaration table rebuilt without dead entries
+    MAINT_HEAP_TRIM,                // Free heap pages returned after a load
+    MAINT_TEXTURE_RESIDENCY,        // Idle managed textures lowered or evicted
+    MAINT_TASK_COUNT
+};
+
+static const char* const kMaintenanceTaskNames[MAINT_TASK_COUNT] = { "cache", "capture", "slim", "heap", "residency" };
+
+/**
+ * Maintenance scheduler - work the proxy needs done but that is too slow for
+ * a gameplay frame. Anything may queue a task (any thread); Present runs
+ * queued tasks on the render thread, either while the idle cap would sleep
+ * anyway or in the slack left under the target frame time, never starting a
+ * task whose measured cost does not fit the budget. A task that doesn't fit
+ * stays queued and counts as deferred.
+ */
+class MaintenanceScheduler {
+public:
+    typedef void (*TaskFn)();
+
+private:
+    struct Task {
+        TaskFn run = nullptr;
+        volatile LONG queued = 0;
+        float estimateMs = 1.0f;    // Jumps to a slower run, decays towards faster ones
+        int completed = 0;          // Since last status
+        int deferred = 0;           // Frames it waited for budget, since last status
+        double ms = 0.0;
+    };
+    Task m_tasks[MAINT_TASK_COUNT];
+
+public:
+    void Register(MaintenanceTask task, TaskFn run, float estimateMs) {
+        m_tasks[task].run = run;
+        m_tasks[task].estimateMs = estimateMs;
+    }
+
+    void Queue(MaintenanceTask task) { InterlockedExchange(&m_tasks[task].queued, 1); }
+
+    // Run queued tasks that fit in budgetMs (render thread); returns the time spent
+    float Run(float budgetMs) {
+        LONGLONG start = QpcNow();
+        for (int i = 0; i < MAINT_TASK_COUNT; i++) {
+            Task& t = m_tasks[i];
+            if (!t.queued || !t.run) continue;
+            float spent = (float)QpcToMs(QpcNow() - start);
+            if (t.estimateMs > budgetMs - spent) {
+                t.deferred++;
+                continue;
+            }
+            InterlockedExchange(&t.queued, 0);
+            LONGLONG taskStart = QpcNow();
+            t.run();
+            float ms = (float)QpcToMs(QpcNow() - taskStart);
+            t.estimateMs = ms > t.estimateMs ? ms : t.estimateMs * 0.75f + ms * 0.25f;
+            t.completed++;
+            t.ms += ms;
+        }
+        return (float)QpcToMs(QpcNow() - start);
+    }
+
+    void LogStatus() {
+        char line[512];
+        int len = 0, pending = 0;
+        line[0] = 0;
+        for (int i = 0; i < MAINT_TASK_COUNT; i++) {
+            Task& t = m_tasks[i];
+            if (t.queued) pending++;
+            if (t.completed || t.deferred) {
+                len += sprintf(line + len, "%s %s %d done / %d deferred (%.2f ms)", len ? "," : "",
+                               kMaintenanceTaskNames[i], t.completed, t.deferred, t.ms);
+            }
+            t.completed = t.deferred = 0;
+            t.ms = 0.0;
+        }
+        if (len || pending) LogMsg("  Maintenance:%s%s %d queued", line, len ? ";" : "", pending);
+    }
+};
+
+static MaintenanceScheduler g_maintenance;
+
+/**
+ * Capture writer - records vertex shader binds, constant uploads, draws and
+ * frame boundaries to camera_proxy_capture.bin (see capture_format.h) for the
+ * offline tools. Plain buffered writes on the render thread; opt-in only.
+ */
+class CaptureWriter {
+private:
+    FILE* m_file = nullptr;
+    char* m_buffer = nullptr;
+    int m_framesLeft = 0;               // 0 = unlimited
+    double m_bytes = 0.0;
+    double m_unflushed = 0.0;           // Written since the last Flush
+
+public:
+    bool Open(const char* path, int frames) {
+        m_file = fopen(path, "wb");
+        if (!m_file) return false;
+        m_buffer = (char*)malloc(4 << 20);
+        if (m_buffer) setvbuf(m_file, m_buffer, _IOFBF, 4 << 20);
+        CaptureHeader header = {};
+        memcpy(header.magic, kCaptureMagic, sizeof(header.magic));
+        header.version = 1;
+        fwrite(&header, sizeof(header), 1, m_file);
+        m_framesLeft = frames;
+        LogMsg("Capture: recording to %s (%d frames)", path, frames);
+        return true;
+    }
+
+    void Close() {
+        if (!m_file) return;
+        fclose(m_file);
+        free(m_buffer);
+        m_file = nullptr;
+        m_buffer = nullptr;
+        LogMsg("Capture: closed, %.1f MB written", m_bytes / (1024.0 * 1024.0));
+    }
+
+    inline void Write(CaptureRecordType type, UINT arg, const float* data = nullptr, UINT count = 0) {
+        if (!m_file) return;
+        CaptureRecordHeader h = { (uint8_t)type, 0, (uint16_t)count, arg };
+        fwrite(&h, sizeof(h), 1, m_file);
+        if (count) fwrite(data, 16, count, m_file);
+        m_bytes += sizeof(h) + count * 16.0;
+        m_unflushed += sizeof(h) + count * 16.0;
+    }
+
+    // Push the buffer to disk before it fills and writes itself out mid-frame
+    void EndFrame(int frame) {
+        if (!m_file) return;
+        Write(CAP_FRAME, (UINT)frame);
+        if (m_framesLeft > 0 && --m_framesLeft == 0) {
+            Close();
+        } else if (m_unflushed >= (1 << 20)) {
+            g_maintenance.Queue(MAINT_CAPTURE_FLUSH);
+        }
+    }
+
+    void Flush() {
+        if (!m_file) return;
+        fflush(m_file);
+        m_unflushed = 0.0;
+    }
+};
+
+static CaptureWriter g_capture;
+
+/**
+ * Speculative runtime init - Remix's Direct3DCreate9 starts the bridge and
+ * brings up Vulkan, none of which depends on anything the game passes in. When
+ * enabled, a thread started at attach makes that call as soon as the loader
+ * lock is released, overlapping it with the game's own startup;
+ * Proxy_Direct3DCreate9 then joins the thread and takes the object it made.
+ *
+ * The thread and the game race for it with a compare-exchange: if the game
+ * asks first (thread not yet running), the thread does nothing and the game
+ * creates its own, so nobody ever waits on a thread that can't start.
+ *
+ * With UpgradeToEx=1 the game's Direct3DCreate9 becomes Direct3DCreate9Ex, so
+ * that is what gets speculated; a plain object would only be thrown away.
+ */
+class SpeculativeRuntime {
+private:
+    enum State { IDLE = 0, PENDING, RUNNING, CLAIMED };
+
+    volatile LONG m_state = IDLE;
+    HANDLE m_thread = nullptr;
+    HANDLE m_done = nullptr;
+    bool m_ex = false;              // Speculating Direct3DCreate9Ex
+    IDirect3D9* m_d3d9 = nullptr;   // An IDirect3D9Ex when m_ex
+    LONGLONG m_loadQpc = 0;
+    double m_createMs = 0.0;
+    double m_waitMs = 0.0;
+    bool m_used = false;
+
+    static DWORD WINAPI Thread(LPVOID param) {
+        SpeculativeRuntime* self = (SpeculativeRuntime*)param;
+        if (InterlockedCompareExchange(&self->m_state, RUNNING, PENDING) != PENDING) return 0;
+        LONGLONG start = QpcNow();
+        if (self->m_ex) {
+            IDirect3D9Ex* d3d9Ex = nullptr;
+            if (SUCCEEDED(g_origDirect3DCreate9Ex(D3D_SDK_VERSION, &d3d9Ex))) self->m_d3d9 = d3d9Ex;
+        } else {
+            self->m_d3d9 = g_origDirect3DCreate9(D3D_SDK_VERSION);
+        }
+        self->m_createMs = QpcToMs(QpcNow() - start);
+        SetEvent(self->m_done);
+        return 0;
+    }
+
+    // Waits for a running speculative create; null if there was none or it failed
+    IDirect3D9* Join() {
+        LONG state = InterlockedCompareExchange(&m_state, CLAIMED, PENDING);
+        if (state == PENDING || state == IDLE || state == CLAIMED) return nullptr;
+        LONGLONG start = QpcNow();
+        WaitForSingleObject(m_done, INFINITE);
+        m_waitMs = QpcToMs(QpcNow() - start);
+        InterlockedExchange(&m_state, CLAIMED);
+        IDirect3D9* d3d9 = m_d3d9;
+        m_d3d9 = nullptr;
+        return d3d9;
+    }
+
+public:
+    // Called at attach, after the runtime is loaded; time to first frame counts from here
+    void Start(bool speculate, bool ex) {
+        m_loadQpc = QpcNow();
+        if (!speculate || !(ex ? (void*)g_origDirect3DCreate9Ex : (void*)g_origDirect3DCreate9)) return;
+        m_ex = ex;
+        m_done = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        if (!m_done) return;
+        m_state = PENDING;
+        m_thread = CreateThread(nullptr, 0, Thread, this, 0, nullptr);
+        if (!m_thread) {
+            m_state = IDLE;
+            return;
+        }
+        LogMsg("SPECULATIVE: %s queued on a background thread", ex ? "Direct3DCreate9Ex" : "Direct3DCreate9");
+    }
+
+    // The speculative object for a create of this kind if it matches, else null; only one
+    // runtime instance should exist, so a mismatched object is released
+    IDirect3D9* Take(UINT sdkVersion, bool ex) {
+        if (ex != m_ex) {
+            Discard(ex ? "game needs Direct3DCreate9Ex" : "game needs Direct3DCreate9");
+            return nullptr;
+        }
+        IDirect3D9* d3d9 = Join();
+        if (!d3d9) return nullptr;
+        if (sdkVersion != D3D_SDK_VERSION) {
+            LogMsg("SPECULATIVE: game asked for SDK version %u, discarding the speculative object", sdkVersion);
+            d3d9->Release();
+            return nullptr;
+        }
+        m_used = true;
+        LogMsg("SPECULATIVE: %s took %.1f ms in the background, game waited %.1f ms, %.1f ms saved",
+               m_ex ? "Direct3DCreate9Ex" : "Direct3DCreate9", m_createMs, m_waitMs, m_createMs - m_waitMs);
+        return d3d9;
+    }
+
+    IDirect3D9Ex* TakeEx(UINT sdkVersion) { return static_cast<IDirect3D9Ex*>(Take(sdkVersion, true)); }
+
+    void Discard(const char* reason) {
+        IDirect3D9* d3d9 = Join();
+        if (d3d9) {
+            LogMsg("SPECULATIVE: %s, discarding the speculative object", reason);
+            d3d9->Release();
+        }
+    }
+
+    void NoteFirstFrame() {
+        LogMsg("First frame presented %.1f ms after proxy load%s", QpcToMs(QpcNow() - m_loadQpc),
+               m_used ? " (speculative init)" : "");
+    }
+
+    // Detach: under the loader lock, so no waiting
+    void Shutdown() {
+        if (m_thread) CloseHandle(m_thread);
+        m_thread = nullptr;
+    }
+};
+
+static SpeculativeRuntime g_speculative;
+
+/**
+ * Persistent cache - what the proxy learned about this game in earlier runs,
+ * kept in camera_proxy_cache.ini next to the executable, one section per
+ * executable name so several games can share a Remix install. Values set
+ * during play are held until the maintenance scheduler writes them out (or
+ * the device goes away), since every write rewrites the file. Values that
+ * must survive a crash go through SetIntNow instead.
+ */
+class PersistentCache {
+private:
+    struct Pending {
+        char key[48];
+        int value;
+    };
+    static const int kMaxPending = 32;
+
+    char m_path[MAX_PATH] = {};
+    char m_section[64] = "default";
+    CRITICAL_SECTION m_lock;
+    Pending m_pending[kMaxPending];
+    int m_pendingCount = 0;
+
+public:
+    PersistentCache() { InitializeCriticalSection(&m_lock); }
+
+    void Init() {
+        GetModuleFileNameA(nullptr, m_path, MAX_PATH);
+        char* lastSlash = strrchr(m_path, '\\');
+        const char* exe = lastSlash ? lastSlash + 1 : m_path;
+        if (*exe) {
+            strncpy(m_section, exe, sizeof(m_section) - 1);
+            m_section[sizeof(m_section) - 1] = 0;
+        }
+        if (lastSlash) {
+            strcpy(lastSlash + 1, "camera_proxy_cache.ini");
+        } else {
+            strcpy(m_path, "camera_proxy_cache.ini");
+        }
+    }
+
+    int GetInt(const char* key, int def) {
+        EnterCriticalSection(&m_lock);
+        for (int i = 0; i < m_pendingCount; i++) {
+            if (strcmp(m_pending[i].key, key) == 0) {
+                int value = m_pending[i].value;
+                LeaveCriticalSection(&m_lock);
+                return value;
+            }
+        }
+        LeaveCriticalSection(&m_lock);
+        return (int)GetPrivateProfileIntA(m_section, key, def, m_path);
+    }
+
+    // Any thread; written by the next Flush
+    void SetInt(const char* key, int value) {
+        EnterCriticalSection(&m_lock);
+        int i = 0;
+        while (i < m_pendingCount && strcmp(m_pending[i].key, key) != 0) i++;
+        if (i == kMaxPending) {
+            LeaveCriticalSection(&m_lock);
+            Flush();
+            SetInt(key, value);
+            return;
+        }
+        if (i == m_pendingCount) {
+            strncpy(m_pending[i].key, key, sizeof(m_pending[i].key) - 1);
+            m_pending[i].key[sizeof(m_pending[i].key) - 1] = 0;
+            m_pendingCount++;
+        }
+        m_pending[i].value = value;
+        LeaveCriticalSection(&m_lock);
+        g_maintenance.Queue(MAINT_CACHE_WRITE);
+    }
+
+    // Any thread; on disk before it returns, for values a crash must not lose
+    void SetIntNow(const char* key, int value) {
+        SetInt(key, value);
+        Flush();
+    }
+
+    void Flush() {
+        Pending pending[kMaxPending];
+        EnterCriticalSection(&m_lock);
+        int count = m_pendingCount;
+        memcpy(pending, m_pending, count * sizeof(Pending));
+        m_pendingCount = 0;
+        LeaveCriticalSection(&m_lock);
+        for (int i = 0; i < count; i++) {
+            char buf[16];
+            sprintf(buf, "%d", pending[i].value);
+            WritePrivateProfileStringA(m_section, pending[i].key, buf, m_path);
+        }
+    }
+};
+
+static PersistentCache g_cache;
+
+/**
+ * Device thread tripwire. A game that creates its device with
+ * D3DCREATE_MULTITHREADED makes every call pay for the runtime's lock, even if
+ * it only ever uses the device from one thread. The tripwire watches which
+ * thread calls the device; once a run finishes without concurrent use, the
+ * next launch creates the device without the flag and the tripwire stands
+ * guard, switching to a proxy-side lock the moment a second thread shows up.
+ *
+ * The one hand-off UE3 makes before its first Present (device created on the
+ * game thread, then driven by the rendering thread) is allowed; any other
+ * change of thread counts as multithreaded use and is recorded in the cache.
+ * Resource wrappers that call into the runtime (locks, texture access,
+ * destruction) check the same wire through ResourceGuard. When it trips, owner
+ * calls already in flight finish before any other thread takes the lock.
+ */
+class ThreadTripwire {
+public:
+    enum Mode {
+        MODE_OFF = 0,       // Game did not ask for a multithreaded device
+        MODE_OBSERVE,       // Flag kept; record whether it was needed
+        MODE_GUARD          // Flag stripped; lock on the proxy side once tripped
+    };
+
+private:
+    Mode m_mode = MODE_OFF;
+    DWORD m_owner = 0;
+    volatile LONG m_tripped = 0;
+    volatile LONG m_inCall = 0;         // Owner-thread call depth, unlocked calls only
+    volatile LONG m_drained = 0;        // Unlocked owner calls begun before the trip have returned
+    bool m_presented = false;
+    bool m_recordedClean = false;
+    CRITICAL_SECTION m_lock;
+
+    void Cross(DWORD tid) {
+        if (m_inCall == 0 && !m_presented) {
+            LogMsg("THREADS: device handed from thread %u to %u before the first Present", m_owner, tid);
+            m_owner = tid;
+            return;
+        }
+        if (InterlockedCompareExchange(&m_tripped, 1, 0) != 0) return;
+        LogMsg("THREADS: device called from thread %u while owned by %u at frame %d%s", tid, m_owner, g_frameCount,
+               m_mode == MODE_GUARD ? ", switching to a proxy-side lock" : "");
+        g_cache.SetIntNow("MultithreadedDevice", 1);   // The race it guards against may well crash the game
+        if (m_mode == MODE_GUARD) {
+            // The owner bumps m_inCall before rereading m_tripped; the flush orders
+            // both sides without a barrier on its fast path
+            FlushProcessWriteBuffers();
+            while (m_inCall > 0) SwitchToThread();
+        }
+        InterlockedExchange(&m_drained, 1);
+    }
+
+    // ns per uncontended EnterCriticalSection/LeaveCriticalSection pair
+    double TimeLockPair() {
+        const int N = 100000;
+        LONGLONG start = QpcNow();
+        for (int i = 0; i < N; i++) {
+            EnterCriticalSection(&m_lock);
+            LeaveCriticalSection(&m_lock);
+        }
+        return QpcToMs(QpcNow() - start) * 1.0e6 / N;
+    }
+
+public:
+    DWORD calls = 0;                    // Since last status
+    double nsPerLock = 0.0;
+    double nsPerCheck = 0.0;
+
+    ThreadTripwire() { InitializeCriticalSection(&m_lock); }
+
+    void Init(Mode mode) {
+        m_mode = mode;
+        m_owner = GetCurrentThreadId();
+        if (mode != MODE_GUARD) return;
+        nsPerLock = TimeLockPair();
+        LONGLONG start = QpcNow();
+        const int N = 100000;
+        for (int i = 0; i < N; i++) {
+            int token = Enter();
+            Leave(token);
+        }
+        nsPerCheck = QpcToMs(QpcNow() - start) * 1.0e6 / N;
+        calls = 0;
+    }
+
+    Mode GetMode() const { return m_mode; }
+    bool Tripped() const { return m_tripped != 0; }
+
+    // Token for Leave: TOKEN_COUNTED for an unlocked owner call, TOKEN_LOCKED when the proxy lock is held
+    enum { TOKEN_NONE = 0, TOKEN_COUNTED, TOKEN_LOCKED };
+
+    inline int Enter() {
+        if (m_mode == MODE_OFF) return TOKEN_NONE;
+        if (!m_tripped) {
+            DWORD tid = GetCurrentThreadId();
+            if (tid != m_owner) Cross(tid);
+            if (!m_tripped) {
+                m_inCall++;
+                if (!m_tripped) {
+                    calls++;
+                    return TOKEN_COUNTED;
+                }
+                m_inCall--;             // Tripped in between; lock like everyone else
+            }
+        }
+        if (m_mode != MODE_GUARD) return TOKEN_NONE;
+        // Nested owner calls may lock while an unlocked outer call is still in flight; other threads wait it out
+        if (!m_drained && GetCurrentThreadId() != m_owner) {
+            while (!m_drained) SwitchToThread();
+        }
+        EnterCriticalSection(&m_lock);
+        return TOKEN_LOCKED;
+    }
+
+    inline void Leave(int token) {
+        if (token == TOKEN_LOCKED) {
+            LeaveCriticalSection(&m_lock);
+        } else if (token == TOKEN_COUNTED) {
+            m_inCall--;
+        }
+    }
+
+    // A run this long without a second thread is worth remembering
+    void RecordIfClean(int minFrames) {
+        if (m_mode != MODE_OBSERVE || m_tripped || m_recordedClean || g_frameCount < minFrames) return;
+        m_recordedClean = true;
+        g_cache.SetInt("MultithreadedDevice", 0);
+        LogMsg("THREADS: no multithreaded device use in %d frames, flag will be stripped next launch", g_frameCount);
+    }
+
+    // Present: past the startup hand-off
+    void NotePresent() {
+        m_presented = true;
+        RecordIfClean(3600);
+    }
+
+    void NoteShutdown() { RecordIfClean(300); }
+
+    void LogStatus(int frames) {
+        if (m_mode == MODE_OFF) return;
+        if (m_mode == MODE_OBSERVE) {
+            LogMsg("  Threads: multithreaded flag kept, %s", m_tripped ? "concurrent use seen" : "single-threaded so far");
+        } else if (m_tripped) {
+            LogMsg("  Threads: flag stripped, second thread seen, proxy-side lock active");
+        } else {
+            double net = nsPerLock - nsPerCheck;
+            LogMsg("  Threads: flag stripped, %.0f calls/frame, lock %.1f ns vs check %.1f ns per call, %.3f ms/frame saved",
+                   calls / (double)frames, nsPerLock, nsPerCheck, calls * net / 1.0e6 / frames);
+        }
+        calls = 0;
+    }
+};
+
+// Scoped tripwire check at the top of every device method
+class ThreadGuard {
+private:
+    ThreadTripwire& m_tripwire;
+    int m_token;
+
+public:
+    explicit ThreadGuard(ThreadTripwire& tripwire) : m_tripwire(tripwire), m_token(tripwire.Enter()) {}
+    ~ThreadGuard() { m_tripwire.Leave(m_token); }
+};
+
+// Tripwire of the live device; resource wrappers have no device pointer of the right type
+static ThreadTripwire* g_resourceTripwire = nullptr;
+
+// Same check for resource wrapper methods that call into the runtime
+class ResourceGuard {
+private:
+    ThreadTripwire* m_tripwire;
+    int m_token;
+
+public:
+    ResourceGuard() : m_tripwire(g_resourceTripwire), m_token(m_tripwire ? m_tripwire->Enter() : 0) {}
+    ~ResourceGuard() {
+        if (m_tripwire) m_tripwire->Leave(m_token);
+    }
+};
+
+/**
+ * World matrix stabilizer - per-geometry-ID memory of the last World sent
+ * to Remix. MVP x VP^-1 reconstruction jitters in the low bits, which makes
+ * static objects look like moving instances (transform updates and BLAS/TLAS
+ * refits in Remix). A reconstruction within worldSnapEpsilon of the previous
+ * reconstruction is noise and gets the exact bits sent before, as long as it
+ * is also within epsilon of those bits; the held matrix never lags the fresh
+ * one by more than that.
+ */
+class WorldStabilizer {
+private:
+    struct Entry {
+        UINT64 id;          // 0 = empty
+        int lastFrame;
+        D3DMATRIX world;    // Last sent to Remix
+        D3DMATRIX fresh;    // Last reconstruction, before snapping
+    };
+    static const int CAPACITY = 16384;  // Power of two
+    static const int MAX_PROBE = 16;
+    static const int STALE_FRAMES = 300;
+    Entry* m_entries = nullptr;
+
+public:
+    int snapped = 0;        // Reconstructions replaced by the previous World (since last status)
+    int suppressed = 0;     // ...of which differed in bits, i.e. instance updates avoided
+    int updates = 0;        // Reconstructions that moved beyond epsilon
+
+    WorldStabilizer() { m_entries = (Entry*)calloc(CAPACITY, sizeof(Entry)); }
+    ~WorldStabilizer() { free(m_entries); }
+
+    // Replaces *world with the remembered matrix when it only moved by noise.
+    // hint = slot this ID was found in before (checked first); returns its slot now, or -1
+    int Stabilize(UINT64 id, D3DMATRIX* world, int hint = -1) {
+        if (!m_entries) return -1;
+        id |= 1;  // Keep 0 free as the empty marker
+
+        if (hint >= 0 && m_entries[hint].id == id) {
+            Update(m_entries[hint], world);
+            return hint;
+        }
+        Entry* reuse = nullptr;
+        UINT slot = (UINT)id & (CAPACITY - 1);
+        for (int probe = 0; probe < MAX_PROBE; probe++, slot = (slot + 1) & (CAPACITY - 1)) {
+            Entry& e = m_entries[slot];
+            if (e.id == id) {
+                Update(e, world);
+                return (int)slot;
+            }
+            if (!reuse && (e.id == 0 || g_frameCount - e.lastFrame > STALE_FRAMES)) {
+                reuse = &e;
+            }
+        }
+        if (!reuse) return -1;
+        reuse->id = id;
+        reuse->lastFrame = g_frameCount;
+        reuse->world = *world;
+        reuse->fresh = *world;
+        return (int)(reuse - m_entries);
+    }
+
+private:
+    void Update(Entry& e, D3DMATRIX* world) {
+        bool noise = MatricesNearlyEqual(*world, e.fresh, g_config.worldSnapEpsilon) &&
+                     MatricesNearlyEqual(*world, e.world, g_config.worldSnapEpsilon);
+        e.fresh = *world;
+        if (noise) {
+            if (memcmp(world, &e.world, sizeof(D3DMATRIX)) != 0) suppressed++;
+            snapped++;
+            *world = e.world;
+        } else {
+            updates++;
+            e.world = *world;
+        }
+        e.lastFrame = g_frameCount;
+    }
+};
+
+/**
+ * Object-space draw bounds, per geometry ID, computed once from the CPU shadow
+ * of a static vertex buffer and recomputed when the buffer is written.
+ * Geometry whose positions can't be read is remembered as unbounded.
+ */
+class DrawBoundsCache {
+public:
+    struct Entry {
+        UINT64 id;          // 0 = empty
+        const void* vb;
+        UINT version;
+        bool known;
+        float center[3];
+        float extent[3];
+    };
+
+private:
+    static const int CAPACITY = 16384;  // Power of two
+    static const int MAX_PROBE = 16;
+    Entry* m_entries = nullptr;
+
+public:
+    DrawBoundsCache() { m_entries = (Entry*)calloc(CAPACITY, sizeof(Entry)); }
+    ~DrawBoundsCache() { free(m_entries); }
+
+    // Entry for this geometry, or null when the table is full around it; *fresh = must be (re)computed
+    Entry* Find(UINT64 id, const void* vb, UINT version, bool* fresh) {
+        if (!m_entries) return nullptr;
+        id |= 1;
+        UINT slot = (UINT)id & (CAPACITY - 1);
+        for (int probe = 0; probe < MAX_PROBE; probe++, slot = (slot + 1) & (CAPACITY - 1)) {
+            Entry& e = m_entries[slot];
+            if (e.id == id || e.id == 0) {
+                *fresh = e.id == 0 || e.vb != vb || e.version != version;
+                e.id = id;
+                e.vb = vb;
+                e.version = version;
+                return &e;
+            }
+        }
+        return nullptr;
+    }
+};
+
+/**
+ * Draw-order predictor. UE3 submits nearly the same draws in the same order
+ * every frame, so the proxy keeps last frame's sequence of draw keys (bound
+ * buffers and shaders, draw arguments, target class, pass, camera presence)
+ * with what was worked out for each draw. A new draw is compared first with
+ * the entry at the current position, then within a few entries either side
+ * to resynchronize after inserted or dropped draws. On a hit the geometry ID,
+ * draw rule and stabilizer slot are reused, and so is the World when c0-c3
+ * and the camera are bit-identical to what it was built from.
+ */
+struct DrawKey {
+    const void* vb;
+    const void* ib;
+    const void* vs;
+    const void* ps;
+    UINT vbOffset;
+    UINT a, b, c;           // Draw arguments that go into the geometry ID
+    BYTE method;            // FlightMethod
+    BYTE target;            // TargetClass
+    BYTE pass;              // PerfPass
+    BYTE camera;            // This frame's camera captured
+};
+
+struct DrawPrediction {
+    DrawKey key;
+    UINT64 geometryId;
+    int rule;               // Matching draw rule, -1 = none
+    int ruleGeneration;
+    int stabilizerSlot;     // -1 = unknown
+    int viewProjVersion;    // Camera the World was built under, -1 = no World recorded
+    D3DMATRIX mvp;
+    D3DMATRIX world;
+};
+
+class DrawPredictor {
+private:
+    static const int CAPACITY = 8192;   // Draws remembered per frame
+    static const int WINDOW = 8;        // Entries searched either side on a miss
+    DrawPrediction* m_prev = nullptr;
+    DrawPrediction* m_cur = nullptr;
+    int m_prevCount = 0;
+    int m_curCount = 0;
+    int m_cursor = 0;
+
+public:
+    int hits = 0;           // Matched at the predicted position (since last status)
+    int resyncs = 0;        // Matched within the window
+    int misses = 0;
+    int worldsReused = 0;
+    unsigned __int64 hitTicks = 0;      // Resolving predicted draws
+    unsigned __int64 missTicks = 0;     // Resolving draws the long way
+
+    ~DrawPredictor() {
+        free(m_prev);
+        free(m_cur);
+    }
+
+    bool Init() {
+        m_prev = (DrawPrediction*)malloc(CAPACITY * sizeof(DrawPrediction));
+        m_cur = (DrawPrediction*)malloc(CAPACITY * sizeof(DrawPrediction));
+        return m_prev && m_cur;
+    }
+
+    // Last frame's entry for this draw, or null
+    inline const DrawPrediction* Predict(const DrawKey& key) {
+        if (!m_prev) return nullptr;
+        if (m_cursor < m_prevCount && memcmp(&m_prev[m_cursor].key, &key, sizeof(DrawKey)) == 0) {
+            hits++;
+            return &m_prev[m_cursor++];
+        }
+        int lo = (std::max)(0, m_cursor - WINDOW);
+        int hi = (std::min)(m_prevCount, m_cursor + WINDOW + 1);
+        for (int i = lo; i < hi; i++) {
+            if (memcmp(&m_prev[i].key, &key, sizeof(DrawKey)) == 0) {
+                resyncs++;
+                m_cursor = i + 1;
+                return &m_prev[i];
+            }
+        }
+        misses++;
+        return nullptr;
+    }
+
+    // This frame's entry for the draw, filled in by the caller; null when the frame is over capacity
+    inline DrawPrediction* Record(const DrawKey& key) {
+        if (!m_cur || m_curCount >= CAPACITY) return nullptr;
+        DrawPrediction* p = &m_cur[m_curCount++];
+        p->key = key;
+        p->rule = -1;
+        p->ruleGeneration = -1;
+        p->stabilizerSlot = -1;
+        p->viewProjVersion = -1;
+        return p;
+    }
+
+    // Present: this frame's sequence is next frame's prediction
+    void EndFrame() {
+        std::swap(m_prev, m_cur);
+        m_prevCount = m_curCount;
+        m_curCount = 0;
+        m_cursor = 0;
+    }
+
+    void LogStatus(int frames, double tscPerMs) {
+        int total = hits + resyncs + misses;
+        if (total) {
+            int predicted = hits + resyncs;
+            double hitNs = predicted && tscPerMs > 0.0 ? hitTicks / tscPerMs * 1.0e6 / predicted : 0.0;
+            double missNs = misses && tscPerMs > 0.0 ? missTicks / tscPerMs * 1.0e6 / misses : 0.0;
+            double savedMs = missNs > hitNs ? predicted * (missNs - hitNs) / 1.0e6 / frames : 0.0;
+            LogMsg("  Predict: %.1f draws/frame, %.1f%% at position, %.1f%% resynced, %.1f%% missed; %.1f worlds/frame reused; %.0f ns/draw predicted vs %.0f missed, ~%.3f ms/frame saved",
+                   total / (double)frames, 100.0 * hits / total, 100.0 * resyncs / total, 100.0 * misses / total,
+                   worldsReused / (double)frames, hitNs, missNs, savedMs);
+        }
+        hits = resyncs = misses = worldsReused = 0;
+        hitTicks = missTicks = 0;
+    }
+};
+
+// Per-draw inline testing against batched testing of the same boxes, logged once at startup
+static void BenchmarkDrawBatch() {
+    FrameArena arena;
+    if (!arena.Init(8 << 20)) return;
+    D3DMATRIX view, proj, vp;
+    CreateIdentityMatrix(&view);
+    CreateProjectionMatrix(&proj, 1.5708f, 16.0f / 9.0f, 10.0f, 100000.0f);
+    MultiplyMatrix(&vp, view, proj);
+    FrustumPlanes planes;
+    ExtractFrustumPlanes(&vp._11, &planes);
+
+    static const UINT kSizes[2] = { 5000, 20000 };
+    for (UINT size : kSizes) {
+        arena.Reset();
+        DrawBatch batch;
+        batch.Clear();
+        if (!batch.Reserve(arena, size)) return;
+        UINT seed = 12345;
+        for (UINT i = 0; i < size; i++) {
+            float c[3], e[3];
+            for (int k = 0; k < 3; k++) {
+                seed = seed * 1664525u + 1013904223u;
+                c[k] = (float)(seed >> 8) / (1 << 24) * 40000.0f - 20000.0f;
+                e[k] = 50.0f + (float)((seed >> 4) & 1023);
+            }
+            batch.Push(c, e, i, 0);
+        }
+        BYTE* inlineResult = (BYTE*)malloc(size);
+        if (!inlineResult) return;
+
+        const int kReps = 20;
+        LONGLONG start = QpcNow();
+        for (int r = 0; r < kReps; r++) {
+            for (UINT i = 0; i < size; i++) {
+                inlineResult[i] = (BYTE)ClassifyBox(planes, batch.cx[i], batch.cy[i], batch.cz[i], batch.ex[i], batch.ey[i], batch.ez[i]);
+            }
+        }
+        double perDrawUs = QpcToMs(QpcNow() - start) * 1000.0 / kReps;
+        start = QpcNow();
+        for (int r = 0; r < kReps; r++) ClassifyBatch(planes, batch);
+        double batchedUs = QpcToMs(QpcNow() - start) * 1000.0 / kReps;
+
+        int mismatches = 0;
+        for (UINT i = 0; i < size; i++) {
+            if (inlineResult[i] != batch.visibility[i]) mismatches++;
+        }
+        free(inlineResult);
+        LogMsg("BATCH: %u draws: per-draw %.1f us, batched %.1f us (%.1fx)%s", size, perDrawUs, batchedUs,
+               batchedUs > 0.0 ? perDrawUs / batchedUs : 0.0, mismatches ? ", RESULTS DIFFER" : "");
+    }
+}
+
+/**
+ * Pixel shader eye register - UE3 also uploads the camera world position to a
+ * pixel shader constant for lighting and fog. While learning, each PS register
+ * written in a frame is compared at Present with the eye recovered from that
+ * frame's accepted view; the register that keeps matching is locked. After
+ * that, a c5-c8 candidate is the main camera exactly when it maps this frame's
+ * PS eye to the view-space origin, so one transform and compare replaces the
+ * full validation, and shadow/reflection cameras are rejected no matter which
+ * comes first in the frame.
+ */
+class EyeRegister {
+private:
+    static const int kRegisters = 256;
+    static const int kLearnFrames = 60;     // Matching frames before a register is trusted
+    static const int kMissFrames = 30;      // Frames with only secondary cameras before relearning
+    float m_values[kRegisters][3];          // Last xyz written this frame, while learning
+    UINT m_written[kRegisters / 32] = {};
+    int m_hits[kRegisters] = {};
+    int m_misses[kRegisters] = {};
+    int m_locked = -1;
+    float m_eye[3] = {};                    // Locked register's latest value
+    int m_eyeFrame = -1;                    // Frame it was written in
+    int m_missFrames = 0;
+    int m_learnFrames = 0;
+    bool m_secondaryThisFrame = false;
+
+public:
+    int fastAccepts = 0;    // Candidates accepted by the eye compare alone (since last status)
+    int fullChecks = 0;     // Candidates that went through ClassifyViewMatrix
+    int secondaries = 0;    // World-shaped candidates rejected for not sitting at the eye
+
+    int Locked() const { return m_locked; }
+
+    // SetPixelShaderConstantF
+    inline void NoteUpload(UINT start, const float* data, UINT count) {
+        if (m_locked >= 0) {
+            if ((UINT)m_locked >= start && (UINT)m_locked < start + count) {
+                memcpy(m_eye, data + (m_locked - start) * 4, sizeof(m_eye));
+                m_eyeFrame = g_frameCount;
+            }
+            return;
+        }
+        for (UINT i = 0; i < count && start + i < kRegisters; i++) {
+            memcpy(m_values[start + i], data + i * 4, sizeof(m_values[0]));
+            m_written[(start + i) >> 5] |= 1u << ((start + i) & 31);
+        }
+    }
+
+    // 1 = the main camera, 0 = some other camera, -1 = no eye from this frame to compare with
+    inline int Match(const float* m) const {
+        if (m_locked < 0 || m_eyeFrame != g_frameCount) return -1;
+        return ViewSitsAtEye(m, m_eye, g_config.detect) ? 1 : 0;
+    }
+
+    void NoteSecondary() {
+        secondaries++;
+        m_secondaryThisFrame = true;
+    }
+
+    // Present; view = this frame's accepted camera, or null
+    void EndFrame(const D3DMATRIX* view) {
+        if (m_locked >= 0) {
+            // Frames that saw cameras but none at the eye: the register no longer holds it
+            if (!view && m_secondaryThisFrame) {
+                if (++m_missFrames >= kMissFrames) {
+                    LogMsg("EYE: no camera at PS c%d for %d frames, relearning", m_locked, kMissFrames);
+                    m_locked = -1;
+                    m_learnFrames = 0;
+                    memset(m_hits, 0, sizeof(m_hits));
+                    memset(m_misses, 0, sizeof(m_misses));
+                }
+            } else {
+                m_missFrames = 0;
+            }
+            m_secondaryThisFrame = false;
+            return;
+        }
+
+        if (view) {
+            float eye[3];
+            EyeFromView(&view->_11, eye);
+            float tol = EyeTolerance(eye);
+            int best = -1;
+            for (int r = 0; r < kRegisters; r++) {
+                if (!(m_written[r >> 5] & (1u << (r & 31)))) continue;
+                float dx = m_values[r][0] - eye[0], dy = m_values[r][1] - eye[1], dz = m_values[r][2] - eye[2];
+                if (dx * dx + dy * dy + dz * dz < tol * tol) m_hits[r]++; else m_misses[r]++;
+                if (m_hits[r] >= kLearnFrames && m_misses[r] * 10 <= m_hits[r] && (best < 0 || m_hits[r] > m_hits[best])) {
+                    best = r;
+                }
+            }
+            m_learnFrames++;
+            if (best >= 0) {
+                m_locked = best;
+                m_missFrames = 0;
+                LogMsg("EYE: camera position found at PS c%d after %d frames (%d hits, %d misses)",
+                       best, m_learnFrames, m_hits[best], m_misses[best]);
+            }
+        }
+        memset(m_written, 0, sizeof(m_written));
+    }
+
+    void LogStatus(int frames) {
+        if (m_locked >= 0) {
+            LogMsg("  Eye: PS c%d, %.1f fast accepts/frame, %.1f full checks/frame, %.1f secondary cameras rejected/frame",
+                   m_locked, fastAccepts / (double)frames, fullChecks / (double)frames, secondaries / (double)frames);
+        } else {
+            LogMsg("  Eye: learning the PS camera position register (%d frames with a camera)", m_learnFrames);
+        }
+        fastAccepts = fullChecks = secondaries = 0;
+    }
+};
+
+/**
+ * Draw rules - per-draw filtering decisions written as lines in a sidecar file
+ * instead of code in the draw path. A rule is an action followed by
+ * conditions on the render target size class, the D3DPERF pass, the primitive
+ * count, whether this frame's camera has been captured yet, and the bound
+ * shaders' intern hashes; the first rule whose conditions all hold decides
+ * the draw, and a draw no rule matches is forwarded.
+ *
+ *   # action [rt=full|half|quarter|square|other,...] [pass=shadow|prepass|base|lighting|translucency|post|ui|none,...]
+ *   #        [prims=N|N-|-M|N-M] [camera=yes|no] [vs=<hash>] [ps=<hash>]
+ *   skip pass=post rt=quarter
+ *   identity pass=ui
+ *   tag vs=9c1e44a0b27d13f5
+ *
+ * Loading compiles the rules into one bitmask per condition value (bit r =
+ * rule r accepts it), so a draw costs five table lookups, an AND and a bit
+ * scan. Shader masks only change on bind, so the device caches them. The
+ * file is checked for changes every 60 frames and recompiled in place.
+ */
+enum DrawRuleAction {
+    RULE_FORWARD = 0,       // Draw unchanged; stops later rules from matching
+    RULE_SKIP,              // Drop the draw
+    RULE_IDENTITY,          // Draw with an identity World instead of the reconstructed one
+    RULE_TAG,               // Draw unchanged; the first few are logged with their attributes
+    RULE_ACTION_COUNT
+};
+
+static const char* kRuleActionNames[RULE_ACTION_COUNT] = { "forward", "skip", "identity", "tag" };
+
+// Render target 0 size relative to the back buffer
+enum TargetClass {
+    TARGET_FULL = 0,
+    TARGET_HALF,
+    TARGET_QUARTER,
+    TARGET_SQUARE,          // Any other square target (shadow maps)
+    TARGET_OTHER,
+    TARGET_CLASS_COUNT
+};
+
+static const char* kTargetClassNames[TARGET_CLASS_COUNT] = { "full", "half", "quarter", "square", "other" };
+
+static TargetClass ClassifyTarget(UINT w, UINT h, UINT backW, UINT backH) {
+    if (w == backW && h == backH) return TARGET_FULL;
+    if (backW && backH) {
+        // Games round odd sizes either way
+        if (abs((int)(w * 2) - (int)backW) <= 2 && abs((int)(h * 2) - (int)backH) <= 2) return TARGET_HALF;
+        if (abs((int)(w * 4) - (int)backW) <= 4 && abs((int)(h * 4) - (int)backH) <= 4) return TARGET_QUARTER;
+    }
+    return w == h ? TARGET_SQUARE : TARGET_OTHER;
+}
+
+class DrawRules {
+public:
+    static const int kMaxRules = 32;
+
+private:
+    static const int kMaxTagLogs = 16;     // Tagged draws logged per load
+
+    struct Rule {
+        int line;
+        int action;
+        DWORD targets;          // Bit per TargetClass
+        DWORD passes;           // Bit per PerfPass
+        DWORD cameras;          // Bit 0 = no camera yet, bit 1 = camera captured
+        UINT minPrims;
+        UINT maxPrims;
+        UINT64 vs;              // 0 = any
+        UINT64 ps;
+    };
+
+    struct ShaderEntry {
+        UINT64 hash;
+        DWORD mask;
+    };
+
+    // Compiled rules: each array holds, per condition value, the rules accepting it
+    struct Table {
+        int count = 0;
+        int line[kMaxRules];
+        BYTE action[kMaxRules];
+        DWORD target[TARGET_CLASS_COUNT] = {};
+        DWORD pass[PERF_PASS_COUNT] = {};
+        DWORD camera[2] = {};
+        UINT primBounds[kMaxRules * 2];     // Sorted edges; bucket b = [primBounds[b - 1], primBounds[b])
+        int primBoundCount = 0;
+        DWORD prims[kMaxRules * 2 + 1] = {};
+        DWORD vsAny = 0;                    // Rules without a vs= condition
+        DWORD psAny = 0;
+        ShaderEntry vs[kMaxRules];
+        ShaderEntry ps[kMaxRules];
+        int vsCount = 0;
+        int psCount = 0;
+    };
+
+    char m_path[MAX_PATH] = {};
+    const char* m_name = "";
+    FILETIME m_writeTime = {};
+    Table* m_table = nullptr;
+    int m_generation = 0;
+    DWORD m_hits[kMaxRules] = {};
+    int m_tagsLogged = 0;
+
+    // Comma-separated names into a bit per name index (strtok is busy with the rule line)
+    static bool ParseList(const char* value, const char* const* names, int count, DWORD* bits) {
+        *bits = 0;
+        while (*value) {
+            const char* comma = strchr(value, ',');
+            size_t len = comma ? (size_t)(comma - value) : strlen(value);
+            int i = 0;
+            while (i < count && !(strlen(names[i]) == len && _strnicmp(value, names[i], len) == 0)) i++;
+            if (i == count) return false;
+            *bits |= 1u << i;
+            value += len + (comma ? 1 : 0);
+        }
+        return *bits != 0;
+    }
+
+    // False (and logs why) when the line is not a valid rule
+    bool ParseRule(char* text, int line, Rule* rule) {
+        memset(rule, 0, sizeof(*rule));
+        rule->line = line;
+        rule->targets = (1u << TARGET_CLASS_COUNT) - 1;
+        rule->passes = (1u << PERF_PASS_COUNT) - 1;
+        rule->cameras = 3;
+        rule->maxPrims = UINT_MAX;
+
+        char* tok = strtok(text, " \t");
+        rule->action = -1;
+        for (int a = 0; a < RULE_ACTION_COUNT; a++) {
+            if (_stricmp(tok, kRuleActionNames[a]) == 0) rule->action = a;
+        }
+        if (rule->action < 0) {
+            LogMsg("RULES: %s line %d: unknown action \"%s\", rule ignored", m_name, line, tok);
+            return false;
+        }
+
+        while ((tok = strtok(nullptr, " \t")) != nullptr) {
+            char* value = strchr(tok, '=');
+            if (!value) {
+                LogMsg("RULES: %s line %d: expected key=value, got \"%s\", rule ignored", m_name, line, tok);
+                return false;
+            }
+            *value++ = 0;
+            bool ok;
+            if (_stricmp(tok, "rt") == 0) {
+                ok = ParseList(value, kTargetClassNames, TARGET_CLASS_COUNT, &rule->targets);
+            } else if (_stricmp(tok, "pass") == 0) {
+                ok = ParseList(value, kPerfPassNames, PERF_PASS_COUNT, &rule->passes);
+            } else if (_stricmp(tok, "camera") == 0) {
+                ok = _stricmp(value, "yes") == 0 || _stricmp(value, "no") == 0;
+                rule->cameras = _stricmp(value, "yes") == 0 ? 2 : 1;
+            } else if (_stricmp(tok, "prims") == 0) {
+                // N, N-, -M or N-M
+                char* dash = strchr(value, '-');
+                ok = *value != 0;
+                if (!dash) {
+                    rule->minPrims = rule->maxPrims = (UINT)strtoul(value, nullptr, 10);
+                } else {
+                    if (dash != value) rule->minPrims = (UINT)strtoul(value, nullptr, 10);
+                    if (dash[1]) rule->maxPrims = (UINT)strtoul(dash + 1, nullptr, 10);
+                    ok = ok && rule->minPrims <= rule->maxPrims;
+                }
+            } else if (_stricmp(tok, "vs") == 0 || _stricmp(tok, "ps") == 0) {
+                UINT64 hash = _strtoui64(value, nullptr, 16);
+                ok = hash != 0;
+                (tok[0] == 'v' || tok[0] == 'V' ? rule->vs : rule->ps) = hash;
+            } else {
+                LogMsg("RULES: %s line %d: unknown condition \"%s\", rule ignored", m_name, line, tok);
+                return false;
+            }
+            if (!ok) {
+                LogMsg("RULES: %s line %d: bad value \"%s\" for %s, rule ignored", m_name, line, value, tok);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void AddShader(ShaderEntry* list, int* count, UINT64 hash, DWORD bit) {
+        int i = 0;
+        while (i < *count && list[i].hash < hash) i++;
+        if (i < *count && list[i].hash == hash) {
+            list[i].mask |= bit;
+            return;
+        }
+        memmove(list + i + 1, list + i, (*count - i) * sizeof(ShaderEntry));
+        list[i].hash = hash;
+        list[i].mask = bit;
+        (*count)++;
+    }
+
+    static DWORD LookupShader(const ShaderEntry* list, int count, DWORD any, UINT64 hash) {
+        if (!hash) return any;
+        const ShaderEntry* end = list + count;
+        const ShaderEntry* it = std::lower_bound(list, end, hash,
+                                                [](const ShaderEntry& s, UINT64 h) { return s.hash < h; });
+        return any | (it != end && it->hash == hash ? it->mask : 0);
+    }
+
+    static Table* Compile(const Rule* rules, int count) {
+        Table* t = new Table();
+        t->count = count;
+        for (int r = 0; r < count; r++) {
+            const Rule& rule = rules[r];
+            DWORD bit = 1u << r;
+            t->line[r] = rule.line;
+            t->action[r] = (BYTE)rule.action;
+            for (int c = 0; c < TARGET_CLASS_COUNT; c++) if (rule.targets & (1u << c)) t->target[c] |= bit;
+            for (int p = 0; p < PERF_PASS_COUNT; p++) if (rule.passes & (1u << p)) t->pass[p] |= bit;
+            for (int c = 0; c < 2; c++) if (rule.cameras & (1u << c)) t->camera[c] |= bit;
+            if (rule.vs) AddShader(t->vs, &t->vsCount, rule.vs, bit); else t->vsAny |= bit;
+            if (rule.ps) AddShader(t->ps, &t->psCount, rule.ps, bit); else t->psAny |= bit;
+            if (rule.minPrims > 0) t->primBounds[t->primBoundCount++] = rule.minPrims;
+            if (rule.maxPrims < UINT_MAX) t->primBounds[t->primBoundCount++] = rule.maxPrims + 1;
+        }
+
+        // Every rule's range edges are bucket edges, so a rule accepts a bucket wholly or not at all
+        std::sort(t->primBounds, t->primBounds + t->primBoundCount);
+        t->primBoundCount = (int)(std::unique(t->primBounds, t->primBounds + t->primBoundCount) - t->primBounds);
+        for (int b = 0; b <= t->primBoundCount; b++) {
+            UINT low = b ? t->primBounds[b - 1] : 0;
+            for (int r = 0; r < count; r++) {
+                if (low >= rules[r].minPrims && low <= rules[r].maxPrims) t->prims[b] |= 1u << r;
+            }
+        }
+        return t;
+    }
+
+    // False when the file can't be read; the current rules stay in force
+    bool Load() {
+        FILE* f = fopen(m_path, "r");
+        if (!f) return false;
+        Rule rules[kMaxRules];
+        int count = 0, ignored = 0, line = 0;
+        bool shaderConditions = false;
+        char text[512];
+        while (fgets(text, sizeof(text), f)) {
+            line++;
+            char* comment = strchr(text, '#');
+            if (comment) *comment = 0;
+            char* end = text + strlen(text);
+            while (end > text && (unsigned char)end[-1] <= ' ') *--end = 0;
+            char* start = text;
+            while (*start == ' ' || *start == '\t') start++;
+            if (!*start) continue;
+            if (count == kMaxRules) {
+                LogMsg("RULES: %s line %d: more than %d rules, rest ignored", m_name, line, kMaxRules);
+                ignored++;
+                break;
+            }
+            char copy[512];
+            strcpy(copy, start);
+            if (ParseRule(start, line, &rules[count])) {
+                LogMsg("RULES: line %d: %s", line, copy);
+                shaderConditions |= rules[count].vs || rules[count].ps;
+                count++;
+            } else {
+                ignored++;
+            }
+        }
+        fclose(f);
+
+        delete m_table;
+        m_table = Compile(rules, count);
+        m_generation++;
+        memset(m_hits, 0, sizeof(m_hits));
+        m_tagsLogged = 0;
+        LogMsg("RULES: %d rules compiled from %s (%d ignored), generation %d", count, m_name, ignored, m_generation);
+        if (shaderConditions && !g_config.internShaders) {
+            LogMsg("RULES: vs=/ps= conditions need InternShaders=1, those rules will not match");
+        }
+        return true;
+    }
+
+public:
+    ~DrawRules() { delete m_table; }
+
+    // file: relative to the executable's directory unless absolute
+    void Init(const char* file) {
+        if (!file[0]) return;
+        if (strchr(file, ':') || file[0] == '\\' || file[0] == '/') {
+            strncpy(m_path, file, MAX_PATH - 1);
+        } else {
+            GetModuleFileNameA(nullptr, m_path, MAX_PATH);
+            char* lastSlash = strrchr(m_path, '\\');
+            char* dir = lastSlash ? lastSlash + 1 : m_path;
+            snprintf(dir, MAX_PATH - (dir - m_path) - 1, "%s", file);
+        }
+        char* lastSlash = strrchr(m_path, '\\');
+        m_name = lastSlash ? lastSlash + 1 : m_path;
+        Poll();
+        if (!m_table) LogMsg("RULES: %s not found, watching for it", m_path);
+    }
+
+    // Present, every 60 frames: recompile when the file's write time changes
+    void Poll() {
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        if (!m_path[0] || !GetFileAttributesExA(m_path, GetFileExInfoStandard, &data)) return;
+        if (m_table && memcmp(&data.ftLastWriteTime, &m_writeTime, sizeof(FILETIME)) == 0) return;
+        if (Load()) m_writeTime = data.ftLastWriteTime;
+    }
+
+    inline bool Active() const { return m_table && m_table->count; }
+    inline int Generation() const { return m_generation; }
+
+    // Rules a draw with these shaders can match; the device caches this per bind
+    DWORD ShaderMask(UINT64 vsHash, UINT64 psHash) const {
+        const Table* t = m_table;
+        return LookupShader(t->vs, t->vsCount, t->vsAny, vsHash) & LookupShader(t->ps, t->psCount, t->psAny, psHash);
+    }
+
+    // First matching rule, or -1
+    inline int Match(int target, int pass, bool camera, UINT prims, DWORD shaderMask) const {
+        const Table* t = m_table;
+        int bucket = (int)(std::upper_bound(t->primBounds, t->primBounds + t->primBoundCount, prims) - t->primBounds);
+        DWORD mask = t->target[target] & t->pass[pass] & t->camera[camera] & t->prims[bucket] & shaderMask;
+        unsigned long r;
+        if (!_BitScanForward(&r, mask)) return -1;
+        return (int)r;
+    }
+
+    // Counts the hit and returns the rule's action
+    inline int Hit(int rule) {
+        m_hits[rule]++;
+        return m_table->action[rule];
+    }
+
+    void LogTag(int rule, int target, int pass, bool camera, UINT prims, UINT64 vsHash, UINT64 psHash) {
+        if (m_tagsLogged >= kMaxTagLogs) return;
+        m_tagsLogged++;
+        LogMsg("RULES: line %d tagged draw at frame %d: rt=%s pass=%s prims=%u camera=%s vs=%016llx ps=%016llx",
+               m_table->line[rule], g_frameCount, kTargetClassNames[target], kPerfPassNames[pass], prims,
+               camera ? "yes" : "no", vsHash, psHash);
+    }
+
+    void LogStatus(int frames) {
+        char hits[512];
+        int len = 0;
+        for (int r = 0; r < m_table->count && len < (int)sizeof(hits) - 48; r++) {
+            len += snprintf(hits + len, sizeof(hits) - len, "%sline %d %s %.1f", r ? ", " : "",
+                             m_table->line[r], kRuleActionNames[m_table->action[r]], m_hits[r] / (double)frames);
+        }
+        hits[len] = 0;
+        LogMsg("  Rules: %d from %s (generation %d), draws/frame: %s", m_table->count, m_name, m_generation, hits);
+        memset(m_hits, 0, sizeof(m_hits));
+    }
+};
+
+static DrawRules g_drawRules;
+
+// Approximate storage per pixel, for VRAM accounting (block formats are per-texel averages)
+UINT BitsPerPixel(D3DFORMAT format) {
+    switch (format) {
+    case D3DFMT_A32B32G32R32F: return 128;
+    case D3DFMT_A16B16G16R16F: case D3DFMT_A16B16G16R16: case D3DFMT_G32R32F: return 64;
+    case D3DFMT_R5G6B5: case D3DFMT_A1R5G5B5: case D3DFMT_A4R4G4B4: case D3DFMT_A8L8:
+    case D3DFMT_V8U8: case D3DFMT_R16F: case D3DFMT_D16: case D3DFMT_D16_LOCKABLE: return 16;
+    case D3DFMT_A8: case D3DFMT_L8: return 8;
+    case D3DFMT_DXT1: return 4;
+    case D3DFMT_DXT3: case D3DFMT_DXT5: return 8;
+    default: return 32;
+    }
+}
+
+// {5E6A3C41-2B7D-4F0E-9A61-0C8D7B2E4F19}
+static const GUID GUID_ProxyShrinkTag =
+    { 0x5e6a3c41, 0x2b7d, 0x4f0e, { 0x9a, 0x61, 0x0c, 0x8d, 0x7b, 0x2e, 0x4f, 0x19 } };
+
+static volatile LONG g_shrinkLiveBytesSaved = 0;
+
+/**
+ * Private-data tag on render targets allocated below the requested size.
+ * Attached with D3DSPD_IUNKNOWN so the runtime releases it together with the
+ * surface, which keeps the live "VRAM saved" figure exact.
+ */
+class ShrinkTag : public IUnknown {
+private:
+    volatile LONG m_refs = 1;
+
+public:
+    UINT width;         // Size the game asked for
+    UINT height;
+    float scale;
+    LONG bytesSaved;
+    IDirect3DSurface9* wrapper = nullptr;   // Live ShrunkSurface9 for this surface, not referenced
+
+    ShrinkTag(UINT w, UINT h, float s, LONG saved) : width(w), height(h), scale(s), bytesSaved(saved) {
+        InterlockedExchangeAdd(&g_shrinkLiveBytesSaved, bytesSaved);
+    }
+    ~ShrinkTag() {
+        InterlockedExchangeAdd(&g_shrinkLiveBytesSaved, -bytesSaved);
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObj) override {
+        if (riid == IID_IUnknown) {
+            AddRef();
+            *ppvObj = this;
+            return S_OK;
+        }
+        *ppvObj = nullptr;
+        return E_NOINTERFACE;
+    }
+    ULONG STDMETHODCALLTYPE AddRef() override { return InterlockedIncrement(&m_refs); }
+    ULONG STDMETHODCALLTYPE Release() override {
+        LONG count = InterlockedDecrement(&m_refs);
+        if (count == 0) delete this;
+        return count;
+    }
+
+    static void Attach(IDirect3DResource9* resource, UINT w, UINT h, float s, LONG saved) {
+        ShrinkTag* tag = new ShrinkTag(w, h, s, saved);
+        IUnknown* unk = tag;
+        resource->SetPrivateData(GUID_ProxyShrinkTag, &unk, sizeof(unk), D3DSPD_IUNKNOWN);
+        tag->Release();  // The resource holds the only reference now
+    }
+
+    // Tag of a real surface, kept alive by the surface itself; null if allocated at full size
+    static ShrinkTag* Find(IDirect3DSurface9* surface) {
+        if (!surface) return nullptr;
+        IUnknown* unk = nullptr;
+        DWORD size = sizeof(unk);
+        if (FAILED(surface->GetPrivateData(GUID_ProxyShrinkTag, &unk, &size)) || !unk) return nullptr;
+        unk->Release();
+        return (ShrinkTag*)unk;
+    }
+
+    // Returns false for surfaces that were allocated at full size
+    static bool Lookup(IDirect3DSurface9* surface, UINT* w, UINT* h, float* s) {
+        if (!surface) return false;
+        IUnknown* unk = nullptr;
+        DWORD size = sizeof(unk);
+        if (FAILED(surface->GetPrivateData(GUID_ProxyShrinkTag, &unk, &size)) || !unk) return false;
+        ShrinkTag* tag = (ShrinkTag*)unk;
+        *w = tag->width;
+        *h = tag->height;
+        *s = tag->scale;
+        unk->Release();  // GetPrivateData AddRefs IUnknown data
+        return true;
+    }
+};
+
+static void ScaleRect(RECT* r, float scale) {
+    r->left = (LONG)(r->left * scale);
+    r->top = (LONG)(r->top * scale);
+    r->right = (LONG)(r->right * scale + 0.5f);
+    r->bottom = (LONG)(r->bottom * scale + 0.5f);
+}
+
+// ---------------------------------------------------------------------------
+// BC1/BC3 (DXT1/DXT5) block encoder. Bounding-box endpoints with inset and
+// branchless index selection (after van Waveren's real-time DXT compressor);
+// the color min/max and index search run four pixels at a time in SSE2.
+// Input pixels are D3DFMT_A8R8G8B8 dwords (B, G, R, A in memory).
+// ---------------------------------------------------------------------------
+
+static inline WORD ColorTo565(DWORD c) {
+    return (WORD)((((c >> 16) & 0xF8) << 8) | (((c >> 8) & 0xFC) << 3) | ((c & 0xF8) >> 3));
+}
+
+static inline DWORD Color565To888(WORD c) {
+    DWORD r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    r = (r << 3) | (r >> 2);
+    g = (g << 2) | (g >> 4);
+    b = (b << 3) | (b >> 2);
+    return (r << 16) | (g << 8) | b;
+}
+
+// Per-channel (a * wa + b * wb) / 3 for the two interpolated palette entries
+static inline DWORD LerpColorThird(DWORD a, DWORD b, int wa, int wb) {
+    DWORD out = 0;
+    for (int shift = 0; shift < 24; shift += 8) {
+        DWORD ca = (a >> shift) & 0xFF, cb = (b >> shift) & 0xFF;
+        out |= ((ca * wa + cb * wb) / 3) << shift;
+    }
+    return out;
+}
+
+// Sum of absolute RGB differences between four pixels and one palette color
+static inline __m128i ColorDistance4(__m128i pixels, __m128i color) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i diff = _mm_or_si128(_mm_subs_epu8(pixels, color), _mm_subs_epu8(color, pixels));
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(diff, zero), ones);  // (b+g), (r+0) for pixels 0,1
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(diff, zero), ones);  // ...for pixels 2,3
+    lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+    hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+    lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 3, 2, 0));
+    hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 3, 2, 0));
+    return _mm_unpacklo_epi64(lo, hi);
+}
+
+// 8-byte BC1 color block (always 4-color mode)
+void EncodeColorBlock(const DWORD* pixels, BYTE* out) {
+    const __m128i rgbMask = _mm_set1_epi32(0x00FFFFFF);
+    __m128i rows[4];
+    for (int i = 0; i < 4; i++) {
+        rows[i] = _mm_and_si128(_mm_loadu_si128((const __m128i*)(pixels + i * 4)), rgbMask);
+    }
+
+    __m128i mn = _mm_min_epu8(_mm_min_epu8(rows[0], rows[1]), _mm_min_epu8(rows[2], rows[3]));
+    __m128i mx = _mm_max_epu8(_mm_max_epu8(rows[0], rows[1]), _mm_max_epu8(rows[2], rows[3]));
+    mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, _MM_SHUFFLE(1, 0, 3, 2)));
+    mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, _MM_SHUFFLE(2, 3, 0, 1)));
+    mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, _MM_SHUFFLE(1, 0, 3, 2)));
+    mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    // Inset the bounding box by 1/16 of its extent to cut endpoint error
+    __m128i inset = _mm_srli_epi16(_mm_unpacklo_epi8(_mm_subs_epu8(mx, mn), _mm_setzero_si128()), 4);
+    inset = _mm_packus_epi16(inset, inset);
+    mn = _mm_adds_epu8(mn, inset);
+    mx = _mm_subs_epu8(mx, inset);
+
+    WORD c0 = ColorTo565((DWORD)_mm_cvtsi128_si32(mx));
+    WORD c1 = ColorTo565((DWORD)_mm_cvtsi128_si32(mn));
+    DWORD indices = 0;
+
+    if (c0 != c1) {
+        DWORD p0 = Color565To888(c0), p1 = Color565To888(c1);
+        __m128i pal0 = _mm_set1_epi32((int)p0);
+        __m128i pal1 = _mm_set1_epi32((int)p1);
+        __m128i pal2 = _mm_set1_epi32((int)LerpColorThird(p0, p1, 2, 1));
+        __m128i pal3 = _mm_set1_epi32((int)LerpColorThird(p0, p1, 1, 2));
+        const __m128i one = _mm_set1_epi32(1);
+        const __m128i two = _mm_set1_epi32(2);
+
+        for (int r = 0; r < 4; r++) {
+            __m128i d0 = ColorDistance4(rows[r], pal0);
+            __m128i d1 = ColorDistance4(rows[r], pal1);
+            __m128i d2 = ColorDistance4(rows[r], pal2);
+            __m128i d3 = ColorDistance4(rows[r], pal3);
+
+            __m128i b0 = _mm_cmpgt_epi32(d0, d3);
+            __m128i b1 = _mm_cmpgt_epi32(d1, d2);
+            __m128i b2 = _mm_cmpgt_epi32(d0, d2);
+            __m128i b3 = _mm_cmpgt_epi32(d1, d3);
+            __m128i b4 = _mm_cmpgt_epi32(d2, d3);
+            __m128i x0 = _mm_and_si128(b1, b2);
+            __m128i x1 = _mm_and_si128(b0, b3);
+            __m128i x2 = _mm_and_si128(b0, b4);
+            __m128i idx = _mm_or_si128(_mm_and_si128(x2, one), _mm_and_si128(_mm_or_si128(x0, x1), two));
+
+            DWORD lanes[4];
+            _mm_storeu_si128((__m128i*)lanes, idx);
+            for (int i = 0; i < 4; i++) {
+                indices |= lanes[i] << (2 * (r * 4 + i));
+            }
+        }
+    }
+
+    out[0] = (BYTE)(c0 & 0xFF);
+    out[1] = (BYTE)(c0 >> 8);
+    out[2] = (BYTE)(c1 & 0xFF);
+    out[3] = (BYTE)(c1 >> 8);
+    memcpy(out + 4, &indices, 4);
+}
+
+// 8-byte BC3 alpha block (8-value mode, exact endpoints)
+void EncodeAlphaBlock(const DWORD* pixels, BYTE* out) {
+    DWORD minA = 255, maxA = 0;
+    for (int i = 0; i < 16; i++) {
+        DWORD a = pixels[i] >> 24;
+        if (a < minA) minA = a;
+        if (a > maxA) maxA = a;
+    }
+
+    UINT64 bits = 0;
+    if (maxA > minA) {
+        DWORD range = maxA - minA;
+        for (int i = 0; i < 16; i++) {
+            DWORD a = pixels[i] >> 24;
+            DWORD p = ((a - minA) * 7 + range / 2) / range;   // 0 = min ... 7 = max
+            DWORD idx = (p == 7) ? 0 : (p == 0) ? 1 : 8 - p;
+            bits |= (UINT64)idx << (3 * i);
+        }
+    }
+
+    out[0] = (BYTE)maxA;
+    out[1] = (BYTE)minA;
+    for (int i = 0; i < 6; i++) {
+        out[2 + i] = (BYTE)(bits >> (8 * i));
+    }
+}
+
+// Compress one mip level; edge blocks of non-multiple-of-4 levels replicate the last texel
+void CompressLevel(const BYTE* src, UINT srcPitch, UINT width, UINT height, bool dxt5,
+                   BYTE* dst, UINT dstPitch) {
+    UINT blockBytes = dxt5 ? 16 : 8;
+    DWORD block[16];
+    for (UINT by = 0; by < height; by += 4) {
+        BYTE* outRow = dst + (by / 4) * dstPitch;
+        for (UINT bx = 0; bx < width; bx += 4) {
+            for (UINT y = 0; y < 4; y++) {
+                UINT sy = (by + y < height) ? by + y : height - 1;
+                const DWORD* row = (const DWORD*)(src + sy * srcPitch);
+                for (UINT x = 0; x < 4; x++) {
+                    UINT sx = (bx + x < width) ? bx + x : width - 1;
+                    block[y * 4 + x] = row[sx];
+                }
+            }
+            BYTE* out = outRow + (bx / 4) * blockBytes;
+            if (dxt5) {
+                EncodeAlphaBlock(block, out);
+                EncodeColorBlock(block, out + 8);
+            } else {
+                EncodeColorBlock(block, out);
+            }
+        }
+    }
+}
+
+// Inverse of EncodeColorBlock, for handing a compressed level back to the game
+void DecodeColorBlock(const BYTE* in, DWORD* pixels) {
+    WORD c0 = (WORD)(in[0] | in[1] << 8);
+    WORD c1 = (WORD)(in[2] | in[3] << 8);
+    DWORD palette[4];
+    palette[0] = Color565To888(c0) | 0xFF000000;
+    palette[1] = Color565To888(c1) | 0xFF000000;
+    if (c0 > c1) {
+        palette[2] = LerpColorThird(palette[0], palette[1], 2, 1) | 0xFF000000;
+        palette[3] = LerpColorThird(palette[0], palette[1], 1, 2) | 0xFF000000;
+    } else {
+        palette[2] = 0xFF000000;
+        for (int shift = 0; shift < 24; shift += 8) {
+            palette[2] |= ((((palette[0] >> shift) & 0xFF) + ((palette[1] >> shift) & 0xFF)) / 2) << shift;
+        }
+        palette[3] = 0;     // 3-color mode's transparent black
+    }
+    DWORD indices;
+    memcpy(&indices, in + 4, 4);
+    for (int i = 0; i < 16; i++) {
+        pixels[i] = palette[(indices >> (2 * i)) & 3];
+    }
+}
+
+// Inverse of EncodeAlphaBlock; replaces the alpha of pixels decoded by DecodeColorBlock
+void DecodeAlphaBlock(const BYTE* in, DWORD* pixels) {
+    DWORD a0 = in[0], a1 = in[1];
+    DWORD palette[8] = { a0, a1 };
+    if (a0 > a1) {
+        for (int k = 2; k < 8; k++) palette[k] = ((8 - k) * a0 + (k - 1) * a1) / 7;
+    } else {
+        for (int k = 2; k < 6; k++) palette[k] = ((6 - k) * a0 + (k - 1) * a1) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+    UINT64 bits = 0;
+    for (int i = 0; i < 6; i++) {
+        bits |= (UINT64)in[2 + i] << (8 * i);
+    }
+    for (int i = 0; i < 16; i++) {
+        pixels[i] = (pixels[i] & 0x00FFFFFF) | palette[(bits >> (3 * i)) & 7] << 24;
+    }
+}
+
+// Decode one mip level back to A8R8G8B8 texels
+void DecompressLevel(const BYTE* src, UINT srcPitch, UINT width, UINT height, bool dxt5,
+                     BYTE* dst, UINT dstPitch) {
+    UINT blockBytes = dxt5 ? 16 : 8;
+    DWORD block[16];
+    for (UINT by = 0; by < height; by += 4) {
+        const BYTE* inRow = src + (by / 4) * srcPitch;
+        for (UINT bx = 0; bx < width; bx += 4) {
+            const BYTE* in = inRow + (bx / 4) * blockBytes;
+            if (dxt5) {
+                DecodeColorBlock(in + 8, block);
+                DecodeAlphaBlock(in, block);
+            } else {
+                DecodeColorBlock(in, block);
+            }
+            for (UINT y = 0; y < 4 && by + y < height; y++) {
+                DWORD* row = (DWORD*)(dst + (by + y) * dstPitch);
+                for (UINT x = 0; x < 4 && bx + x < width; x++) {
+                    row[bx + x] = block[y * 4 + x];
+                }
+            }
+        }
+    }
+}
+
+static inline UINT MipDim(UINT dim, UINT level) {
+    UINT d = dim >> level;
+    return d ? d : 1;
+}
+
+class TextureCompressor;
+static TextureCompressor* GetTextureCompressor();
+class TextureResidency;
+class WrappedTexture9;
+
+/**
+ * Keeps a texture's real object in place for one call on its wrapper: an
+ * evicted texture is recreated first, and eviction waits until the call
+ * returns (residency part a no-op unless TextureResidency is on). Also runs
+ * the thread tripwire check for the wrapper call.
+ */
+class TexturePin {
+private:
+    ResourceGuard m_guard;              // Taken before the residency lock, as on the device paths
+    bool m_locked = false;
+
+public:
+    IDirect3DTexture9* real;            // Null if an evicted texture could not be recreated
+
+    explicit TexturePin(WrappedTexture9* texture);
+    ~TexturePin();
+};
+
+/**
+ * Wrapped IDirect3DTexture9 - proxy-owned texture identity.
+ *
+ * Created when the proxy changes what sits behind a texture: CPU-compressed
+ * storage for uncompressed static textures, where the game keeps seeing the
+ * format it asked for and locks proxy-owned staging memory (UnlockRect hands
+ * the level to the compression worker); managed textures under the
+ * residency manager, whose real texture may be released and recreated; and
+ * managed textures on an upgraded Ex device, which has no managed pool: the
+ * real texture is in the default pool and the game locks a system-memory
+ * shadow that is copied over with UpdateTexture before the next bind. Also
+ * render-target textures allocated below the requested size, which report
+ * the requested size and hand out ShrunkSurface9 levels.
+ */
+class WrappedTexture9 : public IDirect3DTexture9 {
+    friend class TextureResidency;
+    friend class TexturePin;
+
+private:
+    IDirect3DTexture9* m_real;          // Null while evicted
+    IDirect3DDevice9* m_device;         // Wrapped device, returned from GetDevice
+    volatile LONG m_refs = 1;
+    D3DFORMAT m_gameFormat;
+    UINT m_width;
+    UINT m_height;
+
+    // CPU compression
+    bool m_compressed = false;
+    bool m_dxt5 = false;
+    BYTE* m_staging[16] = {};
+    WORD m_levelsWritten = 0;           // Levels submitted at least once; later locks decode them first
+    WORD m_readOnlyLocks = 0;           // Levels locked D3DLOCK_READONLY, not resubmitted on unlock
+
+    void ReadBackLevel(IDirect3DTexture9* real, UINT level);
+
+    // Residency (see TextureResidency)
+    int m_residencyIndex = -1;          // Slot in the tracked list, -1 = not tracked
+    D3DFORMAT m_realFormat = D3DFMT_UNKNOWN;
+    DWORD m_levelCount = 0;
+    double m_bytes = 0.0;               // Approximate VRAM of all levels
+    DWORD m_gamePriority = 0;           // What the game set; the real texture sits one above until lowered
+    bool m_lowered = false;
+    DWORD m_lod = 0;                    // Saved across eviction
+    BYTE* m_evicted[16] = {};           // Level contents while the real texture is released
+    UINT m_evictedPitch[16] = {};
+    volatile LONG m_lockedLevels = 0;   // Levels the game has locked on the real texture
+
+    bool m_shrunk = false;              // Real levels smaller than m_width x m_height
+
+    // Managed-pool emulation on an Ex device
+    IDirect3DTexture9* m_shadow = nullptr;  // System-memory copy the game writes
+    bool m_shadowDirty = false;
+    bool m_shadowSurfacesOut = false;   // Game holds shadow surfaces and may lock them at any time
+
+    static void* s_vtable;
+    static volatile LONG s_shadowWrites;    // Bumped whenever any shadow gets dirty
+
+    void MarkShadowDirty() {
+        m_shadowDirty = true;
+        InterlockedIncrement(&s_shadowWrites);
+    }
+
+    // Where level contents are written: the shadow if there is one
+    IDirect3DTexture9* WriteTarget(IDirect3DTexture9* real) const { return m_shadow ? m_shadow : real; }
+
+    DWORD ResidentPriority() const {
+        return m_lowered || m_gamePriority == 0xFFFFFFFF ? m_gamePriority : m_gamePriority + 1;
+    }
+
+public:
+    volatile LONG pendingJobs = 0;      // Levels queued on the compression worker
+    volatile LONG lastBound = 0;        // Frame of the last SetTexture, for residency
+
+    WrappedTexture9(IDirect3DTexture9* real, IDirect3DDevice9* device, UINT width, UINT height, D3DFORMAT gameFormat)
+        : m_real(real), m_device(device), m_gameFormat(gameFormat), m_width(width), m_height(height) {
+        if (!s_vtable) s_vtable = *(void**)this;
+    }
+
+    ~WrappedTexture9();
+
+    // Identify our wrappers by vtable; every COM object starts with its vtable pointer
+    static WrappedTexture9* FromBase(IDirect3DBaseTexture9* texture) {
+        if (!texture || !s_vtable || *(void**)texture != s_vtable) return nullptr;
+        return static_cast<WrappedTexture9*>(texture);
+    }
+
+    // Real texture to hand to the runtime for any (possibly wrapped) texture
+    static IDirect3DBaseTexture9* Unwrap(IDirect3DBaseTexture9* texture) {
+        WrappedTexture9* wrapped = FromBase(texture);
+        return wrapped ? wrapped->m_real : texture;
+    }
+
+    IDirect3DTexture9* Real() const { return m_real; }
+    bool Tracked() const { return m_residencyIndex >= 0; }
+
+    void EnableCompression(bool dxt5) {
+        m_compressed = true;
+        m_dxt5 = dxt5;
+    }
+
+    // Takes ownership of a system-memory texture of the same size, format and levels
+    void EnableShadow(IDirect3DTexture9* shadow) { m_shadow = shadow; }
+
+    void EnableShrink() { m_shrunk = true; }
+
+    // Copy finished blocks into the real (DXT) level
+    void UploadBlocks(UINT level, const BYTE* blocks, UINT rowBytes, UINT rows) {
+        TexturePin pin(this);
+        D3DLOCKED_RECT lr;
+        IDirect3DTexture9* target = WriteTarget(pin.real);
+        if (!target || FAILED(target->LockRect(level, &lr, nullptr, 0))) return;
+        for (UINT r = 0; r < rows; r++) {
+            memcpy((BYTE*)lr.pBits + r * lr.Pitch, blocks + r * rowBytes, rowBytes);
+        }
+        target->UnlockRect(level);
+        if (m_shadow) MarkShadowDirty();
+    }
+
+    static LONG ShadowWrites() { return s_shadowWrites; }
+
+    // Before a bind or a draw: bring the default-pool texture up to date with the shadow (render thread)
+    bool FlushShadow(IDirect3DDevice9* realDevice) {
+        if (!m_shadow || !(m_shadowDirty || m_shadowSurfacesOut)) return false;
+        m_shadowDirty = false;
+        return SUCCEEDED(realDevice->UpdateTexture(m_shadow, m_real));
+    }
+
+    // IUnknown
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObj) override {
+        if (riid == IID_IUnknown || riid == IID_IDirect3DResource9 ||
+            riid == IID_IDirect3DBaseTexture9 || riid == IID_IDirect3DTexture9) {
+            AddRef();
+            *ppvObj = this;
+            return S_OK;
+        }
+        TexturePin pin(this);
+        return pin.real ? pin.real->QueryInterface(riid, ppvObj) : E_NOINTERFACE;
+    }
+    ULONG STDMETHODCALLTYPE AddRef() override { return InterlockedIncrement(&m_refs); }
+    ULONG STDMETHODCALLTYPE Release() override {
+        LONG count = InterlockedDecrement(&m_refs);
+        if (count == 0) {
+            ResourceGuard guard;       // Destruction releases real objects
+            delete this;
+        }
+        return count;
+    }
+
+    // IDirect3DResource9
+    HRESULT STDMETHODCALLTYPE GetDevice(IDirect3DDevice9** ppDevice) override {
+        m_device->AddRef();
+        *ppDevice = m_device;
+        return D3D_OK;
+    }
+    HRESULT STDMETHODCALLTYPE SetPrivateData(REFGUID refguid, const void* pData, DWORD SizeOfData, DWORD Flags) override { TexturePin pin(this); return pin.real ? pin.real->SetPrivateData(refguid, pData, SizeOfData, Flags) : D3DERR_OUTOFVIDEOMEMORY; }
+    HRESULT STDMETHODCALLTYPE GetPrivateData(REFGUID refguid, void* pData, DWORD* pSizeOfData) override { TexturePin pin(this); return pin.real ? pin.real->GetPrivateData(refguid, pData, pSizeOfData) : D3DERR_NOTFOUND; }
+    HRESULT STDMETHODCALLTYPE FreePrivateData(REFGUID refguid) override { TexturePin pin(this); return pin.real ? pin.real->FreePrivateData(refguid) : D3DERR_NOTFOUND; }
+    DWORD STDMETHODCALLTYPE SetPriority(DWORD PriorityNew) override {
+        TexturePin pin(this);
+        if (!Tracked()) return pin.real->SetPriority(PriorityNew);
+        // The game sees its own value; the real texture keeps the residency offset
+        DWORD old = m_gamePriority;
+        m_gamePriority = PriorityNew;
+        if (pin.real) pin.real->SetPriority(ResidentPriority());
+        return old;
+    }
+    DWORD STDMETHODCALLTYPE GetPriority() override {
+        if (Tracked()) return m_gamePriority;
+        return m_real->GetPriority();
+    }
+    void STDMETHODCALLTYPE PreLoad() override { TexturePin pin(this); if (pin.real) pin.real->PreLoad(); }
+    D3DRESOURCETYPE STDMETHODCALLTYPE GetType() override { return D3DRTYPE_TEXTURE; }
+
+    // IDirect3DBaseTexture9
+    DWORD STDMETHODCALLTYPE SetLOD(DWORD LODNew) override { TexturePin pin(this); return pin.real ? pin.real->SetLOD(LODNew) : 0; }
+    DWORD STDMETHODCALLTYPE GetLOD() override { TexturePin pin(this); return pin.real ? pin.real->GetLOD() : m_lod; }
+    DWORD STDMETHODCALLTYPE GetLevelCount() override {
+        if (Tracked()) return m_levelCount;
+        return m_real->GetLevelCount();
+    }
+    HRESULT STDMETHODCALLTYPE SetAutoGenFilterType(D3DTEXTUREFILTERTYPE FilterType) override { TexturePin pin(this); return pin.real ? pin.real->SetAutoGenFilterType(FilterType) : D3DERR_OUTOFVIDEOMEMORY; }
+    D3DTEXTUREFILTERTYPE STDMETHODCALLTYPE GetAutoGenFilterType() override { TexturePin pin(this); return pin.real ? pin.real->GetAutoGenFilterType() : D3DTEXF_LINEAR; }
+    void STDMETHODCALLTYPE GenerateMipSubLevels() override { TexturePin pin(this); if (pin.real) pin.real->GenerateMipSubLevels(); }
+
+    // IDirect3DTexture9
+    HRESULT STDMETHODCALLTYPE GetLevelDesc(UINT Level, D3DSURFACE_DESC* pDesc) override {
+        TexturePin pin(this);
+        if (!pin.real) return D3DERR_OUTOFVIDEOMEMORY;
+        HRESULT hr = pin.real->GetLevelDesc(Level, pDesc);
+        if (SUCCEEDED(hr)) {
+            pDesc->Format = m_gameFormat;
+            if (m_shadow) pDesc->Pool = D3DPOOL_MANAGED;
+            if (m_shrunk) {
+                pDesc->Width = MipDim(m_width, Level);
+                pDesc->Height = MipDim(m_height, Level);
+            }
+        }
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE GetSurfaceLevel(UINT Level, IDirect3DSurface9** ppSurfaceLevel) override;
+    HRESULT GetShrunkSurfaceLevel(IDirect3DTexture9* real, UINT Level, IDirect3DSurface9** ppSurfaceLevel);
+    HRESULT GetRealSurfaceLevel(UINT Level, IDirect3DSurface9** ppSurfaceLevel) {
+        TexturePin pin(this);
+        if (!pin.real) return D3DERR_OUTOFVIDEOMEMORY;
+        if (m_shrunk) return GetShrunkSurfaceLevel(pin.real, Level, ppSurfaceLevel);
+        if (!m_shadow) return pin.real->GetSurfaceLevel(Level, ppSurfaceLevel);
+        // Surface locks bypass the wrapper, so from here on every bind copies the shadow's dirty regions
+        m_shadowSurfacesOut = true;
+        return m_shadow->GetSurfaceLevel(Level, ppSurfaceLevel);
+    }
+    HRESULT STDMETHODCALLTYPE AddDirtyRect(const RECT* pDirtyRect) override {
+        TexturePin pin(this);
+        if (!pin.real) return D3DERR_OUTOFVIDEOMEMORY;
+        if (m_shadow) MarkShadowDirty();
+        return WriteTarget(pin.real)->AddDirtyRect(pDirtyRect);
+    }
+
+    HRESULT STDMETHODCALLTYPE LockRect(UINT Level, D3DLOCKED_RECT* pLockedRect, const RECT* pRect, DWORD Flags) override {
+        TexturePin pin(this);
+        if (!pin.real) return D3DERR_OUTOFVIDEOMEMORY;
+        if (!m_compressed) {
+            HRESULT hr = WriteTarget(pin.real)->LockRect(Level, pLockedRect, pRect, Flags);
+            if (SUCCEEDED(hr)) InterlockedIncrement(&m_lockedLevels);
+            return hr;
+        }
+        if (Level >= 16 || Level >= pin.real->GetLevelCount() || !pLockedRect) return D3DERR_INVALIDCALL;
+
+        // The game locks uncompressed staging memory covering the whole level. A level
+        // submitted before is decoded into it first, so reads and partial writes see
+        // the current texels (after one round of BC1/BC3 loss)
+        UINT w = MipDim(m_width, Level), h = MipDim(m_height, Level);
+        if (!m_staging[Level]) {
+            m_staging[Level] = (BYTE*)calloc((size_t)w * h, 4);
+            if (!m_staging[Level]) return E_OUTOFMEMORY;
+            if (m_levelsWritten & (1 << Level)) ReadBackLevel(pin.real, Level);
+        }
+        if (Flags & D3DLOCK_READONLY) {
+            m_readOnlyLocks |= 1 << Level;
+        } else {
+            m_readOnlyLocks &= ~(1 << Level);
+        }
+        UINT pitch = w * 4;
+        BYTE* bits = m_staging[Level];
+        if (pRect) bits += pRect->top * pitch + pRect->left * 4;
+        pLockedRect->pBits = bits;
+        pLockedRect->Pitch = (INT)pitch;
+        return D3D_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE UnlockRect(UINT Level) override;
+};
+
+void* WrappedTexture9::s_vtable = nullptr;
+volatile LONG WrappedTexture9::s_shadowWrites = 0;
+
+/**
+ * Texture compressor - one worker thread that turns staging levels into
+ * BC1/BC3 blocks. The worker never touches D3D; finished blocks are uploaded
+ * on the render thread at Present, or immediately when a texture with
+ * outstanding levels is bound.
+ */
+class TextureCompressor {
+private:
+    struct Job {
+        WrappedTexture9* texture;   // Holds a reference until uploaded
+        UINT level;
+        UINT width;
+        UINT height;
+        bool dxt5;
+        BYTE* pixels;               // Owned, freed by the worker
+        BYTE* blocks;               // Owned, freed after upload
+        UINT rowBytes;
+        UINT rows;
+        double encodeMs;
+        Job* next;
+    };
+
+    CRITICAL_SECTION m_lock;
+    HANDLE m_wakeEvent = nullptr;
+    HANDLE m_doneEvent = nullptr;
+    HANDLE m_stoppedEvent = nullptr;    // Set by the worker as its last action
+    HANDLE m_thread = nullptr;
+    Job* m_queueHead = nullptr;         // FIFO of jobs waiting for the worker
+    Job* m_queueTail = nullptr;
+    Job* m_done = nullptr;              // Encoded, waiting for upload
+    volatile LONG m_shutdown = 0;
+
+    static DWORD WINAPI WorkerThread(LPVOID param) {
+        TextureCompressor* self = (TextureCompressor*)param;
+        while (!self->m_shutdown) {
+            EnterCriticalSection(&self->m_lock);
+            Job* job = self->m_queueHead;
+            if (job) {
+                self->m_queueHead = job->next;
+                if (!self->m_queueHead) self->m_queueTail = nullptr;
+            }
+            LeaveCriticalSection(&self->m_lock);
+
+            if (!job) {
+                WaitForSingleObject(self->m_wakeEvent, INFINITE);
+                continue;
+            }
+
+            LONGLONG start = QpcNow();
+            job->rowBytes = ((job->width + 3) / 4) * (job->dxt5 ? 16 : 8);
+            job->rows = (job->height + 3) / 4;
+            job->blocks = (BYTE*)malloc((size_t)job->rowBytes * job->rows);
+            if (job->blocks) {
+                CompressLevel(job->pixels, job->width * 4, job->width, job->height, job->dxt5,
+                              job->blocks, job->rowBytes);
+            }
+            free(job->pixels);
+            job->pixels = nullptr;
+            job->encodeMs = QpcToMs(QpcNow() - start);
+
+            EnterCriticalSection(&self->m_lock);
+            job->next = self->m_done;
+            self->m_done = job;
+            LeaveCriticalSection(&self->m_lock);
+            SetEvent(self->m_doneEvent);
+        }
+        SetEvent(self->m_stoppedEvent);
+        return 0;
+    }
+
+    bool StartWorker() {
+        if (m_thread) return true;
+        if (!m_wakeEvent || !m_stoppedEvent) return false;
+        m_thread = CreateThread(nullptr, 0, WorkerThread, this, 0, nullptr);
+        if (!m_thread) return false;
+        SetThreadPriority(m_thread, THREAD_PRIORITY_BELOW_NORMAL);
+        return true;
+    }
+
+    void Upload(Job* job) {
+        if (job->blocks) {
+            job->texture->UploadBlocks(job->level, job->blocks, job->rowBytes, job->rows);
+            encodeMsTotal += job->encodeMs;
+            levelsCompressed++;
+        }
+        free(job->blocks);
+        InterlockedDecrement(&job->texture->pendingJobs);
+        job->texture->Release();
+        delete job;
+    }
+
+public:
+    // Statistics, reported in the periodic status
+    int texturesCompressed = 0;
+    int levelsCompressed = 0;
+    double bytesSaved = 0.0;
+    double encodeMsTotal = 0.0;
+
+    TextureCompressor() {
+        InitializeCriticalSection(&m_lock);
+        m_wakeEvent = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+        m_doneEvent = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+        m_stoppedEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+    }
+
+    // Detach. On FreeLibrary the worker finishes its current level and signals m_stoppedEvent
+    // before the module goes away (the thread can't exit under the loader lock, so its handle
+    // is no use); queued levels are abandoned. At process exit the worker is already gone.
+    void Shutdown(bool processExit) {
+        InterlockedExchange(&m_shutdown, 1);
+        if (!m_thread) return;
+        SetEvent(m_wakeEvent);
+        if (!processExit) WaitForSingleObject(m_stoppedEvent, INFINITE);
+        CloseHandle(m_thread);
+        m_thread = nullptr;
+    }
+
+    // Takes ownership of pixels; falls back to compressing inline if no worker can start
+    void Submit(WrappedTexture9* texture, UINT level, UINT width, UINT height, bool dxt5, BYTE* pixels) {
+        Job* job = new Job();
+        job->texture = texture;
+        job->level = level;
+        job->width = width;
+        job->height = height;
+        job->dxt5 = dxt5;
+        job->pixels = pixels;
+        texture->AddRef();
+        InterlockedIncrement(&texture->pendingJobs);
+
+        if (!StartWorker()) {
+            LONGLONG start = QpcNow();
+            job->rowBytes = ((width + 3) / 4) * (dxt5 ? 16 : 8);
+            job->rows = (height + 3) / 4;
+            job->blocks = (BYTE*)malloc((size_t)job->rowBytes * job->rows);
+            if (job->blocks) CompressLevel(pixels, width * 4, width, height, dxt5, job->blocks, job->rowBytes);
+            free(pixels);
+            job->encodeMs = QpcToMs(QpcNow() - start);
+            Upload(job);
+            return;
+        }
+
+        EnterCriticalSection(&m_lock);
+        job->next = nullptr;
+        if (m_queueTail) m_queueTail->next = job; else m_queueHead = job;
+        m_queueTail = job;
+        LeaveCriticalSection(&m_lock);
+        SetEvent(m_wakeEvent);
+    }
+
+    // Upload everything the worker has finished (render thread only)
+    void Drain() {
+        EnterCriticalSection(&m_lock);
+        Job* done = m_done;
+        m_done = nullptr;
+        LeaveCriticalSection(&m_lock);
+        while (done) {
+            Job* next = done->next;
+            Upload(done);
+            done = next;
+        }
+    }
+
+    // Block until every queued level of one texture is uploaded (render thread only)
+    void Finish(WrappedTexture9* texture) {
+        texture->AddRef();
+        while (texture->pendingJobs > 0) {
+            Drain();
+            if (texture->pendingJobs > 0) WaitForSingleObject(m_doneEvent, 1);
+        }
+        texture->Release();
+    }
+};
+
+static TextureCompressor* g_texCompressor = nullptr;
+
+static TextureCompressor* GetTextureCompressor() {
+    if (!g_texCompressor) g_texCompressor = new TextureCompressor();
+    return g_texCompressor;
+}
+
+HRESULT STDMETHODCALLTYPE WrappedTexture9::UnlockRect(UINT Level) {
+    ResourceGuard guard;
+    if (!m_compressed) {
+        // Never evicted while a level is locked, so the real texture is there
+        HRESULT hr = WriteTarget(m_real)->UnlockRect(Level);
+        if (SUCCEEDED(hr) && m_lockedLevels > 0) InterlockedDecrement(&m_lockedLevels);
+        if (SUCCEEDED(hr) && m_shadow) MarkShadowDirty();
+        return hr;
+    }
+    if (Level >= 16 || !m_staging[Level]) return D3DERR_INVALIDCALL;
+
+    BYTE* pixels = m_staging[Level];
+    m_staging[Level] = nullptr;
+    if (m_readOnlyLocks & (1 << Level)) {
+        free(pixels);       // Nothing changed
+        return D3D_OK;
+    }
+    m_levelsWritten |= 1 << Level;
+    GetTextureCompressor()->Submit(this, Level, MipDim(m_width, Level), MipDim(m_height, Level), m_dxt5, pixels);
+    return D3D_OK;
+}
+
+// Decode the level's current blocks into its staging memory, after any queued encodes land
+void WrappedTexture9::ReadBackLevel(IDirect3DTexture9* real, UINT level) {
+    if (pendingJobs > 0) GetTextureCompressor()->Finish(this);
+    IDirect3DTexture9* source = WriteTarget(real);
+    D3DLOCKED_RECT lr;
+    if (FAILED(source->LockRect(level, &lr, nullptr, D3DLOCK_READONLY))) return;
+    UINT w = MipDim(m_width, level);
+    DecompressLevel((const BYTE*)lr.pBits, (UINT)lr.Pitch, w, MipDim(m_height, level), m_dxt5, m_staging[level], w * 4);
+    source->UnlockRect(level);
+}
+
+/**
+ * Surface of a compressed texture level, as the game sees it: its own format,
+ * with locks going through the texture's staging memory. The real level holds
+ * BC1/BC3 blocks, so handing it out would let surface locks and D3DX loaders
+ * write texels into block storage. Device calls that take surfaces refuse it;
+ * none of them accept a managed-pool surface anyway.
+ */
+class CompressedSurface9 : public IDirect3DSurface9 {
+private:
+    WrappedTexture9* m_texture;         // Holds a reference
+    UINT m_level;
+    volatile LONG m_refs = 1;
+
+    static void* s_vtable;
+
+public:
+    CompressedSurface9(WrappedTexture9* texture, UINT level) : m_texture(texture), m_level(level) {
+        if (!s_vtable) s_vtable = *(void**)this;
+        texture->AddRef();
+    }
+
+    virtual ~CompressedSurface9() { m_texture->Release(); }
+
+    static bool Is(IDirect3DSurface9* surface) {
+        return surface && s_vtable && *(void**)surface == s_vtable;
+    }
+
+    // IUnknown
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObj) override {
+        if (riid == IID_IUnknown || riid == IID_IDirect3DResource9 || riid == IID_IDirect3DSurface9) {
+            AddRef();
+            *ppvObj = this;
+            return S_OK;
+        }
+        *ppvObj = nullptr;
+        return E_NOINTERFACE;
+    }
+    ULONG STDMETHODCALLTYPE AddRef() override { return InterlockedIncrement(&m_refs); }
+    ULONG STDMETHODCALLTYPE Release() override {
+        LONG count = InterlockedDecrement(&m_refs);
+        if (count == 0) delete this;
+        return count;
+    }
+
+    // IDirect3DResource9 - private data and priority are the texture's
+    HRESULT STDMETHODCALLTYPE GetDevice(IDirect3DDevice9** ppDevice) override { return m_texture->GetDevice(ppDevice); }
+    HRESULT STDMETHODCALLTYPE SetPrivateData(REFGUID refguid, const void* pData, DWORD SizeOfData, DWORD Flags) override { return m_texture->SetPrivateData(refguid, pData, SizeOfData, Flags); }
+    HRESULT STDMETHODCALLTYPE GetPrivateData(REFGUID refguid, void* pData, DWORD* pSizeOfData) override { return m_texture->GetPrivateData(refguid, pData, pSizeOfData); }
+    HRESULT STDMETHODCALLTYPE FreePrivateData(REFGUID refguid) override { return m_texture->FreePrivateData(refguid); }
+    DWORD STDMETHODCALLTYPE SetPriority(DWORD PriorityNew) override { return m_texture->SetPriority(PriorityNew); }
+    DWORD STDMETHODCALLTYPE GetPriority() override { return m_texture->GetPriority(); }
+    void STDMETHODCALLTYPE PreLoad() override { m_texture->PreLoad(); }
+    D3DRESOURCETYPE STDMETHODCALLTYPE GetType() override { return D3DRTYPE_SURFACE; }
+
+    // IDirect3DSurface9
+    HRESULT STDMETHODCALLTYPE GetContainer(REFIID riid, void** ppContainer) override { return m_texture->QueryInterface(riid, ppContainer); }
+    HRESULT STDMETHODCALLTYPE GetDesc(D3DSURFACE_DESC* pDesc) override { return m_texture->GetLevelDesc(m_level, pDesc); }
+    HRESULT STDMETHODCALLTYPE LockRect(D3DLOCKED_RECT* pLockedRect, const RECT* pRect, DWORD Flags) override { return m_texture->LockRect(m_level, pLockedRect, pRect, Flags); }
+    HRESULT STDMETHODCALLTYPE UnlockRect() override { return m_texture->UnlockRect(m_level); }
+    HRESULT STDMETHODCALLTYPE GetDC(HDC* phdc) override { return D3DERR_INVALIDCALL; }
+    HRESULT STDMETHODCALLTYPE ReleaseDC(HDC hdc) override { return D3DERR_INVALIDCALL; }
+};
+
+void* CompressedSurface9::s_vtable = nullptr;
+
+/**
+ * Game-facing surface for a render target allocated below the requested size.
+ * Forwards to the real surface but reports the requested size from GetDesc.
+ * At most one lives per real surface, found through its ShrinkTag, so
+ * GetRenderTarget and GetSurfaceLevel keep returning the same object.
+ */
+class ShrunkSurface9 : public IDirect3DSurface9 {
+private:
+    IDirect3DSurface9* m_real;          // Holds a reference, which keeps m_tag alive
+    ShrinkTag* m_tag;
+    IDirect3DDevice9* m_device;         // Wrapped device, returned from GetDevice
+    WrappedTexture9* m_container;       // Holds a reference; null for standalone surfaces
+    volatile LONG m_refs = 1;
+
+    static void* s_vtable;
+
+    ShrunkSurface9(IDirect3DSurface9* real, ShrinkTag* tag, IDirect3DDevice9* device, WrappedTexture9* container)
+        : m_real(real), m_tag(tag), m_device(device), m_container(container) {
+        if (!s_vtable) s_vtable = *(void**)this;
+        if (container) container->AddRef();
+        tag->wrapper = this;
+    }
+
+public:
+    virtual ~ShrunkSurface9() {
+        m_tag->wrapper = nullptr;
+        m_real->Release();
+        if (m_container) m_container->Release();
+    }
+
+    // Takes over the caller's reference to real; surfaces allocated at full size come back as is
+    static IDirect3DSurface9* Wrap(IDirect3DSurface9* real, IDirect3DDevice9* device, WrappedTexture9* container = nullptr) {
+        ShrinkTag* tag = ShrinkTag::Find(real);
+        if (!tag) return real;
+        if (tag->wrapper) {
+            tag->wrapper->AddRef();
+            real->Release();
+            return tag->wrapper;
+        }
+        return new ShrunkSurface9(real, tag, device, container);
+    }
+
+    static IDirect3DSurface9* Unwrap(IDirect3DSurface9* surface) {
+        if (!surface || !s_vtable || *(void**)surface != s_vtable) return surface;
+        return static_cast<ShrunkSurface9*>(surface)->m_real;
+    }
+
+    // IUnknown
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObj) override {
+        if (riid == IID_IUnknown || riid == IID_IDirect3DResource9 || riid == IID_IDirect3DSurface9) {
+            AddRef();
+            *ppvObj = this;
+            return S_OK;
+        }
+        return m_real->QueryInterface(riid, ppvObj);
+    }
+    ULONG STDMETHODCALLTYPE AddRef() override { return InterlockedIncrement(&m_refs); }
+    ULONG STDMETHODCALLTYPE Release() override {
+        LONG count = InterlockedDecrement(&m_refs);
+        if (count == 0) {
+            ResourceGuard guard;       // Destruction releases real objects
+            delete this;
+        }
+        return count;
+    }
+
+    // IDirect3DResource9
+    HRESULT STDMETHODCALLTYPE GetDevice(IDirect3DDevice9** ppDevice) override {
+        m_device->AddRef();
+        *ppDevice = m_device;
+        return D3D_OK;
+    }
+    HRESULT STDMETHODCALLTYPE SetPrivateData(REFGUID refguid, const void* pData, DWORD SizeOfData, DWORD Flags) override { return m_real->SetPrivateData(refguid, pData, SizeOfData, Flags); }
+    HRESULT STDMETHODCALLTYPE GetPrivateData(REFGUID refguid, void* pData, DWORD* pSizeOfData) override { return m_real->GetPrivateData(refguid, pData, pSizeOfData); }
+    HRESULT STDMETHODCALLTYPE FreePrivateData(REFGUID refguid) override { return m_real->FreePrivateData(refguid); }
+    DWORD STDMETHODCALLTYPE SetPriority(DWORD PriorityNew) override { return m_real->SetPriority(PriorityNew); }
+    DWORD STDMETHODCALLTYPE GetPriority() override { return m_real->GetPriority(); }
+    void STDMETHODCALLTYPE PreLoad() override { m_real->PreLoad(); }
+    D3DRESOURCETYPE STDMETHODCALLTYPE GetType() override { return D3DRTYPE_SURFACE; }
+
+    // IDirect3DSurface9
+    HRESULT STDMETHODCALLTYPE GetContainer(REFIID riid, void** ppContainer) override {
+        if (m_container) return m_container->QueryInterface(riid, ppContainer);
+        return m_real->GetContainer(riid, ppContainer);
+    }
+    HRESULT STDMETHODCALLTYPE GetDesc(D3DSURFACE_DESC* pDesc) override {
+        HRESULT hr = m_real->GetDesc(pDesc);
+        if (SUCCEEDED(hr)) {
+            pDesc->Width = m_tag->width;
+            pDesc->Height = m_tag->height;
+        }
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE LockRect(D3DLOCKED_RECT* pLockedRect, const RECT* pRect, DWORD Flags) override { return m_real->LockRect(pLockedRect, pRect, Flags); }
+    HRESULT STDMETHODCALLTYPE UnlockRect() override { return m_real->UnlockRect(); }
+    HRESULT STDMETHODCALLTYPE GetDC(HDC* phdc) override { return m_real->GetDC(phdc); }
+    HRESULT STDMETHODCALLTYPE ReleaseDC(HDC hdc) override { return m_real->ReleaseDC(hdc); }
+};
+
+void* ShrunkSurface9::s_vtable = nullptr;
+
+HRESULT WrappedTexture9::GetShrunkSurfaceLevel(IDirect3DTexture9* real, UINT Level, IDirect3DSurface9** ppSurfaceLevel) {
+    HRESULT hr = real->GetSurfaceLevel(Level, ppSurfaceLevel);
+    if (SUCCEEDED(hr)) *ppSurfaceLevel = ShrunkSurface9::Wrap(*ppSurfaceLevel, m_device, this);
+    return hr;
+}
+
+HRESULT STDMETHODCALLTYPE WrappedTexture9::GetSurfaceLevel(UINT Level, IDirect3DSurface9** ppSurfaceLevel) {
+    if (!m_compressed) return GetRealSurfaceLevel(Level, ppSurfaceLevel);
+    if (!ppSurfaceLevel || Level >= GetLevelCount()) return D3DERR_INVALIDCALL;
+    *ppSurfaceLevel = new CompressedSurface9(this, Level);
+    return D3D_OK;
+}
+
+/**
+ * Texture residency - UE3 keeps many managed textures alive long after it
+ * last bound them, and they hold VRAM the path tracer needs. With
+ * TextureResidency=1 every plain managed texture is wrapped and stamped with
+ * the frame of its last SetTexture. A maintenance task, queued every 60
+ * frames, drops textures idle for ResidencyLowerFrames to the game's own
+ * priority (recent ones sit one above it) so the runtime's texture manager
+ * pages them out first. When GetAvailableTextureMem falls under
+ * ResidencyBudgetMB, textures idle for ResidencyEvictFrames are copied to
+ * system memory, oldest first, and their real textures released; the next
+ * bind or call on the wrapper recreates and refills them.
+ */
+class TextureResidency {
+private:
+    CRITICAL_SECTION m_lock;
+    std::vector<WrappedTexture9*> m_textures;   // Tracked wrappers; each holds its index
+    IDirect3DDevice9* m_device = nullptr;       // Real device, recreates evicted textures
+    double m_residentBytes = 0.0;
+    double m_evictedBytes = 0.0;
+    int m_evictedCount = 0;
+
+    static const UINT kMaxEvictBytesPerRun = 16 << 20;   // Larger shortfalls continue next run
+
+    static bool IsBlockFormat(D3DFORMAT format) {
+        return format == D3DFMT_DXT1 || format == D3DFMT_DXT2 || format == D3DFMT_DXT3 ||
+               format == D3DFMT_DXT4 || format == D3DFMT_DXT5;
+    }
+
+    // Copy every level out and release the real texture (lock held)
+    bool Evict(WrappedTexture9* t) {
+        IDirect3DTexture9* real = t->m_real;
+        if (!real || t->pendingJobs > 0 || t->m_lockedLevels > 0 || t->m_levelCount > 16) return false;
+        for (int i = 0; i < 16; i++) {
+            if (t->m_staging[i]) return false;
+        }
+        // A binding or a surface the game kept holds a reference and pins the texture
+        real->AddRef();
+        if (real->Release() != 1) return false;
+
+        LONGLONG start = QpcNow();
+        BYTE* copies[16] = {};
+        UINT pitches[16] = {};
+        bool ok = true;
+        for (DWORD level = 0; level < t->m_levelCount && ok; level++) {
+            D3DLOCKED_RECT lr;
+            if (FAILED(real->LockRect(level, &lr, nullptr, D3DLOCK_READONLY))) {
+                ok = false;
+                break;
+            }
+            UINT h = MipDim(t->m_height, level);
+            size_t bytes = (size_t)lr.Pitch * (IsBlockFormat(t->m_realFormat) ? (h + 3) / 4 : h);
+            copies[level] = (BYTE*)malloc(bytes);
+            if (copies[level]) memcpy(copies[level], lr.pBits, bytes);
+            else ok = false;
+            pitches[level] = (UINT)lr.Pitch;
+            real->UnlockRect(level);
+        }
+        if (!ok) {
+            for (int i = 0; i < 16; i++) free(copies[i]);
+            return false;
+        }
+
+        memcpy(t->m_evicted, copies, sizeof(copies));
+        memcpy(t->m_evictedPitch, pitches, sizeof(pitches));
+        t->m_lod = real->GetLOD();
+        real->Release();
+        t->m_real = nullptr;
+        m_residentBytes -= t->m_bytes;
+        m_evictedBytes += t->m_bytes;
+        m_evictedCount++;
+        evictions++;
+        evictMs += QpcToMs(QpcNow() - start);
+        return true;
+    }
+
+public:
+    // Statistics since the last status
+    int evictions = 0;
+    int restores = 0;
+    int restoreFailures = 0;
+    int lowered = 0;
+    int raised = 0;
+    double evictMs = 0.0;
+    double restoreMs = 0.0;
+    UINT availableMB = 0;               // At the last run
+
+    TextureResidency() { InitializeCriticalSection(&m_lock); }
+
+    void SetDevice(IDirect3DDevice9* real) { m_device = real; }
+    void Lock() { EnterCriticalSection(&m_lock); }
+    void Unlock() { LeaveCriticalSection(&m_lock); }
+
+    // Start tracking a new managed texture (its real texture is fresh and unbound)
+    void Track(WrappedTexture9* t) {
+        IDirect3DTexture9* real = t->m_real;
+        D3DSURFACE_DESC desc;
+        if (FAILED(real->GetLevelDesc(0, &desc))) return;
+        t->m_realFormat = desc.Format;
+        t->m_levelCount = real->GetLevelCount();
+        for (DWORD level = 0; level < t->m_levelCount; level++) {
+            t->m_bytes += (double)MipDim(t->m_width, level) * MipDim(t->m_height, level) * BitsPerPixel(desc.Format) / 8.0;
+        }
+        t->m_gamePriority = real->GetPriority();
+        real->SetPriority(t->ResidentPriority());
+        t->lastBound = g_frameCount;
+
+        Lock();
+        t->m_residencyIndex = (int)m_textures.size();
+        m_textures.push_back(t);
+        m_residentBytes += t->m_bytes;
+        Unlock();
+    }
+
+    // Wrapper destruction; frees the system memory copy of an evicted texture
+    void Untrack(WrappedTexture9* t) {
+        Lock();
+        WrappedTexture9* last = m_textures.back();
+        m_textures[t->m_residencyIndex] = last;
+        last->m_residencyIndex = t->m_residencyIndex;
+        m_textures.pop_back();
+        t->m_residencyIndex = -1;
+        if (t->m_real) {
+            m_residentBytes -= t->m_bytes;
+        } else {
+            m_evictedBytes -= t->m_bytes;
+            m_evictedCount--;
+        }
+        for (int i = 0; i < 16; i++) {
+            free(t->m_evicted[i]);
+            t->m_evicted[i] = nullptr;
+        }
+        Unlock();
+    }
+
+    // Recreate an evicted texture from its copy (lock held)
+    bool Restore(WrappedTexture9* t) {
+        if (t->m_real) return true;
+        if (!m_device) {
+            restoreFailures++;
+            return false;
+        }
+        LONGLONG start = QpcNow();
+        IDirect3DTexture9* real = nullptr;
+        if (FAILED(m_device->CreateTexture(t->m_width, t->m_height, t->m_levelCount, 0, t->m_realFormat,
+                                           D3DPOOL_MANAGED, &real, nullptr))) {
+            restoreFailures++;
+            return false;
+        }
+        for (DWORD level = 0; level < t->m_levelCount; level++) {
+            D3DLOCKED_RECT lr;
+            if (t->m_evicted[level] && SUCCEEDED(real->LockRect(level, &lr, nullptr, 0))) {
+                UINT h = MipDim(t->m_height, level);
+                UINT rows = IsBlockFormat(t->m_realFormat) ? (h + 3) / 4 : h;
+                UINT srcPitch = t->m_evictedPitch[level];
+                UINT rowBytes = srcPitch < (UINT)lr.Pitch ? srcPitch : (UINT)lr.Pitch;
+                for (UINT r = 0; r < rows; r++) {
+                    memcpy((BYTE*)lr.pBits + r * lr.Pitch, t->m_evicted[level] + r * srcPitch, rowBytes);
+                }
+                real->UnlockRect(level);
+            }
+            free(t->m_evicted[level]);
+            t->m_evicted[level] = nullptr;
+        }
+        t->m_lowered = false;
+        real->SetPriority(t->ResidentPriority());
+        real->SetLOD(t->m_lod);
+        t->m_real = real;
+        t->lastBound = g_frameCount;
+        m_residentBytes += t->m_bytes;
+        m_evictedBytes -= t->m_bytes;
+        m_evictedCount--;
+        restores++;
+        restoreMs += QpcToMs(QpcNow() - start);
+        return true;
+    }
+
+    // SetTexture (render thread): stamp the frame, bring the texture back to full residency
+    void Bind(WrappedTexture9* t) {
+        t->lastBound = g_frameCount;
+        if (t->m_real && !t->m_lowered) return;
+        Lock();
+        if (!t->m_real) {
+            Restore(t);
+        } else if (t->m_lowered) {
+            t->m_lowered = false;
+            t->m_real->SetPriority(t->ResidentPriority());
+            raised++;
+        }
+        Unlock();
+    }
+
+    // Maintenance task (render thread)
+    void Run() {
+        if (!m_device) return;
+        UINT available = m_device->GetAvailableTextureMem() >> 20;
+        availableMB = available;
+        bool tight = available < (UINT)g_config.residencyBudgetMB;
+
+        Lock();
+        std::vector<WrappedTexture9*> stale;
+        for (WrappedTexture9* t : m_textures) {
+            if (!t->m_real) continue;
+            int idle = g_frameCount - t->lastBound;
+            if (idle >= g_config.residencyLowerFrames && !t->m_lowered) {
+                t->m_lowered = true;
+                t->m_real->SetPriority(t->ResidentPriority());
+                lowered++;
+            }
+            if (tight && idle >= g_config.residencyEvictFrames) stale.push_back(t);
+        }
+        if (!stale.empty()) {
+            std::sort(stale.begin(), stale.end(),
+                      [](const WrappedTexture9* a, const WrappedTexture9* b) { return a->lastBound < b->lastBound; });
+            double want = ((double)g_config.residencyBudgetMB - available) * 1048576.0;
+            double freed = 0.0;
+            size_t i = 0;
+            for (; i < stale.size() && freed < want && freed < kMaxEvictBytesPerRun; i++) {
+                if (Evict(stale[i])) freed += stale[i]->m_bytes;
+            }
+            if (freed < want && i < stale.size()) g_maintenance.Queue(MAINT_TEXTURE_RESIDENCY);
+        }
+        Unlock();
+    }
+
+    void LogStatus() {
+        Lock();
+        size_t tracked = m_textures.size();
+        Unlock();
+        LogMsg("  Residency: %u textures, %.1f MB resident, %.1f MB evicted (%d textures), %u MB available (budget %d MB), %d evicted (%.2f ms), %d restored (%.2f ms, %d failed), %d lowered / %d raised",
+               (unsigned)tracked, m_residentBytes / 1048576.0, m_evictedBytes / 1048576.0, m_evictedCount,
+               availableMB, g_config.residencyBudgetMB, evictions, evictMs, restores, restoreMs, restoreFailures,
+               lowered, raised);
+        evictions = restores = restoreFailures = lowered = raised = 0;
+        evictMs = restoreMs = 0.0;
+    }
+};
+
+static TextureResidency g_residency;
+
+TexturePin::TexturePin(WrappedTexture9* texture) : real(texture->m_real) {
+    if (!texture->Tracked()) return;
+    g_residency.Lock();
+    m_locked = true;
+    if (!texture->m_real) g_residency.Restore(texture);
+    real = texture->m_real;
+}
+
+TexturePin::~TexturePin() {
+    if (m_locked) g_residency.Unlock();
+}
+
+WrappedTexture9::~WrappedTexture9() {
+    if (Tracked()) g_residency.Untrack(this);
+    for (int i = 0; i < 16; i++) free(m_staging[i]);
+    if (m_shadow) m_shadow->Release();
+    if (m_real) m_real->Release();
+}
+
+// ---------------------------------------------------------------------------
+// Index buffer optimization: post-transform vertex cache reordering (Tom
+// Forsyth's linear-speed algorithm) and simulated cache efficiency (ACMR,
+// misses per triangle) for reporting.
+// ---------------------------------------------------------------------------
+
+static const int kForsythCacheSize = 32;    // Size the scoring models
+static const int kSimulatedCacheSize = 16;  // FIFO size used for ACMR reporting
+
+static float ForsythVertexScore(int cachePos, UINT remainingTris) {
+    if (remainingTris == 0) return -1.0f;
+    float score = 0.0f;
+    if (cachePos >= 0) {
+        // The last triangle's vertices score the same, so strips don't dominate
+        if (cachePos < 3) score = 0.75f;
+        else score = powf(1.0f - (cachePos - 3) / (float)(kForsythCacheSize - 3), 1.5f);
+    }
+    return score + 2.0f / sqrtf((float)remainingTris);   // Favor finishing off lonely vertices
+}
+
+// Post-transform cache misses for a triangle list through a FIFO cache
+static UINT SimulateCacheMisses(const UINT* indices, UINT count) {
+    UINT cache[kSimulatedCacheSize];
+    int filled = 0, head = 0;
+    UINT misses = 0;
+    for (UINT i = 0; i < count; i++) {
+        bool hit = false;
+        for (int c = 0; c < filled; c++) {
+            if (cache[c] == indices[i]) { hit = true; break; }
+        }
+        if (hit) continue;
+        misses++;
+        cache[head] = indices[i];
+        head = (head + 1) % kSimulatedCacheSize;
+        if (filled < kSimulatedCacheSize) filled++;
+    }
+    return misses;
+}
+
+// Reorder the triangles of a triangle list in place
+static void OptimizeVertexCache(UINT* indices, UINT indexCount) {
+    UINT triCount = indexCount / 3;
+    if (triCount < 2) return;
+
+    // Compact vertex ids to 0..n-1 for this range
+    std::vector<UINT> src(indices, indices + triCount * 3);
+    std::vector<UINT> verts(src);
+    std::sort(verts.begin(), verts.end());
+    verts.erase(std::unique(verts.begin(), verts.end()), verts.end());
+    UINT vertCount = (UINT)verts.size();
+    std::vector<UINT> local(triCount * 3);
+    for (UINT i = 0; i < triCount * 3; i++) {
+        local[i] = (UINT)(std::lower_bound(verts.begin(), verts.end(), src[i]) - verts.begin());
+    }
+
+    // Vertex -> triangle adjacency; the first remaining[v] entries of a list are live
+    std::vector<UINT> remaining(vertCount, 0), adjStart(vertCount + 1, 0), adj(triCount * 3);
+    for (UINT i = 0; i < triCount * 3; i++) remaining[local[i]]++;
+    for (UINT v = 0; v < vertCount; v++) adjStart[v + 1] = adjStart[v] + remaining[v];
+    std::vector<UINT> fill(adjStart.begin(), adjStart.end() - 1);
+    for (UINT i = 0; i < triCount * 3; i++) adj[fill[local[i]]++] = i / 3;
+
+    std::vector<int> cachePos(vertCount, -1);
+    std::vector<float> vertScore(vertCount);
+    for (UINT v = 0; v < vertCount; v++) vertScore[v] = ForsythVertexScore(-1, remaining[v]);
+    std::vector<float> triScore(triCount);
+    std::vector<char> emitted(triCount, 0);
+    int best = 0;
+    for (UINT t = 0; t < triCount; t++) {
+        triScore[t] = vertScore[local[t * 3]] + vertScore[local[t * 3 + 1]] + vertScore[local[t * 3 + 2]];
+        if (triScore[t] > triScore[best]) best = (int)t;
+    }
+
+    UINT cache[kForsythCacheSize + 3];
+    int cacheCount = 0;
+    UINT scan = 0;
+    for (UINT out = 0; out < triCount; out++) {
+        if (best < 0) {
+            // Nothing adjacent to the cache; take the next unemitted triangle
+            while (emitted[scan]) scan++;
+            best = (int)scan;
+        }
+        emitted[best] = 1;
+        memcpy(indices + out * 3, &src[best * 3], 3 * sizeof(UINT));
+
+        // Retire the triangle from its vertices' adjacency lists
+        UINT newCache[kForsythCacheSize + 3];
+        int newCount = 0;
+        for (int k = 0; k < 3; k++) {
+            UINT v = local[best * 3 + k];
+            UINT* list = &adj[adjStart[v]];
+            for (UINT j = 0; j < remaining[v]; j++) {
+                if (list[j] == (UINT)best) {
+                    list[j] = list[remaining[v] - 1];
+                    remaining[v]--;
+                    break;
+                }
+            }
+            bool dup = false;
+            for (int c = 0; c < newCount; c++) dup |= newCache[c] == v;
+            if (!dup) newCache[newCount++] = v;
+        }
+        for (int c = 0; c < cacheCount; c++) {
+            UINT v = cache[c];
+            if (v != newCache[0] && (newCount < 2 || v != newCache[1]) && (newCount < 3 || v != newCache[2])) {
+                newCache[newCount++] = v;
+            }
+        }
+
+        // Rescore the cache (including vertices just pushed out) and its triangles
+        for (int c = 0; c < newCount; c++) {
+            UINT v = newCache[c];
+            cachePos[v] = c < kForsythCacheSize ? c : -1;
+            vertScore[v] = ForsythVertexScore(cachePos[v], remaining[v]);
+        }
+        best = -1;
+        float bestScore = -1.0f;
+        for (int c = 0; c < newCount; c++) {
+            UINT v = newCache[c];
+            for (UINT j = 0; j < remaining[v]; j++) {
+                UINT t = adj[adjStart[v] + j];
+                triScore[t] = vertScore[local[t * 3]] + vertScore[local[t * 3 + 1]] + vertScore[local[t * 3 + 2]];
+                if (triScore[t] > bestScore) {
+                    bestScore = triScore[t];
+                    best = (int)t;
+                }
+            }
+        }
+        cacheCount = newCount < kForsythCacheSize ? newCount : kForsythCacheSize;
+        memcpy(cache, newCache, cacheCount * sizeof(UINT));
+    }
+}
+
+// Session totals for the status dump
+struct IndexOptimizerStats {
+    int buffersNarrowed = 0;
+    double bytesSaved = 0.0;
+    int rangesOptimized = 0;
+    int rangesReverted = 0;
+    UINT64 triangles = 0;
+    UINT64 missesBefore = 0;
+    UINT64 missesAfter = 0;
+};
+static IndexOptimizerStats g_ibStats;
+
+/**
+ * Wrapped IDirect3DIndexBuffer9 - static index buffers the proxy may rewrite.
+ *
+ * The game's indices live in a shadow copy; the real buffer holds them narrowed
+ * to 16-bit when every index fits, with the triangles of each opaque draw range
+ * reordered for the vertex cache. Draw parameters are counted in indices, so
+ * startIndex carries over to the narrowed buffer unchanged. A range is put back
+ * in authored order as soon as another draw overlaps it differently or draws it
+ * blended, since those draws depend on which triangles sit where.
+ *
+ * Unlock uploads only the indices written since the last upload. The first
+ * draw of a range hands a copy of its indices to the IndexOptimizer worker;
+ * the reordered triangles are written at Present, if the range is still
+ * waiting and the buffer has not been written since.
+ */
+class WrappedIndexBuffer9 : public IDirect3DIndexBuffer9 {
+private:
+    enum RangeState : BYTE { RANGE_PENDING, RANGE_OPTIMIZED, RANGE_BLOCKED };
+    struct DrawRange {
+        UINT start;
+        UINT count;
+        RangeState state;
+    };
+    static const size_t kMaxRanges = 256;
+
+    IDirect3DIndexBuffer9* m_real;
+    IDirect3DDevice9* m_realDevice;     // For recreating the real buffer in another format
+    IDirect3DDevice9* m_device;         // Wrapped device, returned from GetDevice
+    volatile LONG m_refs = 1;
+    UINT m_length;
+    DWORD m_usage;
+    D3DFORMAT m_gameFormat;
+    D3DFORMAT m_realFormat;
+    D3DPOOL m_pool;
+    BYTE* m_shadow;                     // Game's indices, authored order and format
+    UINT m_dirtyBegin = 0;              // Bytes written since the last upload
+    UINT m_dirtyEnd = 0;
+    UINT m_version = 0;                 // Bumped per upload; stale optimizer results are dropped
+    bool m_valid = false;               // Real buffer holds the shadow's contents
+    bool m_narrowCounted = false;
+    std::vector<DrawRange> m_ranges;
+    size_t m_lastRange = 0;
+    bool m_tooManyRanges = false;
+
+    static void* s_vtable;
+
+    UINT GameStride() const { return m_gameFormat == D3DFMT_INDEX32 ? 4 : 2; }
+    UINT IndexCount() const { return m_length / GameStride(); }
+
+    UINT ReadIndex(UINT i) const {
+        return m_gameFormat == D3DFMT_INDEX32 ? ((const UINT*)m_shadow)[i] : ((const WORD*)m_shadow)[i];
+    }
+
+    // Write count indices starting at index start, converting to the real format
+    bool WriteReal(UINT start, const UINT* indices, UINT count) {
+        UINT stride = m_realFormat == D3DFMT_INDEX32 ? 4 : 2;
+        void* dst = nullptr;
+        if (FAILED(m_real->Lock(start * stride, count * stride, &dst, 0))) return false;
+        if (stride == 4) {
+            memcpy(dst, indices, count * 4);
+        } else {
+            for (UINT i = 0; i < count; i++) ((WORD*)dst)[i] = (WORD)indices[i];
+        }
+        m_real->Unlock();
+        return true;
+    }
+
+    bool WriteShadowRange(UINT start, UINT count) {
+        std::vector<UINT> indices(count);
+        for (UINT i = 0; i < count; i++) indices[i] = ReadIndex(start + i);
+        return WriteReal(start, indices.data(), count);
+    }
+
+    bool Recreate(D3DFORMAT format) {
+        UINT size = format == D3DFMT_INDEX16 ? IndexCount() * 2 : m_length;
+        IDirect3DIndexBuffer9* replacement = nullptr;
+        if (FAILED(m_realDevice->CreateIndexBuffer(size, m_usage, format, m_pool, &replacement, nullptr))) return false;
+        m_real->Release();
+        m_real = replacement;
+        m_realFormat = format;
+        if (format == D3DFMT_INDEX16 && !m_narrowCounted) {
+            m_narrowCounted = true;
+            g_ibStats.buffersNarrowed++;
+            g_ibStats.bytesSaved += m_length - size;
+        }
+        return true;
+    }
+
+    // Shadow -> real for the indices written since the last upload. 32-bit indices are
+    // narrowed when a whole-buffer write fits in 16 bits, and widened again if a later
+    // write doesn't
+    void Upload() {
+        UINT first = m_dirtyBegin / GameStride();
+        UINT end = (std::min)((m_dirtyEnd + GameStride() - 1) / GameStride(), IndexCount());
+        m_dirtyBegin = m_dirtyEnd = 0;
+        m_version++;
+        if (!m_valid) {
+            first = 0;
+            end = IndexCount();
+        }
+
+        D3DFORMAT want = m_realFormat;
+        if (m_gameFormat == D3DFMT_INDEX32) {
+            UINT maxIndex = 0;
+            for (UINT i = first; i < end; i++) maxIndex = (std::max)(maxIndex, ReadIndex(i));
+            if (maxIndex >= 0xFFFF) want = D3DFMT_INDEX32;
+            else if (first == 0 && end == IndexCount()) want = D3DFMT_INDEX16;
+        }
+        if (want != m_realFormat && Recreate(want)) {
+            first = 0;
+            end = IndexCount();
+        }
+
+        // Ranges the write touches are decided again on their next draw. An optimized one
+        // is rewritten whole so no reordered triangles survive next to new ones; waiting
+        // ones are resubmitted since their results will be stale
+        size_t kept = 0;
+        UINT writeFirst = first, writeEnd = end;
+        for (size_t i = 0; i < m_ranges.size(); i++) {
+            DrawRange& range = m_ranges[i];
+            bool touched = range.start < end && first < range.start + range.count;
+            if (touched && range.state == RANGE_OPTIMIZED) {
+                writeFirst = (std::min)(writeFirst, range.start);
+                writeEnd = (std::max)(writeEnd, range.start + range.count);
+            }
+            if (!touched && range.state != RANGE_PENDING) m_ranges[kept++] = range;
+        }
+        m_ranges.resize(kept);
+        m_lastRange = 0;
+        m_tooManyRanges = false;
+        if (writeEnd > writeFirst) m_valid = WriteShadowRange(writeFirst, writeEnd - writeFirst);
+    }
+
+    void SubmitRange(DrawRange& range);
+
+    // Pending or optimized ranges go back to authored order
+    void Block(DrawRange& range) {
+        if (range.state == RANGE_OPTIMIZED) {
+            WriteShadowRange(range.start, range.count);
+            g_ibStats.rangesReverted++;
+        }
+        range.state = RANGE_BLOCKED;
+    }
+
+public:
+    WrappedIndexBuffer9(IDirect3DIndexBuffer9* real, IDirect3DDevice9* realDevice, IDirect3DDevice9* device,
+                        UINT length, DWORD usage, D3DFORMAT format, D3DPOOL pool)
+        : m_real(real), m_realDevice(realDevice), m_device(device), m_length(length), m_usage(usage),
+          m_gameFormat(format), m_realFormat(format), m_pool(pool) {
+        m_shadow = (BYTE*)calloc(length, 1);
+        if (!s_vtable) s_vtable = *(void**)this;
+    }
+
+    ~WrappedIndexBuffer9() {
+        free(m_shadow);
+        m_real->Release();
+    }
+
+    static WrappedIndexBuffer9* FromBase(IDirect3DIndexBuffer9* buffer) {
+        if (!buffer || !s_vtable || *(void**)buffer != s_vtable) return nullptr;
+        return static_cast<WrappedIndexBuffer9*>(buffer);
+    }
+
+    static IDirect3DIndexBuffer9* Unwrap(IDirect3DIndexBuffer9* buffer) {
+        WrappedIndexBuffer9* wrapped = FromBase(buffer);
+        return wrapped ? wrapped->m_real : buffer;
+    }
+
+    bool Valid() const { return m_shadow != nullptr; }
+    IDirect3DIndexBuffer9* Real() const { return m_real; }
+
+    // Called for every indexed draw from this buffer
+    void NoteDraw(UINT start, UINT count, bool opaqueTriangleList) {
+        if (!m_valid || m_tooManyRanges) return;
+
+        if (m_lastRange < m_ranges.size() && m_ranges[m_lastRange].start == start && m_ranges[m_lastRange].count == count) {
+            if (!opaqueTriangleList) Block(m_ranges[m_lastRange]);
+            return;
+        }
+        for (size_t i = 0; i < m_ranges.size(); i++) {
+            if (m_ranges[i].start == start && m_ranges[i].count == count) {
+                m_lastRange = i;
+                if (!opaqueTriangleList) Block(m_ranges[i]);
+                return;
+            }
+        }
+
+        // First draw of this range: any overlap pins both ranges to authored order
+        bool overlaps = false;
+        for (DrawRange& other : m_ranges) {
+            if (start < other.start + other.count && other.start < start + count) {
+                overlaps = true;
+                Block(other);
+            }
+        }
+        if (m_ranges.size() >= kMaxRanges) {
+            // Too many to keep track of overlaps; restore everything and stop
+            for (DrawRange& other : m_ranges) Block(other);
+            m_tooManyRanges = true;
+            return;
+        }
+
+        DrawRange range = { start, count, RANGE_BLOCKED };
+        m_ranges.push_back(range);
+        m_lastRange = m_ranges.size() - 1;
+        bool inBounds = start + count <= IndexCount();
+        if (opaqueTriangleList && !overlaps && inBounds && count % 3 == 0) SubmitRange(m_ranges.back());
+    }
+
+    // Present: reordered triangles back from the worker; kept only if they cut cache misses
+    void ApplyOptimized(UINT version, UINT start, UINT count, const UINT* indices, UINT before, UINT after) {
+        if (version != m_version) return;
+        for (DrawRange& range : m_ranges) {
+            if (range.start != start || range.count != count) continue;
+            if (range.state != RANGE_PENDING) return;
+            if (after >= before || !WriteReal(start, indices, count)) {
+                range.state = RANGE_BLOCKED;
+                return;
+            }
+            range.state = RANGE_OPTIMIZED;
+            g_ibStats.rangesOptimized++;
+            g_ibStats.triangles += count / 3;
+            g_ibStats.missesBefore += before;
+            g_ibStats.missesAfter += after;
+            return;
+        }
+    }
+
+    // IUnknown
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObj) override {
+        if (riid == IID_IUnknown || riid == IID_IDirect3DResource9 || riid == IID_IDirect3DIndexBuffer9) {
+            AddRef();
+            *ppvObj = this;
+            return S_OK;
+        }
+        return m_real->QueryInterface(riid, ppvObj);
+    }
+    ULONG STDMETHODCALLTYPE AddRef() override { return InterlockedIncrement(&m_refs); }
+    ULONG STDMETHODCALLTYPE Release() override {
+        LONG count = InterlockedDecrement(&m_refs);
+        if (count == 0) {
+            ResourceGuard guard;       // Destruction releases real objects
+            delete this;
+        }
+        return count;
+    }
+
+    // IDirect3DResource9
+    HRESULT STDMETHODCALLTYPE GetDevice(IDirect3DDevice9** ppDevice) override {
+        m_device->AddRef();
+        *ppDevice = m_device;
+        return D3D_OK;
+    }
+    HRESULT STDMETHODCALLTYPE SetPrivateData(REFGUID refguid, const void* pData, DWORD SizeOfData, DWORD Flags) override { return m_real->SetPrivateData(refguid, pData, SizeOfData, Flags); }
+    HRESULT STDMETHODCALLTYPE GetPrivateData(REFGUID refguid, void* pData, DWORD* pSizeOfData) override { return m_real->GetPrivateData(refguid, pData, pSizeOfData); }
+    HRESULT STDMETHODCALLTYPE FreePrivateData(REFGUID refguid) override { return m_real->FreePrivateData(refguid); }
+    DWORD STDMETHODCALLTYPE SetPriority(DWORD PriorityNew) override { return m_real->SetPriority(PriorityNew); }
+    DWORD STDMETHODCALLTYPE GetPriority() override { return m_real->GetPriority(); }
+    void STDMETHODCALLTYPE PreLoad() override { m_real->PreLoad(); }
+    D3DRESOURCETYPE STDMETHODCALLTYPE GetType() override { return m_real->GetType(); }
+
+    // IDirect3DIndexBuffer9
+    HRESULT STDMETHODCALLTYPE Lock(UINT OffsetToLock, UINT SizeToLock, void** ppbData, DWORD Flags) override {
+        ResourceGuard guard;
+        if (OffsetToLock > m_length || !ppbData) return D3DERR_INVALIDCALL;
+        if (SizeToLock == 0 || OffsetToLock + SizeToLock > m_length) SizeToLock = m_length - OffsetToLock;
+        if (!(Flags & D3DLOCK_READONLY)) {
+            // Widen to cover every write since the last unlock
+            bool dirty = m_dirtyEnd > m_dirtyBegin;
+            m_dirtyBegin = dirty ? (std::min)(m_dirtyBegin, OffsetToLock) : OffsetToLock;
+            m_dirtyEnd = dirty ? (std::max)(m_dirtyEnd, OffsetToLock + SizeToLock) : OffsetToLock + SizeToLock;
+        }
+        *ppbData = m_shadow + OffsetToLock;
+        return D3D_OK;
+    }
+    HRESULT STDMETHODCALLTYPE Unlock() override {
+        ResourceGuard guard;
+        if (m_dirtyEnd > m_dirtyBegin) Upload();
+        return D3D_OK;
+    }
+    HRESULT STDMETHODCALLTYPE GetDesc(D3DINDEXBUFFER_DESC* pDesc) override {
+        HRESULT hr = m_real->GetDesc(pDesc);
+        if (SUCCEEDED(hr)) {
+            pDesc->Format = m_gameFormat;
+            pDesc->Size = m_length;
+        }
+        return hr;
+    }
+};
+
+void* WrappedIndexBuffer9::s_vtable = nullptr;
+
+/**
+ * Index optimizer - one worker thread that reorders draw ranges for the vertex
+ * cache, so the first draw of a range only pays for copying its indices. The
+ * worker never touches D3D; results are written on the render thread at
+ * Present.
+ */
+class IndexOptimizer {
+private:
+    struct Job {
+        WrappedIndexBuffer9* buffer;    // Holds a reference until applied
+        UINT version;
+        UINT start;
+        UINT count;
+        UINT* indices;                  // Owned; reordered in place by the worker
+        UINT before;
+        UINT after;
+        Job* next;
+    };
+
+    CRITICAL_SECTION m_lock;
+    HANDLE m_wakeEvent = nullptr;
+    HANDLE m_stoppedEvent = nullptr;    // Set by the worker as its last action
+    HANDLE m_thread = nullptr;
+    Job* m_queueHead = nullptr;         // FIFO of jobs waiting for the worker
+    Job* m_queueTail = nullptr;
+    Job* m_done = nullptr;              // Reordered, waiting to be written
+    volatile LONG m_shutdown = 0;
+
+    static void Run(Job* job) {
+        job->before = SimulateCacheMisses(job->indices, job->count);
+        OptimizeVertexCache(job->indices, job->count);
+        job->after = SimulateCacheMisses(job->indices, job->count);
+    }
+
+    static DWORD WINAPI WorkerThread(LPVOID param) {
+        IndexOptimizer* self = (IndexOptimizer*)param;
+        while (!self->m_shutdown) {
+            EnterCriticalSection(&self->m_lock);
+            Job* job = self->m_queueHead;
+            if (job) {
+                self->m_queueHead = job->next;
+                if (!self->m_queueHead) self->m_queueTail = nullptr;
+            }
+            LeaveCriticalSection(&self->m_lock);
+
+            if (!job) {
+                WaitForSingleObject(self->m_wakeEvent, INFINITE);
+                continue;
+            }
+
+            Run(job);
+            EnterCriticalSection(&self->m_lock);
+            job->next = self->m_done;
+            self->m_done = job;
+            LeaveCriticalSection(&self->m_lock);
+        }
+        SetEvent(self->m_stoppedEvent);
+        return 0;
+    }
+
+    bool StartWorker() {
+        if (m_thread) return true;
+        if (!m_wakeEvent || !m_stoppedEvent) return false;
+        m_thread = CreateThread(nullptr, 0, WorkerThread, this, 0, nullptr);
+        if (!m_thread) return false;
+        SetThreadPriority(m_thread, THREAD_PRIORITY_BELOW_NORMAL);
+        return true;
+    }
+
+    void Apply(Job* job) {
+        job->buffer->ApplyOptimized(job->version, job->start, job->count, job->indices, job->before, job->after);
+        free(job->indices);
+        job->buffer->Release();
+        delete job;
+    }
+
+public:
+    IndexOptimizer() {
+        InitializeCriticalSection(&m_lock);
+        m_wakeEvent = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+        m_stoppedEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+    }
+
+    // Detach, same as TextureCompressor: on FreeLibrary wait for the worker to finish its
+    // current range and signal; queued ranges are abandoned
+    void Shutdown(bool processExit) {
+        InterlockedExchange(&m_shutdown, 1);
+        if (!m_thread) return;
+        SetEvent(m_wakeEvent);
+        if (!processExit) WaitForSingleObject(m_stoppedEvent, INFINITE);
+        CloseHandle(m_thread);
+        m_thread = nullptr;
+    }
+
+    // Takes ownership of indices; falls back to reordering inline if no worker can start
+    void Submit(WrappedIndexBuffer9* buffer, UINT version, UINT start, UINT count, UINT* indices) {
+        Job* job = new Job();
+        job->buffer = buffer;
+        job->version = version;
+        job->start = start;
+        job->count = count;
+        job->indices = indices;
+        buffer->AddRef();
+
+        if (!StartWorker()) {
+            Run(job);
+            Apply(job);
+            return;
+        }
+
+        EnterCriticalSection(&m_lock);
+        job->next = nullptr;
+        if (m_queueTail) m_queueTail->next = job; else m_queueHead = job;
+        m_queueTail = job;
+        LeaveCriticalSection(&m_lock);
+        SetEvent(m_wakeEvent);
+    }
+
+    // Write everything the worker has finished (render thread only)
+    void Drain() {
+        EnterCriticalSection(&m_lock);
+        Job* done = m_done;
+        m_done = nullptr;
+        LeaveCriticalSection(&m_lock);
+        while (done) {
+            Job* next = done->next;
+            Apply(done);
+            done = next;
+        }
+    }
+};
+
+static IndexOptimizer* g_ibOptimizer = nullptr;
+
+void WrappedIndexBuffer9::SubmitRange(DrawRange& range) {
+    UINT* indices = (UINT*)malloc(range.count * sizeof(UINT));
+    if (!indices) return;
+    for (UINT i = 0; i < range.count; i++) indices[i] = ReadIndex(range.start + i);
+    if (!g_ibOptimizer) g_ibOptimizer = new IndexOptimizer();
+    range.state = RANGE_PENDING;
+    g_ibOptimizer->Submit(this, m_version, range.start, range.count, indices);
+}
+
+// ---------------------------------------------------------------------------
+// Vertex stream slimming: per declaration, the elements Remix consumes on the
+// fixed-function / CPU-skinning path (position, normal, first UV set, first
+// color, skinning weights and indices). Static vertex buffers get compacted
+// copies holding only those elements, bound in place of the originals. Draws
+// with a vertex shader are only slimmed when every input the shader declares
+// is one of the kept elements.
+// ---------------------------------------------------------------------------
+
+static const int kMaxDeclElements = 64;     // MAXD3DDECLLENGTH
+
+static UINT DeclTypeSize(BYTE type) {
+    switch (type) {
+        case D3DDECLTYPE_FLOAT1: return 4;
+        case D3DDECLTYPE_FLOAT2: return 8;
+        case D3DDECLTYPE_FLOAT3: return 12;
+        case D3DDECLTYPE_FLOAT4: return 16;
+        case D3DDECLTYPE_SHORT4:
+        case D3DDECLTYPE_SHORT4N:
+        case D3DDECLTYPE_USHORT4N:
+        case D3DDECLTYPE_FLOAT16_4: return 8;
+        case D3DDECLTYPE_UNUSED: return 0;
+        default: return 4;  // D3DCOLOR, UBYTE4(N), SHORT2(N), USHORT2N, UDEC3, DEC3N, FLOAT16_2
+    }
+}
+
+static bool SlimKeepsElement(const D3DVERTEXELEMENT9& e) {
+    switch (e.Usage) {
+        case D3DDECLUSAGE_POSITION:
+        case D3DDECLUSAGE_POSITIONT:
+        case D3DDECLUSAGE_NORMAL:
+        case D3DDECLUSAGE_TEXCOORD:
+        case D3DDECLUSAGE_COLOR:
+        case D3DDECLUSAGE_BLENDWEIGHT:
+        case D3DDECLUSAGE_BLENDINDICES:
+            return e.UsageIndex == 0;
+        default:
+            return false;
+    }
+}
+
+// True when every dcl_ input of an SM2+ vertex shader is an element slimming keeps
+static bool VertexShaderSlimSafe(const DWORD* function) {
+    if (((function[0] >> 8) & 0xFF) < 2) return false;     // SM1 instruction lengths aren't encoded
+    for (UINT i = 1; i < (1u << 20);) {
+        DWORD token = function[i];
+        if (token == 0x0000FFFF) return true;
+        if ((token & 0xFFFF) == 0xFFFE) {
+            i += 1 + ((token >> 16) & 0x7FFF);
+            continue;
+        }
+        if ((token & 0xFFFF) == D3DSIO_DCL) {
+            DWORD usage = function[i + 1];
+            DWORD reg = function[i + 2];
+            DWORD regType = ((reg >> 28) & 0x7) | ((reg >> 8) & 0x18);
+            if (regType == D3DSPR_INPUT) {
+                D3DVERTEXELEMENT9 e = {};
+                e.Usage = (BYTE)(usage & 0x1F);
+                e.UsageIndex = (BYTE)((usage >> 16) & 0xF);
+                if (!SlimKeepsElement(e)) return false;
+            }
+        }
+        i += 1 + ((token >> 24) & 0xF);
+    }
+    return false;
+}
+
+struct SlimElement {
+    WORD stream;
+    WORD srcOffset;
+    WORD dstOffset;
+    WORD size;
+};
+
+// Slimmed form of one game vertex declaration
+struct SlimDecl {
+    IDirect3DVertexDeclaration9* game;
+    IDirect3DVertexDeclaration9* slim;  // Real declaration with kept elements only, null if nothing strips
+    SlimElement elements[kMaxDeclElements];
+    int elementCount;
+    WORD streamMask;                    // Streams the declaration reads
+    WORD copyMask;                      // Streams that lose elements and need a compacted copy
+    UINT slimStride[16];
+    UINT64 layoutKey[16];               // Identifies the kept layout of each copied stream
+    int positionStream;                 // FLOAT3/FLOAT4 POSITION0 element, -1 if none
+    UINT positionOffset;
+};
+
+// Session totals for the status dump
+struct VertexSlimStats {
+    int declsSlimmed = 0;
+    int copies = 0;
+    double copyBytes = 0.0;             // Size of the compacted copies
+    double originalBytes = 0.0;         // Size of the buffers they stand in for
+    double fetchBytesSaved = 0.0;       // Vertex fetch saved, since last status
+};
+static VertexSlimStats g_slimStats;
+static volatile LONG g_slimGeneration = 0;  // Bumped whenever a compacted copy is dropped
+
+/**
+ * Declaration table - open addressing keyed by the game's declaration pointer.
+ * Entries are rebuilt when CreateVertexDeclaration hands out a reused address.
+ */
+class SlimDeclTable {
+private:
+    static const UINT kSize = 1024;
+    SlimDecl* m_entries[kSize] = {};
+    CRITICAL_SECTION m_lock;            // MarkDead against Compact; lookups stay lock-free
+    int m_dead = 0;                     // Entries whose declaration is gone, still holding a slot
+
+    static UINT Slot(IDirect3DVertexDeclaration9* decl) {
+        return (UINT)HashMix64((UINT64)(UINT_PTR)decl) & (kSize - 1);
+    }
+
+public:
+    SlimDeclTable() { InitializeCriticalSection(&m_lock); }
+
+    const SlimDecl* Find(IDirect3DVertexDeclaration9* decl) const {
+        for (UINT i = 0, slot = Slot(decl); i < kSize; i++, slot = (slot + 1) & (kSize - 1)) {
+            if (!m_entries[slot]) return nullptr;
+            if (m_entries[slot]->game == decl) return m_entries[slot];
+        }
+        return nullptr;
+    }
+
+    void Add(IDirect3DDevice9* realDevice, IDirect3DVertexDeclaration9* decl, const D3DVERTEXELEMENT9* elements) {
+        SlimDecl* entry = new SlimDecl();
+        entry->game = decl;
+        entry->positionStream = -1;
+
+        // Pack each stream's kept elements in their original order
+        D3DVERTEXELEMENT9 slimElements[kMaxDeclElements + 1];
+        int slimCount = 0;
+        bool stripped[16] = {};
+        for (int i = 0; i < kMaxDeclElements && elements[i].Stream != 0xFF; i++) {
+            const D3DVERTEXELEMENT9& e = elements[i];
+            if (e.Stream >= 16) continue;
+            entry->streamMask |= 1 << e.Stream;
+            if (e.Usage == D3DDECLUSAGE_POSITION && e.UsageIndex == 0 &&
+                (e.Type == D3DDECLTYPE_FLOAT3 || e.Type == D3DDECLTYPE_FLOAT4)) {
+                entry->positionStream = e.Stream;
+                entry->positionOffset = e.Offset;
+            }
+            if (!SlimKeepsElement(e)) {
+                stripped[e.Stream] = true;
+                continue;
+            }
+            SlimElement& k = entry->elements[entry->elementCount++];
+            k.stream = e.Stream;
+            k.srcOffset = e.Offset;
+            k.dstOffset = (WORD)entry->slimStride[e.Stream];
+            k.size = (WORD)DeclTypeSize(e.Type);
+            entry->slimStride[e.Stream] += k.size;
+            slimElements[slimCount++] = e;
+        }
+
+        for (int s = 0; s < 16; s++) {
+            if (stripped[s] && entry->slimStride[s] > 0) entry->copyMask |= 1 << s;
+        }
+        for (int i = 0; i < entry->elementCount; i++) {
+            SlimElement& k = entry->elements[i];
+            if (entry->copyMask & (1 << k.stream)) {
+                slimElements[i].Offset = k.dstOffset;
+                entry->layoutKey[k.stream] = HashMix64(entry->layoutKey[k.stream] ^
+                    ((UINT64)k.srcOffset << 32 | (UINT64)k.dstOffset << 16 | k.size));
+            } else {
+                k.dstOffset = k.srcOffset;  // Untouched stream keeps its layout
+            }
+        }
+
+        // A stream losing every element would be left unbound, so leave such declarations alone
+        bool emptied = false;
+        for (int s = 0; s < 16; s++) {
+            if (stripped[s] && entry->slimStride[s] == 0) emptied = true;
+        }
+        if (entry->copyMask && !emptied) {
+            D3DVERTEXELEMENT9 end = D3DDECL_END();
+            slimElements[slimCount] = end;
+            if (SUCCEEDED(realDevice->CreateVertexDeclaration(slimElements, &entry->slim))) {
+                g_slimStats.declsSlimmed++;
+            } else {
+                entry->slim = nullptr;
+            }
+        }
+
+        EnterCriticalSection(&m_lock);
+        for (UINT i = 0, slot = Slot(decl); i < kSize; i++, slot = (slot + 1) & (kSize - 1)) {
+            SlimDecl* old = m_entries[slot];
+            if (!old || old->game == decl) {
+                if (old) {
+                    if (old->slim) old->slim->Release();
+                    delete old;
+                }
+                m_entries[slot] = entry;
+                LeaveCriticalSection(&m_lock);
+                return;
+            }
+        }
+        if (m_dead) g_maintenance.Queue(MAINT_SLIM_COMPACT);
+        LeaveCriticalSection(&m_lock);
+        if (entry->slim) entry->slim->Release();  // Table full
+        delete entry;
+    }
+
+    // Real declaration about to be released (any thread). The entry keeps its
+    // slot so probe chains stay intact until the next Compact.
+    void MarkDead(IDirect3DVertexDeclaration9* decl) {
+        EnterCriticalSection(&m_lock);
+        for (UINT i = 0, slot = Slot(decl); i < kSize; i++, slot = (slot + 1) & (kSize - 1)) {
+            SlimDecl* e = m_entries[slot];
+            if (!e) break;
+            if (e->game == decl) {
+                e->game = nullptr;
+                if (++m_dead == 32) g_maintenance.Queue(MAINT_SLIM_COMPACT);
+                break;
+            }
+        }
+        LeaveCriticalSection(&m_lock);
+    }
+
+    // Rebuild the table from its live entries (render thread, maintenance)
+    void Compact() {
+        EnterCriticalSection(&m_lock);
+        SlimDecl* live[kSize];
+        UINT count = 0;
+        for (UINT slot = 0; slot < kSize; slot++) {
+            SlimDecl* e = m_entries[slot];
+            m_entries[slot] = nullptr;
+            if (!e) continue;
+            if (e->game) {
+                live[count++] = e;
+            } else {
+                if (e->slim) e->slim->Release();
+                delete e;
+            }
+        }
+        for (UINT i = 0; i < count; i++) {
+            UINT slot = Slot(live[i]->game);
+            while (m_entries[slot]) slot = (slot + 1) & (kSize - 1);
+            m_entries[slot] = live[i];
+        }
+        m_dead = 0;
+        LeaveCriticalSection(&m_lock);
+    }
+};
+
+static SlimDeclTable g_slimDecls;
+
+/**
+ * Wrapped IDirect3DVertexBuffer9 - static vertex buffers with a CPU shadow, from
+ * which compacted copies are built for slimmed declarations. The game's own
+ * buffer stays as authored for every draw that cannot be slimmed.
+ */
+class WrappedVertexBuffer9 : public IDirect3DVertexBuffer9 {
+private:
+    struct SlimCopy {
+        UINT64 key;
+        IDirect3DVertexBuffer9* vb;
+        UINT stride;
+    };
+    static const int kMaxCopies = 4;
+
+    IDirect3DVertexBuffer9* m_real;
+    IDirect3DDevice9* m_realDevice;
+    IDirect3DDevice9* m_device;         // Wrapped device, returned from GetDevice
+    volatile LONG m_refs = 1;
+    UINT m_length;
+    DWORD m_usage;
+    D3DPOOL m_pool;
+    BYTE* m_shadow;
+    UINT m_lockOffset = 0;
+    UINT m_lockSize = 0;
+    bool m_lockWrites = false;
+    SlimCopy m_copies[kMaxCopies] = {};
+    int m_copyCount = 0;
+    UINT m_version = 0;                 // Bumped by every write, invalidates bounds computed from the shadow
+
+    static void* s_vtable;
+
+    void DropCopies() {
+        for (int i = 0; i < m_copyCount; i++) m_copies[i].vb->Release();
+        if (m_copyCount) InterlockedIncrement(&g_slimGeneration);
+        m_copyCount = 0;
+    }
+
+public:
+    WrappedVertexBuffer9(IDirect3DVertexBuffer9* real, IDirect3DDevice9* realDevice, IDirect3DDevice9* device,
+                         UINT length, DWORD usage, D3DPOOL pool)
+        : m_real(real), m_realDevice(realDevice), m_device(device), m_length(length), m_usage(usage), m_pool(pool) {
+        m_shadow = (BYTE*)calloc(length, 1);
+        if (!s_vtable) s_vtable = *(void**)this;
+    }
+
+    ~WrappedVertexBuffer9() {
+        DropCopies();
+        free(m_shadow);
+        m_real->Release();
+    }
+
+    static WrappedVertexBuffer9* FromBase(IDirect3DVertexBuffer9* buffer) {
+        if (!buffer || !s_vtable || *(void**)buffer != s_vtable) return nullptr;
+        return static_cast<WrappedVertexBuffer9*>(buffer);
+    }
+
+    static IDirect3DVertexBuffer9* Unwrap(IDirect3DVertexBuffer9* buffer) {
+        WrappedVertexBuffer9* wrapped = FromBase(buffer);
+        return wrapped ? wrapped->m_real : buffer;
+    }
+
+    bool Valid() const { return m_shadow != nullptr; }
+    UINT Version() const { return m_version; }
+
+    // The runtime wrote the real buffer behind the shadow (ProcessVertices): read it back and
+    // drop everything built from the old contents. Reading a write-only buffer is slow, not wrong
+    void RefreshFromReal() {
+        void* src = nullptr;
+        if (SUCCEEDED(m_real->Lock(0, 0, &src, D3DLOCK_READONLY))) {
+            memcpy(m_shadow, src, m_length);
+            m_real->Unlock();
+        } else {
+            LogMsg("SLIM: read-back after ProcessVertices failed, shadow of %p is stale", m_real);
+        }
+        m_version++;
+        DropCopies();
+    }
+
+    // Object-space box of a float3 position over a vertex range, from the CPU shadow
+    bool PositionBounds(UINT offset, UINT stride, UINT positionOffset, UINT first, UINT count, float* center, float* extent) const {
+        if (!m_shadow || stride < positionOffset + 12 || count == 0) return false;
+        UINT64 begin = offset + (UINT64)first * stride + positionOffset;
+        if (begin + (UINT64)(count - 1) * stride + 12 > m_length) return false;
+        float mn[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, mx[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        const BYTE* p = m_shadow + begin;
+        for (UINT v = 0; v < count; v++, p += stride) {
+            float pos[3];
+            memcpy(pos, p, sizeof(pos));
+            for (int k = 0; k < 3; k++) {
+                mn[k] = (std::min)(mn[k], pos[k]);
+                mx[k] = (std::max)(mx[k], pos[k]);
+            }
+        }
+        for (int k = 0; k < 3; k++) {
+            center[k] = (mn[k] + mx[k]) * 0.5f;
+            extent[k] = (mx[k] - mn[k]) * 0.5f;
+        }
+        return true;
+    }
+
+    // Compacted copy of one stream for a slimmed declaration, built on first use
+    IDirect3DVertexBuffer9* SlimCopyFor(const SlimDecl& decl, UINT stream, UINT srcStride, UINT* slimStride) {
+        UINT64 key = HashMix64(decl.layoutKey[stream] ^ srcStride);
+        for (int i = 0; i < m_copyCount; i++) {
+            if (m_copies[i].key == key) {
+                *slimStride = m_copies[i].stride;
+                return m_copies[i].vb;
+            }
+        }
+        if (m_copyCount == kMaxCopies) return nullptr;
+
+        UINT stride = decl.slimStride[stream];
+        UINT vertexCount = m_length / srcStride;
+        for (int i = 0; i < decl.elementCount; i++) {
+            const SlimElement& k = decl.elements[i];
+            if (k.stream == stream && k.srcOffset + k.size > srcStride) return nullptr;
+        }
+        IDirect3DVertexBuffer9* vb = nullptr;
+        if (vertexCount == 0 || FAILED(m_realDevice->CreateVertexBuffer(vertexCount * stride, m_usage, 0, m_pool, &vb, nullptr))) {
+            return nullptr;
+        }
+        BYTE* dst = nullptr;
+        if (FAILED(vb->Lock(0, 0, (void**)&dst, 0))) {
+            vb->Release();
+            return nullptr;
+        }
+        for (UINT v = 0; v < vertexCount; v++) {
+            const BYTE* srcVertex = m_shadow + v * srcStride;
+            BYTE* dstVertex = dst + v * stride;
+            for (int i = 0; i < decl.elementCount; i++) {
+                const SlimElement& k = decl.elements[i];
+                if (k.stream == stream) memcpy(dstVertex + k.dstOffset, srcVertex + k.srcOffset, k.size);
+            }
+        }
+        vb->Unlock();
+
+        m_copies[m_copyCount++] = { key, vb, stride };
+        g_slimStats.copies++;
+        g_slimStats.copyBytes += (double)vertexCount * stride;
+        g_slimStats.originalBytes += m_length;
+        *slimStride = stride;
+        return vb;
+    }
+
+    // IUnknown
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObj) override {
+        if (riid == IID_IUnknown || riid == IID_IDirect3DResource9 || riid == IID_IDirect3DVertexBuffer9) {
+            AddRef();
+            *ppvObj = this;
+            return S_OK;
+        }
+        return m_real->QueryInterface(riid, ppvObj);
+    }
+    ULONG STDMETHODCALLTYPE AddRef() override { return InterlockedIncrement(&m_refs); }
+    ULONG STDMETHODCALLTYPE Release() override {
+        LONG count = InterlockedDecrement(&m_refs);
+        if (count == 0) {
+            ResourceGuard guard;       // Destruction releases real objects
+            delete this;
+        }
+        return count;
+    }
+
+    // IDirect3DResource9
+    HRESULT STDMETHODCALLTYPE GetDevice(IDirect3DDevice9** ppDevice) override {
+        m_device->AddRef();
+        *ppDevice = m_device;
+        return D3D_OK;
+    }
+    HRESULT STDMETHODCALLTYPE SetPrivateData(REFGUID refguid, const void* pData, DWORD SizeOfData, DWORD Flags) override { return m_real->SetPrivateData(refguid, pData, SizeOfData, Flags); }
+    HRESULT STDMETHODCALLTYPE GetPrivateData(REFGUID refguid, void* pData, DWORD* pSizeOfData) override { return m_real->GetPrivateData(refguid, pData, pSizeOfData); }
+    HRESULT STDMETHODCALLTYPE FreePrivateData(REFGUID refguid) override { return m_real->FreePrivateData(refguid); }
+    DWORD STDMETHODCALLTYPE SetPriority(DWORD PriorityNew) override { return m_real->SetPriority(PriorityNew); }
+    DWORD STDMETHODCALLTYPE GetPriority() override { return m_real->GetPriority(); }
+    void STDMETHODCALLTYPE PreLoad() override { m_real->PreLoad(); }
+    D3DRESOURCETYPE STDMETHODCALLTYPE GetType() override { return m_real->GetType(); }
+
+    // IDirect3DVertexBuffer9
+    HRESULT STDMETHODCALLTYPE Lock(UINT OffsetToLock, UINT SizeToLock, void** ppbData, DWORD Flags) override {
+        ResourceGuard guard;
+        if (OffsetToLock > m_length || !ppbData) return D3DERR_INVALIDCALL;
+        if (SizeToLock == 0 || OffsetToLock + SizeToLock > m_length) SizeToLock = m_length - OffsetToLock;
+        if (!(Flags & D3DLOCK_READONLY)) {
+            // Widen to cover every write since the last unlock
+            UINT end = m_lockWrites ? (std::max)(m_lockOffset + m_lockSize, OffsetToLock + SizeToLock) : OffsetToLock + SizeToLock;
+            m_lockOffset = m_lockWrites ? (std::min)(m_lockOffset, OffsetToLock) : OffsetToLock;
+            m_lockSize = end - m_lockOffset;
+            m_lockWrites = true;
+        }
+        *ppbData = m_shadow + OffsetToLock;
+        return D3D_OK;
+    }
+    HRESULT STDMETHODCALLTYPE Unlock() override {
+        ResourceGuard guard;
+        if (!m_lockWrites) return D3D_OK;
+        m_lockWrites = false;
+        m_version++;
+        void* dst = nullptr;
+        HRESULT hr = m_real->Lock(m_lockOffset, m_lockSize, &dst, 0);
+        if (SUCCEEDED(hr)) {
+            memcpy(dst, m_shadow + m_lockOffset, m_lockSize);
+            hr = m_real->Unlock();
+        }
+        DropCopies();
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE GetDesc(D3DVERTEXBUFFER_DESC* pDesc) override { return m_real->GetDesc(pDesc); }
+};
+
+void* WrappedVertexBuffer9::s_vtable = nullptr;
+
+// ---------------------------------------------------------------------------
+// Buffer usage policy: UE3 creates some vertex and index buffers without
+// D3DUSAGE_WRITEONLY, and puts write-once buffers in D3DPOOL_MANAGED, which
+// costs the runtime a system-memory copy and extra copies per lock. Buffers
+// are grouped by creation signature (kind, usage, format/FVF, pool, size
+// class); locks are profiled per signature and the verdict stored in the
+// persistent cache, and later runs create matching buffers with corrected
+// flags.
+// ---------------------------------------------------------------------------
+
+enum BufferFix {
+    BUFFER_FIX_WRITEONLY = 1,       // Add D3DUSAGE_WRITEONLY: never read back
+    BUFFER_FIX_DEFAULT_POOL = 2,    // Managed -> default pool: written once, never read
+    BUFFER_FIX_MASK = 3,
+    BUFFER_DEVIATED = 8             // Corrected buffers were used differently; create as the game asks
+};
+
+struct BufferSignature {
+    char key[48];                   // Cache key, also used in the log
+    DWORD usage;                    // As the game asks
+    D3DPOOL pool;
+    int stored;                     // Cache value at startup, -1 = nothing learned yet
+    int fixes;                      // BufferFix bits applied this run
+    bool learned;                   // Verdict written this run
+    bool deviated;
+
+    // Observed this run
+    int buffers;
+    int writeLocks;
+    int readLocks;
+    int discardLocks;
+    int rewritten;                  // Buffers locked for writing more than once
+    double totalLockMs;             // Real Lock + Unlock time, the evidence and baseline for Learn
+    int totalLocks;
+    double lockMs;                  // The same, since the last status
+    int locks;
+
+    void NoteLock() {
+        locks++;
+        totalLocks++;
+    }
+
+    void NoteLockTime(double ms) {
+        lockMs += ms;
+        totalLockMs += ms;
+    }
+};
+
+/**
+ * Per-signature lock profile and the corrections learned from it. The cache
+ * value packs the fixes (low byte) with the observed lock + Unlock cost in
+ * tenths of a microsecond (the rest), which later runs compare against to
+ * report lock time saved.
+ */
+class BufferPolicy {
+private:
+    static const int kMaxSignatures = 256;
+    static const int kMinBuffers = 4;       // Evidence needed before a verdict
+    static const int kMinLocks = 4;
+
+    BufferSignature m_signatures[kMaxSignatures];
+    int m_count = 0;
+    CRITICAL_SECTION m_lock;
+
+public:
+    // Statistics; live figures except the lock counters, which are since the last status
+    int corrected = 0;                  // Live buffers created with corrected flags
+    double movedBytes = 0.0;            // Live buffers moved out of the managed pool
+    int fallbacks = 0;                  // Corrected creates that failed and were retried as asked
+    int deviations = 0;
+    int resetRefills = 0;
+
+    BufferPolicy() { InitializeCriticalSection(&m_lock); }
+
+    void Lock() { EnterCriticalSection(&m_lock); }
+    void Unlock() { LeaveCriticalSection(&m_lock); }
+
+    // Signature of a new buffer (creation thread); null once the table is full
+    BufferSignature* Lookup(bool index, UINT length, DWORD usage, DWORD format, D3DPOOL pool) {
+        int sizeClass = 0;
+        while (sizeClass < 31 && (1u << (sizeClass + 1)) <= length) sizeClass++;
+        char key[48];
+        sprintf(key, "Buffer%c_%X_%X_%d_%d", index ? 'I' : 'V', (unsigned)usage, (unsigned)format, (int)pool, sizeClass);
+
+        Lock();
+        for (int i = 0; i < m_count; i++) {
+            if (strcmp(m_signatures[i].key, key) == 0) {
+                m_signatures[i].buffers++;
+                Unlock();
+                return &m_signatures[i];
+            }
+        }
+        if (m_count == kMaxSignatures) {
+            Unlock();
+            return nullptr;
+        }
+        BufferSignature* sig = &m_signatures[m_count++];
+        memset(sig, 0, sizeof(*sig));
+        strcpy(sig->key, key);
+        sig->usage = usage;
+        sig->pool = pool;
+        sig->stored = g_cache.GetInt(key, -1);
+        if (sig->stored >= 0 && !(sig->stored & BUFFER_DEVIATED)) sig->fixes = sig->stored & BUFFER_FIX_MASK;
+        sig->learned = sig->stored >= 0;
+        sig->buffers = 1;
+        Unlock();
+        if (sig->fixes) {
+            LogMsg("BUFFERS: %s created%s%s", key, (sig->fixes & BUFFER_FIX_WRITEONLY) ? " write-only" : "",
+                   (sig->fixes & BUFFER_FIX_DEFAULT_POOL) ? " in the default pool" : "");
+        }
+        return sig;
+    }
+
+    // Flags to create a buffer of this signature with; returns the fixes applied. Corrected
+    // buffers keep a shadow that serves reads and refills them after a Reset, so the real
+    // buffer is write-only either way
+    static int Correct(const BufferSignature* sig, DWORD* usage, D3DPOOL* pool) {
+        if (!sig || sig->deviated) return 0;
+        if (*usage & D3DUSAGE_SOFTWAREPROCESSING) return 0;    // ProcessVertices targets; the runtime writes them
+        int fixes = sig->fixes;
+        if (*usage & D3DUSAGE_DYNAMIC) fixes &= ~BUFFER_FIX_WRITEONLY;     // Too often locked to shadow
+        if (fixes & BUFFER_FIX_DEFAULT_POOL) *pool = D3DPOOL_DEFAULT;
+        if (fixes) *usage |= D3DUSAGE_WRITEONLY;
+        return fixes;
+    }
+
+    // A corrected buffer was used in a way its fix assumed it never would be
+    void Deviate(BufferSignature* sig, const char* how) {
+        Lock();
+        bool first = !sig->deviated;
+        sig->deviated = true;
+        Unlock();
+        if (!first) return;
+        deviations++;
+        g_cache.SetInt(sig->key, BUFFER_DEVIATED | (sig->stored & ~0xFF));
+        LogMsg("BUFFERS: %s deviated (%s), created as the game asks from the next buffer on", sig->key, how);
+    }
+
+    // Store verdicts for signatures with enough evidence (render thread)
+    void Learn() {
+        Lock();
+        for (int i = 0; i < m_count; i++) {
+            BufferSignature& sig = m_signatures[i];
+            if (sig.learned || sig.buffers < kMinBuffers || sig.totalLocks < kMinLocks) continue;
+            int fixes = 0;
+            if (sig.readLocks == 0 && !(sig.usage & (D3DUSAGE_WRITEONLY | D3DUSAGE_DYNAMIC))) fixes |= BUFFER_FIX_WRITEONLY;
+            if (sig.pool == D3DPOOL_MANAGED && !(sig.usage & D3DUSAGE_DYNAMIC) && sig.readLocks == 0 &&
+                sig.discardLocks == 0 && sig.rewritten == 0) {
+                fixes |= BUFFER_FIX_DEFAULT_POOL;
+            }
+            // Lock + Unlock cost in tenths of a microsecond, the baseline for later runs
+            int cost = (int)(sig.totalLockMs * 10000.0 / sig.totalLocks);
+            if (cost > 0x7FFFFF) cost = 0x7FFFFF;
+            g_cache.SetInt(sig.key, fixes | (cost << 8));
+            sig.learned = true;
+            LogMsg("BUFFERS: learned %s from %d buffers, %d write / %d read / %d discard locks, %d rewritten -> fixes %d",
+                   sig.key, sig.buffers, sig.writeLocks, sig.readLocks, sig.discardLocks, sig.rewritten, fixes);
+        }
+        Unlock();
+    }
+
+    void LogStatus() {
+        int locks = 0, correctedLocks = 0;
+        double correctedMs = 0.0, savedMs = 0.0;
+        Lock();
+        for (int i = 0; i < m_count; i++) {
+            BufferSignature& sig = m_signatures[i];
+            locks += sig.locks;
+            if (sig.fixes && sig.locks && sig.stored >= 0) {
+                double baselineMs = (sig.stored >> 8) / 10000.0;
+                correctedLocks += sig.locks;
+                correctedMs += sig.lockMs;
+                savedMs += baselineMs * sig.locks - sig.lockMs;
+            }
+            sig.locks = 0;
+            sig.lockMs = 0.0;
+        }
+        int signatures = m_count;
+        Unlock();
+        LogMsg("  Buffers: %d signatures, %d live corrected (%.1f MB out of the managed pool), %d locks (%d corrected, %.3f ms), lock time saved %.3f ms, %d create fallbacks, %d deviations, %d Reset refills",
+               signatures, corrected, movedBytes / (1024.0 * 1024.0), locks, correctedLocks, correctedMs, savedMs,
+               fallbacks, deviations, resetRefills);
+    }
+};
+
+static BufferPolicy g_bufferPolicy;
+
+// Managed-pool emulation on an upgraded Ex device (UpgradeToEx)
+struct ExEmulationStats {
+    int textures = 0;               // Created since start
+    int buffers = 0;
+    int lockableTextures = 0;       // Cube/volume textures made dynamic instead of shadowed
+    double shadowBytes = 0.0;       // System-memory shadows allocated since start
+    int uploads = 0;                // Shadow -> default pool texture copies, since last status
+};
+static ExEmulationStats g_exStats;
+
+static HRESULT CreateRealBuffer(IDirect3DDevice9* device, UINT length, DWORD usage, DWORD format, D3DPOOL pool,
+                                IDirect3DVertexBuffer9** out) {
+    return device->CreateVertexBuffer(length, usage, format, pool, out, nullptr);
+}
+
+static HRESULT CreateRealBuffer(IDirect3DDevice9* device, UINT length, DWORD usage, DWORD format, D3DPOOL pool,
+                                IDirect3DIndexBuffer9** out) {
+    return device->CreateIndexBuffer(length, usage, (D3DFORMAT)format, pool, out, nullptr);
+}
+
+/**
+ * Game-facing vertex/index buffer under the usage policy or managed-pool
+ * emulation: profiles the game's locks and reports flags and pool as the game
+ * asked. Corrected buffers and emulated managed buffers (Ex device) keep a
+ * system-memory shadow the game locks; Unlock copies the written range into
+ * the write-only real buffer, and reads never touch it. Buffers moved to the
+ * default pool are released before a Reset and recreated and refilled from
+ * the shadow after it; locks in between only see the shadow.
+ */
+template <typename T, typename DESC>
+class ProfiledBuffer : public T {
+protected:
+    T* m_real;                          // Null between a Reset read-back and the recreate
+    IDirect3DDevice9* m_realDevice;
+    IDirect3DDevice9* m_device;         // Wrapped device, returned from GetDevice
+    const IID* m_iid;
+    volatile LONG m_refs = 1;
+    BufferSignature* m_sig;
+    int m_fixes;
+    UINT m_length;
+    DWORD m_usage;                      // Real creation flags
+    D3DPOOL m_pool;
+    DWORD m_format;                     // FVF or index format
+    DWORD m_gameUsage;
+    D3DPOOL m_gamePool;
+    int m_writeLocks = 0;
+    int m_movedIndex = -1;              // In s_moved, -1 = not in the default pool by our doing
+    BYTE* m_shadow = nullptr;           // Managed-pool emulation: the game's copy
+    UINT m_dirtyBegin = 0;              // Shadow range written since the last Unlock
+    UINT m_dirtyEnd = 0;
+
+    static void* s_vtable;
+    static std::vector<ProfiledBuffer*> s_moved;
+
+    void NoteLock(DWORD flags) {
+        if (!m_sig) return;
+        if (flags & D3DLOCK_READONLY) {
+            m_sig->readLocks++;
+            if (m_fixes && !m_sig->deviated) g_bufferPolicy.Deviate(m_sig, "read back");
+        } else if (flags & D3DLOCK_DISCARD) {
+            m_sig->discardLocks++;
+            if ((m_fixes & BUFFER_FIX_DEFAULT_POOL) && !m_sig->deviated) g_bufferPolicy.Deviate(m_sig, "discarded");
+        } else {
+            m_sig->writeLocks++;
+            if (++m_writeLocks == 2) {
+                m_sig->rewritten++;
+                if ((m_fixes & BUFFER_FIX_DEFAULT_POOL) && !m_sig->deviated) g_bufferPolicy.Deviate(m_sig, "rewritten");
+            }
+        }
+    }
+
+public:
+    ProfiledBuffer(T* real, IDirect3DDevice9* realDevice, IDirect3DDevice9* device, const IID& iid,
+                   BufferSignature* sig, int fixes, UINT length, DWORD usage, D3DPOOL pool, DWORD format,
+                   DWORD gameUsage, D3DPOOL gamePool)
+        : m_real(real), m_realDevice(realDevice), m_device(device), m_iid(&iid), m_sig(sig), m_fixes(fixes),
+          m_length(length), m_usage(usage), m_pool(pool), m_format(format), m_gameUsage(gameUsage), m_gamePool(gamePool) {
+        if (fixes) g_bufferPolicy.corrected++;
+        if (fixes & BUFFER_FIX_DEFAULT_POOL) {
+            g_bufferPolicy.Lock();
+            m_movedIndex = (int)s_moved.size();
+            s_moved.push_back(this);
+            g_bufferPolicy.movedBytes += length;
+            g_bufferPolicy.Unlock();
+        }
+    }
+
+    virtual ~ProfiledBuffer() {
+        if (m_fixes) g_bufferPolicy.corrected--;
+        if (m_movedIndex >= 0) {
+            g_bufferPolicy.Lock();
+            ProfiledBuffer* last = s_moved.back();
+            s_moved[m_movedIndex] = last;
+            last->m_movedIndex = m_movedIndex;
+            s_moved.pop_back();
+            g_bufferPolicy.movedBytes -= m_length;
+            g_bufferPolicy.Unlock();
+        }
+        free(m_shadow);
+        if (m_real) m_real->Release();
+    }
+
+    // Corrected buffers and managed-pool emulation; false if the shadow can't be allocated
+    bool EnableShadow() {
+        m_shadow = (BYTE*)calloc(m_length, 1);
+        return m_shadow != nullptr;
+    }
+
+    static ProfiledBuffer* FromBase(T* buffer) {
+        if (!buffer || !s_vtable || *(void**)buffer != s_vtable) return nullptr;
+        return static_cast<ProfiledBuffer*>(buffer);
+    }
+
+    // The runtime wrote the real buffer behind the shadow (ProcessVertices): read it back so
+    // later locks don't return, and Unlock doesn't copy back, the old contents. Reading a
+    // write-only buffer is slow, not wrong
+    void ResyncShadow() {
+        if (!m_shadow || !m_real) return;
+        void* src = nullptr;
+        if (SUCCEEDED(m_real->Lock(0, 0, &src, D3DLOCK_READONLY))) {
+            memcpy(m_shadow, src, m_length);
+            m_real->Unlock();
+            m_dirtyBegin = m_dirtyEnd = 0;
+        } else {
+            LogMsg("BUFFERS: read-back after ProcessVertices failed, shadow of %p is stale", m_real);
+        }
+        if (m_fixes && m_sig && !m_sig->deviated) g_bufferPolicy.Deviate(m_sig, "written by ProcessVertices");
+    }
+
+    static T* Unwrap(T* buffer) {
+        ProfiledBuffer* wrapped = FromBase(buffer);
+        return wrapped ? wrapped->m_real : buffer;
+    }
+
+    // Before Reset: release every buffer moved to the default pool; the shadow has the contents,
+    // which a lost device may already have discarded from the real buffer (render thread)
+    static void ReleaseMoved() {
+        g_bufferPolicy.Lock();
+        for (ProfiledBuffer* b : s_moved) {
+            if (!b->m_real) continue;
+            b->m_real->Release();
+            b->m_real = nullptr;
+        }
+        g_bufferPolicy.Unlock();
+    }
+
+    // After a successful Reset: recreate them and refill from the shadow
+    static void RecreateMoved() {
+        g_bufferPolicy.Lock();
+        for (ProfiledBuffer* b : s_moved) {
+            if (b->m_real || FAILED(CreateRealBuffer(b->m_realDevice, b->m_length, b->m_usage, b->m_format, b->m_pool, &b->m_real))) {
+                continue;
+            }
+            void* dst = nullptr;
+            if (SUCCEEDED(b->m_real->Lock(0, 0, &dst, 0))) {
+                memcpy(dst, b->m_shadow, b->m_length);
+                b->m_real->Unlock();
+            }
+            b->m_dirtyBegin = b->m_dirtyEnd = 0;
+            g_bufferPolicy.resetRefills++;
+        }
+        g_bufferPolicy.Unlock();
+    }
+
+    // IUnknown
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObj) override {
+        if (riid == IID_IUnknown || riid == IID_IDirect3DResource9 || riid == *m_iid) {
+            this->AddRef();
+            *ppvObj = this;
+            return S_OK;
+        }
+        return m_real ? m_real->QueryInterface(riid, ppvObj) : E_NOINTERFACE;
+    }
+    ULONG STDMETHODCALLTYPE AddRef() override { return InterlockedIncrement(&m_refs); }
+    ULONG STDMETHODCALLTYPE Release() override {
+        LONG count = InterlockedDecrement(&m_refs);
+        if (count == 0) {
+            ResourceGuard guard;       // Destruction releases real objects
+            delete this;
+        }
+        return count;
+    }
+
+    // IDirect3DResource9
+    HRESULT STDMETHODCALLTYPE GetDevice(IDirect3DDevice9** ppDevice) override {
+        m_device->AddRef();
+        *ppDevice = m_device;
+        return D3D_OK;
+    }
+    HRESULT STDMETHODCALLTYPE SetPrivateData(REFGUID refguid, const void* pData, DWORD SizeOfData, DWORD Flags) override { return m_real ? m_real->SetPrivateData(refguid, pData, SizeOfData, Flags) : D3DERR_DEVICELOST; }
+    HRESULT STDMETHODCALLTYPE GetPrivateData(REFGUID refguid, void* pData, DWORD* pSizeOfData) override { return m_real ? m_real->GetPrivateData(refguid, pData, pSizeOfData) : D3DERR_NOTFOUND; }
+    HRESULT STDMETHODCALLTYPE FreePrivateData(REFGUID refguid) override { return m_real ? m_real->FreePrivateData(refguid) : D3DERR_NOTFOUND; }
+    DWORD STDMETHODCALLTYPE SetPriority(DWORD PriorityNew) override { return m_real ? m_real->SetPriority(PriorityNew) : 0; }
+    DWORD STDMETHODCALLTYPE GetPriority() override { return m_real ? m_real->GetPriority() : 0; }
+    void STDMETHODCALLTYPE PreLoad() override { if (m_real) m_real->PreLoad(); }
+    D3DRESOURCETYPE STDMETHODCALLTYPE GetType() override {
+        return *m_iid == IID_IDirect3DIndexBuffer9 ? D3DRTYPE_INDEXBUFFER : D3DRTYPE_VERTEXBUFFER;
+    }
+
+    HRESULT STDMETHODCALLTYPE Lock(UINT OffsetToLock, UINT SizeToLock, void** ppbData, DWORD Flags) override {
+        ResourceGuard guard;
+        NoteLock(Flags);
+        if (m_shadow) {
+            if (OffsetToLock > m_length || !ppbData) return D3DERR_INVALIDCALL;
+            if (SizeToLock == 0 || OffsetToLock + SizeToLock > m_length) SizeToLock = m_length - OffsetToLock;
+            if (!(Flags & D3DLOCK_READONLY)) {
+                // Widen to cover every write since the last unlock
+                bool dirty = m_dirtyEnd > m_dirtyBegin;
+                m_dirtyBegin = dirty ? (std::min)(m_dirtyBegin, OffsetToLock) : OffsetToLock;
+                m_dirtyEnd = dirty ? (std::max)(m_dirtyEnd, OffsetToLock + SizeToLock) : OffsetToLock + SizeToLock;
+            }
+            if (m_sig) m_sig->NoteLock();
+            *ppbData = m_shadow + OffsetToLock;
+            return D3D_OK;
+        }
+        if (!m_real) return D3DERR_INVALIDCALL;
+        LONGLONG start = QpcNow();
+        HRESULT hr = m_real->Lock(OffsetToLock, SizeToLock, ppbData, Flags);
+        if (m_sig) {
+            m_sig->NoteLockTime(QpcToMs(QpcNow() - start));
+            m_sig->NoteLock();
+        }
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE Unlock() override {
+        ResourceGuard guard;
+        if (!m_real) return D3D_OK;     // Released for a Reset; the dirty range waits for the refill
+        LONGLONG start = QpcNow();
+        HRESULT hr = D3D_OK;
+        if (m_shadow) {
+            if (m_dirtyEnd > m_dirtyBegin) {
+                void* dst = nullptr;
+                hr = m_real->Lock(m_dirtyBegin, m_dirtyEnd - m_dirtyBegin, &dst, 0);
+                if (SUCCEEDED(hr)) {
+                    memcpy(dst, m_shadow + m_dirtyBegin, m_dirtyEnd - m_dirtyBegin);
+                    hr = m_real->Unlock();
+                }
+                m_dirtyBegin = m_dirtyEnd = 0;
+            }
+        } else {
+            hr = m_real->Unlock();
+        }
+        if (m_sig) m_sig->NoteLockTime(QpcToMs(QpcNow() - start));
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE GetDesc(DESC* pDesc) override {
+        if (!m_real) return D3DERR_DEVICELOST;
+        HRESULT hr = m_real->GetDesc(pDesc);
+        if (SUCCEEDED(hr)) {
+            pDesc->Usage = m_gameUsage;
+            pDesc->Pool = m_gamePool;
+        }
+        return hr;
+    }
+};
+
+template <typename T, typename DESC>
+void* ProfiledBuffer<T, DESC>::s_vtable = nullptr;
+
+template <typename T, typename DESC>
+std::vector<ProfiledBuffer<T, DESC>*> ProfiledBuffer<T, DESC>::s_moved;
+
+class ProfiledVertexBuffer9 : public ProfiledBuffer<IDirect3DVertexBuffer9, D3DVERTEXBUFFER_DESC> {
+public:
+    ProfiledVertexBuffer9(IDirect3DVertexBuffer9* real, IDirect3DDevice9* realDevice, IDirect3DDevice9* device,
+                          BufferSignature* sig, int fixes, UINT length, DWORD usage, D3DPOOL pool, DWORD fvf,
+                          DWORD gameUsage, D3DPOOL gamePool)
+        : ProfiledBuffer(real, realDevice, device, IID_IDirect3DVertexBuffer9, sig, fixes, length, usage, pool, fvf,
+                         gameUsage, gamePool) {
+        if (!s_vtable) s_vtable = *(void**)this;
+    }
+};
+
+class ProfiledIndexBuffer9 : public ProfiledBuffer<IDirect3DIndexBuffer9, D3DINDEXBUFFER_DESC> {
+public:
+    ProfiledIndexBuffer9(IDirect3DIndexBuffer9* real, IDirect3DDevice9* realDevice, IDirect3DDevice9* device,
+                         BufferSignature* sig, int fixes, UINT length, DWORD usage, D3DPOOL pool, D3DFORMAT format,
+                         DWORD gameUsage, D3DPOOL gamePool)
+        : ProfiledBuffer(real, realDevice, device, IID_IDirect3DIndexBuffer9, sig, fixes, length, usage, pool, format,
+                         gameUsage, gamePool) {
+        if (!s_vtable) s_vtable = *(void**)this;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Shader / declaration interning: UE3 creates byte-identical shaders and
+// vertex declarations many times over (per material, per streamed level), and
+// each real object costs Remix a translation and pipeline setup. Creates are
+// keyed by a hash of their input; identical content shares one real object,
+// and the game gets its own refcounted wrapper around it.
+// ---------------------------------------------------------------------------
+
+enum InternKind {
+    INTERN_VERTEX_SHADER = 0,
+    INTERN_PIXEL_SHADER,
+    INTERN_DECLARATION,
+    INTERN_KIND_COUNT
+};
+
+struct InternEntry {
+    InternEntry* next;          // Bucket chain
+    IDirect3DDevice9* device;   // Real device that owns the object; part of the key
+    UINT64 hash;
+    InternKind kind;
+    UINT size;
+    BYTE* bytes;                // Copy of the creation input, compared on lookup
+    IUnknown* real;             // The one reference the table holds
+    LONG users;                 // Live wrappers
+    bool slimSafe;              // Vertex shaders: reads only elements stream slimming keeps
+};
+
+// Length in bytes of a shader token stream including the end token, 0 if it can't be walked
+static UINT ShaderByteLength(const DWORD* function) {
+    DWORD major = (function[0] >> 8) & 0xFF;
+    for (UINT i = 1; i < (1u << 20);) {
+        DWORD token = function[i];
+        if (token == 0x0000FFFF) return (i + 1) * 4;
+        if ((token & 0xFFFF) == 0xFFFE) {
+            i += 1 + ((token >> 16) & 0x7FFF);  // Comment block
+        } else if (major >= 2) {
+            i += 1 + ((token >> 24) & 0xF);     // SM2+ instructions carry their length
+        } else {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static UINT DeclarationByteLength(const D3DVERTEXELEMENT9* elements) {
+    UINT count = 0;
+    while (count < 64 && elements[count].Stream != 0xFF) count++;
+    return (count + 1) * sizeof(D3DVERTEXELEMENT9);
+}
+
+static UINT64 HashBytes64(const void* data, UINT size) {
+    const BYTE* p = (const BYTE*)data;
+    UINT64 h = HashMix64(size);
+    UINT i = 0;
+    for (; i + 8 <= size; i += 8) {
+        UINT64 word;
+        memcpy(&word, p + i, 8);
+        h = HashMix64(h ^ word);
+    }
+    UINT64 tail = 0;
+    memcpy(&tail, p + i, size - i);
+    return HashMix64(h ^ tail);
+}
+
+class InternTable {
+private:
+    static const UINT kBuckets = 4096;
+    CRITICAL_SECTION m_lock;
+    InternEntry* m_buckets[kBuckets] = {};
+
+public:
+    struct KindStats {
+        int requested = 0;
+        int created = 0;        // Real objects made
+        int live = 0;           // Real objects alive now
+        double createMs = 0.0;  // Time spent in the real creates
+    };
+    KindStats stats[INTERN_KIND_COUNT];
+
+    InternTable() { InitializeCriticalSection(&m_lock); }
+
+    // Shared entry for this content on this real device with one more user; create makes the
+    // real object on a miss. A live entry holds a reference on its device through the real
+    // object, so a recreated device can never land on the same pointer and see stale entries
+    template <typename CreateFn>
+    InternEntry* Acquire(IDirect3DDevice9* device, InternKind kind, const void* bytes, UINT size, CreateFn create) {
+        UINT64 hash = HashMix64(HashBytes64(bytes, size) ^ kind);   // Content only: draw rules match on it across runs
+        EnterCriticalSection(&m_lock);
+        KindStats& ks = stats[kind];
+        ks.requested++;
+        InternEntry** bucket = &m_buckets[hash & (kBuckets - 1)];
+        for (InternEntry* e = *bucket; e; e = e->next) {
+            if (e->hash == hash && e->device == device && e->kind == kind && e->size == size &&
+                memcmp(e->bytes, bytes, size) == 0) {
+                e->users++;
+                LeaveCriticalSection(&m_lock);
+                return e;
+            }
+        }
+
+        LONGLONG start = QpcNow();
+        IUnknown* real = create();
+        ks.createMs += QpcToMs(QpcNow() - start);
+        InternEntry* e = nullptr;
+        if (real) {
+            e = new InternEntry();
+            e->device = device;
+            e->hash = hash;
+            e->kind = kind;
+            e->size = size;
+            e->bytes = (BYTE*)malloc(size);
+            memcpy(e->bytes, bytes, size);
+            e->real = real;
+            e->users = 1;
+            e->next = *bucket;
+            *bucket = e;
+            ks.created++;
+            ks.live++;
+        } else {
+            ks.requested--;     // Failed creates are the game's problem, not a miss
+        }
+        LeaveCriticalSection(&m_lock);
+        return e;
+    }
+
+    // Last wrapper gone: unlink and drop the real object
+    void Release(InternEntry* entry) {
+        EnterCriticalSection(&m_lock);
+        if (--entry->users > 0) {
+            LeaveCriticalSection(&m_lock);
+            return;
+        }
+        for (InternEntry** link = &m_buckets[entry->hash & (kBuckets - 1)]; *link; link = &(*link)->next) {
+            if (*link == entry) {
+                *link = entry->next;
+                break;
+            }
+        }
+        stats[entry->kind].live--;
+        LeaveCriticalSection(&m_lock);
+        if (entry->kind == INTERN_DECLARATION && g_config.slimVertexStreams) {
+            g_slimDecls.MarkDead((IDirect3DVertexDeclaration9*)entry->real);
+        }
+        entry->real->Release();
+        free(entry->bytes);
+        delete entry;
+    }
+
+    // Creation time the shared objects avoided, from the measured average per kind
+    double SavedMs() const {
+        double saved = 0.0;
+        for (int k = 0; k < INTERN_KIND_COUNT; k++) {
+            const KindStats& ks = stats[k];
+            if (ks.created) saved += (ks.requested - ks.created) * ks.createMs / ks.created;
+        }
+        return saved;
+    }
+};
+
+static InternTable g_intern;
+
+/**
+ * Game-facing wrapper around an interned real object. Each create returns its
+ * own wrapper so the game's refcounting and object identity are unchanged;
+ * the device unwraps on Set and hands wrappers back from Get.
+ */
+template <typename T>
+class InternedObject : public T {
+protected:
+    InternEntry* m_entry;
+    IDirect3DDevice9* m_device;         // Wrapped device, returned from GetDevice
+    const IID* m_iid;
+    volatile LONG m_refs = 1;
+
+    static void* s_vtable;
+
+    T* RealObject() const { return static_cast<T*>(m_entry->real); }
+
+public:
+    InternedObject(InternEntry* entry, IDirect3DDevice9* device, const IID& iid)
+        : m_entry(entry), m_device(device), m_iid(&iid) {}
+
+    virtual ~InternedObject() { g_intern.Release(m_entry); }
+
+    static InternedObject* FromBase(T* object) {
+        if (!object || !s_vtable || *(void**)object != s_vtable) return nullptr;
+        return static_cast<InternedObject*>(object);
+    }
+
+    static T* Unwrap(T* object) {
+        InternedObject* wrapped = FromBase(object);
+        return wrapped ? wrapped->RealObject() : object;
+    }
+
+    // Content hash of the creation input, stable across runs; 0 for objects that were not interned
+    static UINT64 HashOf(T* object) {
+        InternedObject* wrapped = FromBase(object);
+        return wrapped ? wrapped->m_entry->hash : 0;
+    }
+
+    // False for objects that were not interned, whose inputs were never parsed
+    static bool SlimSafe(T* object) {
+        InternedObject* wrapped = FromBase(object);
+        return wrapped && wrapped->m_entry->slimSafe;
+    }
+
+    // IUnknown
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObj) override {
+        if (riid == IID_IUnknown || riid == *m_iid) {
+            AddRef();
+            *ppvObj = this;
+            return S_OK;
+        }
+        return RealObject()->QueryInterface(riid, ppvObj);
+    }
+    ULONG STDMETHODCALLTYPE AddRef() override { return InterlockedIncrement(&m_refs); }
+    ULONG STDMETHODCALLTYPE Release() override {
+        LONG count = InterlockedDecrement(&m_refs);
+        if (count == 0) {
+            ResourceGuard guard;       // Destruction releases real objects
+            delete this;
+        }
+        return count;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetDevice(IDirect3DDevice9** ppDevice) override {
+        m_device->AddRef();
+        *ppDevice = m_device;
+        return D3D_OK;
+    }
+};
+
+template <typename T>
+void* InternedObject<T>::s_vtable = nullptr;
+
+class InternedVertexShader9 : public InternedObject<IDirect3DVertexShader9> {
+public:
+    InternedVertexShader9(InternEntry* entry, IDirect3DDevice9* device)
+        : InternedObject(entry, device, IID_IDirect3DVertexShader9) {
+        if (!s_vtable) s_vtable = *(void**)this;
+    }
+    HRESULT STDMETHODCALLTYPE GetFunction(void* pData, UINT* pSizeOfData) override { return RealObject()->GetFunction(pData, pSizeOfData); }
+};
+
+class InternedPixelShader9 : public InternedObject<IDirect3DPixelShader9> {
+public:
+    InternedPixelShader9(InternEntry* entry, IDirect3DDevice9* device)
+        : InternedObject(entry, device, IID_IDirect3DPixelShader9) {
+        if (!s_vtable) s_vtable = *(void**)this;
+    }
+    HRESULT STDMETHODCALLTYPE GetFunction(void* pData, UINT* pSizeOfData) override { return RealObject()->GetFunction(pData, pSizeOfData); }
+};
+
+class InternedVertexDeclaration9 : public InternedObject<IDirect3DVertexDeclaration9> {
+public:
+    InternedVertexDeclaration9(InternEntry* entry, IDirect3DDevice9* device)
+        : InternedObject(entry, device, IID_IDirect3DVertexDeclaration9) {
+        if (!s_vtable) s_vtable = *(void**)this;
+    }
+    HRESULT STDMETHODCALLTYPE GetDeclaration(D3DVERTEXELEMENT9* pElement, UINT* pNumElements) override { return RealObject()->GetDeclaration(pElement, pNumElements); }
+};
+
+// ---------------------------------------------------------------------------
+// Performance HUD: a text overlay drawn into the back buffer just before the
+// real Present, so the numbers in the status dump can be read mid-session.
+// ---------------------------------------------------------------------------
+
+// 5x7 glyphs for ' ' through '_', one byte per column, bit 0 = top row
+static const BYTE kHudFont[64][5] = {
+    {0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x5F,0x00,0x00}, {0x00,0x07,0x00,0x07,0x00}, {0x14,0x7F,0x14,0x7F,0x14},
+    {0x24,0x2A,0x7F,0x2A,0x12}, {0x23,0x13,0x08,0x64,0x62}, {0x36,0x49,0x55,0x22,0x50}, {0x00,0x05,0x03,0x00,0x00},
+    {0x00,0x1C,0x22,0x41,0x00}, {0x00,0x41,0x22,0x1C,0x00}, {0x14,0x08,0x3E,0x08,0x14}, {0x08,0x08,0x3E,0x08,0x08},
+    {0x00,0x50,0x30,0x00,0x00}, {0x08,0x08,0x08,0x08,0x08}, {0x00,0x60,0x60,0x00,0x00}, {0x20,0x10,0x08,0x04,0x02},
+    {0x3E,0x51,0x49,0x45,0x3E}, {0x00,0x42,0x7F,0x40,0x00}, {0x42,0x61,0x51,0x49,0x46}, {0x21,0x41,0x45,0x4B,0x31},
+    {0x18,0x14,0x12,0x7F,0x10}, {0x27,0x45,0x45,0x45,0x39}, {0x3C,0x4A,0x49,0x49,0x30}, {0x01,0x71,0x09,0x05,0x03},
+    {0x36,0x49,0x49,0x49,0x36}, {0x06,0x49,0x49,0x29,0x1E}, {0x00,0x36,0x36,0x00,0x00}, {0x00,0x56,0x36,0x00,0x00},
+    {0x08,0x14,0x22,0x41,0x00}, {0x14,0x14,0x14,0x14,0x14}, {0x00,0x41,0x22,0x14,0x08}, {0x02,0x01,0x51,0x09,0x06},
+    {0x32,0x49,0x79,0x41,0x3E}, {0x7E,0x11,0x11,0x11,0x7E}, {0x7F,0x49,0x49,0x49,0x36}, {0x3E,0x41,0x41,0x41,0x22},
+    {0x7F,0x41,0x41,0x22,0x1C}, {0x7F,0x49,0x49,0x49,0x41}, {0x7F,0x09,0x09,0x01,0x01}, {0x3E,0x41,0x41,0x51,0x32},
+    {0x7F,0x08,0x08,0x08,0x7F}, {0x00,0x41,0x7F,0x41,0x00}, {0x20,0x40,0x41,0x3F,0x01}, {0x7F,0x08,0x14,0x22,0x41},
+    {0x7F,0x40,0x40,0x40,0x40}, {0x7F,0x02,0x04,0x02,0x7F}, {0x7F,0x04,0x08,0x10,0x7F}, {0x3E,0x41,0x41,0x41,0x3E},
+    {0x7F,0x09,0x09,0x09,0x06}, {0x3E,0x41,0x51,0x21,0x5E}, {0x7F,0x09,0x19,0x29,0x46}, {0x46,0x49,0x49,0x49,0x31},
+    {0x01,0x01,0x7F,0x01,0x01}, {0x3F,0x40,0x40,0x40,0x3F}, {0x1F,0x20,0x40,0x20,0x1F}, {0x7F,0x20,0x18,0x20,0x7F},
+    {0x63,0x14,0x08,0x14,0x63}, {0x03,0x04,0x78,0x04,0x03}, {0x61,0x51,0x49,0x45,0x43}, {0x00,0x7F,0x41,0x41,0x00},
+    {0x02,0x04,0x08,0x10,0x20}, {0x00,0x41,0x41,0x7F,0x00}, {0x04,0x02,0x01,0x02,0x04}, {0x40,0x40,0x40,0x40,0x40}
+};
+
+// What the HUD shows, gathered by the device at Present
+struct HudStats {
+    float frameMs;
+    float medianMs;
+    float gpuMs;                    // 0 when GPU timing is off or unsupported
+    float proxyMs;                  // Proxy-side CPU work in the previous frame
+    bool hasView;
+    bool captured;                  // Camera found this frame
+    bool idle;
+    float viewT[3];
+    int draws[DRAW_CLASS_COUNT];
+    float internHitRate;            // -1 when interning is off
+    float snapRate;                 // -1 when stabilization saw nothing
+    float largestFreeMB;            // -1 when the address space monitor is off
+    float freeMB;
+    bool lowAddressSpace;
+};
+
+/**
+ * Performance HUD - the proxy's own state block around one batched
+ * DrawPrimitiveUP of pretransformed, textured quads from a built-in font
+ * texture. Remix treats XYZRHW draws as screen-space UI. Toggled with a
+ * hotkey; the time the HUD itself takes is measured and shown next frame.
+ */
+class PerfHud {
+private:
+    struct Vertex {
+        float x, y, z, rhw;
+        DWORD color;
+        float u, v;
+    };
+    static const DWORD kFVF = D3DFVF_XYZRHW | D3DFVF_DIFFUSE | D3DFVF_TEX1;
+    static const int kCell = 8;             // Glyph cell in the font texture
+    static const int kTexWidth = 128;       // 16 cells across
+    static const int kTexHeight = 64;       // 4 rows of glyphs + a solid cell
+    static const int kScale = 2;            // Screen pixels per font pixel
+    static const int kSolidGlyph = 64;      // Index of the all-opaque cell
+    static const int kMaxChars = 1024;
+
+    IDirect3DTexture9* m_font = nullptr;
+    IDirect3DStateBlock9* m_state = nullptr;
+    bool m_failed = false;
+    bool m_visible = false;
+    bool m_keyDown = false;
+    HWND m_window = nullptr;            // Device focus window, null = any window of this process
+    std::vector<Vertex> m_vertices;
+    float m_costMs = 0.0f;
+
+    static void FillFont(IDirect3DTexture9* texture) {
+        D3DLOCKED_RECT lr;
+        if (FAILED(texture->LockRect(0, &lr, nullptr, 0))) return;
+        for (int y = 0; y < kTexHeight; y++) {
+            DWORD* row = (DWORD*)((BYTE*)lr.pBits + y * lr.Pitch);
+            for (int x = 0; x < kTexWidth; x++) {
+                int glyph = (y / kCell) * (kTexWidth / kCell) + x / kCell;
+                int gx = x % kCell, gy = y % kCell;
+                bool on = glyph == kSolidGlyph ||
+                          (glyph < 64 && gx < 5 && gy < 7 && (kHudFont[glyph][gx] >> gy) & 1);
+                row[x] = on ? 0xFFFFFFFF : 0x00FFFFFF;
+            }
+        }
+        texture->UnlockRect(0);
+    }
+
+    // Managed where there is a managed pool; on an Ex device, a default-pool texture
+    // filled from a system-memory copy (Ex devices don't lose it on Reset)
+    bool CreateFontTexture(IDirect3DDevice9* real) {
+        if (SUCCEEDED(real->CreateTexture(kTexWidth, kTexHeight, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &m_font, nullptr))) {
+            FillFont(m_font);
+            return true;
+        }
+        m_font = nullptr;
+        IDirect3DTexture9* upload = nullptr;
+        if (FAILED(real->CreateTexture(kTexWidth, kTexHeight, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_SYSTEMMEM, &upload, nullptr))) {
+            return false;
+        }
+        FillFont(upload);
+        if (FAILED(real->CreateTexture(kTexWidth, kTexHeight, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_DEFAULT, &m_font, nullptr)) ||
+            FAILED(real->UpdateTexture(upload, m_font))) {
+            if (m_font) m_font->Release();
+            m_font = nullptr;
+        }
+        upload->Release();
+        return m_font != nullptr;
+    }
+
+    bool CreateResources(IDirect3DDevice9* real) {
+        if (m_failed) return false;
+        if (!m_font && !CreateFontTexture(real)) {
+            m_failed = true;
+            LogMsg("HUD: font texture creation failed, HUD disabled");
+            return false;
+        }
+        if (!m_state && FAILED(real->CreateStateBlock(D3DSBT_ALL, &m_state))) {
+            m_state = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    void Quad(float x, float y, float w, float h, int glyph, DWORD color) {
+        float u0 = (float)((glyph % (kTexWidth / kCell)) * kCell) / kTexWidth;
+        float v0 = (float)((glyph / (kTexWidth / kCell)) * kCell) / kTexHeight;
+        float u1 = u0 + (glyph == kSolidGlyph ? kCell : 5) / (float)kTexWidth;
+        float v1 = v0 + (glyph == kSolidGlyph ? kCell : 7) / (float)kTexHeight;
+        x -= 0.5f;
+        y -= 0.5f;
+        Vertex a = { x, y, 0.0f, 1.0f, color, u0, v0 };
+        Vertex b = { x + w, y, 0.0f, 1.0f, color, u1, v0 };
+        Vertex c = { x, y + h, 0.0f, 1.0f, color, u0, v1 };
+        Vertex d = { x + w, y + h, 0.0f, 1.0f, color, u1, v1 };
+        m_vertices.push_back(a);
+        m_vertices.push_back(b);
+        m_vertices.push_back(c);
+        m_vertices.push_back(c);
+        m_vertices.push_back(b);
+        m_vertices.push_back(d);
+    }
+
+    // Returns the width of the text in pixels
+    int Print(int x, int y, DWORD color, const char* fmt, ...) {
+        char text[160];
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(text, sizeof(text), fmt, args);
+        va_end(args);
+        int cx = x;
+        for (const char* p = text; *p && m_vertices.size() / 6 < kMaxChars; p++) {
+            int ch = (unsigned char)*p;
+            if (ch >= 'a' && ch <= 'z') ch -= 32;
+            if (ch < 32 || ch > 95) ch = '?';
+            if (ch != ' ') Quad((float)cx, (float)y, 5.0f * kScale, 7.0f * kScale, ch - 32, color);
+            cx += 6 * kScale;
+        }
+        return cx - x;
+    }
+
+public:
+    void SetVisible(bool visible) { m_visible = visible; }
+    void SetWindow(HWND window) { m_window = window; }
+
+    // GetAsyncKeyState sees keys pressed in other applications too
+    bool HasFocus() const {
+        HWND foreground = GetForegroundWindow();
+        if (!foreground) return false;
+        if (m_window) return foreground == GetAncestor(m_window, GA_ROOT);
+        DWORD pid = 0;
+        GetWindowThreadProcessId(foreground, &pid);
+        return pid == GetCurrentProcessId();
+    }
+
+    // Edge-triggered toggle, polled once per frame while the game has focus
+    void PollHotkey(int vk) {
+        if (vk <= 0) return;
+        if (!HasFocus()) {
+            m_keyDown = true;           // A key still held on return doesn't toggle
+            return;
+        }
+        bool down = (GetAsyncKeyState(vk) & 0x8000) != 0;
+        if (down && !m_keyDown) {
+            m_visible = !m_visible;
+            LogMsg("HUD: %s", m_visible ? "shown" : "hidden");
+        }
+        m_keyDown = down;
+    }
+
+    void Draw(IDirect3DDevice9* real, const HudStats& s) {
+        if (!m_visible) return;
+        LONGLONG start = QpcNow();
+        if (!CreateResources(real)) return;
+
+        // Text first, then a backdrop sized to it, drawn underneath
+        m_vertices.clear();
+        const int line = 9 * kScale, x0 = 12, y0 = 12;
+        const DWORD white = 0xFFFFFFFF, dim = 0xFFB0B0B0, warn = 0xFFFF8040;
+        int y = y0, width = 0;
+        width = (std::max)(width, Print(x0, y, white, "FRAME %.2f MS  MEDIAN %.2f MS  GPU %.2f MS", s.frameMs, s.medianMs, s.gpuMs));
+        y += line;
+        width = (std::max)(width, Print(x0, y, white, "PROXY CPU %.3f MS  HUD %.3f MS", s.proxyMs, m_costMs));
+        y += line;
+        if (s.hasView) {
+            width = (std::max)(width, Print(x0, y, s.captured ? white : warn, "CAMERA %s  T %.0f %.0f %.0f%s",
+                                            s.captured ? "LIVE" : "HELD", s.viewT[0], s.viewT[1], s.viewT[2], s.idle ? "  IDLE" : ""));
+        } else {
+            width = (std::max)(width, Print(x0, y, warn, "CAMERA NONE%s", s.idle ? "  IDLE" : ""));
+        }
+        y += line;
+        width = (std::max)(width, Print(x0, y, dim, "DRAWS WORLD %d  UI %d  SHADOW %d  UNKNOWN %d",
+                                        s.draws[DRAW_CLASS_WORLD], s.draws[DRAW_CLASS_UI],
+                                        s.draws[DRAW_CLASS_SHADOW], s.draws[DRAW_CLASS_UNKNOWN]));
+        y += line;
+        char intern[16] = "OFF", snap[16] = "-";
+        if (s.internHitRate >= 0.0f) sprintf(intern, "%.0f%%", s.internHitRate * 100.0f);
+        if (s.snapRate >= 0.0f) sprintf(snap, "%.0f%%", s.snapRate * 100.0f);
+        width = (std::max)(width, Print(x0, y, dim, "HITS INTERN %s  WORLD SNAP %s", intern, snap));
+        y += line;
+        if (s.largestFreeMB >= 0.0f) {
+            width = (std::max)(width, Print(x0, y, s.lowAddressSpace ? warn : dim, "ADDRESS SPACE FREE %.0f MB  LARGEST %.0f MB",
+                                            s.freeMB, s.largestFreeMB));
+            y += line;
+        }
+
+        size_t textVertices = m_vertices.size();
+        Quad((float)(x0 - 6), (float)(y0 - 6), (float)(width + 12), (float)(y - y0 + 8), kSolidGlyph, 0xA0000000);
+        std::rotate(m_vertices.begin(), m_vertices.begin() + textVertices, m_vertices.end());
+
+        m_state->Capture();
+        IDirect3DSurface9* backBuffer = nullptr;
+        IDirect3DSurface9* target = nullptr;
+        real->GetBackBuffer(0, 0, D3DBACKBUFFER_TYPE_MONO, &backBuffer);
+        real->GetRenderTarget(0, &target);
+        if (backBuffer && target != backBuffer) real->SetRenderTarget(0, backBuffer);
+        if (backBuffer) {
+            D3DSURFACE_DESC desc;
+            backBuffer->GetDesc(&desc);
+            D3DVIEWPORT9 vp = { 0, 0, desc.Width, desc.Height, 0.0f, 1.0f };
+            real->SetViewport(&vp);
+        }
+
+        real->SetVertexShader(nullptr);
+        real->SetPixelShader(nullptr);
+        real->SetFVF(kFVF);
+        real->SetTexture(0, m_font);
+        real->SetTexture(1, nullptr);
+        real->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_MODULATE);
+        real->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
+        real->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_DIFFUSE);
+        real->SetTextureStageState(0, D3DTSS_ALPHAOP, D3DTOP_MODULATE);
+        real->SetTextureStageState(0, D3DTSS_ALPHAARG1, D3DTA_TEXTURE);
+        real->SetTextureStageState(0, D3DTSS_ALPHAARG2, D3DTA_DIFFUSE);
+        real->SetTextureStageState(0, D3DTSS_TEXCOORDINDEX, 0);
+        real->SetTextureStageState(0, D3DTSS_TEXTURETRANSFORMFLAGS, 0);
+        real->SetTextureStageState(1, D3DTSS_COLOROP, D3DTOP_DISABLE);
+        real->SetTextureStageState(1, D3DTSS_ALPHAOP, D3DTOP_DISABLE);
+        real->SetSamplerState(0, D3DSAMP_MINFILTER, D3DTEXF_POINT);
+        real->SetSamplerState(0, D3DSAMP_MAGFILTER, D3DTEXF_POINT);
+        real->SetSamplerState(0, D3DSAMP_MIPFILTER, D3DTEXF_NONE);
+        real->SetSamplerState(0, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP);
+        real->SetSamplerState(0, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP);
+        real->SetSamplerState(0, D3DSAMP_SRGBTEXTURE, FALSE);
+        real->SetRenderState(D3DRS_ZENABLE, FALSE);
+        real->SetRenderState(D3DRS_ZWRITEENABLE, FALSE);
+        real->SetRenderState(D3DRS_FILLMODE, D3DFILL_SOLID);
+        real->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+        real->SetRenderState(D3DRS_LIGHTING, FALSE);
+        real->SetRenderState(D3DRS_FOGENABLE, FALSE);
+        real->SetRenderState(D3DRS_STENCILENABLE, FALSE);
+        real->SetRenderState(D3DRS_SCISSORTESTENABLE, FALSE);
+        real->SetRenderState(D3DRS_ALPHATESTENABLE, FALSE);
+        real->SetRenderState(D3DRS_ALPHABLENDENABLE, TRUE);
+        real->SetRenderState(D3DRS_SEPARATEALPHABLENDENABLE, FALSE);
+        real->SetRenderState(D3DRS_BLENDOP, D3DBLENDOP_ADD);
+        real->SetRenderState(D3DRS_SRCBLEND, D3DBLEND_SRCALPHA);
+        real->SetRenderState(D3DRS_DESTBLEND, D3DBLEND_INVSRCALPHA);
+        real->SetRenderState(D3DRS_COLORWRITEENABLE, 0xF);
+        real->SetRenderState(D3DRS_SRGBWRITEENABLE, FALSE);
+
+        // The game has already ended its scene by Present
+        if (SUCCEEDED(real->BeginScene())) {
+            real->DrawPrimitiveUP(D3DPT_TRIANGLELIST, (UINT)(m_vertices.size() / 3), m_vertices.data(), sizeof(Vertex));
+            real->EndScene();
+        }
+
+        if (backBuffer && target != backBuffer) real->SetRenderTarget(0, target);
+        m_state->Apply();
+        if (backBuffer) backBuffer->Release();
+        if (target) target->Release();
+
+        m_costMs = (float)QpcToMs(QpcNow() - start);
+    }
+
+    // State blocks must go before Reset; the managed font survives it
+    void OnReset() {
+        if (m_state) m_state->Release();
+        m_state = nullptr;
+    }
+
+    void Release() {
+        OnReset();
+        if (m_font) m_font->Release();
+        m_font = nullptr;
+    }
+};
+
+// Forward declarations
+class WrappedD3D9Device;
+class WrappedD3D9;
+
+/**
+ * Wrapped IDirect3DDevice9 - intercepts SetVertexShaderConstantF
+ */
+class WrappedD3D9Device : public IDirect3DDevice9 {
+private:
+    IDirect3DDevice9* m_real;
+    IDirect3DDevice9Ex* m_realEx = nullptr;     // Same object as m_real on a device upgraded to Ex
+    D3DMATRIX m_lastViewMatrix;
+    D3DMATRIX m_lastProjMatrix;
+    D3DMATRIX m_pendingViewMatrix;  // Captured during frame
+    bool m_hasView = false;
+    bool m_hasProj = false;
+    bool m_pendingViewUpdate = false;  // Flag for once-per-frame update
+    bool m_capturedThisFrame = false;  // Only capture FIRST camera per frame
+    int m_constantLogThrottle = 0;
+    int m_loggedThisFrame = 0;
+    int m_drawClass = DRAW_CLASS_UNKNOWN;  // From the most recent c5-c8 upload
+    LONGLONG m_lastPresentQpc = 0;
+    FrameTimeHistory m_frameHistory;
+    int m_drawsByClass[DRAW_CLASS_COUNT] = {};
+
+    // Menu/pause detection
+    int m_framesWithoutCamera = 0;
+    int m_idleCandidateFrames = 0;
+    bool m_idle = false;
+    float m_capSleepMs = 0.0f;          // Time the last Present spent in the idle cap
+    LONGLONG m_capEndQpc = 0;           // When the last Present left the idle cap
+    int m_idleFramesTotal = 0;          // Since last status
+    float m_idleSleepTotalMs = 0.0f;
+
+    // GPU timing (timestamp queries)
+    GpuTimer m_gpuTimer;
+    bool m_gpuTimerInit = false;
+    bool m_lastDrawWorld = false;       // Inside GPU_REGION_WORLD
+
+    // Device thread tripwire
+    ThreadTripwire m_threads;
+
+    // On-screen HUD and the proxy-side CPU time it reports
+    PerfHud m_hud;
+    unsigned __int64 m_proxyTicks = 0;  // rdtsc ticks of proxy work this frame
+    unsigned __int64 m_lastPresentTsc = 0;
+    double m_tscPerMs = 0.0;            // From the last two Presents
+    float m_proxyMs = 0.0f;
+
+    // Reduced-size raster targets
+    float m_rtScale = 1.0f;             // Scale of the bound render target 0
+    D3DVIEWPORT9 m_gameViewport = {};   // Viewport as the game set it (unscaled)
+    RECT m_gameScissor = {};
+    int m_shrunkTargets = 0;            // Created at reduced size, cumulative
+    double m_shrinkPixelsSaved = 0.0;   // Viewport pixels not rasterized, since last status
+
+    // Bound index buffer wrapper (one reference) and the real buffer last handed to the runtime
+    WrappedIndexBuffer9* m_boundIB = nullptr;
+    IDirect3DIndexBuffer9* m_boundIBReal = nullptr;
+
+    // Interned wrappers the game has bound, handed back from Get*
+    IDirect3DVertexShader9* m_boundVS = nullptr;
+    IDirect3DPixelShader9* m_boundPS = nullptr;
+    IDirect3DVertexDeclaration9* m_boundDecl = nullptr;
+
+    // Draw rules: render target 0's size class, and the rules the bound shaders allow
+    UINT m_backBufferWidth = 0;
+    UINT m_backBufferHeight = 0;
+    int m_targetClass = TARGET_FULL;
+    DWORD m_ruleShaderMask = 0;
+    int m_rulesGeneration = -1;         // -1 = shader mask stale
+
+    // Keep a reference on a bound interned wrapper; other objects are not tracked
+    template <typename T>
+    static void TrackBound(T*& bound, T* object) {
+        T* wrapped = InternedObject<T>::FromBase(object) ? object : nullptr;
+        if (wrapped == bound) return;
+        if (wrapped) wrapped->AddRef();
+        if (bound) bound->Release();
+        bound = wrapped;
+    }
+
+    template <typename T>
+    static bool ReturnBound(T* bound, T** out) {
+        if (!bound || !out) return false;
+        bound->AddRef();
+        *out = bound;
+        return true;
+    }
+
+    // Raster state that decides whether triangle order within a draw matters
+    bool m_alphaBlend = false;
+    bool m_zEnable = true;
+    bool m_stencil = false;
+
+    // Vertex streams and declaration as the game set them; wrapped buffers hold one reference
+    struct StreamBinding {
+        IDirect3DVertexBuffer9* vb;
+        UINT offset;
+        UINT stride;
+        UINT freq;                      // SetStreamSourceFreq setting, 0 = never set
+    };
+    StreamBinding m_streams[16] = {};
+    WrappedVertexBuffer9* m_streamWrappers[16] = {};
+    IDirect3DVertexBuffer9* m_profiledStreams[16] = {};     // Buffers under the usage policy, one reference each
+    IDirect3DIndexBuffer9* m_profiledIB = nullptr;
+    IDirect3DVertexDeclaration9* m_gameDecl = nullptr;
+    bool m_slimBound = false;           // Real device has compacted streams + slim declaration bound
+    bool m_slimDirty = true;            // Game state changed since the slim state was applied
+    bool m_slimShaderOk = true;         // No vertex shader, or one that reads only kept elements
+    LONG m_slimGeneration = 0;
+    WORD m_slimStreams = 0;             // Streams currently replaced by compacted copies
+    UINT m_slimBytesPerVertex = 0;
+
+    void RestoreGameStreams() {
+        for (int s = 0; s < 16; s++) {
+            if (m_slimStreams & (1 << s)) {
+                m_real->SetStreamSource(s, WrappedVertexBuffer9::Unwrap(m_streams[s].vb), m_streams[s].offset, m_streams[s].stride);
+            }
+        }
+        m_real->SetVertexDeclaration(m_gameDecl);
+        m_slimStreams = 0;
+        m_slimBound = false;
+    }
+
+    // Bind compacted streams for the draw if the current declaration and buffers allow it
+    void ApplyVertexSlimming(UINT vertexCount) {
+        if (!g_config.slimVertexStreams) return;
+        if (m_slimBound && !m_slimDirty && m_slimGeneration == g_slimGeneration) {
+            g_slimStats.fetchBytesSaved += (double)vertexCount * m_slimBytesPerVertex;
+            return;
+        }
+
+        const SlimDecl* decl = m_gameDecl ? g_slimDecls.Find(m_gameDecl) : nullptr;
+        IDirect3DVertexBuffer9* copies[16] = {};
+        UINT strides[16] = {};
+        UINT bytesPerVertex = 0;
+        bool usable = decl && decl->slim && m_slimShaderOk;
+        for (int s = 0; usable && s < 16; s++) {
+            if (!(decl->copyMask & (1 << s))) continue;
+            const StreamBinding& b = m_streams[s];
+            if (!m_streamWrappers[s] || b.stride == 0 || b.offset % b.stride != 0 || b.freq > 1) {
+                usable = false;
+                break;
+            }
+            copies[s] = m_streamWrappers[s]->SlimCopyFor(*decl, s, b.stride, &strides[s]);
+            if (!copies[s]) usable = false;
+            bytesPerVertex += b.stride - strides[s];
+        }
+
+        if (!usable) {
+            if (m_slimBound) RestoreGameStreams();
+            m_slimDirty = false;
+            return;
+        }
+
+        if (m_slimBound) RestoreGameStreams();
+        for (int s = 0; s < 16; s++) {
+            if (!copies[s]) continue;
+            m_real->SetStreamSource(s, copies[s], m_streams[s].offset / m_streams[s].stride * strides[s], strides[s]);
+            m_slimStreams |= 1 << s;
+        }
+        m_real->SetVertexDeclaration(decl->slim);
+        m_slimBound = true;
+        m_slimDirty = false;
+        m_slimGeneration = g_slimGeneration;
+        m_slimBytesPerVertex = bytesPerVertex;
+        g_slimStats.fetchBytesSaved += (double)vertexCount * bytesPerVertex;
+    }
+
+    // The runtime unbinds stream 0 after a DrawPrimitiveUP-style draw
+    void ForgetStreamZero() {
+        if (m_streamWrappers[0]) m_streamWrappers[0]->Release();
+        m_streamWrappers[0] = nullptr;
+        if (m_profiledStreams[0]) m_profiledStreams[0]->Release();
+        m_profiledStreams[0] = nullptr;
+        m_streams[0].vb = nullptr;
+        m_streams[0].offset = m_streams[0].stride = 0;
+        m_slimStreams &= ~1;
+        m_slimDirty = true;
+    }
+
+    static UINT VerticesForPrimitives(D3DPRIMITIVETYPE type, UINT count) {
+        switch (type) {
+            case D3DPT_TRIANGLELIST: return count * 3;
+            case D3DPT_TRIANGLESTRIP:
+            case D3DPT_TRIANGLEFAN: return count + 2;
+            case D3DPT_LINELIST: return count * 2;
+            case D3DPT_LINESTRIP: return count + 1;
+            default: return count;
+        }
+    }
+
+    // Texture wrappers bound per sampler (pixel 0-15, vertex 16-19), one reference each
+    WrappedTexture9* m_boundTextures[20] = {};
+    LONG m_shadowWrites = 0;            // WrappedTexture9::ShadowWrites() at the last flush
+
+    // Ex device: upload shadows written while their textures stayed bound. Draws flush when
+    // any shadow got dirty; Present flushes every frame for writes through surfaces
+    void FlushBoundShadows() {
+        m_shadowWrites = WrappedTexture9::ShadowWrites();
+        for (int i = 0; i < 20; i++) {
+            if (m_boundTextures[i] && m_boundTextures[i]->FlushShadow(m_real)) g_exStats.uploads++;
+        }
+    }
+
+    inline void FlushBoundShadowsForDraw() {
+        if (m_realEx && m_shadowWrites != WrappedTexture9::ShadowWrites()) FlushBoundShadows();
+    }
+
+    static int SamplerSlot(DWORD stage) {
+        if (stage < 16) return (int)stage;
+        if (stage >= 257 && stage <= 260) return (int)(stage - 257 + 16);  // D3DVERTEXTEXTURESAMPLER0-3
+        return -1;
+    }
+
+    // Allowlist entry matching this texture, or false when it must stay uncompressed
+    static bool CompressionAllowed(UINT width, UINT height, D3DFORMAT format) {
+        for (int i = 0; i < g_config.compressAllowCount; i++) {
+            const CompressRule& rule = g_config.compressAllow[i];
+            if (rule.format != (int)format) continue;
+            if (rule.width && rule.width != width) continue;
+            if (rule.height && rule.height != height) continue;
+            return true;
+        }
+        return false;
+    }
+
+    // The enclosing D3DPERF pass, when one is named, overrides the c5-c8 guess
+    int DrawClassNow() const {
+        switch (g_perfEvents.CurrentPass()) {
+            case PERF_PASS_NONE: return m_drawClass;
+            case PERF_PASS_SHADOW_DEPTH: return DRAW_CLASS_SHADOW;
+            case PERF_PASS_POST_PROCESS:
+            case PERF_PASS_UI: return DRAW_CLASS_UI;
+            default: return DRAW_CLASS_WORLD;
+        }
+    }
+
+    void ReadBackBufferSize() {
+        IDirect3DSurface9* backBuffer = nullptr;
+        if (FAILED(m_real->GetBackBuffer(0, 0, D3DBACKBUFFER_TYPE_MONO, &backBuffer)) || !backBuffer) return;
+        D3DSURFACE_DESC desc;
+        if (SUCCEEDED(backBuffer->GetDesc(&desc))) {
+            m_backBufferWidth = desc.Width;
+            m_backBufferHeight = desc.Height;
+        }
+        backBuffer->Release();
+        m_targetClass = TARGET_FULL;
+    }
+
+    // First draw rule this draw matches, -1 when none does
+    int MatchRule(UINT primCount) {
+        if (!g_drawRules.Active()) return -1;
+        if (m_rulesGeneration != g_drawRules.Generation()) {
+            m_ruleShaderMask = g_drawRules.ShaderMask(InternedVertexShader9::HashOf(m_boundVS),
+                                                      InternedPixelShader9::HashOf(m_boundPS));
+            m_rulesGeneration = g_drawRules.Generation();
+        }
+        return g_drawRules.Match(m_targetClass, g_perfEvents.CurrentPass(), m_capturedThisFrame, primCount, m_ruleShaderMask);
+    }
+
+    // Counts a matched rule's hit and returns its action
+    int RuleAction(int rule, UINT primCount) {
+        if (rule < 0) return RULE_FORWARD;
+        int action = g_drawRules.Hit(rule);
+        if (action == RULE_TAG) {
+            g_drawRules.LogTag(rule, m_targetClass, g_perfEvents.CurrentPass(), m_capturedThisFrame, primCount,
+                               InternedVertexShader9::HashOf(m_boundVS), InternedPixelShader9::HashOf(m_boundPS));
+        }
+        return action;
+    }
+
+    // Action of the first draw rule this draw matches, RULE_FORWARD when none does
+    int RuleForDraw(UINT primCount) {
+        return RuleAction(MatchRule(primCount), primCount);
+    }
+
+    void NoteDraw(int method, UINT primCount) {
+        int drawClass = DrawClassNow();
+        g_flight.Push(method, drawClass, CAM_NONE, primCount);
+        g_capture.Write(CAP_DRAW, primCount);
+        m_drawsByClass[drawClass]++;
+        g_perfEvents.drawsByPass[g_perfEvents.CurrentPass()]++;
+        bool world = drawClass == DRAW_CLASS_WORLD;
+        if (world) m_gpuTimer.BeginRegion(GPU_REGION_WORLD);
+        else if (m_lastDrawWorld) m_gpuTimer.EndRegion(GPU_REGION_WORLD);
+        m_lastDrawWorld = world;
+        if (m_rtScale < 1.0f) {
+            m_shrinkPixelsSaved += (double)m_gameViewport.Width * m_gameViewport.Height *
+                                   (1.0 - m_rtScale * m_rtScale);
+        }
+    }
+
+    // Scale for a new target, or 1.0 when the shrink policy does not apply. Only sizes and
+    // formats listed in the config qualify: UI and post-process targets share both with the
+    // scene, so a blanket rule would shrink them too
+    float ShrinkScaleFor(UINT width, UINT height, D3DFORMAT format, bool depth) const {
+        if (!g_config.shrinkRenderTargets) return 1.0f;
+        if (depth && !g_config.shrinkDepthStencil) return 1.0f;
+        if ((int)width < g_config.shrinkMinSize || (int)height < g_config.shrinkMinSize) return 1.0f;
+        bool sized = false;
+        for (int i = 0; i < g_config.shrinkSizeCount; i++) {
+            if (g_config.shrinkSizes[i][0] == width && g_config.shrinkSizes[i][1] == height) sized = true;
+        }
+        if (!sized) return 1.0f;
+        if (!depth) {
+            bool listed = false;
+            for (int i = 0; i < g_config.shrinkFormatCount; i++) {
+                if (g_config.shrinkFormats[i] == (int)format) listed = true;
+            }
+            if (!listed) return 1.0f;
+        }
+        return g_config.shrinkScale;
+    }
+
+    static UINT ShrinkDim(UINT dim, float scale) {
+        UINT d = (UINT)(dim * scale + 0.5f);
+        return d ? d : 1;
+    }
+
+    void TagShrunk(IDirect3DResource9* resource, UINT w, UINT h, float scale, D3DFORMAT format) {
+        UINT bpp = BitsPerPixel(format);
+        UINT sw = ShrinkDim(w, scale), sh = ShrinkDim(h, scale);
+        LONG saved = (LONG)(((UINT64)w * h - (UINT64)sw * sh) * bpp / 8);
+        ShrinkTag::Attach(resource, w, h, scale, saved);
+        m_shrunkTargets++;
+    }
+
+    void ApplyScaledViewport() {
+        D3DVIEWPORT9 vp = m_gameViewport;
+        vp.X = (DWORD)(vp.X * m_rtScale);
+        vp.Y = (DWORD)(vp.Y * m_rtScale);
+        vp.Width = ShrinkDim(vp.Width, m_rtScale);
+        vp.Height = ShrinkDim(vp.Height, m_rtScale);
+        m_real->SetViewport(&vp);
+    }
+
+    // Menu or pause screen: a UI-dominated frame with no camera or a frozen one. Loading
+    // screens and cutscenes also lose the camera, so some draws must be positively UI
+    void UpdateIdleState(bool cameraMoved) {
+        if (g_config.idleFrameCap <= 0) return;
+
+        if (cameraMoved) {
+            if (m_idle) LogMsg("IDLE: camera moved at frame %d, frame cap lifted", g_frameCount);
+            m_idle = false;
+            m_idleCandidateFrames = 0;
+            return;
+        }
+
+        int total = 0;
+        for (int c = 0; c < DRAW_CLASS_COUNT; c++) total += m_drawsByClass[c];
+        bool uiDominated = m_drawsByClass[DRAW_CLASS_UI] > 0 &&
+            (float)(m_drawsByClass[DRAW_CLASS_UNKNOWN] + m_drawsByClass[DRAW_CLASS_UI]) >= g_config.idleUIFraction * total;
+        bool noCamera = m_framesWithoutCamera > 0;
+
+        if (uiDominated && (noCamera || m_capturedThisFrame)) {
+            m_idleCandidateFrames++;
+        } else {
+            m_idleCandidateFrames = 0;
+            if (m_idle) LogMsg("IDLE: world draws resumed at frame %d, frame cap lifted", g_frameCount);
+            m_idle = false;
+        }
+
+        if (!m_idle && m_idleCandidateFrames >= g_config.idleDetectFrames) {
+            m_idle = true;
+            g_maintenance.Queue(MAINT_HEAP_TRIM);   // Menus and loads follow heap churn
+            LogMsg("IDLE: menu/pause detected at frame %d (%s), capping to %d FPS", g_frameCount,
+                   noCamera ? "no camera + UI" : "frozen camera + UI", g_config.idleFrameCap);
+        }
+    }
+
+    // Sleep out the rest of the idle frame budget, measured from the previous Present
+    void ApplyIdleCap() {
+        m_capSleepMs = 0.0f;
+        LONGLONG start = QpcNow();
+        if (m_idle && m_capEndQpc) {
+            float targetMs = 1000.0f / g_config.idleFrameCap;
+            float elapsed = (float)QpcToMs(start - m_capEndQpc);
+            if (elapsed < targetMs) {
+                // Time we would sleep anyway is the maintenance window
+                elapsed += g_maintenance.Run(targetMs - elapsed);
+                if (elapsed < targetMs) Sleep((DWORD)(targetMs - elapsed));
+                m_capSleepMs = (float)QpcToMs(QpcNow() - start);
+            }
+            m_idleFramesTotal++;
+            m_idleSleepTotalMs += m_capSleepMs;
+        }
+        m_capEndQpc = start + (LONGLONG)(m_capSleepMs * g_qpcFreq.QuadPart / 1000.0);
+    }
+
+    // World reconstruction: World = MVP(c0-c3) x (View x GameProj)^-1
+    D3DMATRIX m_gameProjMatrix;         // Game's real projection, learned from an identity-World draw
+    D3DMATRIX m_viewProjInv;            // Inverse of this frame's View x GameProj
+    D3DMATRIX m_objectMVP;              // Last c0-c3 upload, row-major
+    bool m_hasGameProj = false;
+    bool m_hasViewProjInv = false;
+    bool m_mvpPending = false;          // c0-c3 changed since the last draw
+    int m_viewProjVersion = 0;          // Bumped whenever m_viewProjInv changes
+    bool m_worldIsIdentity = true;
+    int m_projProbesThisFrame = 0;
+    IDirect3DVertexBuffer9* m_streamVB = nullptr;  // Stream 0, for geometry IDs
+    UINT m_streamOffset = 0;
+    IDirect3DIndexBuffer9* m_indices = nullptr;
+    WorldStabilizer m_worldStabilizer;
+    DrawPredictor m_predictor;
+    EyeRegister m_eyeRegister;
+    D3DMATRIX m_currentWorld;           // World last sent to the runtime
+
+    // Draw batching: each pass's world draws as SoA boxes in a per-frame arena
+    struct DrawStateSnapshot {
+        const void* vs;
+        const void* ps;
+        const void* decl;
+        const void* stream0;
+    };
+    struct BatchStats {
+        int passes;
+        int recorded;
+        int unbounded;                  // World draws whose positions can't be read
+        int overflowed;                 // Draws dropped from recording with the arena full
+        int states;                     // Distinct state snapshots, summed over passes
+        int byVisibility[3];            // DrawVisibility
+        double classifyMs;
+    };
+    FrameArena m_batchArena;
+    DrawBatch m_batch;
+    std::vector<DrawStateSnapshot> m_batchStates;
+    DrawBoundsCache m_boundsCache;
+    bool m_batchFull = false;
+    BatchStats m_batchStats = {};
+
+    // Try to recover the game projection: for world-space geometry MVP = View x Proj
+    void ProbeGameProjection(const D3DMATRIX& view) {
+        D3DMATRIX viewInv, proj;
+        if (!InvertMatrix(&viewInv, view)) return;
+        MultiplyMatrix(&proj, viewInv, m_objectMVP);
+        if (!LooksLikeProjection(proj, g_config.minFOV, g_config.maxFOV)) return;
+        // A translated World leaks into row 4; a perspective projection has none there but _43
+        if (fabsf(proj._41) > 0.01f || fabsf(proj._42) > 0.01f || fabsf(proj._44) > 0.01f) return;
+
+        m_gameProjMatrix = proj;
+        m_hasGameProj = true;
+        LogMsg("GAME PROJ: xScale=%.4f yScale=%.4f A=%.4f B=%.4f FOV=%.1fdeg",
+               proj._11, proj._22, proj._33, proj._43, ExtractFOV(proj) * 57.2958f);
+    }
+
+    void UpdateViewProjInverse() {
+        m_hasViewProjInv = false;
+        if (!m_hasGameProj || !m_capturedThisFrame) return;
+        D3DMATRIX vp;
+        MultiplyMatrix(&vp, m_pendingViewMatrix, m_gameProjMatrix);
+        D3DMATRIX previous = m_viewProjInv;
+        m_hasViewProjInv = InvertMatrix(&m_viewProjInv, vp);
+        if (memcmp(&previous, &m_viewProjInv, sizeof(D3DMATRIX)) != 0) m_viewProjVersion++;
+    }
+
+    void SetWorld(const D3DMATRIX& world, bool identity) {
+        m_currentWorld = world;
+        if (identity && m_worldIsIdentity) return;
+        m_real->SetTransform(D3DTS_WORLD, &world);
+        m_worldIsIdentity = identity;
+    }
+
+    // A draw rule asked for identity World; c0-c3 stays pending so the next draw gets its own
+    void ApplyIdentityWorld() {
+        D3DMATRIX identity;
+        CreateIdentityMatrix(&identity);
+        SetWorld(identity, true);
+        if (g_config.reconstructWorld) m_mvpPending = true;
+    }
+
+    // Called before each draw: send the World that belongs to the current c0-c3
+    // predicted = last frame's entry for this draw, record = this frame's (either may be null)
+    void ApplyObjectWorld(UINT64 geometryId, const DrawPrediction* predicted = nullptr, DrawPrediction* record = nullptr) {
+        if (!g_config.reconstructWorld || !m_mvpPending) return;
+        m_mvpPending = false;
+
+        if (DrawClassNow() != DRAW_CLASS_WORLD || !m_hasViewProjInv) {
+            D3DMATRIX identity;
+            CreateIdentityMatrix(&identity);
+            SetWorld(identity, true);
+            return;
+        }
+
+        // Same c0-c3 under the same camera as last frame: the World is the one built then
+        if (predicted && predicted->viewProjVersion == m_viewProjVersion &&
+            memcmp(&predicted->mvp, &m_objectMVP, sizeof(D3DMATRIX)) == 0) {
+            SetWorld(predicted->world, false);
+            if (record) {
+                record->stabilizerSlot = predicted->stabilizerSlot;
+                record->viewProjVersion = m_viewProjVersion;
+                record->mvp = m_objectMVP;
+                record->world = predicted->world;
+            }
+            m_predictor.worldsReused++;
+            return;
+        }
+
+        D3DMATRIX world;
+        MultiplyMatrix(&world, m_objectMVP, m_viewProjInv);
+        int slot = -1;
+        if (g_config.stabilizeWorld) {
+            slot = m_worldStabilizer.Stabilize(geometryId, &world, predicted ? predicted->stabilizerSlot : -1);
+        }
+        SetWorld(world, false);
+        if (record) {
+            record->stabilizerSlot = slot;
+            record->viewProjVersion = m_viewProjVersion;
+            record->mvp = m_objectMVP;
+            record->world = world;
+        }
+    }
+
+    // Geometry ID, rule action and World for DrawPrimitive/DrawIndexedPrimitive; draws the
+    // predictor recognizes from last frame reuse what was worked out for them then
+    int ResolveDraw(int method, UINT64 a, UINT b, UINT primCount, UINT64* geometryId) {
+        if (!g_config.predictDraws) {
+            int action = RuleForDraw(primCount);
+            *geometryId = GeometryId(a, b, primCount);
+            if (action == RULE_IDENTITY) ApplyIdentityWorld();
+            else if (action != RULE_SKIP) ApplyObjectWorld(*geometryId);
+            return action;
+        }
+
+        unsigned __int64 start = __rdtsc();
+        DrawKey key;
+        memset(&key, 0, sizeof(key));
+        key.vb = m_streamVB;
+        key.ib = m_indices;
+        key.vs = m_boundVS;
+        key.ps = m_boundPS;
+        key.vbOffset = m_streamOffset;
+        key.a = (UINT)a;
+        key.b = b;
+        key.c = primCount;
+        key.method = (BYTE)method;
+        key.target = (BYTE)m_targetClass;
+        key.pass = (BYTE)g_perfEvents.CurrentPass();
+        key.camera = m_capturedThisFrame;
+        const DrawPrediction* predicted = m_predictor.Predict(key);
+        DrawPrediction* record = m_predictor.Record(key);
+
+        *geometryId = predicted ? predicted->geometryId : GeometryId(a, b, primCount);
+        int rule = predicted && predicted->ruleGeneration == g_drawRules.Generation() ? predicted->rule : MatchRule(primCount);
+        int action = RuleAction(rule, primCount);
+        if (action == RULE_IDENTITY) ApplyIdentityWorld();
+        else if (action != RULE_SKIP) ApplyObjectWorld(*geometryId, predicted, record);
+        if (record) {
+            record->geometryId = *geometryId;
+            record->rule = rule;
+            record->ruleGeneration = g_drawRules.Generation();
+        }
+
+        unsigned __int64 ticks = __rdtsc() - start;
+        if (predicted) m_predictor.hitTicks += ticks;
+        else m_predictor.missTicks += ticks;
+        return action;
+    }
+
+    // Record a world draw's box for the pass; needs positions from a shadowed vertex buffer
+    void RecordBatchedDraw(UINT64 geometryId, INT baseVertex, UINT minVertex, UINT numVertices) {
+        if (m_batchFull) {
+            m_batchStats.overflowed++;
+            return;
+        }
+        const SlimDecl* decl = m_gameDecl ? g_slimDecls.Find(m_gameDecl) : nullptr;
+        int stream = decl ? decl->positionStream : -1;
+        WrappedVertexBuffer9* vb = stream >= 0 ? m_streamWrappers[stream] : nullptr;
+        bool fresh = false;
+        DrawBoundsCache::Entry* bounds = m_boundsCache.Find(geometryId, vb, vb ? vb->Version() : 0, &fresh);
+        if (bounds && fresh) {
+            bounds->known = vb && baseVertex + (INT)minVertex >= 0 &&
+                            vb->PositionBounds(m_streams[stream].offset, m_streams[stream].stride, decl->positionOffset,
+                                               baseVertex + minVertex, numVertices, bounds->center, bounds->extent);
+        }
+        if (!bounds || !bounds->known) {
+            m_batchStats.unbounded++;
+            return;
+        }
+        if (!m_batch.Reserve(m_batchArena, m_batch.count + 1)) {
+            m_batchFull = true;
+            m_batchStats.overflowed++;
+            return;
+        }
+
+        DrawStateSnapshot state = { m_boundVS, m_boundPS, m_gameDecl, m_streams[0].vb };
+        if (m_batchStates.empty() || memcmp(&m_batchStates.back(), &state, sizeof(state)) != 0) {
+            m_batchStates.push_back(state);
+        }
+        float center[3], extent[3];
+        TransformBox(&m_currentWorld._11, bounds->center, bounds->extent, center, extent);
+        m_batch.Push(center, extent, geometryId, (UINT)m_batchStates.size() - 1);
+        m_batchStats.recorded++;
+    }
+
+    // Pass boundary: classify the recorded draws against this frame's camera in one batch
+    void FlushDrawBatch() {
+        if (!m_batch.count) return;
+        D3DMATRIX vp;
+        MultiplyMatrix(&vp, m_capturedThisFrame ? m_pendingViewMatrix : m_lastViewMatrix,
+                       m_hasGameProj ? m_gameProjMatrix : m_lastProjMatrix);
+        FrustumPlanes planes;
+        ExtractFrustumPlanes(&vp._11, &planes);
+        LONGLONG start = QpcNow();
+        ClassifyBatch(planes, m_batch);
+        m_batchStats.classifyMs += QpcToMs(QpcNow() - start);
+        for (UINT i = 0; i < m_batch.count; i++) m_batchStats.byVisibility[m_batch.visibility[i]]++;
+        m_batchStats.passes++;
+        m_batchStats.states += (int)m_batchStates.size();
+        m_batch.Clear();
+        m_batchStates.clear();
+    }
+
+    UINT64 GeometryId(UINT64 a, UINT64 b, UINT64 c) const {
+        UINT64 h = HashMix64((UINT64)(UINT_PTR)m_streamVB ^ ((UINT64)m_streamOffset << 32));
+        h = HashMix64(h ^ (UINT64)(UINT_PTR)m_indices);
+        h = HashMix64(h ^ a);
+        h = HashMix64(h ^ (b << 32 | c));
+        return h;
+    }
 
 public:
     WrappedD3D9Device(IDirect3DDevice9* real) : m_real(real) {
         memset(&m_lastViewMatrix, 0, sizeof(D3DMATRIX));
         memset(&m_lastProjMatrix, 0, sizeof(D3DMATRIX));
+        memset(&m_gameProjMatrix, 0, sizeof(D3DMATRIX));
+        memset(&m_viewProjInv, 0, sizeof(D3DMATRIX));
+        memset(&m_objectMVP, 0, sizeof(D3DMATRIX));
+        CreateIdentityMatrix(&m_currentWorld);
+        if (g_config.batchDraws) {
+            if (!m_batchArena.Init(4 << 20)) LogMsg("BATCH: arena allocation failed, nothing will be recorded");
+            BenchmarkDrawBatch();
+        }
+        m_hud.SetVisible(g_config.hud);
+        if (g_config.hud) {
+            D3DDEVICE_CREATION_PARAMETERS params;
+            if (SUCCEEDED(real->GetCreationParameters(&params))) m_hud.SetWindow(params.hFocusWindow);
+        }
+        if (g_config.drawRules[0]) ReadBackBufferSize();
+        // A prediction only saves the World build and the rule lookup; without either it is pure cost.
+        // A configured rule file counts even if it is empty now, since Poll can load rules later
+        if (g_config.predictDraws && !g_config.reconstructWorld && !g_config.drawRules[0]) {
+            LogMsg("PREDICT: nothing to reuse without ReconstructWorld=1 or DrawRules, disabled");
+            g_config.predictDraws = false;
+        }
+        if (g_config.predictDraws && !m_predictor.Init()) LogMsg("PREDICT: allocation failed, every draw is resolved the long way");
+        if (g_config.textureResidency) g_residency.SetDevice(real);
         LogMsg("WrappedD3D9Device created, wrapping device at %p", real);
     }
 
     ~WrappedD3D9Device() {
+        for (int i = 0; i < 20; i++) {
+            if (m_boundTextures[i]) m_boundTextures[i]->Release();
+        }
+        if (m_boundIB) m_boundIB->Release();
+        if (m_boundVS) m_boundVS->Release();
+        if (m_boundPS) m_boundPS->Release();
+        if (m_boundDecl) m_boundDecl->Release();
+        m_gpuTimer.Shutdown();
+        for (int i = 0; i < 16; i++) {
+            if (m_streamWrappers[i]) m_streamWrappers[i]->Release();
+            if (m_profiledStreams[i]) m_profiledStreams[i]->Release();
+        }
+        if (m_profiledIB) m_profiledIB->Release();
+        m_threads.NoteShutdown();
+        if (g_config.bufferPolicy) g_bufferPolicy.Learn();
+        g_residency.SetDevice(nullptr);     // Evicted textures that outlive the device stay evicted
+        g_cache.Flush();
+        m_hud.Release();
+        if (g_resourceTripwire == &m_threads) g_resourceTripwire = nullptr;
         LogMsg("WrappedD3D9Device destroyed");
     }
 
+    // Called by the creating factory; mode depends on whether the multithreaded flag was stripped
+    void InitThreadTripwire(ThreadTripwire::Mode mode) {
+        m_threads.Init(mode);
+        g_resourceTripwire = &m_threads;
+    }
+
+    // Called by the creating factory when the game's plain device is an Ex device underneath
+    void EnableEx(IDirect3DDevice9Ex* realEx) {
+        m_realEx = realEx;
+        if (g_config.exMaxFrameLatency > 0) {
+            HRESULT hr = realEx->SetMaximumFrameLatency(g_config.exMaxFrameLatency);
+            LogMsg("EX: maximum frame latency %d: 0x%08X", g_config.exMaxFrameLatency, hr);
+        }
+        if (g_config.exGPUThreadPriority != 0) {
+            HRESULT hr = realEx->SetGPUThreadPriority(g_config.exGPUThreadPriority);
+            LogMsg("EX: GPU thread priority %d: 0x%08X", g_config.exGPUThreadPriority, hr);
+        }
+        if (g_config.textureResidency) {
+            // Eviction reads the real texture back, which the default pool doesn't allow
+            LogMsg("EX: TextureResidency needs the managed pool, turned off");
+            g_config.textureResidency = false;
+            g_residency.SetDevice(nullptr);
+        }
+    }
+
+    // Default-pool texture plus the system-memory shadow the game writes (managed pool on Ex)
+    HRESULT CreateShadowedTexture(UINT width, UINT height, UINT levels, DWORD usage, D3DFORMAT format,
+                                  IDirect3DTexture9** real, IDirect3DTexture9** shadow) {
+        HRESULT hr = m_real->CreateTexture(width, height, levels, usage, format, D3DPOOL_DEFAULT, real, nullptr);
+        if (FAILED(hr)) return hr;
+        DWORD levelCount = (*real)->GetLevelCount();
+        hr = m_real->CreateTexture(width, height, levelCount, 0, format, D3DPOOL_SYSTEMMEM, shadow, nullptr);
+        if (FAILED(hr)) {
+            (*real)->Release();
+            *real = nullptr;
+            return hr;
+        }
+        g_exStats.textures++;
+        for (DWORD level = 0; level < levelCount; level++) {
+            g_exStats.shadowBytes += (double)MipDim(width, level) * MipDim(height, level) * BitsPerPixel(format) / 8.0;
+        }
+        return D3D_OK;
+    }
+
     // IUnknown
     HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObj) override {
+        if (m_realEx && riid == IID_IDirect3DDevice9Ex) {
+            // The game asked for a plain device; the raw Ex interface would bypass the proxy
+            if (ppvObj) *ppvObj = nullptr;
+            return E_NOINTERFACE;
+        }
         HRESULT hr = m_real->QueryInterface(riid, ppvObj);
         return hr;
     }
@@ -242,42 +6261,53 @@ public:
         const float* pConstantData,
         UINT Vector4fCount) override
     {
+        ThreadGuard guard(m_threads);
+        unsigned __int64 cpuStart = __rdtsc();
+        int decision = CAM_NONE;
+        g_capture.Write(CAP_VS_CONSTANTS, StartRegister, pConstantData, Vector4fCount);
+
         // MIRROR'S EDGE: View matrix is at c5-c8
         // Format: c5=RotRow0, c6=RotRow1, c7=RotRow2, c8=[Tx,Ty,Tz,1]
         if (StartRegister <= 5 && StartRegister + Vector4fCount >= 9) {
+            decision = CAM_NOT_VIEW;
             // c5-c8 is within this update
             int offset = (5 - StartRegister) * 4;
             const float* viewData = pConstantData + offset;
 
-            // Validate it looks like a proper view matrix
-            float row0len = sqrtf(viewData[0]*viewData[0] + viewData[1]*viewData[1] + viewData[2]*viewData[2]);
-            float row1len = sqrtf(viewData[4]*viewData[4] + viewData[5]*viewData[5] + viewData[6]*viewData[6]);
-            float row2len = sqrtf(viewData[8]*viewData[8] + viewData[9]*viewData[9] + viewData[10]*viewData[10]);
-
-            // Check for orthonormal rotation (all row lengths ~1.0) and valid w components
-            bool isValidView = (fabsf(row0len - 1.0f) < 0.15f) &&
-                              (fabsf(row1len - 1.0f) < 0.15f) &&
-                              (fabsf(row2len - 1.0f) < 0.15f) &&
-                              (fabsf(viewData[3]) < 0.01f) &&   // c5.w = 0
-                              (fabsf(viewData[7]) < 0.01f) &&   // c6.w = 0
-                              (fabsf(viewData[11]) < 0.01f) &&  // c7.w = 0
-                              (fabsf(viewData[15] - 1.0f) < 0.01f); // c8.w = 1
-
-            if (isValidView) {
+            // Once the PS eye register is known, the main camera is the one sitting at the eye;
+            // anything else gets the full validation (shared with the offline tools)
+            int atEye = g_config.pixelShaderEye ? m_eyeRegister.Match(viewData) : -1;
+            ViewVerdict verdict = VIEW_WORLD;
+            if (atEye == 1) {
+                m_eyeRegister.fastAccepts++;
+            } else {
+                verdict = ClassifyViewMatrix(viewData, g_config.detect);
+                m_eyeRegister.fullChecks++;
+            }
+
+            if (verdict == VIEW_WORLD && atEye == 0) {
+                // Shadow or reflection camera: never this frame's camera, whatever the order
+                m_eyeRegister.NoteSecondary();
+                m_drawClass = DRAW_CLASS_SHADOW;
+                decision = CAM_SECONDARY;
+            } else if (verdict != VIEW_REJECT) {
                 // Copy the view matrix
                 D3DMATRIX viewMat;
                 memcpy(&viewMat, viewData, sizeof(D3DMATRIX));
 
                 // Check if this is a real 3D camera (not UI - has non-trivial translation)
-                float transMag = sqrtf(viewMat._41*viewMat._41 + viewMat._42*viewMat._42 + viewMat._43*viewMat._43);
+                bool world = verdict == VIEW_WORLD;
+                m_drawClass = world ? DRAW_CLASS_WORLD : DRAW_CLASS_UI;
+                decision = world ? CAM_ALREADY_CAPTURED : CAM_SMALL_TRANSLATION;
 
                 // Only use if translation magnitude suggests 3D world (> 100 units typically)
                 // AND we haven't captured a camera this frame yet (avoid shadow/reflection cameras)
-                if (transMag > 50.0f && !m_capturedThisFrame) {
+                if (world && !m_capturedThisFrame) {
                     // Store pending view - will apply once per frame in Present()
                     memcpy(&m_pendingViewMatrix, &viewMat, sizeof(D3DMATRIX));
                     m_pendingViewUpdate = true;
                     m_capturedThisFrame = true;  // Only capture FIRST camera per frame
+                    decision = CAM_ACCEPTED;
 
                     // Create projection if we don't have one (90 degree FOV, matching ME's typical FOV)
                     if (!m_hasProj) {
@@ -297,10 +6327,28 @@ public:
                         CreateIdentityMatrix(&identity);
                         m_real->SetTransform(D3DTS_WORLD, &identity);
                     }
+
+                    UpdateViewProjInverse();
                 }
             }
         }
 
+        // c0-c3: per-object WorldViewProjection (column-major)
+        if (g_config.reconstructWorld && StartRegister == 0 && Vector4fCount >= 4) {
+            TransposeFromRegisters(&m_objectMVP, pConstantData);
+            m_mvpPending = true;
+
+            if (!m_hasGameProj && m_capturedThisFrame && m_projProbesThisFrame < 32) {
+                m_projProbesThisFrame++;
+                ProbeGameProjection(m_pendingViewMatrix);
+                UpdateViewProjInverse();
+            }
+        }
+
+        if (decision != CAM_NONE) {
+            g_flight.Push(FR_SET_VS_CONSTANTS, m_drawClass, decision, StartRegister);
+        }
+
         // Optional: Log for debugging (throttled)
         if (g_config.logAllConstants && m_constantLogThrottle == 0 && Vector4fCount >= 4) {
             if (m_loggedThisFrame < 10) {
@@ -310,12 +6358,48 @@ public:
             }
         }
 
+        m_proxyTicks += __rdtsc() - cpuStart;
         return m_real->SetVertexShaderConstantF(StartRegister, pConstantData, Vector4fCount);
     }
 
     // Present - per-frame operations
     HRESULT STDMETHODCALLTYPE Present(const RECT* pSourceRect, const RECT* pDestRect,
                                        HWND hDestWindowOverride, const RGNDATA* pDirtyRegion) override {
+        ThreadGuard guard(m_threads);
+        unsigned __int64 cpuStart = __rdtsc();
+        g_flight.Push(FR_PRESENT, m_drawClass, CAM_NONE, 0);
+        if (g_config.batchDraws) {
+            FlushDrawBatch();
+            m_batchArena.Reset();
+            m_batchFull = false;
+        }
+        if (m_lastDrawWorld) m_gpuTimer.EndRegion(GPU_REGION_WORLD);
+        m_lastDrawWorld = false;
+        if (g_texCompressor) {
+            m_gpuTimer.BeginRegion(GPU_REGION_UPLOADS);
+            g_texCompressor->Drain();
+            m_gpuTimer.EndRegion(GPU_REGION_UPLOADS);
+        }
+        if (g_ibOptimizer) g_ibOptimizer->Drain();
+        if (m_realEx) FlushBoundShadows();
+        m_gpuTimer.EndFrame();
+
+        // Frame time is Present-to-Present, including the previous Present call itself
+        // but not time the idle cap spent sleeping
+        LONGLONG now = QpcNow();
+        float frameMs = m_lastPresentQpc ? (float)QpcToMs(now - m_lastPresentQpc) - m_capSleepMs : 0.0f;
+        m_lastPresentQpc = now;
+        float medianMs = m_frameHistory.Median();
+        g_flight.EndFrame(frameMs, medianMs, m_frameHistory.count);
+        if (frameMs > 0.0f) m_frameHistory.Add(frameMs);
+
+        // Real camera motion lifts the idle cap on this very frame
+        bool cameraMoved = m_capturedThisFrame &&
+                           memcmp(&m_pendingViewMatrix, &m_lastViewMatrix, sizeof(D3DMATRIX)) != 0;
+        m_framesWithoutCamera = m_capturedThisFrame ? 0 : m_framesWithoutCamera + 1;
+        UpdateIdleState(cameraMoved);
+        if (g_config.pixelShaderEye) m_eyeRegister.EndFrame(m_capturedThisFrame ? &m_pendingViewMatrix : nullptr);
+
         // Apply pending view matrix ONCE per frame (prevents constant camera cut detection)
         if (m_pendingViewUpdate && m_hasView) {
             memcpy(&m_lastViewMatrix, &m_pendingViewMatrix, sizeof(D3DMATRIX));
@@ -323,9 +6407,54 @@ public:
             m_pendingViewUpdate = false;
         }
 
+        // HUD numbers are this frame's, so gather them before the per-frame reset
+        HudStats hud = {};
+        m_proxyTicks += __rdtsc() - cpuStart;
+        if (m_lastPresentTsc && frameMs > 0.0f) {
+            m_tscPerMs = (double)(cpuStart - m_lastPresentTsc) / (frameMs + m_capSleepMs);
+            m_proxyMs = (float)(m_proxyTicks / m_tscPerMs);
+        }
+        m_lastPresentTsc = cpuStart;
+        m_proxyTicks = 0;
+        hud.frameMs = frameMs;
+        hud.medianMs = medianMs;
+        hud.gpuMs = m_gpuTimer.lastFrameMs;
+        hud.proxyMs = m_proxyMs;
+        hud.hasView = m_hasView;
+        hud.captured = m_capturedThisFrame;
+        hud.idle = m_idle;
+        hud.viewT[0] = m_lastViewMatrix._41;
+        hud.viewT[1] = m_lastViewMatrix._42;
+        hud.viewT[2] = m_lastViewMatrix._43;
+        memcpy(hud.draws, m_drawsByClass, sizeof(hud.draws));
+        const InternTable::KindStats* ks = g_intern.stats;
+        int requested = ks[INTERN_VERTEX_SHADER].requested + ks[INTERN_PIXEL_SHADER].requested + ks[INTERN_DECLARATION].requested;
+        int created = ks[INTERN_VERTEX_SHADER].created + ks[INTERN_PIXEL_SHADER].created + ks[INTERN_DECLARATION].created;
+        hud.internHitRate = g_config.internShaders && requested ? (float)(requested - created) / requested : -1.0f;
+        int stabilized = m_worldStabilizer.snapped + m_worldStabilizer.updates;
+        hud.snapRate = stabilized ? (float)m_worldStabilizer.snapped / stabilized : -1.0f;
+        hud.largestFreeMB = -1.0f;
+        AddressSpaceMonitor::Sample space;
+        if (g_config.hud && g_addressSpace.Latest(&space, &hud.lowAddressSpace)) {
+            hud.largestFreeMB = (float)space.largestFreeMB;
+            hud.freeMB = (float)space.freeMB;
+        }
+
         // Reset for next frame - allow capturing first camera again
         m_capturedThisFrame = false;
+        m_drawClass = DRAW_CLASS_UNKNOWN;
+        m_hasViewProjInv = false;
+        m_projProbesThisFrame = 0;
+        memset(m_drawsByClass, 0, sizeof(m_drawsByClass));
 
+        g_capture.EndFrame(g_frameCount);
+        m_threads.NotePresent();
+        if (g_frameCount == 0) g_speculative.NoteFirstFrame();
+        if (g_config.perfEvents) g_perfEvents.EndFrame();
+        if (g_frameCount % 60 == 0) g_drawRules.Poll();
+        if (g_config.textureResidency && g_frameCount % 60 == 0) g_maintenance.Queue(MAINT_TEXTURE_RESIDENCY);
+        if (g_config.bufferPolicy && g_frameCount % 1800 == 1799) g_bufferPolicy.Learn();
+        if (g_config.predictDraws) m_predictor.EndFrame();
         g_frameCount++;
         m_loggedThisFrame = 0;
 
@@ -342,153 +6471,993 @@ public:
                 LogMsg("  View matrix translation: [%.1f, %.1f, %.1f]",
                        m_lastViewMatrix._41, m_lastViewMatrix._42, m_lastViewMatrix._43);
             }
+            LogMsg("  Frame time: last %.2f ms, median %.2f ms", frameMs, medianMs);
+            m_gpuTimer.LogStatus();
+            if (g_config.reconstructWorld) {
+                LogMsg("  World: gameProj=%d, snapped %.1f/frame, instance updates suppressed %.1f/frame, moved %.1f/frame",
+                       m_hasGameProj, m_worldStabilizer.snapped / 300.0f,
+                       m_worldStabilizer.suppressed / 300.0f, m_worldStabilizer.updates / 300.0f);
+                m_worldStabilizer.snapped = m_worldStabilizer.suppressed = m_worldStabilizer.updates = 0;
+            }
+            if (g_config.shrinkRenderTargets) {
+                LogMsg("  Shrink: %d targets reduced, %.1f MB VRAM saved (live), %.1f Mpix/frame not rasterized",
+                       m_shrunkTargets, g_shrinkLiveBytesSaved / (1024.0 * 1024.0), m_shrinkPixelsSaved / 300.0 / 1.0e6);
+                m_shrinkPixelsSaved = 0.0;
+            }
+            if (g_config.optimizeIndexBuffers) {
+                LogMsg("  Indices: %d buffers narrowed to 16-bit, %.1f KB saved; %d ranges reordered (%d reverted), ACMR %.3f -> %.3f",
+                       g_ibStats.buffersNarrowed, g_ibStats.bytesSaved / 1024.0, g_ibStats.rangesOptimized, g_ibStats.rangesReverted,
+                       g_ibStats.triangles ? (double)g_ibStats.missesBefore / g_ibStats.triangles : 0.0,
+                       g_ibStats.triangles ? (double)g_ibStats.missesAfter / g_ibStats.triangles : 0.0);
+            }
+            if (g_config.slimVertexStreams) {
+                LogMsg("  VertexSlim: %d decls slimmed, %d copies %.1f MB standing in for %.1f MB, %.1f MB/frame vertex fetch saved",
+                       g_slimStats.declsSlimmed, g_slimStats.copies, g_slimStats.copyBytes / (1024.0 * 1024.0),
+                       g_slimStats.originalBytes / (1024.0 * 1024.0), g_slimStats.fetchBytesSaved / 300.0 / (1024.0 * 1024.0));
+                g_slimStats.fetchBytesSaved = 0.0;
+            }
+            if (g_config.internShaders) {
+                const InternTable::KindStats* ks = g_intern.stats;
+                LogMsg("  Intern: VS %d unique / %d requested, PS %d / %d, decls %d / %d; %d live; %.1f ms creation saved",
+                       ks[INTERN_VERTEX_SHADER].created, ks[INTERN_VERTEX_SHADER].requested,
+                       ks[INTERN_PIXEL_SHADER].created, ks[INTERN_PIXEL_SHADER].requested,
+                       ks[INTERN_DECLARATION].created, ks[INTERN_DECLARATION].requested,
+                       ks[INTERN_VERTEX_SHADER].live + ks[INTERN_PIXEL_SHADER].live + ks[INTERN_DECLARATION].live,
+                       g_intern.SavedMs());
+            }
+            if (g_config.compressTextures && g_texCompressor) {
+                TextureCompressor* tc = g_texCompressor;
+                LogMsg("  Compress: %d textures, %d levels encoded, %.1f MB saved, encode %.1f ms total (%.3f ms/level)",
+                       tc->texturesCompressed, tc->levelsCompressed, tc->bytesSaved / (1024.0 * 1024.0),
+                       tc->encodeMsTotal, tc->levelsCompressed ? tc->encodeMsTotal / tc->levelsCompressed : 0.0);
+            }
+            if (g_config.textureResidency) g_residency.LogStatus();
+            if (g_config.bufferPolicy) g_bufferPolicy.LogStatus();
+            if (m_realEx) {
+                LogMsg("  Ex: %d textures and %d buffers emulated with %.1f MB of shadows, %d cube/volume made dynamic, %d shadow uploads",
+                       g_exStats.textures, g_exStats.buffers, g_exStats.shadowBytes / (1024.0 * 1024.0),
+                       g_exStats.lockableTextures, g_exStats.uploads);
+                g_exStats.uploads = 0;
+            }
+            if (g_config.idleFrameCap > 0) {
+                LogMsg("  Idle: %s, %d/300 frames capped, %.1f ms slept",
+                       m_idle ? "YES" : "no", m_idleFramesTotal, m_idleSleepTotalMs);
+                m_idleFramesTotal = 0;
+                m_idleSleepTotalMs = 0.0f;
+            }
+            if (g_config.batchDraws) {
+                const BatchStats& b = m_batchStats;
+                LogMsg("  Batch: %.1f passes/frame, %.1f draws recorded/frame (%.1f unbounded, %.1f over arena), inside %.1f / crossing %.1f / outside %.1f, %.1f states/pass, classify %.3f ms/frame",
+                       b.passes / 300.0, b.recorded / 300.0, b.unbounded / 300.0, b.overflowed / 300.0,
+                       b.byVisibility[DRAW_INSIDE] / 300.0, b.byVisibility[DRAW_INTERSECTING] / 300.0,
+                       b.byVisibility[DRAW_OUTSIDE] / 300.0, b.passes ? (double)b.states / b.passes : 0.0, b.classifyMs / 300.0);
+                memset(&m_batchStats, 0, sizeof(m_batchStats));
+            }
+            if (g_config.pixelShaderEye) m_eyeRegister.LogStatus(300);
+            if (g_config.perfEvents) g_perfEvents.LogStatus(300);
+            if (g_drawRules.Active()) g_drawRules.LogStatus(300);
+            if (g_config.predictDraws) m_predictor.LogStatus(300, m_tscPerMs);
+            m_threads.LogStatus(300);
+            g_maintenance.LogStatus();
+            g_flight.LogStatus();
+            g_addressSpace.LogStatus();
+        }
+
+        if (g_config.hud) {
+            m_hud.PollHotkey(g_config.hudKey);
+            m_hud.Draw(m_real, hud);
+        }
+
+        // Outside idle windows, maintenance only gets the slack under the target frame time
+        if (!m_idle && g_config.maintenanceTargetFps > 0 && frameMs > 0.0f) {
+            float slackMs = 1000.0f / g_config.maintenanceTargetFps - frameMs;
+            g_maintenance.Run((std::min)(slackMs, g_config.maintenanceBudgetMs));
+        }
+        ApplyIdleCap();
+        HRESULT hr;
+        if (m_realEx) {
+            // Occlusion and mode changes are success codes a plain-device game doesn't know
+            hr = m_realEx->PresentEx(pSourceRect, pDestRect, hDestWindowOverride, pDirtyRegion, 0);
+            if (hr == S_PRESENT_OCCLUDED || hr == S_PRESENT_MODE_CHANGED) hr = D3D_OK;
+        } else {
+            hr = m_real->Present(pSourceRect, pDestRect, hDestWindowOverride, pDirtyRegion);
         }
 
-        return m_real->Present(pSourceRect, pDestRect, hDestWindowOverride, pDirtyRegion);
+        if (!m_gpuTimerInit && g_config.gpuTiming) {
+            m_gpuTimerInit = true;
+            m_gpuTimer.Init(m_real, g_config.gpuTimingLatency);
+        }
+        m_gpuTimer.BeginFrame();
+        return hr;
     }
 
     // All other methods pass through
-    HRESULT STDMETHODCALLTYPE TestCooperativeLevel() override { return m_real->TestCooperativeLevel(); }
-    UINT STDMETHODCALLTYPE GetAvailableTextureMem() override { return m_real->GetAvailableTextureMem(); }
-    HRESULT STDMETHODCALLTYPE EvictManagedResources() override { return m_real->EvictManagedResources(); }
-    HRESULT STDMETHODCALLTYPE GetDirect3D(IDirect3D9** ppD3D9) override { return m_real->GetDirect3D(ppD3D9); }
-    HRESULT STDMETHODCALLTYPE GetDeviceCaps(D3DCAPS9* pCaps) override { return m_real->GetDeviceCaps(pCaps); }
-    HRESULT STDMETHODCALLTYPE GetDisplayMode(UINT iSwapChain, D3DDISPLAYMODE* pMode) override { return m_real->GetDisplayMode(iSwapChain, pMode); }
-    HRESULT STDMETHODCALLTYPE GetCreationParameters(D3DDEVICE_CREATION_PARAMETERS* pParameters) override { return m_real->GetCreationParameters(pParameters); }
-    HRESULT STDMETHODCALLTYPE SetCursorProperties(UINT XHotSpot, UINT YHotSpot, IDirect3DSurface9* pCursorBitmap) override { return m_real->SetCursorProperties(XHotSpot, YHotSpot, pCursorBitmap); }
-    void STDMETHODCALLTYPE SetCursorPosition(int X, int Y, DWORD Flags) override { m_real->SetCursorPosition(X, Y, Flags); }
-    BOOL STDMETHODCALLTYPE ShowCursor(BOOL bShow) override { return m_real->ShowCursor(bShow); }
-    HRESULT STDMETHODCALLTYPE CreateAdditionalSwapChain(D3DPRESENT_PARAMETERS* pPresentationParameters, IDirect3DSwapChain9** pSwapChain) override { return m_real->CreateAdditionalSwapChain(pPresentationParameters, pSwapChain); }
-    HRESULT STDMETHODCALLTYPE GetSwapChain(UINT iSwapChain, IDirect3DSwapChain9** pSwapChain) override { return m_real->GetSwapChain(iSwapChain, pSwapChain); }
-    UINT STDMETHODCALLTYPE GetNumberOfSwapChains() override { return m_real->GetNumberOfSwapChains(); }
-    HRESULT STDMETHODCALLTYPE Reset(D3DPRESENT_PARAMETERS* pPresentationParameters) override { return m_real->Reset(pPresentationParameters); }
-    HRESULT STDMETHODCALLTYPE GetBackBuffer(UINT iSwapChain, UINT iBackBuffer, D3DBACKBUFFER_TYPE Type, IDirect3DSurface9** ppBackBuffer) override { return m_real->GetBackBuffer(iSwapChain, iBackBuffer, Type, ppBackBuffer); }
-    HRESULT STDMETHODCALLTYPE GetRasterStatus(UINT iSwapChain, D3DRASTER_STATUS* pRasterStatus) override { return m_real->GetRasterStatus(iSwapChain, pRasterStatus); }
-    HRESULT STDMETHODCALLTYPE SetDialogBoxMode(BOOL bEnableDialogs) override { return m_real->SetDialogBoxMode(bEnableDialogs); }
-    void STDMETHODCALLTYPE SetGammaRamp(UINT iSwapChain, DWORD Flags, const D3DGAMMARAMP* pRamp) override { m_real->SetGammaRamp(iSwapChain, Flags, pRamp); }
-    void STDMETHODCALLTYPE GetGammaRamp(UINT iSwapChain, D3DGAMMARAMP* pRamp) override { m_real->GetGammaRamp(iSwapChain, pRamp); }
-    HRESULT STDMETHODCALLTYPE CreateTexture(UINT Width, UINT Height, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DTexture9** ppTexture, HANDLE* pSharedHandle) override { return m_real->CreateTexture(Width, Height, Levels, Usage, Format, Pool, ppTexture, pSharedHandle); }
-    HRESULT STDMETHODCALLTYPE CreateVolumeTexture(UINT Width, UINT Height, UINT Depth, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DVolumeTexture9** ppVolumeTexture, HANDLE* pSharedHandle) override { return m_real->CreateVolumeTexture(Width, Height, Depth, Levels, Usage, Format, Pool, ppVolumeTexture, pSharedHandle); }
-    HRESULT STDMETHODCALLTYPE CreateCubeTexture(UINT EdgeLength, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DCubeTexture9** ppCubeTexture, HANDLE* pSharedHandle) override { return m_real->CreateCubeTexture(EdgeLength, Levels, Usage, Format, Pool, ppCubeTexture, pSharedHandle); }
-    HRESULT STDMETHODCALLTYPE CreateVertexBuffer(UINT Length, DWORD Usage, DWORD FVF, D3DPOOL Pool, IDirect3DVertexBuffer9** ppVertexBuffer, HANDLE* pSharedHandle) override { return m_real->CreateVertexBuffer(Length, Usage, FVF, Pool, ppVertexBuffer, pSharedHandle); }
-    HRESULT STDMETHODCALLTYPE CreateIndexBuffer(UINT Length, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DIndexBuffer9** ppIndexBuffer, HANDLE* pSharedHandle) override { return m_real->CreateIndexBuffer(Length, Usage, Format, Pool, ppIndexBuffer, pSharedHandle); }
-    HRESULT STDMETHODCALLTYPE CreateRenderTarget(UINT Width, UINT Height, D3DFORMAT Format, D3DMULTISAMPLE_TYPE MultiSample, DWORD MultisampleQuality, BOOL Lockable, IDirect3DSurface9** ppSurface, HANDLE* pSharedHandle) override { return m_real->CreateRenderTarget(Width, Height, Format, MultiSample, MultisampleQuality, Lockable, ppSurface, pSharedHandle); }
-    HRESULT STDMETHODCALLTYPE CreateDepthStencilSurface(UINT Width, UINT Height, D3DFORMAT Format, D3DMULTISAMPLE_TYPE MultiSample, DWORD MultisampleQuality, BOOL Discard, IDirect3DSurface9** ppSurface, HANDLE* pSharedHandle) override { return m_real->CreateDepthStencilSurface(Width, Height, Format, MultiSample, MultisampleQuality, Discard, ppSurface, pSharedHandle); }
-    HRESULT STDMETHODCALLTYPE UpdateSurface(IDirect3DSurface9* pSourceSurface, const RECT* pSourceRect, IDirect3DSurface9* pDestinationSurface, const POINT* pDestPoint) override { return m_real->UpdateSurface(pSourceSurface, pSourceRect, pDestinationSurface, pDestPoint); }
-    HRESULT STDMETHODCALLTYPE UpdateTexture(IDirect3DBaseTexture9* pSourceTexture, IDirect3DBaseTexture9* pDestinationTexture) override { return m_real->UpdateTexture(pSourceTexture, pDestinationTexture); }
-    HRESULT STDMETHODCALLTYPE GetRenderTargetData(IDirect3DSurface9* pRenderTarget, IDirect3DSurface9* pDestSurface) override { return m_real->GetRenderTargetData(pRenderTarget, pDestSurface); }
-    HRESULT STDMETHODCALLTYPE GetFrontBufferData(UINT iSwapChain, IDirect3DSurface9* pDestSurface) override { return m_real->GetFrontBufferData(iSwapChain, pDestSurface); }
-    HRESULT STDMETHODCALLTYPE StretchRect(IDirect3DSurface9* pSourceSurface, const RECT* pSourceRect, IDirect3DSurface9* pDestSurface, const RECT* pDestRect, D3DTEXTUREFILTERTYPE Filter) override { return m_real->StretchRect(pSourceSurface, pSourceRect, pDestSurface, pDestRect, Filter); }
-    HRESULT STDMETHODCALLTYPE ColorFill(IDirect3DSurface9* pSurface, const RECT* pRect, D3DCOLOR color) override { return m_real->ColorFill(pSurface, pRect, color); }
-    HRESULT STDMETHODCALLTYPE CreateOffscreenPlainSurface(UINT Width, UINT Height, D3DFORMAT Format, D3DPOOL Pool, IDirect3DSurface9** ppSurface, HANDLE* pSharedHandle) override { return m_real->CreateOffscreenPlainSurface(Width, Height, Format, Pool, ppSurface, pSharedHandle); }
-    HRESULT STDMETHODCALLTYPE SetRenderTarget(DWORD RenderTargetIndex, IDirect3DSurface9* pRenderTarget) override { return m_real->SetRenderTarget(RenderTargetIndex, pRenderTarget); }
-    HRESULT STDMETHODCALLTYPE GetRenderTarget(DWORD RenderTargetIndex, IDirect3DSurface9** ppRenderTarget) override { return m_real->GetRenderTarget(RenderTargetIndex, ppRenderTarget); }
-    HRESULT STDMETHODCALLTYPE SetDepthStencilSurface(IDirect3DSurface9* pNewZStencil) override { return m_real->SetDepthStencilSurface(pNewZStencil); }
-    HRESULT STDMETHODCALLTYPE GetDepthStencilSurface(IDirect3DSurface9** ppZStencilSurface) override { return m_real->GetDepthStencilSurface(ppZStencilSurface); }
+    HRESULT STDMETHODCALLTYPE TestCooperativeLevel() override { ThreadGuard guard(m_threads); return m_real->TestCooperativeLevel(); }
+    UINT STDMETHODCALLTYPE GetAvailableTextureMem() override { ThreadGuard guard(m_threads); return m_real->GetAvailableTextureMem(); }
+    HRESULT STDMETHODCALLTYPE EvictManagedResources() override { ThreadGuard guard(m_threads); return m_real->EvictManagedResources(); }
+    HRESULT STDMETHODCALLTYPE GetDirect3D(IDirect3D9** ppD3D9) override { ThreadGuard guard(m_threads); return m_real->GetDirect3D(ppD3D9); }
+    HRESULT STDMETHODCALLTYPE GetDeviceCaps(D3DCAPS9* pCaps) override { ThreadGuard guard(m_threads); return m_real->GetDeviceCaps(pCaps); }
+    HRESULT STDMETHODCALLTYPE GetDisplayMode(UINT iSwapChain, D3DDISPLAYMODE* pMode) override { ThreadGuard guard(m_threads); return m_real->GetDisplayMode(iSwapChain, pMode); }
+    HRESULT STDMETHODCALLTYPE GetCreationParameters(D3DDEVICE_CREATION_PARAMETERS* pParameters) override {
+        ThreadGuard guard(m_threads);
+        HRESULT hr = m_real->GetCreationParameters(pParameters);
+        if (SUCCEEDED(hr) && m_threads.GetMode() == ThreadTripwire::MODE_GUARD) {
+            pParameters->BehaviorFlags |= D3DCREATE_MULTITHREADED;  // What the game asked for
+        }
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE SetCursorProperties(UINT XHotSpot, UINT YHotSpot, IDirect3DSurface9* pCursorBitmap) override { ThreadGuard guard(m_threads); return m_real->SetCursorProperties(XHotSpot, YHotSpot, pCursorBitmap); }
+    void STDMETHODCALLTYPE SetCursorPosition(int X, int Y, DWORD Flags) override { ThreadGuard guard(m_threads); m_real->SetCursorPosition(X, Y, Flags); }
+    BOOL STDMETHODCALLTYPE ShowCursor(BOOL bShow) override { ThreadGuard guard(m_threads); return m_real->ShowCursor(bShow); }
+    HRESULT STDMETHODCALLTYPE CreateAdditionalSwapChain(D3DPRESENT_PARAMETERS* pPresentationParameters, IDirect3DSwapChain9** pSwapChain) override { ThreadGuard guard(m_threads); return m_real->CreateAdditionalSwapChain(pPresentationParameters, pSwapChain); }
+    HRESULT STDMETHODCALLTYPE GetSwapChain(UINT iSwapChain, IDirect3DSwapChain9** pSwapChain) override { ThreadGuard guard(m_threads); return m_real->GetSwapChain(iSwapChain, pSwapChain); }
+    UINT STDMETHODCALLTYPE GetNumberOfSwapChains() override { ThreadGuard guard(m_threads); return m_real->GetNumberOfSwapChains(); }
+    HRESULT STDMETHODCALLTYPE Reset(D3DPRESENT_PARAMETERS* pPresentationParameters) override {
+        ThreadGuard guard(m_threads);
+        m_hud.OnReset();
+        if (g_config.bufferPolicy && !m_realEx) {
+            // Buffers moved out of the managed pool must go before the runtime will reset;
+            // unbind first so nothing on the real device still references them
+            for (int s = 0; s < 16; s++) m_real->SetStreamSource(s, nullptr, 0, 0);
+            m_real->SetIndices(nullptr);
+            ProfiledVertexBuffer9::ReleaseMoved();
+            ProfiledIndexBuffer9::ReleaseMoved();
+        }
+        HRESULT hr = m_real->Reset(pPresentationParameters);
+        if (SUCCEEDED(hr) && g_config.drawRules[0]) ReadBackBufferSize();
+        if (SUCCEEDED(hr) && g_config.bufferPolicy && !m_realEx) {
+            ProfiledVertexBuffer9::RecreateMoved();
+            ProfiledIndexBuffer9::RecreateMoved();
+        }
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE GetBackBuffer(UINT iSwapChain, UINT iBackBuffer, D3DBACKBUFFER_TYPE Type, IDirect3DSurface9** ppBackBuffer) override { ThreadGuard guard(m_threads); return m_real->GetBackBuffer(iSwapChain, iBackBuffer, Type, ppBackBuffer); }
+    HRESULT STDMETHODCALLTYPE GetRasterStatus(UINT iSwapChain, D3DRASTER_STATUS* pRasterStatus) override { ThreadGuard guard(m_threads); return m_real->GetRasterStatus(iSwapChain, pRasterStatus); }
+    HRESULT STDMETHODCALLTYPE SetDialogBoxMode(BOOL bEnableDialogs) override { ThreadGuard guard(m_threads); return m_real->SetDialogBoxMode(bEnableDialogs); }
+    void STDMETHODCALLTYPE SetGammaRamp(UINT iSwapChain, DWORD Flags, const D3DGAMMARAMP* pRamp) override { ThreadGuard guard(m_threads); m_real->SetGammaRamp(iSwapChain, Flags, pRamp); }
+    void STDMETHODCALLTYPE GetGammaRamp(UINT iSwapChain, D3DGAMMARAMP* pRamp) override { ThreadGuard guard(m_threads); m_real->GetGammaRamp(iSwapChain, pRamp); }
+    HRESULT STDMETHODCALLTYPE CreateTexture(UINT Width, UINT Height, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DTexture9** ppTexture, HANDLE* pSharedHandle) override {
+        ThreadGuard guard(m_threads);
+        // Static uncompressed textures: store as BC1/BC3, compress on unlock
+        if (g_config.compressTextures && Pool == D3DPOOL_MANAGED && Usage == 0 &&
+            (Format == D3DFMT_A8R8G8B8 || Format == D3DFMT_X8R8G8B8) &&
+            Width % 4 == 0 && Height % 4 == 0 && CompressionAllowed(Width, Height, Format)) {
+            bool dxt5 = Format == D3DFMT_A8R8G8B8;
+            IDirect3DTexture9* real = nullptr;
+            IDirect3DTexture9* shadow = nullptr;
+            HRESULT hr = m_realEx ? CreateShadowedTexture(Width, Height, Levels, 0, dxt5 ? D3DFMT_DXT5 : D3DFMT_DXT1, &real, &shadow)
+                                  : m_real->CreateTexture(Width, Height, Levels, 0, dxt5 ? D3DFMT_DXT5 : D3DFMT_DXT1, Pool, &real, pSharedHandle);
+            if (SUCCEEDED(hr)) {
+                WrappedTexture9* wrapped = new WrappedTexture9(real, this, Width, Height, Format);
+                wrapped->EnableCompression(dxt5);
+                if (shadow) wrapped->EnableShadow(shadow);
+
+                TextureCompressor* compressor = GetTextureCompressor();
+                compressor->texturesCompressed++;
+                for (DWORD level = 0; level < real->GetLevelCount(); level++) {
+                    UINT w = MipDim(Width, level), h = MipDim(Height, level);
+                    UINT blocks = ((w + 3) / 4) * ((h + 3) / 4);
+                    compressor->bytesSaved += (double)w * h * 4 - (double)blocks * (dxt5 ? 16 : 8);
+                }
+                if (g_config.textureResidency) g_residency.Track(wrapped);
+                *ppTexture = wrapped;
+                return D3D_OK;
+            }
+            // DXT not available for this texture, fall through to the game's format
+        }
+
+        if (m_realEx && Pool == D3DPOOL_MANAGED) {
+            IDirect3DTexture9* real = nullptr;
+            IDirect3DTexture9* shadow = nullptr;
+            HRESULT hr = CreateShadowedTexture(Width, Height, Levels, Usage, Format, &real, &shadow);
+            if (FAILED(hr)) return hr;
+            WrappedTexture9* wrapped = new WrappedTexture9(real, this, Width, Height, Format);
+            wrapped->EnableShadow(shadow);
+            *ppTexture = wrapped;
+            return D3D_OK;
+        }
+
+        if (g_config.textureResidency && Pool == D3DPOOL_MANAGED && Usage == 0) {
+            IDirect3DTexture9* real = nullptr;
+            HRESULT hr = m_real->CreateTexture(Width, Height, Levels, Usage, Format, Pool, &real, pSharedHandle);
+            if (FAILED(hr)) return hr;
+            WrappedTexture9* wrapped = new WrappedTexture9(real, this, Width, Height, Format);
+            g_residency.Track(wrapped);
+            *ppTexture = wrapped;
+            return D3D_OK;
+        }
+
+        float scale = (Usage & D3DUSAGE_RENDERTARGET) ? ShrinkScaleFor(Width, Height, Format, false) : 1.0f;
+        if (scale >= 1.0f) {
+            return m_real->CreateTexture(Width, Height, Levels, Usage, Format, Pool, ppTexture, pSharedHandle);
+        }
+
+        IDirect3DTexture9* tex = nullptr;
+        HRESULT hr = m_real->CreateTexture(ShrinkDim(Width, scale), ShrinkDim(Height, scale), Levels, Usage, Format, Pool, &tex, pSharedHandle);
+        if (SUCCEEDED(hr)) {
+            // Render-target textures are bound through their surfaces, so tag every level
+            for (DWORD level = 0; level < tex->GetLevelCount(); level++) {
+                IDirect3DSurface9* surface = nullptr;
+                if (SUCCEEDED(tex->GetSurfaceLevel(level, &surface))) {
+                    UINT w = Width >> level, h = Height >> level;
+                    TagShrunk(surface, w ? w : 1, h ? h : 1, scale, Format);
+                    surface->Release();
+                }
+            }
+            LogMsg("SHRINK: RT texture %ux%u fmt=%d -> %ux%u", Width, Height, Format,
+                   ShrinkDim(Width, scale), ShrinkDim(Height, scale));
+            WrappedTexture9* wrapped = new WrappedTexture9(tex, this, Width, Height, Format);
+            wrapped->EnableShrink();
+            *ppTexture = wrapped;
+        }
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE CreateVolumeTexture(UINT Width, UINT Height, UINT Depth, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DVolumeTexture9** ppVolumeTexture, HANDLE* pSharedHandle) override {
+        ThreadGuard guard(m_threads);
+        if (m_realEx && Pool == D3DPOOL_MANAGED) {
+            // No shadow for these: a dynamic default-pool texture stays lockable on Ex
+            g_exStats.lockableTextures++;
+            return m_real->CreateVolumeTexture(Width, Height, Depth, Levels, Usage | D3DUSAGE_DYNAMIC, Format, D3DPOOL_DEFAULT, ppVolumeTexture, pSharedHandle);
+        }
+        return m_real->CreateVolumeTexture(Width, Height, Depth, Levels, Usage, Format, Pool, ppVolumeTexture, pSharedHandle);
+    }
+    HRESULT STDMETHODCALLTYPE CreateCubeTexture(UINT EdgeLength, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DCubeTexture9** ppCubeTexture, HANDLE* pSharedHandle) override {
+        ThreadGuard guard(m_threads);
+        if (m_realEx && Pool == D3DPOOL_MANAGED) {
+            g_exStats.lockableTextures++;
+            return m_real->CreateCubeTexture(EdgeLength, Levels, Usage | D3DUSAGE_DYNAMIC, Format, D3DPOOL_DEFAULT, ppCubeTexture, pSharedHandle);
+        }
+        return m_real->CreateCubeTexture(EdgeLength, Levels, Usage, Format, Pool, ppCubeTexture, pSharedHandle);
+    }
+    HRESULT STDMETHODCALLTYPE CreateVertexBuffer(UINT Length, DWORD Usage, DWORD FVF, D3DPOOL Pool, IDirect3DVertexBuffer9** ppVertexBuffer, HANDLE* pSharedHandle) override {
+        ThreadGuard guard(m_threads);
+        // FVF buffers are drawn through SetFVF, which slimming does not cover
+        bool slim = g_config.slimVertexStreams && FVF == 0 && !(Usage & D3DUSAGE_DYNAMIC) &&
+                    (Pool == D3DPOOL_MANAGED || Pool == D3DPOOL_DEFAULT) && !pSharedHandle;
+        if (m_realEx && Pool == D3DPOOL_MANAGED && slim) {
+            Pool = D3DPOOL_DEFAULT;     // The slim wrapper's shadow already stands in for the managed copy
+        } else if (m_realEx && Pool == D3DPOOL_MANAGED && ppVertexBuffer) {
+            // Every read hits the shadow, so the real buffer can be write-only
+            BufferSignature* sig = g_config.bufferPolicy ? g_bufferPolicy.Lookup(false, Length, Usage, FVF, Pool) : nullptr;
+            IDirect3DVertexBuffer9* real = nullptr;
+            HRESULT hr = m_real->CreateVertexBuffer(Length, Usage | D3DUSAGE_WRITEONLY, FVF, D3DPOOL_DEFAULT, &real, nullptr);
+            if (FAILED(hr)) return hr;
+            ProfiledVertexBuffer9* wrapped = new ProfiledVertexBuffer9(real, m_real, this, sig, 0, Length, Usage | D3DUSAGE_WRITEONLY,
+                                                                       D3DPOOL_DEFAULT, FVF, Usage, Pool);
+            if (!wrapped->EnableShadow()) {
+                wrapped->Release();
+                return E_OUTOFMEMORY;
+            }
+            g_exStats.buffers++;
+            g_exStats.shadowBytes += Length;
+            *ppVertexBuffer = wrapped;
+            return D3D_OK;
+        }
+        if (!slim && g_config.bufferPolicy && (Pool == D3DPOOL_MANAGED || Pool == D3DPOOL_DEFAULT) && !pSharedHandle && ppVertexBuffer) {
+            BufferSignature* sig = g_bufferPolicy.Lookup(false, Length, Usage, FVF, Pool);
+            DWORD usage = Usage;
+            D3DPOOL pool = Pool;
+            int fixes = BufferPolicy::Correct(sig, &usage, &pool);
+            IDirect3DVertexBuffer9* real = nullptr;
+            HRESULT hr = m_real->CreateVertexBuffer(Length, usage, FVF, pool, &real, nullptr);
+            if (FAILED(hr) && fixes) {
+                g_bufferPolicy.fallbacks++;
+                fixes = 0;
+                usage = Usage;
+                pool = Pool;
+                hr = m_real->CreateVertexBuffer(Length, usage, FVF, pool, &real, nullptr);
+            }
+            if (FAILED(hr)) return hr;
+            ProfiledVertexBuffer9* wrapped = new ProfiledVertexBuffer9(real, m_real, this, sig, fixes, Length, usage, pool, FVF, Usage, Pool);
+            if (fixes && !wrapped->EnableShadow()) {
+                wrapped->Release();
+                return E_OUTOFMEMORY;
+            }
+            *ppVertexBuffer = wrapped;
+            return D3D_OK;
+        }
+        HRESULT hr = m_real->CreateVertexBuffer(Length, Usage, FVF, Pool, ppVertexBuffer, pSharedHandle);
+        if (SUCCEEDED(hr) && slim) {
+            WrappedVertexBuffer9* wrapped = new WrappedVertexBuffer9(*ppVertexBuffer, m_real, this, Length, Usage, Pool);
+            if (wrapped->Valid()) {
+                *ppVertexBuffer = wrapped;
+            } else {
+                (*ppVertexBuffer)->AddRef();  // Wrapper releases the real buffer on destruction
+                wrapped->Release();
+            }
+        }
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE CreateIndexBuffer(UINT Length, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DIndexBuffer9** ppIndexBuffer, HANDLE* pSharedHandle) override {
+        ThreadGuard guard(m_threads);
+        // Static buffers only: dynamic ones are rewritten every frame and system-memory ones never drawn from
+        bool optimize = g_config.optimizeIndexBuffers && !(Usage & D3DUSAGE_DYNAMIC) &&
+                        (Pool == D3DPOOL_MANAGED || Pool == D3DPOOL_DEFAULT) && !pSharedHandle;
+        if (m_realEx && Pool == D3DPOOL_MANAGED && optimize) {
+            Pool = D3DPOOL_DEFAULT;     // The optimizer's shadow already stands in for the managed copy
+        } else if (m_realEx && Pool == D3DPOOL_MANAGED && ppIndexBuffer) {
+            BufferSignature* sig = g_config.bufferPolicy ? g_bufferPolicy.Lookup(true, Length, Usage, Format, Pool) : nullptr;
+            IDirect3DIndexBuffer9* real = nullptr;
+            HRESULT hr = m_real->CreateIndexBuffer(Length, Usage | D3DUSAGE_WRITEONLY, Format, D3DPOOL_DEFAULT, &real, nullptr);
+            if (FAILED(hr)) return hr;
+            ProfiledIndexBuffer9* wrapped = new ProfiledIndexBuffer9(real, m_real, this, sig, 0, Length, Usage | D3DUSAGE_WRITEONLY,
+                                                                     D3DPOOL_DEFAULT, Format, Usage, Pool);
+            if (!wrapped->EnableShadow()) {
+                wrapped->Release();
+                return E_OUTOFMEMORY;
+            }
+            g_exStats.buffers++;
+            g_exStats.shadowBytes += Length;
+            *ppIndexBuffer = wrapped;
+            return D3D_OK;
+        }
+        if (!optimize && g_config.bufferPolicy && (Pool == D3DPOOL_MANAGED || Pool == D3DPOOL_DEFAULT) && !pSharedHandle && ppIndexBuffer) {
+            BufferSignature* sig = g_bufferPolicy.Lookup(true, Length, Usage, Format, Pool);
+            DWORD usage = Usage;
+            D3DPOOL pool = Pool;
+            int fixes = BufferPolicy::Correct(sig, &usage, &pool);
+            IDirect3DIndexBuffer9* real = nullptr;
+            HRESULT hr = m_real->CreateIndexBuffer(Length, usage, Format, pool, &real, nullptr);
+            if (FAILED(hr) && fixes) {
+                g_bufferPolicy.fallbacks++;
+                fixes = 0;
+                usage = Usage;
+                pool = Pool;
+                hr = m_real->CreateIndexBuffer(Length, usage, Format, pool, &real, nullptr);
+            }
+            if (FAILED(hr)) return hr;
+            ProfiledIndexBuffer9* wrapped = new ProfiledIndexBuffer9(real, m_real, this, sig, fixes, Length, usage, pool, Format, Usage, Pool);
+            if (fixes && !wrapped->EnableShadow()) {
+                wrapped->Release();
+                return E_OUTOFMEMORY;
+            }
+            *ppIndexBuffer = wrapped;
+            return D3D_OK;
+        }
+        HRESULT hr = m_real->CreateIndexBuffer(Length, Usage, Format, Pool, ppIndexBuffer, pSharedHandle);
+        if (SUCCEEDED(hr) && optimize) {
+            WrappedIndexBuffer9* wrapped = new WrappedIndexBuffer9(*ppIndexBuffer, m_real, this, Length, Usage, Format, Pool);
+            if (wrapped->Valid()) {
+                *ppIndexBuffer = wrapped;
+            } else {
+                (*ppIndexBuffer)->AddRef();  // Wrapper releases the real buffer on destruction
+                wrapped->Release();
+            }
+        }
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE CreateRenderTarget(UINT Width, UINT Height, D3DFORMAT Format, D3DMULTISAMPLE_TYPE MultiSample, DWORD MultisampleQuality, BOOL Lockable, IDirect3DSurface9** ppSurface, HANDLE* pSharedHandle) override {
+        ThreadGuard guard(m_threads);
+        // Lockable targets are read back by the game, keep them at full size
+        float scale = Lockable ? 1.0f : ShrinkScaleFor(Width, Height, Format, false);
+        if (scale >= 1.0f) {
+            return m_real->CreateRenderTarget(Width, Height, Format, MultiSample, MultisampleQuality, Lockable, ppSurface, pSharedHandle);
+        }
+
+        HRESULT hr = m_real->CreateRenderTarget(ShrinkDim(Width, scale), ShrinkDim(Height, scale), Format, MultiSample, MultisampleQuality, Lockable, ppSurface, pSharedHandle);
+        if (SUCCEEDED(hr)) {
+            TagShrunk(*ppSurface, Width, Height, scale, Format);
+            *ppSurface = ShrunkSurface9::Wrap(*ppSurface, this);
+            LogMsg("SHRINK: RT %ux%u fmt=%d -> %ux%u", Width, Height, Format,
+                   ShrinkDim(Width, scale), ShrinkDim(Height, scale));
+        }
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE CreateDepthStencilSurface(UINT Width, UINT Height, D3DFORMAT Format, D3DMULTISAMPLE_TYPE MultiSample, DWORD MultisampleQuality, BOOL Discard, IDirect3DSurface9** ppSurface, HANDLE* pSharedHandle) override {
+        ThreadGuard guard(m_threads);
+        float scale = ShrinkScaleFor(Width, Height, Format, true);
+        if (scale >= 1.0f) {
+            return m_real->CreateDepthStencilSurface(Width, Height, Format, MultiSample, MultisampleQuality, Discard, ppSurface, pSharedHandle);
+        }
+
+        HRESULT hr = m_real->CreateDepthStencilSurface(ShrinkDim(Width, scale), ShrinkDim(Height, scale), Format, MultiSample, MultisampleQuality, Discard, ppSurface, pSharedHandle);
+        if (SUCCEEDED(hr)) {
+            TagShrunk(*ppSurface, Width, Height, scale, Format);
+            *ppSurface = ShrunkSurface9::Wrap(*ppSurface, this);
+            LogMsg("SHRINK: DS %ux%u fmt=%d -> %ux%u", Width, Height, Format,
+                   ShrinkDim(Width, scale), ShrinkDim(Height, scale));
+        }
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE UpdateSurface(IDirect3DSurface9* pSourceSurface, const RECT* pSourceRect, IDirect3DSurface9* pDestinationSurface, const POINT* pDestPoint) override {
+        ThreadGuard guard(m_threads);
+        if (CompressedSurface9::Is(pSourceSurface) || CompressedSurface9::Is(pDestinationSurface)) return D3DERR_INVALIDCALL;
+        return m_real->UpdateSurface(ShrunkSurface9::Unwrap(pSourceSurface), pSourceRect, ShrunkSurface9::Unwrap(pDestinationSurface), pDestPoint);
+    }
+    HRESULT STDMETHODCALLTYPE UpdateTexture(IDirect3DBaseTexture9* pSourceTexture, IDirect3DBaseTexture9* pDestinationTexture) override {
+        ThreadGuard guard(m_threads);
+        return m_real->UpdateTexture(WrappedTexture9::Unwrap(pSourceTexture), WrappedTexture9::Unwrap(pDestinationTexture));
+    }
+    HRESULT STDMETHODCALLTYPE GetRenderTargetData(IDirect3DSurface9* pRenderTarget, IDirect3DSurface9* pDestSurface) override {
+        ThreadGuard guard(m_threads);
+        if (CompressedSurface9::Is(pRenderTarget) || CompressedSurface9::Is(pDestSurface)) return D3DERR_INVALIDCALL;
+        return m_real->GetRenderTargetData(ShrunkSurface9::Unwrap(pRenderTarget), ShrunkSurface9::Unwrap(pDestSurface));
+    }
+    HRESULT STDMETHODCALLTYPE GetFrontBufferData(UINT iSwapChain, IDirect3DSurface9* pDestSurface) override {
+        ThreadGuard guard(m_threads);
+        if (CompressedSurface9::Is(pDestSurface)) return D3DERR_INVALIDCALL;
+        return m_real->GetFrontBufferData(iSwapChain, ShrunkSurface9::Unwrap(pDestSurface));
+    }
+    HRESULT STDMETHODCALLTYPE StretchRect(IDirect3DSurface9* pSourceSurface, const RECT* pSourceRect, IDirect3DSurface9* pDestSurface, const RECT* pDestRect, D3DTEXTUREFILTERTYPE Filter) override {
+        ThreadGuard guard(m_threads);
+        if (CompressedSurface9::Is(pSourceSurface) || CompressedSurface9::Is(pDestSurface)) return D3DERR_INVALIDCALL;
+        pSourceSurface = ShrunkSurface9::Unwrap(pSourceSurface);
+        pDestSurface = ShrunkSurface9::Unwrap(pDestSurface);
+        if (!g_config.shrinkRenderTargets) {
+            return m_real->StretchRect(pSourceSurface, pSourceRect, pDestSurface, pDestRect, Filter);
+        }
+
+        // Rects are in the game's (full-size) coordinates
+        RECT src, dst;
+        UINT w, h;
+        float scale;
+        if (pSourceRect && ShrinkTag::Lookup(pSourceSurface, &w, &h, &scale)) {
+            src = *pSourceRect;
+            ScaleRect(&src, scale);
+            pSourceRect = &src;
+        }
+        if (pDestRect && ShrinkTag::Lookup(pDestSurface, &w, &h, &scale)) {
+            dst = *pDestRect;
+            ScaleRect(&dst, scale);
+            pDestRect = &dst;
+        }
+        return m_real->StretchRect(pSourceSurface, pSourceRect, pDestSurface, pDestRect, Filter);
+    }
+    HRESULT STDMETHODCALLTYPE ColorFill(IDirect3DSurface9* pSurface, const RECT* pRect, D3DCOLOR color) override {
+        ThreadGuard guard(m_threads);
+        if (CompressedSurface9::Is(pSurface)) return D3DERR_INVALIDCALL;
+        pSurface = ShrunkSurface9::Unwrap(pSurface);
+        UINT w, h;
+        float scale;
+        if (!pRect || !g_config.shrinkRenderTargets || !ShrinkTag::Lookup(pSurface, &w, &h, &scale)) {
+            return m_real->ColorFill(pSurface, pRect, color);
+        }
+        RECT scaled = *pRect;       // In the game's (full-size) coordinates
+        ScaleRect(&scaled, scale);
+        return m_real->ColorFill(pSurface, &scaled, color);
+    }
+    HRESULT STDMETHODCALLTYPE CreateOffscreenPlainSurface(UINT Width, UINT Height, D3DFORMAT Format, D3DPOOL Pool, IDirect3DSurface9** ppSurface, HANDLE* pSharedHandle) override { ThreadGuard guard(m_threads); return m_real->CreateOffscreenPlainSurface(Width, Height, Format, Pool, ppSurface, pSharedHandle); }
+    HRESULT STDMETHODCALLTYPE SetRenderTarget(DWORD RenderTargetIndex, IDirect3DSurface9* pRenderTarget) override {
+        ThreadGuard guard(m_threads);
+        if (CompressedSurface9::Is(pRenderTarget)) return D3DERR_INVALIDCALL;
+        pRenderTarget = ShrunkSurface9::Unwrap(pRenderTarget);
+        g_flight.Push(FR_SET_RENDER_TARGET, m_drawClass, CAM_NONE, RenderTargetIndex);
+        if (RenderTargetIndex == 0) FlushDrawBatch();
+        HRESULT hr = m_real->SetRenderTarget(RenderTargetIndex, pRenderTarget);
+        if ((!g_config.shrinkRenderTargets && !g_config.drawRules[0]) || RenderTargetIndex != 0 || FAILED(hr)) return hr;
+
+        // Setting RT0 resets the viewport and scissor to the whole target; mirror that in game units
+        UINT w, h;
+        float scale;
+        if (ShrinkTag::Lookup(pRenderTarget, &w, &h, &scale)) {
+            m_rtScale = scale;
+        } else {
+            D3DSURFACE_DESC desc;
+            pRenderTarget->GetDesc(&desc);
+            w = desc.Width;
+            h = desc.Height;
+            m_rtScale = 1.0f;
+        }
+        m_targetClass = ClassifyTarget(w, h, m_backBufferWidth, m_backBufferHeight);
+        if (!g_config.shrinkRenderTargets) return hr;
+        m_gameViewport.X = m_gameViewport.Y = 0;
+        m_gameViewport.Width = w;
+        m_gameViewport.Height = h;
+        m_gameViewport.MinZ = 0.0f;
+        m_gameViewport.MaxZ = 1.0f;
+        SetRect(&m_gameScissor, 0, 0, (int)w, (int)h);
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE GetRenderTarget(DWORD RenderTargetIndex, IDirect3DSurface9** ppRenderTarget) override {
+        ThreadGuard guard(m_threads);
+        HRESULT hr = m_real->GetRenderTarget(RenderTargetIndex, ppRenderTarget);
+        if (SUCCEEDED(hr) && g_config.shrinkRenderTargets) *ppRenderTarget = ShrunkSurface9::Wrap(*ppRenderTarget, this);
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE SetDepthStencilSurface(IDirect3DSurface9* pNewZStencil) override {
+        ThreadGuard guard(m_threads);
+        if (CompressedSurface9::Is(pNewZStencil)) return D3DERR_INVALIDCALL;
+        return m_real->SetDepthStencilSurface(ShrunkSurface9::Unwrap(pNewZStencil));
+    }
+    HRESULT STDMETHODCALLTYPE GetDepthStencilSurface(IDirect3DSurface9** ppZStencilSurface) override {
+        ThreadGuard guard(m_threads);
+        HRESULT hr = m_real->GetDepthStencilSurface(ppZStencilSurface);
+        if (SUCCEEDED(hr) && g_config.shrinkRenderTargets) *ppZStencilSurface = ShrunkSurface9::Wrap(*ppZStencilSurface, this);
+        return hr;
+    }
     HRESULT STDMETHODCALLTYPE BeginScene() override {
+        ThreadGuard guard(m_threads);
         // Set last known camera - Remix needs this during draw calls
         // Using m_lastViewMatrix (stable, from previous frame's Present) not pending
         if (m_hasView && m_hasProj) {
             D3DMATRIX identity;
             CreateIdentityMatrix(&identity);
             m_real->SetTransform(D3DTS_WORLD, &identity);
+            m_worldIsIdentity = true;
+            m_currentWorld = identity;
             m_real->SetTransform(D3DTS_VIEW, &m_lastViewMatrix);
             m_real->SetTransform(D3DTS_PROJECTION, &m_lastProjMatrix);
         }
+        g_flight.Push(FR_BEGIN_SCENE, m_drawClass, CAM_NONE, 0);
         return m_real->BeginScene();
     }
-    HRESULT STDMETHODCALLTYPE EndScene() override { return m_real->EndScene(); }
-    HRESULT STDMETHODCALLTYPE Clear(DWORD Count, const D3DRECT* pRects, DWORD Flags, D3DCOLOR Color, float Z, DWORD Stencil) override { return m_real->Clear(Count, pRects, Flags, Color, Z, Stencil); }
-    HRESULT STDMETHODCALLTYPE SetTransform(D3DTRANSFORMSTATETYPE State, const D3DMATRIX* pMatrix) override { return m_real->SetTransform(State, pMatrix); }
-    HRESULT STDMETHODCALLTYPE GetTransform(D3DTRANSFORMSTATETYPE State, D3DMATRIX* pMatrix) override { return m_real->GetTransform(State, pMatrix); }
-    HRESULT STDMETHODCALLTYPE MultiplyTransform(D3DTRANSFORMSTATETYPE State, const D3DMATRIX* pMatrix) override { return m_real->MultiplyTransform(State, pMatrix); }
-    HRESULT STDMETHODCALLTYPE SetViewport(const D3DVIEWPORT9* pViewport) override { return m_real->SetViewport(pViewport); }
-    HRESULT STDMETHODCALLTYPE GetViewport(D3DVIEWPORT9* pViewport) override { return m_real->GetViewport(pViewport); }
-    HRESULT STDMETHODCALLTYPE SetMaterial(const D3DMATERIAL9* pMaterial) override { return m_real->SetMaterial(pMaterial); }
-    HRESULT STDMETHODCALLTYPE GetMaterial(D3DMATERIAL9* pMaterial) override { return m_real->GetMaterial(pMaterial); }
-    HRESULT STDMETHODCALLTYPE SetLight(DWORD Index, const D3DLIGHT9* pLight) override { return m_real->SetLight(Index, pLight); }
-    HRESULT STDMETHODCALLTYPE GetLight(DWORD Index, D3DLIGHT9* pLight) override { return m_real->GetLight(Index, pLight); }
-    HRESULT STDMETHODCALLTYPE LightEnable(DWORD Index, BOOL Enable) override { return m_real->LightEnable(Index, Enable); }
-    HRESULT STDMETHODCALLTYPE GetLightEnable(DWORD Index, BOOL* pEnable) override { return m_real->GetLightEnable(Index, pEnable); }
-    HRESULT STDMETHODCALLTYPE SetClipPlane(DWORD Index, const float* pPlane) override { return m_real->SetClipPlane(Index, pPlane); }
-    HRESULT STDMETHODCALLTYPE GetClipPlane(DWORD Index, float* pPlane) override { return m_real->GetClipPlane(Index, pPlane); }
-    HRESULT STDMETHODCALLTYPE SetRenderState(D3DRENDERSTATETYPE State, DWORD Value) override { return m_real->SetRenderState(State, Value); }
-    HRESULT STDMETHODCALLTYPE GetRenderState(D3DRENDERSTATETYPE State, DWORD* pValue) override { return m_real->GetRenderState(State, pValue); }
-    HRESULT STDMETHODCALLTYPE CreateStateBlock(D3DSTATEBLOCKTYPE Type, IDirect3DStateBlock9** ppSB) override { return m_real->CreateStateBlock(Type, ppSB); }
-    HRESULT STDMETHODCALLTYPE BeginStateBlock() override { return m_real->BeginStateBlock(); }
-    HRESULT STDMETHODCALLTYPE EndStateBlock(IDirect3DStateBlock9** ppSB) override { return m_real->EndStateBlock(ppSB); }
-    HRESULT STDMETHODCALLTYPE SetClipStatus(const D3DCLIPSTATUS9* pClipStatus) override { return m_real->SetClipStatus(pClipStatus); }
-    HRESULT STDMETHODCALLTYPE GetClipStatus(D3DCLIPSTATUS9* pClipStatus) override { return m_real->GetClipStatus(pClipStatus); }
-    HRESULT STDMETHODCALLTYPE GetTexture(DWORD Stage, IDirect3DBaseTexture9** ppTexture) override { return m_real->GetTexture(Stage, ppTexture); }
-    HRESULT STDMETHODCALLTYPE SetTexture(DWORD Stage, IDirect3DBaseTexture9* pTexture) override { return m_real->SetTexture(Stage, pTexture); }
-    HRESULT STDMETHODCALLTYPE GetTextureStageState(DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD* pValue) override { return m_real->GetTextureStageState(Stage, Type, pValue); }
-    HRESULT STDMETHODCALLTYPE SetTextureStageState(DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD Value) override { return m_real->SetTextureStageState(Stage, Type, Value); }
-    HRESULT STDMETHODCALLTYPE GetSamplerState(DWORD Sampler, D3DSAMPLERSTATETYPE Type, DWORD* pValue) override { return m_real->GetSamplerState(Sampler, Type, pValue); }
-    HRESULT STDMETHODCALLTYPE SetSamplerState(DWORD Sampler, D3DSAMPLERSTATETYPE Type, DWORD Value) override { return m_real->SetSamplerState(Sampler, Type, Value); }
-    HRESULT STDMETHODCALLTYPE ValidateDevice(DWORD* pNumPasses) override { return m_real->ValidateDevice(pNumPasses); }
-    HRESULT STDMETHODCALLTYPE SetPaletteEntries(UINT PaletteNumber, const PALETTEENTRY* pEntries) override { return m_real->SetPaletteEntries(PaletteNumber, pEntries); }
-    HRESULT STDMETHODCALLTYPE GetPaletteEntries(UINT PaletteNumber, PALETTEENTRY* pEntries) override { return m_real->GetPaletteEntries(PaletteNumber, pEntries); }
-    HRESULT STDMETHODCALLTYPE SetCurrentTexturePalette(UINT PaletteNumber) override { return m_real->SetCurrentTexturePalette(PaletteNumber); }
-    HRESULT STDMETHODCALLTYPE GetCurrentTexturePalette(UINT* PaletteNumber) override { return m_real->GetCurrentTexturePalette(PaletteNumber); }
-    HRESULT STDMETHODCALLTYPE SetScissorRect(const RECT* pRect) override { return m_real->SetScissorRect(pRect); }
-    HRESULT STDMETHODCALLTYPE GetScissorRect(RECT* pRect) override { return m_real->GetScissorRect(pRect); }
-    HRESULT STDMETHODCALLTYPE SetSoftwareVertexProcessing(BOOL bSoftware) override { return m_real->SetSoftwareVertexProcessing(bSoftware); }
-    BOOL STDMETHODCALLTYPE GetSoftwareVertexProcessing() override { return m_real->GetSoftwareVertexProcessing(); }
-    HRESULT STDMETHODCALLTYPE SetNPatchMode(float nSegments) override { return m_real->SetNPatchMode(nSegments); }
-    float STDMETHODCALLTYPE GetNPatchMode() override { return m_real->GetNPatchMode(); }
+    HRESULT STDMETHODCALLTYPE EndScene() override {
+        ThreadGuard guard(m_threads);
+        g_flight.Push(FR_END_SCENE, m_drawClass, CAM_NONE, 0);
+        FlushDrawBatch();
+        return m_real->EndScene();
+    }
+    HRESULT STDMETHODCALLTYPE Clear(DWORD Count, const D3DRECT* pRects, DWORD Flags, D3DCOLOR Color, float Z, DWORD Stencil) override {
+        ThreadGuard guard(m_threads);
+        g_flight.Push(FR_CLEAR, m_drawClass, CAM_NONE, Flags);
+        if (m_rtScale < 1.0f && pRects && Count > 0) {
+            // Clear rects are in render-target pixels
+            D3DRECT local[16];
+            std::vector<D3DRECT> heap;
+            D3DRECT* scaled = local;
+            if (Count > 16) {
+                heap.resize(Count);
+                scaled = heap.data();
+            }
+            for (DWORD i = 0; i < Count; i++) {
+                scaled[i].x1 = (LONG)(pRects[i].x1 * m_rtScale);
+                scaled[i].y1 = (LONG)(pRects[i].y1 * m_rtScale);
+                scaled[i].x2 = (LONG)(pRects[i].x2 * m_rtScale + 0.5f);
+                scaled[i].y2 = (LONG)(pRects[i].y2 * m_rtScale + 0.5f);
+            }
+            return m_real->Clear(Count, scaled, Flags, Color, Z, Stencil);
+        }
+        return m_real->Clear(Count, pRects, Flags, Color, Z, Stencil);
+    }
+    HRESULT STDMETHODCALLTYPE SetTransform(D3DTRANSFORMSTATETYPE State, const D3DMATRIX* pMatrix) override { ThreadGuard guard(m_threads); return m_real->SetTransform(State, pMatrix); }
+    HRESULT STDMETHODCALLTYPE GetTransform(D3DTRANSFORMSTATETYPE State, D3DMATRIX* pMatrix) override { ThreadGuard guard(m_threads); return m_real->GetTransform(State, pMatrix); }
+    HRESULT STDMETHODCALLTYPE MultiplyTransform(D3DTRANSFORMSTATETYPE State, const D3DMATRIX* pMatrix) override { ThreadGuard guard(m_threads); return m_real->MultiplyTransform(State, pMatrix); }
+    HRESULT STDMETHODCALLTYPE SetViewport(const D3DVIEWPORT9* pViewport) override {
+        ThreadGuard guard(m_threads);
+        if (!g_config.shrinkRenderTargets || !pViewport) return m_real->SetViewport(pViewport);
+        m_gameViewport = *pViewport;
+        if (m_rtScale >= 1.0f) return m_real->SetViewport(pViewport);
+        ApplyScaledViewport();
+        return D3D_OK;
+    }
+    HRESULT STDMETHODCALLTYPE GetViewport(D3DVIEWPORT9* pViewport) override {
+        ThreadGuard guard(m_threads);
+        if (!g_config.shrinkRenderTargets || m_rtScale >= 1.0f || !pViewport) return m_real->GetViewport(pViewport);
+        *pViewport = m_gameViewport;
+        return D3D_OK;
+    }
+    HRESULT STDMETHODCALLTYPE SetMaterial(const D3DMATERIAL9* pMaterial) override { ThreadGuard guard(m_threads); return m_real->SetMaterial(pMaterial); }
+    HRESULT STDMETHODCALLTYPE GetMaterial(D3DMATERIAL9* pMaterial) override { ThreadGuard guard(m_threads); return m_real->GetMaterial(pMaterial); }
+    HRESULT STDMETHODCALLTYPE SetLight(DWORD Index, const D3DLIGHT9* pLight) override { ThreadGuard guard(m_threads); return m_real->SetLight(Index, pLight); }
+    HRESULT STDMETHODCALLTYPE GetLight(DWORD Index, D3DLIGHT9* pLight) override { ThreadGuard guard(m_threads); return m_real->GetLight(Index, pLight); }
+    HRESULT STDMETHODCALLTYPE LightEnable(DWORD Index, BOOL Enable) override { ThreadGuard guard(m_threads); return m_real->LightEnable(Index, Enable); }
+    HRESULT STDMETHODCALLTYPE GetLightEnable(DWORD Index, BOOL* pEnable) override { ThreadGuard guard(m_threads); return m_real->GetLightEnable(Index, pEnable); }
+    HRESULT STDMETHODCALLTYPE SetClipPlane(DWORD Index, const float* pPlane) override { ThreadGuard guard(m_threads); return m_real->SetClipPlane(Index, pPlane); }
+    HRESULT STDMETHODCALLTYPE GetClipPlane(DWORD Index, float* pPlane) override { ThreadGuard guard(m_threads); return m_real->GetClipPlane(Index, pPlane); }
+    HRESULT STDMETHODCALLTYPE SetRenderState(D3DRENDERSTATETYPE State, DWORD Value) override {
+        ThreadGuard guard(m_threads);
+        if (State == D3DRS_ALPHABLENDENABLE) m_alphaBlend = Value != 0;
+        else if (State == D3DRS_ZENABLE) m_zEnable = Value != 0;
+        else if (State == D3DRS_STENCILENABLE) m_stencil = Value != 0;
+        return m_real->SetRenderState(State, Value);
+    }
+    HRESULT STDMETHODCALLTYPE GetRenderState(D3DRENDERSTATETYPE State, DWORD* pValue) override { ThreadGuard guard(m_threads); return m_real->GetRenderState(State, pValue); }
+    HRESULT STDMETHODCALLTYPE CreateStateBlock(D3DSTATEBLOCKTYPE Type, IDirect3DStateBlock9** ppSB) override { ThreadGuard guard(m_threads); return m_real->CreateStateBlock(Type, ppSB); }
+    HRESULT STDMETHODCALLTYPE BeginStateBlock() override { ThreadGuard guard(m_threads); return m_real->BeginStateBlock(); }
+    HRESULT STDMETHODCALLTYPE EndStateBlock(IDirect3DStateBlock9** ppSB) override { ThreadGuard guard(m_threads); return m_real->EndStateBlock(ppSB); }
+    HRESULT STDMETHODCALLTYPE SetClipStatus(const D3DCLIPSTATUS9* pClipStatus) override { ThreadGuard guard(m_threads); return m_real->SetClipStatus(pClipStatus); }
+    HRESULT STDMETHODCALLTYPE GetClipStatus(D3DCLIPSTATUS9* pClipStatus) override { ThreadGuard guard(m_threads); return m_real->GetClipStatus(pClipStatus); }
+    HRESULT STDMETHODCALLTYPE GetTexture(DWORD Stage, IDirect3DBaseTexture9** ppTexture) override {
+        ThreadGuard guard(m_threads);
+        int slot = SamplerSlot(Stage);
+        if (slot >= 0 && m_boundTextures[slot] && ppTexture) {
+            m_boundTextures[slot]->AddRef();
+            *ppTexture = m_boundTextures[slot];
+            return D3D_OK;
+        }
+        return m_real->GetTexture(Stage, ppTexture);
+    }
+    HRESULT STDMETHODCALLTYPE SetTexture(DWORD Stage, IDirect3DBaseTexture9* pTexture) override {
+        ThreadGuard guard(m_threads);
+        WrappedTexture9* wrapped = WrappedTexture9::FromBase(pTexture);
+        if (wrapped && wrapped->pendingJobs > 0) {
+            // Bound before the worker finished: the draw needs the real contents now
+            GetTextureCompressor()->Finish(wrapped);
+        }
+        if (wrapped && wrapped->Tracked()) g_residency.Bind(wrapped);
+        if (wrapped && m_realEx && wrapped->FlushShadow(m_real)) g_exStats.uploads++;
+        int slot = SamplerSlot(Stage);
+        if (slot >= 0 && m_boundTextures[slot] != wrapped) {
+            if (wrapped) wrapped->AddRef();
+            if (m_boundTextures[slot]) m_boundTextures[slot]->Release();
+            m_boundTextures[slot] = wrapped;
+        }
+        return m_real->SetTexture(Stage, WrappedTexture9::Unwrap(pTexture));
+    }
+    HRESULT STDMETHODCALLTYPE GetTextureStageState(DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD* pValue) override { ThreadGuard guard(m_threads); return m_real->GetTextureStageState(Stage, Type, pValue); }
+    HRESULT STDMETHODCALLTYPE SetTextureStageState(DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD Value) override { ThreadGuard guard(m_threads); return m_real->SetTextureStageState(Stage, Type, Value); }
+    HRESULT STDMETHODCALLTYPE GetSamplerState(DWORD Sampler, D3DSAMPLERSTATETYPE Type, DWORD* pValue) override { ThreadGuard guard(m_threads); return m_real->GetSamplerState(Sampler, Type, pValue); }
+    HRESULT STDMETHODCALLTYPE SetSamplerState(DWORD Sampler, D3DSAMPLERSTATETYPE Type, DWORD Value) override { ThreadGuard guard(m_threads); return m_real->SetSamplerState(Sampler, Type, Value); }
+    HRESULT STDMETHODCALLTYPE ValidateDevice(DWORD* pNumPasses) override { ThreadGuard guard(m_threads); return m_real->ValidateDevice(pNumPasses); }
+    HRESULT STDMETHODCALLTYPE SetPaletteEntries(UINT PaletteNumber, const PALETTEENTRY* pEntries) override { ThreadGuard guard(m_threads); return m_real->SetPaletteEntries(PaletteNumber, pEntries); }
+    HRESULT STDMETHODCALLTYPE GetPaletteEntries(UINT PaletteNumber, PALETTEENTRY* pEntries) override { ThreadGuard guard(m_threads); return m_real->GetPaletteEntries(PaletteNumber, pEntries); }
+    HRESULT STDMETHODCALLTYPE SetCurrentTexturePalette(UINT PaletteNumber) override { ThreadGuard guard(m_threads); return m_real->SetCurrentTexturePalette(PaletteNumber); }
+    HRESULT STDMETHODCALLTYPE GetCurrentTexturePalette(UINT* PaletteNumber) override { ThreadGuard guard(m_threads); return m_real->GetCurrentTexturePalette(PaletteNumber); }
+    HRESULT STDMETHODCALLTYPE SetScissorRect(const RECT* pRect) override {
+        ThreadGuard guard(m_threads);
+        if (!g_config.shrinkRenderTargets || !pRect) return m_real->SetScissorRect(pRect);
+        m_gameScissor = *pRect;
+        if (m_rtScale >= 1.0f) return m_real->SetScissorRect(pRect);
+        RECT scaled = *pRect;
+        ScaleRect(&scaled, m_rtScale);
+        return m_real->SetScissorRect(&scaled);
+    }
+    HRESULT STDMETHODCALLTYPE GetScissorRect(RECT* pRect) override {
+        ThreadGuard guard(m_threads);
+        if (!g_config.shrinkRenderTargets || m_rtScale >= 1.0f || !pRect) return m_real->GetScissorRect(pRect);
+        *pRect = m_gameScissor;
+        return D3D_OK;
+    }
+    HRESULT STDMETHODCALLTYPE SetSoftwareVertexProcessing(BOOL bSoftware) override { ThreadGuard guard(m_threads); return m_real->SetSoftwareVertexProcessing(bSoftware); }
+    BOOL STDMETHODCALLTYPE GetSoftwareVertexProcessing() override { ThreadGuard guard(m_threads); return m_real->GetSoftwareVertexProcessing(); }
+    HRESULT STDMETHODCALLTYPE SetNPatchMode(float nSegments) override { ThreadGuard guard(m_threads); return m_real->SetNPatchMode(nSegments); }
+    float STDMETHODCALLTYPE GetNPatchMode() override { ThreadGuard guard(m_threads); return m_real->GetNPatchMode(); }
     HRESULT STDMETHODCALLTYPE DrawPrimitive(D3DPRIMITIVETYPE PrimitiveType, UINT StartVertex, UINT PrimitiveCount) override {
+        ThreadGuard guard(m_threads);
+        unsigned __int64 cpuStart = __rdtsc();
+        NoteDraw(FR_DRAW_PRIMITIVE, PrimitiveCount);
+        UINT64 geometryId;
+        if (ResolveDraw(FR_DRAW_PRIMITIVE, PrimitiveType, StartVertex, PrimitiveCount, &geometryId) == RULE_SKIP) {
+            m_proxyTicks += __rdtsc() - cpuStart;
+            return D3D_OK;
+        }
+        ApplyVertexSlimming(VerticesForPrimitives(PrimitiveType, PrimitiveCount));
+        FlushBoundShadowsForDraw();
+        m_proxyTicks += __rdtsc() - cpuStart;
         return m_real->DrawPrimitive(PrimitiveType, StartVertex, PrimitiveCount);
     }
     HRESULT STDMETHODCALLTYPE DrawIndexedPrimitive(D3DPRIMITIVETYPE PrimitiveType, INT BaseVertexIndex, UINT MinVertexIndex, UINT NumVertices, UINT startIndex, UINT primCount) override {
+        ThreadGuard guard(m_threads);
+        unsigned __int64 cpuStart = __rdtsc();
+        if (m_boundIB) {
+            // The wrapper may have swapped its real buffer (narrowed) since SetIndices
+            if (m_boundIB->Real() != m_boundIBReal) {
+                m_boundIBReal = m_boundIB->Real();
+                m_real->SetIndices(m_boundIBReal);
+            }
+            bool opaque = !m_alphaBlend && m_zEnable && !m_stencil;
+            m_boundIB->NoteDraw(startIndex, primCount * 3, PrimitiveType == D3DPT_TRIANGLELIST && opaque);
+        }
+        NoteDraw(FR_DRAW_INDEXED_PRIMITIVE, primCount);
+        UINT64 geometryId;
+        int rule = ResolveDraw(FR_DRAW_INDEXED_PRIMITIVE, (UINT64)(UINT)BaseVertexIndex, startIndex, primCount, &geometryId);
+        if (rule == RULE_SKIP) {
+            m_proxyTicks += __rdtsc() - cpuStart;
+            return D3D_OK;
+        }
+        if (g_config.batchDraws && rule != RULE_IDENTITY && g_config.reconstructWorld && m_hasViewProjInv && DrawClassNow() == DRAW_CLASS_WORLD) {
+            RecordBatchedDraw(geometryId, BaseVertexIndex, MinVertexIndex, NumVertices);
+        }
+        ApplyVertexSlimming(NumVertices);
+        FlushBoundShadowsForDraw();
+        m_proxyTicks += __rdtsc() - cpuStart;
         return m_real->DrawIndexedPrimitive(PrimitiveType, BaseVertexIndex, MinVertexIndex, NumVertices, startIndex, primCount);
     }
-    HRESULT STDMETHODCALLTYPE DrawPrimitiveUP(D3DPRIMITIVETYPE PrimitiveType, UINT PrimitiveCount, const void* pVertexStreamZeroData, UINT VertexStreamZeroStride) override { return m_real->DrawPrimitiveUP(PrimitiveType, PrimitiveCount, pVertexStreamZeroData, VertexStreamZeroStride); }
-    HRESULT STDMETHODCALLTYPE DrawIndexedPrimitiveUP(D3DPRIMITIVETYPE PrimitiveType, UINT MinVertexIndex, UINT NumVertices, UINT PrimitiveCount, const void* pIndexData, D3DFORMAT IndexDataFormat, const void* pVertexStreamZeroData, UINT VertexStreamZeroStride) override { return m_real->DrawIndexedPrimitiveUP(PrimitiveType, MinVertexIndex, NumVertices, PrimitiveCount, pIndexData, IndexDataFormat, pVertexStreamZeroData, VertexStreamZeroStride); }
-    HRESULT STDMETHODCALLTYPE ProcessVertices(UINT SrcStartIndex, UINT DestIndex, UINT VertexCount, IDirect3DVertexBuffer9* pDestBuffer, IDirect3DVertexDeclaration9* pVertexDecl, DWORD Flags) override { return m_real->ProcessVertices(SrcStartIndex, DestIndex, VertexCount, pDestBuffer, pVertexDecl, Flags); }
-    HRESULT STDMETHODCALLTYPE CreateVertexDeclaration(const D3DVERTEXELEMENT9* pVertexElements, IDirect3DVertexDeclaration9** ppDecl) override { return m_real->CreateVertexDeclaration(pVertexElements, ppDecl); }
-    HRESULT STDMETHODCALLTYPE SetVertexDeclaration(IDirect3DVertexDeclaration9* pDecl) override { return m_real->SetVertexDeclaration(pDecl); }
-    HRESULT STDMETHODCALLTYPE GetVertexDeclaration(IDirect3DVertexDeclaration9** ppDecl) override { return m_real->GetVertexDeclaration(ppDecl); }
-    HRESULT STDMETHODCALLTYPE SetFVF(DWORD FVF) override { return m_real->SetFVF(FVF); }
-    HRESULT STDMETHODCALLTYPE GetFVF(DWORD* pFVF) override { return m_real->GetFVF(pFVF); }
-    HRESULT STDMETHODCALLTYPE CreateVertexShader(const DWORD* pFunction, IDirect3DVertexShader9** ppShader) override { return m_real->CreateVertexShader(pFunction, ppShader); }
-    HRESULT STDMETHODCALLTYPE SetVertexShader(IDirect3DVertexShader9* pShader) override { return m_real->SetVertexShader(pShader); }
-    HRESULT STDMETHODCALLTYPE GetVertexShader(IDirect3DVertexShader9** ppShader) override { return m_real->GetVertexShader(ppShader); }
-    HRESULT STDMETHODCALLTYPE GetVertexShaderConstantF(UINT StartRegister, float* pConstantData, UINT Vector4fCount) override { return m_real->GetVertexShaderConstantF(StartRegister, pConstantData, Vector4fCount); }
-    HRESULT STDMETHODCALLTYPE SetVertexShaderConstantI(UINT StartRegister, const int* pConstantData, UINT Vector4iCount) override { return m_real->SetVertexShaderConstantI(StartRegister, pConstantData, Vector4iCount); }
-    HRESULT STDMETHODCALLTYPE GetVertexShaderConstantI(UINT StartRegister, int* pConstantData, UINT Vector4iCount) override { return m_real->GetVertexShaderConstantI(StartRegister, pConstantData, Vector4iCount); }
-    HRESULT STDMETHODCALLTYPE SetVertexShaderConstantB(UINT StartRegister, const BOOL* pConstantData, UINT BoolCount) override { return m_real->SetVertexShaderConstantB(StartRegister, pConstantData, BoolCount); }
-    HRESULT STDMETHODCALLTYPE GetVertexShaderConstantB(UINT StartRegister, BOOL* pConstantData, UINT BoolCount) override { return m_real->GetVertexShaderConstantB(StartRegister, pConstantData, BoolCount); }
-    HRESULT STDMETHODCALLTYPE SetStreamSource(UINT StreamNumber, IDirect3DVertexBuffer9* pStreamData, UINT OffsetInBytes, UINT Stride) override { return m_real->SetStreamSource(StreamNumber, pStreamData, OffsetInBytes, Stride); }
-    HRESULT STDMETHODCALLTYPE GetStreamSource(UINT StreamNumber, IDirect3DVertexBuffer9** ppStreamData, UINT* pOffsetInBytes, UINT* pStride) override { return m_real->GetStreamSource(StreamNumber, ppStreamData, pOffsetInBytes, pStride); }
-    HRESULT STDMETHODCALLTYPE SetStreamSourceFreq(UINT StreamNumber, UINT Setting) override { return m_real->SetStreamSourceFreq(StreamNumber, Setting); }
-    HRESULT STDMETHODCALLTYPE GetStreamSourceFreq(UINT StreamNumber, UINT* pSetting) override { return m_real->GetStreamSourceFreq(StreamNumber, pSetting); }
-    HRESULT STDMETHODCALLTYPE SetIndices(IDirect3DIndexBuffer9* pIndexData) override { return m_real->SetIndices(pIndexData); }
-    HRESULT STDMETHODCALLTYPE GetIndices(IDirect3DIndexBuffer9** ppIndexData) override { return m_real->GetIndices(ppIndexData); }
-    HRESULT STDMETHODCALLTYPE CreatePixelShader(const DWORD* pFunction, IDirect3DPixelShader9** ppShader) override { return m_real->CreatePixelShader(pFunction, ppShader); }
-    HRESULT STDMETHODCALLTYPE SetPixelShader(IDirect3DPixelShader9* pShader) override { return m_real->SetPixelShader(pShader); }
-    HRESULT STDMETHODCALLTYPE GetPixelShader(IDirect3DPixelShader9** ppShader) override { return m_real->GetPixelShader(ppShader); }
-    HRESULT STDMETHODCALLTYPE SetPixelShaderConstantF(UINT StartRegister, const float* pConstantData, UINT Vector4fCount) override { return m_real->SetPixelShaderConstantF(StartRegister, pConstantData, Vector4fCount); }
-    HRESULT STDMETHODCALLTYPE GetPixelShaderConstantF(UINT StartRegister, float* pConstantData, UINT Vector4fCount) override { return m_real->GetPixelShaderConstantF(StartRegister, pConstantData, Vector4fCount); }
-    HRESULT STDMETHODCALLTYPE SetPixelShaderConstantI(UINT StartRegister, const int* pConstantData, UINT Vector4iCount) override { return m_real->SetPixelShaderConstantI(StartRegister, pConstantData, Vector4iCount); }
-    HRESULT STDMETHODCALLTYPE GetPixelShaderConstantI(UINT StartRegister, int* pConstantData, UINT Vector4iCount) override { return m_real->GetPixelShaderConstantI(StartRegister, pConstantData, Vector4iCount); }
-    HRESULT STDMETHODCALLTYPE SetPixelShaderConstantB(UINT StartRegister, const BOOL* pConstantData, UINT BoolCount) override { return m_real->SetPixelShaderConstantB(StartRegister, pConstantData, BoolCount); }
-    HRESULT STDMETHODCALLTYPE GetPixelShaderConstantB(UINT StartRegister, BOOL* pConstantData, UINT BoolCount) override { return m_real->GetPixelShaderConstantB(StartRegister, pConstantData, BoolCount); }
-    HRESULT STDMETHODCALLTYPE DrawRectPatch(UINT Handle, const float* pNumSegs, const D3DRECTPATCH_INFO* pRectPatchInfo) override { return m_real->DrawRectPatch(Handle, pNumSegs, pRectPatchInfo); }
-    HRESULT STDMETHODCALLTYPE DrawTriPatch(UINT Handle, const float* pNumSegs, const D3DTRIPATCH_INFO* pTriPatchInfo) override { return m_real->DrawTriPatch(Handle, pNumSegs, pTriPatchInfo); }
-    HRESULT STDMETHODCALLTYPE DeletePatch(UINT Handle) override { return m_real->DeletePatch(Handle); }
-    HRESULT STDMETHODCALLTYPE CreateQuery(D3DQUERYTYPE Type, IDirect3DQuery9** ppQuery) override { return m_real->CreateQuery(Type, ppQuery); }
+    HRESULT STDMETHODCALLTYPE DrawPrimitiveUP(D3DPRIMITIVETYPE PrimitiveType, UINT PrimitiveCount, const void* pVertexStreamZeroData, UINT VertexStreamZeroStride) override {
+        ThreadGuard guard(m_threads);
+        NoteDraw(FR_DRAW_PRIMITIVE_UP, PrimitiveCount);
+        int rule = RuleForDraw(PrimitiveCount);
+        if (rule == RULE_SKIP) {
+            // Leave stream 0 unset, as the runtime does after a UP draw
+            m_real->SetStreamSource(0, nullptr, 0, 0);
+            ForgetStreamZero();
+            return D3D_OK;
+        }
+        if (rule == RULE_IDENTITY) ApplyIdentityWorld();
+        if (m_slimBound) RestoreGameStreams();  // UP data uses the game's declaration
+        FlushBoundShadowsForDraw();
+        HRESULT hr = m_real->DrawPrimitiveUP(PrimitiveType, PrimitiveCount, pVertexStreamZeroData, VertexStreamZeroStride);
+        ForgetStreamZero();
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE DrawIndexedPrimitiveUP(D3DPRIMITIVETYPE PrimitiveType, UINT MinVertexIndex, UINT NumVertices, UINT PrimitiveCount, const void* pIndexData, D3DFORMAT IndexDataFormat, const void* pVertexStreamZeroData, UINT VertexStreamZeroStride) override {
+        ThreadGuard guard(m_threads);
+        NoteDraw(FR_DRAW_INDEXED_PRIMITIVE_UP, PrimitiveCount);
+        int rule = RuleForDraw(PrimitiveCount);
+        if (rule == RULE_SKIP) {
+            // Leave stream 0 and the indices unset, as the runtime does after a UP draw
+            m_real->SetStreamSource(0, nullptr, 0, 0);
+            m_real->SetIndices(nullptr);
+            ForgetStreamZero();
+            return D3D_OK;
+        }
+        if (rule == RULE_IDENTITY) ApplyIdentityWorld();
+        if (m_slimBound) RestoreGameStreams();
+        FlushBoundShadowsForDraw();
+        HRESULT hr = m_real->DrawIndexedPrimitiveUP(PrimitiveType, MinVertexIndex, NumVertices, PrimitiveCount, pIndexData, IndexDataFormat, pVertexStreamZeroData, VertexStreamZeroStride);
+        ForgetStreamZero();
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE ProcessVertices(UINT SrcStartIndex, UINT DestIndex, UINT VertexCount, IDirect3DVertexBuffer9* pDestBuffer, IDirect3DVertexDeclaration9* pVertexDecl, DWORD Flags) override {
+        ThreadGuard guard(m_threads);
+        WrappedVertexBuffer9* slim = WrappedVertexBuffer9::FromBase(pDestBuffer);
+        ProfiledVertexBuffer9* profiled = static_cast<ProfiledVertexBuffer9*>(ProfiledVertexBuffer9::FromBase(pDestBuffer));
+        IDirect3DVertexBuffer9* dest = slim ? WrappedVertexBuffer9::Unwrap(pDestBuffer) : ProfiledVertexBuffer9::Unwrap(pDestBuffer);
+        HRESULT hr = m_real->ProcessVertices(SrcStartIndex, DestIndex, VertexCount, dest, InternedVertexDeclaration9::Unwrap(pVertexDecl), Flags);
+        if (SUCCEEDED(hr) && slim) slim->RefreshFromReal();
+        if (SUCCEEDED(hr) && profiled) profiled->ResyncShadow();
+        return hr;
+    }
+    HRESULT STDMETHODCALLTYPE CreateVertexDeclaration(const D3DVERTEXELEMENT9* pVertexElements, IDirect3DVertexDeclaration9** ppDecl) override {
+        ThreadGuard guard(m_threads);
+        if (!g_config.internShaders || !pVertexElements || !ppDecl) {
+            HRESULT hr = m_real->CreateVertexDeclaration(pVertexElements, ppDecl);
+            if (SUCCEEDED(hr) && g_config.slimVertexStreams) {
+                g_slimDecls.Add(m_real, *ppDecl, pVertexElements);
+            }
+            return hr;
+        }
+
+        // Slimming is keyed by the real declaration, so only new real objects need an entry
+        HRESULT hr = D3D_OK;
+        InternEntry* entry = g_intern.Acquire(m_real, INTERN_DECLARATION, pVertexElements, DeclarationByteLength(pVertexElements), [&]() -> IUnknown* {
+            IDirect3DVertexDeclaration9* real = nullptr;
+            hr = m_real->CreateVertexDeclaration(pVertexElements, &real);
+            if (FAILED(hr)) return nullptr;
+            if (g_config.slimVertexStreams) g_slimDecls.Add(m_real, real, pVertexElements);
+            return real;
+        });
+        if (!entry) return hr;
+        *ppDecl = new InternedVertexDeclaration9(entry, this);
+        return D3D_OK;
+    }
+    HRESULT STDMETHODCALLTYPE SetVertexDeclaration(IDirect3DVertexDeclaration9* pDecl) override {
+        ThreadGuard guard(m_threads);
+        TrackBound(m_boundDecl, pDecl);
+        pDecl = InternedVertexDeclaration9::Unwrap(pDecl);
+        m_gameDecl = pDecl;
+        m_slimBound = false;  // Replaces the slim declaration; stale compacted streams are rebound before the next draw
+        m_slimDirty = true;
+        if (m_slimStreams) {
+            for (int s = 0; s < 16; s++) {
+                if (m_slimStreams & (1 << s)) {
+                    m_real->SetStreamSource(s, WrappedVertexBuffer9::Unwrap(m_streams[s].vb), m_streams[s].offset, m_streams[s].stride);
+                }
+            }
+            m_slimStreams = 0;
+        }
+        return m_real->SetVertexDeclaration(pDecl);
+    }
+    HRESULT STDMETHODCALLTYPE GetVertexDeclaration(IDirect3DVertexDeclaration9** ppDecl) override {
+        ThreadGuard guard(m_threads);
+        if (ReturnBound(m_boundDecl, ppDecl)) return D3D_OK;
+        if (m_slimBound && m_gameDecl && ppDecl) {
+            m_gameDecl->AddRef();
+            *ppDecl = m_gameDecl;
+            return D3D_OK;
+        }
+        return m_real->GetVertexDeclaration(ppDecl);
+    }
+    HRESULT STDMETHODCALLTYPE SetFVF(DWORD FVF) override {
+        ThreadGuard guard(m_threads);
+        if (m_slimBound) RestoreGameStreams();
+        m_gameDecl = nullptr;  // The runtime builds its own declaration for the FVF
+        TrackBound(m_boundDecl, (IDirect3DVertexDeclaration9*)nullptr);
+        m_slimDirty = true;
+        return m_real->SetFVF(FVF);
+    }
+    HRESULT STDMETHODCALLTYPE GetFVF(DWORD* pFVF) override { ThreadGuard guard(m_threads); return m_real->GetFVF(pFVF); }
+    HRESULT STDMETHODCALLTYPE CreateVertexShader(const DWORD* pFunction, IDirect3DVertexShader9** ppShader) override {
+        ThreadGuard guard(m_threads);
+        UINT size = g_config.internShaders && pFunction && ppShader ? ShaderByteLength(pFunction) : 0;
+        if (!size) return m_real->CreateVertexShader(pFunction, ppShader);
+        HRESULT hr = D3D_OK;
+        InternEntry* entry = g_intern.Acquire(m_real, INTERN_VERTEX_SHADER, pFunction, size, [&]() -> IUnknown* {
+            IDirect3DVertexShader9* real = nullptr;
+            hr = m_real->CreateVertexShader(pFunction, &real);
+            return SUCCEEDED(hr) ? real : nullptr;
+        });
+        if (!entry) return hr;
+        if (g_config.slimVertexStreams && entry->users == 1) entry->slimSafe = VertexShaderSlimSafe(pFunction);
+        *ppShader = new InternedVertexShader9(entry, this);
+        return D3D_OK;
+    }
+    HRESULT STDMETHODCALLTYPE SetVertexShader(IDirect3DVertexShader9* pShader) override {
+        ThreadGuard guard(m_threads);
+        TrackBound(m_boundVS, pShader);
+        m_rulesGeneration = -1;
+        bool slimShaderOk = !pShader || InternedVertexShader9::SlimSafe(pShader);
+        if (slimShaderOk != m_slimShaderOk) {
+            m_slimShaderOk = slimShaderOk;
+            m_slimDirty = true;
+        }
+        pShader = InternedVertexShader9::Unwrap(pShader);
+        g_capture.Write(CAP_VERTEX_SHADER, (UINT)(UINT_PTR)pShader);
+        return m_real->SetVertexShader(pShader);
+    }
+    HRESULT STDMETHODCALLTYPE GetVertexShader(IDirect3DVertexShader9** ppShader) override {
+        ThreadGuard guard(m_threads);
+        if (ReturnBound(m_boundVS, ppShader)) return D3D_OK;
+        return m_real->GetVertexShader(ppShader);
+    }
+    HRESULT STDMETHODCALLTYPE GetVertexShaderConstantF(UINT StartRegister, float* pConstantData, UINT Vector4fCount) override { ThreadGuard guard(m_threads); return m_real->GetVertexShaderConstantF(StartRegister, pConstantData, Vector4fCount); }
+    HRESULT STDMETHODCALLTYPE SetVertexShaderConstantI(UINT StartRegister, const int* pConstantData, UINT Vector4iCount) override { ThreadGuard guard(m_threads); return m_real->SetVertexShaderConstantI(StartRegister, pConstantData, Vector4iCount); }
+    HRESULT STDMETHODCALLTYPE GetVertexShaderConstantI(UINT StartRegister, int* pConstantData, UINT Vector4iCount) override { ThreadGuard guard(m_threads); return m_real->GetVertexShaderConstantI(StartRegister, pConstantData, Vector4iCount); }
+    HRESULT STDMETHODCALLTYPE SetVertexShaderConstantB(UINT StartRegister, const BOOL* pConstantData, UINT BoolCount) override { ThreadGuard guard(m_threads); return m_real->SetVertexShaderConstantB(StartRegister, pConstantData, BoolCount); }
+    HRESULT STDMETHODCALLTYPE GetVertexShaderConstantB(UINT StartRegister, BOOL* pConstantData, UINT BoolCount) override { ThreadGuard guard(m_threads); return m_real->GetVertexShaderConstantB(StartRegister, pConstantData, BoolCount); }
+    HRESULT STDMETHODCALLTYPE SetStreamSource(UINT StreamNumber, IDirect3DVertexBuffer9* pStreamData, UINT OffsetInBytes, UINT Stride) override {
+        ThreadGuard guard(m_threads);
+        if (StreamNumber == 0) {
+            m_streamVB = pStreamData;
+            m_streamOffset = OffsetInBytes;
+        }
+        if (StreamNumber < 16) {
+            StreamBinding& b = m_streams[StreamNumber];
+            WrappedVertexBuffer9* wrapped = WrappedVertexBuffer9::FromBase(pStreamData);
+            if (wrapped != m_streamWrappers[StreamNumber]) {
+                if (wrapped) wrapped->AddRef();
+                if (m_streamWrappers[StreamNumber]) m_streamWrappers[StreamNumber]->Release();
+                m_streamWrappers[StreamNumber] = wrapped;
+            }
+            IDirect3DVertexBuffer9* profiled = ProfiledVertexBuffer9::FromBase(pStreamData);
+            if (profiled != m_profiledStreams[StreamNumber]) {
+                if (profiled) profiled->AddRef();
+                if (m_profiledStreams[StreamNumber]) m_profiledStreams[StreamNumber]->Release();
+                m_profiledStreams[StreamNumber] = profiled;
+            }
+            b.vb = pStreamData;
+            b.offset = OffsetInBytes;
+            b.stride = Stride;
+            m_slimStreams &= ~(1 << StreamNumber);
+            m_slimDirty = true;
+        }
+        return m_real->SetStreamSource(StreamNumber, WrappedVertexBuffer9::Unwrap(ProfiledVertexBuffer9::Unwrap(pStreamData)), OffsetInBytes, Stride);
+    }
+    HRESULT STDMETHODCALLTYPE GetStreamSource(UINT StreamNumber, IDirect3DVertexBuffer9** ppStreamData, UINT* pOffsetInBytes, UINT* pStride) override {
+        ThreadGuard guard(m_threads);
+        IDirect3DVertexBuffer9* wrapper = StreamNumber < 16 ? m_streamWrappers[StreamNumber] : nullptr;
+        if (!wrapper && StreamNumber < 16) wrapper = m_profiledStreams[StreamNumber];
+        if (wrapper && ppStreamData && pOffsetInBytes && pStride) {
+            wrapper->AddRef();
+            *ppStreamData = wrapper;
+            *pOffsetInBytes = m_streams[StreamNumber].offset;
+            *pStride = m_streams[StreamNumber].stride;
+            return D3D_OK;
+        }
+        return m_real->GetStreamSource(StreamNumber, ppStreamData, pOffsetInBytes, pStride);
+    }
+    HRESULT STDMETHODCALLTYPE SetStreamSourceFreq(UINT StreamNumber, UINT Setting) override {
+        ThreadGuard guard(m_threads);
+        if (StreamNumber < 16) {
+            m_streams[StreamNumber].freq = Setting;
+            m_slimDirty = true;
+        }
+        return m_real->SetStreamSourceFreq(StreamNumber, Setting);
+    }
+    HRESULT STDMETHODCALLTYPE GetStreamSourceFreq(UINT StreamNumber, UINT* pSetting) override { ThreadGuard guard(m_threads); return m_real->GetStreamSourceFreq(StreamNumber, pSetting); }
+    HRESULT STDMETHODCALLTYPE SetIndices(IDirect3DIndexBuffer9* pIndexData) override {
+        ThreadGuard guard(m_threads);
+        m_indices = pIndexData;
+        WrappedIndexBuffer9* wrapped = WrappedIndexBuffer9::FromBase(pIndexData);
+        if (wrapped != m_boundIB) {
+            if (wrapped) wrapped->AddRef();
+            if (m_boundIB) m_boundIB->Release();
+            m_boundIB = wrapped;
+        }
+        IDirect3DIndexBuffer9* profiled = ProfiledIndexBuffer9::FromBase(pIndexData);
+        if (profiled != m_profiledIB) {
+            if (profiled) profiled->AddRef();
+            if (m_profiledIB) m_profiledIB->Release();
+            m_profiledIB = profiled;
+        }
+        m_boundIBReal = WrappedIndexBuffer9::Unwrap(ProfiledIndexBuffer9::Unwrap(pIndexData));
+        return m_real->SetIndices(m_boundIBReal);
+    }
+    HRESULT STDMETHODCALLTYPE GetIndices(IDirect3DIndexBuffer9** ppIndexData) override {
+        ThreadGuard guard(m_threads);
+        IDirect3DIndexBuffer9* wrapper = m_boundIB ? m_boundIB : m_profiledIB;
+        if (wrapper && ppIndexData) {
+            wrapper->AddRef();
+            *ppIndexData = wrapper;
+            return D3D_OK;
+        }
+        return m_real->GetIndices(ppIndexData);
+    }
+    HRESULT STDMETHODCALLTYPE CreatePixelShader(const DWORD* pFunction, IDirect3DPixelShader9** ppShader) override {
+        ThreadGuard guard(m_threads);
+        UINT size = g_config.internShaders && pFunction && ppShader ? ShaderByteLength(pFunction) : 0;
+        if (!size) return m_real->CreatePixelShader(pFunction, ppShader);
+        HRESULT hr = D3D_OK;
+        InternEntry* entry = g_intern.Acquire(m_real, INTERN_PIXEL_SHADER, pFunction, size, [&]() -> IUnknown* {
+            IDirect3DPixelShader9* real = nullptr;
+            hr = m_real->CreatePixelShader(pFunction, &real);
+            return SUCCEEDED(hr) ? real : nullptr;
+        });
+        if (!entry) return hr;
+        *ppShader = new InternedPixelShader9(entry, this);
+        return D3D_OK;
+    }
+    HRESULT STDMETHODCALLTYPE SetPixelShader(IDirect3DPixelShader9* pShader) override {
+        ThreadGuard guard(m_threads);
+        TrackBound(m_boundPS, pShader);
+        m_rulesGeneration = -1;
+        return m_real->SetPixelShader(InternedPixelShader9::Unwrap(pShader));
+    }
+    HRESULT STDMETHODCALLTYPE GetPixelShader(IDirect3DPixelShader9** ppShader) override {
+        ThreadGuard guard(m_threads);
+        if (ReturnBound(m_boundPS, ppShader)) return D3D_OK;
+        return m_real->GetPixelShader(ppShader);
+    }
+    HRESULT STDMETHODCALLTYPE SetPixelShaderConstantF(UINT StartRegister, const float* pConstantData, UINT Vector4fCount) override {
+        ThreadGuard guard(m_threads);
+        if (g_config.pixelShaderEye && pConstantData) {
+            unsigned __int64 cpuStart = __rdtsc();
+            m_eyeRegister.NoteUpload(StartRegister, pConstantData, Vector4fCount);
+            m_proxyTicks += __rdtsc() - cpuStart;
+        }
+        return m_real->SetPixelShaderConstantF(StartRegister, pConstantData, Vector4fCount);
+    }
+    HRESULT STDMETHODCALLTYPE GetPixelShaderConstantF(UINT StartRegister, float* pConstantData, UINT Vector4fCount) override { ThreadGuard guard(m_threads); return m_real->GetPixelShaderConstantF(StartRegister, pConstantData, Vector4fCount); }
+    HRESULT STDMETHODCALLTYPE SetPixelShaderConstantI(UINT StartRegister, const int* pConstantData, UINT Vector4iCount) override { ThreadGuard guard(m_threads); return m_real->SetPixelShaderConstantI(StartRegister, pConstantData, Vector4iCount); }
+    HRESULT STDMETHODCALLTYPE GetPixelShaderConstantI(UINT StartRegister, int* pConstantData, UINT Vector4iCount) override { ThreadGuard guard(m_threads); return m_real->GetPixelShaderConstantI(StartRegister, pConstantData, Vector4iCount); }
+    HRESULT STDMETHODCALLTYPE SetPixelShaderConstantB(UINT StartRegister, const BOOL* pConstantData, UINT BoolCount) override { ThreadGuard guard(m_threads); return m_real->SetPixelShaderConstantB(StartRegister, pConstantData, BoolCount); }
+    HRESULT STDMETHODCALLTYPE GetPixelShaderConstantB(UINT StartRegister, BOOL* pConstantData, UINT BoolCount) override { ThreadGuard guard(m_threads); return m_real->GetPixelShaderConstantB(StartRegister, pConstantData, BoolCount); }
+    HRESULT STDMETHODCALLTYPE DrawRectPatch(UINT Handle, const float* pNumSegs, const D3DRECTPATCH_INFO* pRectPatchInfo) override { ThreadGuard guard(m_threads); return m_real->DrawRectPatch(Handle, pNumSegs, pRectPatchInfo); }
+    HRESULT STDMETHODCALLTYPE DrawTriPatch(UINT Handle, const float* pNumSegs, const D3DTRIPATCH_INFO* pTriPatchInfo) override { ThreadGuard guard(m_threads); return m_real->DrawTriPatch(Handle, pNumSegs, pTriPatchInfo); }
+    HRESULT STDMETHODCALLTYPE DeletePatch(UINT Handle) override { ThreadGuard guard(m_threads); return m_real->DeletePatch(Handle); }
+    HRESULT STDMETHODCALLTYPE CreateQuery(D3DQUERYTYPE Type, IDirect3DQuery9** ppQuery) override { ThreadGuard guard(m_threads); return m_real->CreateQuery(Type, ppQuery); }
 };
 
+// Strip D3DCREATE_MULTITHREADED when earlier runs never used the device from two threads
+static ThreadTripwire::Mode ThreadModeFor(DWORD* behaviorFlags) {
+    if (!(*behaviorFlags & D3DCREATE_MULTITHREADED)) return ThreadTripwire::MODE_OFF;
+    if (g_config.stripMultithreaded && g_cache.GetInt("MultithreadedDevice", -1) == 0) {
+        *behaviorFlags &= ~D3DCREATE_MULTITHREADED;
+        LogMsg("THREADS: no multithreaded use on record, creating the device without D3DCREATE_MULTITHREADED");
+        return ThreadTripwire::MODE_GUARD;
+    }
+    return ThreadTripwire::MODE_OBSERVE;
+}
+
 /**
  * Wrapped IDirect3D9 - intercepts CreateDevice to return wrapped devices
  */
 class WrappedD3D9 : public IDirect3D9 {
 private:
     IDirect3D9* m_real;
+    IDirect3D9Ex* m_realEx;     // Same object as m_real when UpgradeToEx created it
+
+    // Ex device behind the plain interface when upgraded, else (or if Ex creation fails) a plain one
+    HRESULT CreateRealDevice(UINT adapter, D3DDEVTYPE deviceType, HWND focusWindow, DWORD flags,
+                             D3DPRESENT_PARAMETERS* params, IDirect3DDevice9** device, IDirect3DDevice9Ex** deviceEx) {
+        *deviceEx = nullptr;
+        if (m_realEx && params) {
+            D3DDISPLAYMODEEX mode = {};
+            D3DDISPLAYMODEEX* fullscreenMode = nullptr;
+            if (!params->Windowed) {
+                mode.Size = sizeof(mode);
+                mode.Width = params->BackBufferWidth;
+                mode.Height = params->BackBufferHeight;
+                mode.RefreshRate = params->FullScreen_RefreshRateInHz;
+                mode.Format = params->BackBufferFormat;
+                mode.ScanLineOrdering = D3DSCANLINEORDERING_PROGRESSIVE;
+                fullscreenMode = &mode;
+            }
+            HRESULT hr = m_realEx->CreateDeviceEx(adapter, deviceType, focusWindow, flags, params, fullscreenMode, deviceEx);
+            if (SUCCEEDED(hr) && *deviceEx) {
+                LogMsg("EX: device upgraded to IDirect3DDevice9Ex");
+                *device = *deviceEx;
+                return hr;
+            }
+            LogMsg("EX: CreateDeviceEx failed (0x%08X), creating a plain device", hr);
+            *deviceEx = nullptr;
+        }
+        return m_real->CreateDevice(adapter, deviceType, focusWindow, flags, params, device);
+    }
 
 public:
-    WrappedD3D9(IDirect3D9* real) : m_real(real) {
-        LogMsg("WrappedD3D9 created, wrapping IDirect3D9 at %p", real);
+    WrappedD3D9(IDirect3D9* real, IDirect3D9Ex* realEx = nullptr) : m_real(real), m_realEx(realEx) {
+        LogMsg("WrappedD3D9 created, wrapping IDirect3D9 at %p%s", real, realEx ? " (Ex underneath)" : "");
     }
 
     ~WrappedD3D9() {
@@ -497,6 +7466,11 @@ public:
 
     // IUnknown
     HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObj) override {
+        if (m_realEx && riid == IID_IDirect3D9Ex) {
+            // Same as the device: the raw Ex factory would create devices the proxy never sees
+            if (ppvObj) *ppvObj = nullptr;
+            return E_NOINTERFACE;
+        }
         return m_real->QueryInterface(riid, ppvObj);
     }
 
@@ -576,13 +7550,24 @@ public:
     {
         LogMsg("CreateDevice called - Adapter: %d, DeviceType: %d", Adapter, DeviceType);
 
+        DWORD flags = BehaviorFlags;
+        ThreadTripwire::Mode threadMode = ThreadModeFor(&flags);
         IDirect3DDevice9* realDevice = nullptr;
-        HRESULT hr = m_real->CreateDevice(Adapter, DeviceType, hFocusWindow, BehaviorFlags,
-                                          pPresentationParameters, &realDevice);
+        IDirect3DDevice9Ex* realDeviceEx = nullptr;
+        HRESULT hr = CreateRealDevice(Adapter, DeviceType, hFocusWindow, flags,
+                                      pPresentationParameters, &realDevice, &realDeviceEx);
+        if (FAILED(hr) && flags != BehaviorFlags) {
+            threadMode = ThreadTripwire::MODE_OBSERVE;
+            hr = CreateRealDevice(Adapter, DeviceType, hFocusWindow, BehaviorFlags,
+                                  pPresentationParameters, &realDevice, &realDeviceEx);
+        }
 
         if (SUCCEEDED(hr) && realDevice) {
             LogMsg("CreateDevice succeeded, wrapping device");
-            *ppReturnedDeviceInterface = new WrappedD3D9Device(realDevice);
+            WrappedD3D9Device* device = new WrappedD3D9Device(realDevice);
+            device->InitThreadTripwire(threadMode);
+            if (realDeviceEx) device->EnableEx(realDeviceEx);
+            *ppReturnedDeviceInterface = device;
         } else {
             LogMsg("CreateDevice failed with HRESULT: 0x%08X", hr);
             *ppReturnedDeviceInterface = nullptr;
@@ -638,10 +7623,18 @@ public:
         D3DPRESENT_PARAMETERS* pPresentationParameters, IDirect3DDevice9** ppReturnedDeviceInterface) override
     {
         LogMsg("CreateDevice (via Ex) called");
+        DWORD flags = BehaviorFlags;
+        ThreadTripwire::Mode threadMode = ThreadModeFor(&flags);
         IDirect3DDevice9* realDevice = nullptr;
-        HRESULT hr = m_real->CreateDevice(Adapter, DeviceType, hFocusWindow, BehaviorFlags, pPresentationParameters, &realDevice);
+        HRESULT hr = m_real->CreateDevice(Adapter, DeviceType, hFocusWindow, flags, pPresentationParameters, &realDevice);
+        if (FAILED(hr) && flags != BehaviorFlags) {
+            threadMode = ThreadTripwire::MODE_OBSERVE;
+            hr = m_real->CreateDevice(Adapter, DeviceType, hFocusWindow, BehaviorFlags, pPresentationParameters, &realDevice);
+        }
         if (SUCCEEDED(hr) && realDevice) {
-            *ppReturnedDeviceInterface = new WrappedD3D9Device(realDevice);
+            WrappedD3D9Device* device = new WrappedD3D9Device(realDevice);
+            device->InitThreadTripwire(threadMode);
+            *ppReturnedDeviceInterface = device;
         } else {
             *ppReturnedDeviceInterface = nullptr;
         }
@@ -659,12 +7652,21 @@ public:
         IDirect3DDevice9Ex** ppReturnedDeviceInterface) override
     {
         LogMsg("CreateDeviceEx called");
+        DWORD flags = BehaviorFlags;
+        ThreadTripwire::Mode threadMode = ThreadModeFor(&flags);
         IDirect3DDevice9Ex* realDevice = nullptr;
-        HRESULT hr = m_real->CreateDeviceEx(Adapter, DeviceType, hFocusWindow, BehaviorFlags,
+        HRESULT hr = m_real->CreateDeviceEx(Adapter, DeviceType, hFocusWindow, flags,
                                             pPresentationParameters, pFullscreenDisplayMode, &realDevice);
+        if (FAILED(hr) && flags != BehaviorFlags) {
+            threadMode = ThreadTripwire::MODE_OBSERVE;
+            hr = m_real->CreateDeviceEx(Adapter, DeviceType, hFocusWindow, BehaviorFlags,
+                                        pPresentationParameters, pFullscreenDisplayMode, &realDevice);
+        }
         if (SUCCEEDED(hr) && realDevice) {
             LogMsg("CreateDeviceEx succeeded, wrapping device (as base Device9)");
-            *ppReturnedDeviceInterface = (IDirect3DDevice9Ex*)new WrappedD3D9Device(realDevice);
+            WrappedD3D9Device* device = new WrappedD3D9Device(realDevice);
+            device->InitThreadTripwire(threadMode);
+            *ppReturnedDeviceInterface = (IDirect3DDevice9Ex*)device;
         } else {
             LogMsg("CreateDeviceEx failed: 0x%08X", hr);
             *ppReturnedDeviceInterface = nullptr;
@@ -702,14 +7704,128 @@ void LoadConfig() {
     g_config.minFOV = (float)atof(buf);
     GetPrivateProfileStringA("CameraProxy", "MaxFOV", "2.5", buf, sizeof(buf), path);
     g_config.maxFOV = (float)atof(buf);
+
+    g_config.flightRecorder = GetPrivateProfileIntA("CameraProxy", "FlightRecorder", 1, path) != 0;
+    g_config.flightRecorderEvents = GetPrivateProfileIntA("CameraProxy", "FlightRecorderEvents", 262144, path);
+    g_config.flightRecorderFrames = GetPrivateProfileIntA("CameraProxy", "FlightRecorderFrames", 60, path);
+    g_config.flightRecorderMaxDumps = GetPrivateProfileIntA("CameraProxy", "FlightRecorderMaxDumps", 8, path);
+    GetPrivateProfileStringA("CameraProxy", "HitchMultiple", "2.5", buf, sizeof(buf), path);
+    g_config.hitchMultiple = (float)atof(buf);
+
+    g_config.reconstructWorld = GetPrivateProfileIntA("CameraProxy", "ReconstructWorld", 0, path) != 0;
+    g_config.stabilizeWorld = GetPrivateProfileIntA("CameraProxy", "StabilizeWorld", 1, path) != 0;
+    GetPrivateProfileStringA("CameraProxy", "WorldSnapEpsilon", "0.0005", buf, sizeof(buf), path);
+    g_config.worldSnapEpsilon = (float)atof(buf);
+
+    g_config.idleFrameCap = GetPrivateProfileIntA("CameraProxy", "IdleFrameCap", 0, path);
+    g_config.idleDetectFrames = GetPrivateProfileIntA("CameraProxy", "IdleDetectFrames", 90, path);
+    GetPrivateProfileStringA("CameraProxy", "IdleUIFraction", "0.9", buf, sizeof(buf), path);
+    g_config.idleUIFraction = (float)atof(buf);
+
+    g_config.shrinkRenderTargets = GetPrivateProfileIntA("CameraProxy", "ShrinkRenderTargets", 0, path) != 0;
+    g_config.shrinkMinSize = GetPrivateProfileIntA("CameraProxy", "ShrinkMinSize", 256, path);
+    g_config.shrinkDepthStencil = GetPrivateProfileIntA("CameraProxy", "ShrinkDepthStencil", 0, path) != 0;
+    GetPrivateProfileStringA("CameraProxy", "ShrinkScale", "0.5", buf, sizeof(buf), path);
+    g_config.shrinkScale = (float)atof(buf);
+    if (g_config.shrinkScale <= 0.0f || g_config.shrinkScale > 1.0f) g_config.shrinkScale = 1.0f;
+
+    // Comma-separated D3DFORMAT values, e.g. ShrinkFormats=113,21
+    char list[256];
+    if (GetPrivateProfileStringA("CameraProxy", "ShrinkFormats", "", list, sizeof(list), path) > 0) {
+        g_config.shrinkFormatCount = 0;
+        for (char* tok = strtok(list, ", "); tok && g_config.shrinkFormatCount < 16; tok = strtok(nullptr, ", ")) {
+            g_config.shrinkFormats[g_config.shrinkFormatCount++] = atoi(tok);
+        }
+    }
+    // Comma-separated WxH sizes, e.g. ShrinkSizes=1280x720,640x360
+    if (GetPrivateProfileStringA("CameraProxy", "ShrinkSizes", "", list, sizeof(list), path) > 0) {
+        for (char* tok = strtok(list, ", "); tok && g_config.shrinkSizeCount < 16; tok = strtok(nullptr, ", ")) {
+            UINT w = 0, h = 0;
+            if (sscanf(tok, "%ux%u", &w, &h) == 2 && w && h) {
+                g_config.shrinkSizes[g_config.shrinkSizeCount][0] = w;
+                g_config.shrinkSizes[g_config.shrinkSizeCount][1] = h;
+                g_config.shrinkSizeCount++;
+            }
+        }
+    }
+    if (g_config.shrinkRenderTargets && g_config.shrinkSizeCount == 0) {
+        LogMsg("SHRINK: ShrinkRenderTargets=1 but ShrinkSizes lists no sizes, nothing will be shrunk");
+    }
+
+    g_config.optimizeIndexBuffers = GetPrivateProfileIntA("CameraProxy", "OptimizeIndexBuffers", 0, path) != 0;
+    g_config.slimVertexStreams = GetPrivateProfileIntA("CameraProxy", "SlimVertexStreams", 0, path) != 0;
+    g_config.gpuTiming = GetPrivateProfileIntA("CameraProxy", "GpuTiming", 1, path) != 0;
+    g_config.gpuTimingLatency = GetPrivateProfileIntA("CameraProxy", "GpuTimingLatency", 3, path);
+    g_config.addressSpaceIntervalMs = GetPrivateProfileIntA("CameraProxy", "AddressSpaceIntervalMs", 5000, path);
+    GetPrivateProfileStringA("CameraProxy", "AddressSpaceWarnMB", "256", buf, sizeof(buf), path);
+    g_config.addressSpaceWarnMB = (float)atof(buf);
+
+    // View matrix test thresholds, see tools/detector_tune for tuning them
+    GetPrivateProfileStringA("CameraProxy", "ViewNormTolerance", "0.15", buf, sizeof(buf), path);
+    g_config.detect.normTolerance = (float)atof(buf);
+    GetPrivateProfileStringA("CameraProxy", "ViewWTolerance", "0.01", buf, sizeof(buf), path);
+    g_config.detect.wTolerance = (float)atof(buf);
+    GetPrivateProfileStringA("CameraProxy", "MinViewTranslation", "50", buf, sizeof(buf), path);
+    g_config.detect.minTranslation = (float)atof(buf);
+    g_config.pixelShaderEye = GetPrivateProfileIntA("CameraProxy", "PixelShaderEye", 1, path) != 0;
+
+    g_config.perfEvents = GetPrivateProfileIntA("CameraProxy", "PerfEvents", 0, path) != 0;
+    g_config.skipPerfForwarding = GetPrivateProfileIntA("CameraProxy", "SkipPerfForwarding", 1, path) != 0;
+    GetPrivateProfileStringA("CameraProxy", "DrawRules", "", g_config.drawRules, sizeof(g_config.drawRules), path);
+    g_config.predictDraws = GetPrivateProfileIntA("CameraProxy", "PredictDraws", 0, path) != 0;
+
+    g_config.hud = GetPrivateProfileIntA("CameraProxy", "Hud", 0, path) != 0;
+    g_config.hudKey = GetPrivateProfileIntA("CameraProxy", "HudKey", 0x79, path);
+    g_config.stripMultithreaded = GetPrivateProfileIntA("CameraProxy", "StripMultithreaded", 0, path) != 0;
+    g_config.internShaders = GetPrivateProfileIntA("CameraProxy", "InternShaders", 1, path) != 0;
+    g_config.batchDraws = GetPrivateProfileIntA("CameraProxy", "BatchDraws", 0, path) != 0;
+    g_config.speculativeInit = GetPrivateProfileIntA("CameraProxy", "SpeculativeInit", 0, path) != 0;
+    GetPrivateProfileStringA("CameraProxy", "MaintenanceBudgetMs", "2.0", buf, sizeof(buf), path);
+    g_config.maintenanceBudgetMs = (float)atof(buf);
+    g_config.maintenanceTargetFps = GetPrivateProfileIntA("CameraProxy", "MaintenanceTargetFps", 60, path);
+
+    g_config.captureConstants = GetPrivateProfileIntA("CameraProxy", "CaptureConstants", 0, path) != 0;
+    g_config.captureFrames = GetPrivateProfileIntA("CameraProxy", "CaptureFrames", 1800, path);
+
+    // Comma-separated format:WxH entries, * for any size, e.g. CompressAllow=22:*,21:512x512
+    g_config.compressTextures = GetPrivateProfileIntA("CameraProxy", "CompressTextures", 0, path) != 0;
+    if (GetPrivateProfileStringA("CameraProxy", "CompressAllow", "", list, sizeof(list), path) > 0) {
+        g_config.compressAllowCount = 0;
+        for (char* tok = strtok(list, ", "); tok && g_config.compressAllowCount < 32; tok = strtok(nullptr, ", ")) {
+            CompressRule rule = { atoi(tok), 0, 0 };
+            const char* size = strchr(tok, ':');
+            if (size && size[1] != '*') {
+                sscanf(size + 1, "%ux%u", &rule.width, &rule.height);
+            }
+            g_config.compressAllow[g_config.compressAllowCount++] = rule;
+        }
+    }
+
+    g_config.textureResidency = GetPrivateProfileIntA("CameraProxy", "TextureResidency", 0, path) != 0;
+    g_config.residencyLowerFrames = GetPrivateProfileIntA("CameraProxy", "ResidencyLowerFrames", 1800, path);
+    g_config.residencyEvictFrames = GetPrivateProfileIntA("CameraProxy", "ResidencyEvictFrames", 3600, path);
+    g_config.residencyBudgetMB = GetPrivateProfileIntA("CameraProxy", "ResidencyBudgetMB", 256, path);
+
+    g_config.bufferPolicy = GetPrivateProfileIntA("CameraProxy", "BufferPolicy", 0, path) != 0;
+
+    g_config.upgradeEx = GetPrivateProfileIntA("CameraProxy", "UpgradeToEx", 0, path) != 0;
+    g_config.exMaxFrameLatency = GetPrivateProfileIntA("CameraProxy", "ExMaxFrameLatency", 0, path);
+    g_config.exGPUThreadPriority = GetPrivateProfileIntA("CameraProxy", "ExGPUThreadPriority", 0, path);
 }
 
 // DLL entry point
 BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved) {
     if (fdwReason == DLL_PROCESS_ATTACH) {
         DisableThreadLibraryCalls(hinstDLL);
+        QueryPerformanceFrequency(&g_qpcFreq);
 
         LoadConfig();
+        g_cache.Init();
+        g_maintenance.Register(MAINT_CACHE_WRITE, []() { g_cache.Flush(); }, 2.0f);
+        g_maintenance.Register(MAINT_CAPTURE_FLUSH, []() { g_capture.Flush(); }, 4.0f);
+        g_maintenance.Register(MAINT_SLIM_COMPACT, []() { g_slimDecls.Compact(); }, 0.5f);
+        g_maintenance.Register(MAINT_HEAP_TRIM, []() { HeapCompact(GetProcessHeap(), 0); }, 5.0f);
+        g_maintenance.Register(MAINT_TEXTURE_RESIDENCY, []() { g_residency.Run(); }, 1.0f);
 
         if (g_config.enableLogging) {
             g_logFile = fopen("camera_proxy.log", "w");
@@ -719,6 +7835,21 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved) {
             LogMsg("Projection: Synthetic 90deg FOV");
         }
 
+        if (g_config.flightRecorder && !g_flight.Init(g_config.flightRecorderEvents)) {
+            LogMsg("FlightRecorder: allocation failed, disabled");
+        }
+
+        g_drawRules.Init(g_config.drawRules);
+
+        if (g_config.captureConstants && !g_capture.Open("camera_proxy_capture.bin", g_config.captureFrames)) {
+            LogMsg("Capture: failed to open camera_proxy_capture.bin");
+        }
+
+        if (g_config.addressSpaceIntervalMs > 0 &&
+            !g_addressSpace.Start(g_config.addressSpaceIntervalMs, g_config.addressSpaceWarnMB)) {
+            LogMsg("AddressSpace: monitor thread failed to start");
+        }
+
         // Load the real Remix d3d9.dll
         char path[MAX_PATH];
         GetModuleFileNameA(hinstDLL, path, MAX_PATH);
@@ -745,6 +7876,7 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved) {
             LogMsg("Loaded d3d9_remix.dll successfully");
             LogMsg("  Direct3DCreate9: %p", g_origDirect3DCreate9);
             LogMsg("  Direct3DCreate9Ex: %p", g_origDirect3DCreate9Ex);
+            g_speculative.Start(g_config.speculativeInit, g_config.upgradeEx);
         } else {
             LogMsg("ERROR: Failed to load d3d9_remix.dll!");
             MessageBoxA(nullptr, "Failed to load d3d9_remix.dll!\n\nMake sure Remix's d3d9.dll is renamed to d3d9_remix.dll",
@@ -755,7 +7887,17 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved) {
         if (g_logFile) {
             LogMsg("=== Camera Proxy unloading ===");
             LogMsg("Total frames: %d", g_frameCount);
+        }
+        g_flight.Shutdown(lpvReserved != nullptr);
+        g_addressSpace.Stop(lpvReserved != nullptr);
+        g_capture.Close();
+        g_cache.Flush();
+        g_speculative.Shutdown();
+        if (g_texCompressor) g_texCompressor->Shutdown(lpvReserved != nullptr);
+        if (g_ibOptimizer) g_ibOptimizer->Shutdown(lpvReserved != nullptr);
+        if (g_logFile) {
             fclose(g_logFile);
+            g_logFile = nullptr;
         }
         if (g_hRemixD3D9) {
             FreeLibrary(g_hRemixD3D9);
@@ -774,7 +7916,19 @@ extern "C" {
             return nullptr;
         }
 
-        IDirect3D9* realD3D9 = g_origDirect3DCreate9(SDKVersion);
+        if (g_config.upgradeEx && g_origDirect3DCreate9Ex) {
+            // An Ex object also serves every IDirect3D9 call; the speculative thread made one too
+            IDirect3D9Ex* realD3D9Ex = g_speculative.TakeEx(SDKVersion);
+            HRESULT hr = realD3D9Ex ? S_OK : g_origDirect3DCreate9Ex(SDKVersion, &realD3D9Ex);
+            if (SUCCEEDED(hr) && realD3D9Ex) {
+                LogMsg("EX: wrapping an IDirect3D9Ex as IDirect3D9");
+                return new WrappedD3D9(realD3D9Ex, realD3D9Ex);
+            }
+            LogMsg("EX: Direct3DCreate9Ex failed (0x%08X), using Direct3DCreate9", hr);
+        }
+
+        IDirect3D9* realD3D9 = g_speculative.Take(SDKVersion, false);
+        if (!realD3D9) realD3D9 = g_origDirect3DCreate9(SDKVersion);
         if (!realD3D9) {
             LogMsg("ERROR: Original Direct3DCreate9 returned null!");
             return nullptr;
@@ -792,8 +7946,8 @@ extern "C" {
             return E_FAIL;
         }
 
-        IDirect3D9Ex* realD3D9Ex = nullptr;
-        HRESULT hr = g_origDirect3DCreate9Ex(SDKVersion, &realD3D9Ex);
+        IDirect3D9Ex* realD3D9Ex = g_speculative.TakeEx(SDKVersion);
+        HRESULT hr = realD3D9Ex ? S_OK : g_origDirect3DCreate9Ex(SDKVersion, &realD3D9Ex);
 
         if (SUCCEEDED(hr) && realD3D9Ex) {
             LogMsg("Wrapping IDirect3D9Ex");
@@ -808,13 +7962,37 @@ extern "C" {
 
     // D3DPERF forwarding functions
     int WINAPI Proxy_D3DPERF_BeginEvent(D3DCOLOR col, LPCWSTR name) {
-        if (g_origD3DPERF_BeginEvent) return g_origD3DPERF_BeginEvent(col, name);
-        return 0;
+        if (!g_config.perfEvents) {
+            if (g_origD3DPERF_BeginEvent) return g_origD3DPERF_BeginEvent(col, name);
+            return 0;
+        }
+        int level = g_perfEvents.Begin(name);
+        if (!g_origD3DPERF_BeginEvent) return level;
+        if (g_perfEvents.SkipForward()) {
+            g_perfEvents.skippedCalls++;
+            return level;
+        }
+        unsigned __int64 start = g_perfEvents.ForwardStart();
+        int hr = g_origD3DPERF_BeginEvent(col, name);
+        g_perfEvents.ForwardEnd(start);
+        return hr;
     }
 
     int WINAPI Proxy_D3DPERF_EndEvent(void) {
-        if (g_origD3DPERF_EndEvent) return g_origD3DPERF_EndEvent();
-        return 0;
+        if (!g_config.perfEvents) {
+            if (g_origD3DPERF_EndEvent) return g_origD3DPERF_EndEvent();
+            return 0;
+        }
+        int level = g_perfEvents.End();
+        if (!g_origD3DPERF_EndEvent) return level;
+        if (g_perfEvents.SkipForward()) {
+            g_perfEvents.skippedCalls++;
+            return level;
+        }
+        unsigned __int64 start = g_perfEvents.ForwardStart();
+        int hr = g_origD3DPERF_EndEvent();
+        g_perfEvents.ForwardEnd(start);
+        return hr;
     }
 
     DWORD WINAPI Proxy_D3DPERF_GetStatus(void) {
@@ -828,7 +8006,12 @@ extern "C" {
     }
 
     void WINAPI Proxy_D3DPERF_SetMarker(D3DCOLOR col, LPCWSTR name) {
-        if (g_origD3DPERF_SetMarker) g_origD3DPERF_SetMarker(col, name);
+        if (!g_origD3DPERF_SetMarker) return;
+        if (g_config.perfEvents && g_perfEvents.SkipForward()) {
+            g_perfEvents.skippedCalls++;
+            return;
+        }
+        g_origD3DPERF_SetMarker(col, name);
     }
 
     void WINAPI Proxy_D3DPERF_SetOptions(DWORD options) {
@@ -836,6 +8019,11 @@ extern "C" {
     }
 
     void WINAPI Proxy_D3DPERF_SetRegion(D3DCOLOR col, LPCWSTR name) {
-        if (g_origD3DPERF_SetRegion) g_origD3DPERF_SetRegion(col, name);
+        if (!g_origD3DPERF_SetRegion) return;
+        if (g_config.perfEvents && g_perfEvents.SkipForward()) {
+            g_perfEvents.skippedCalls++;
+            return;
+        }
+        g_origD3DPERF_SetRegion(col, name);
     }
 }
@@ -0,0 +1,224 @@
+/**
+ * draw_batch.h - Structure-of-arrays draw records and batched frustum tests
+ *
+ * Portable (no Windows/D3D dependencies). The proxy records one pass's draws
+ * here and classifies them at the pass boundary; the same kernels run in the
+ * proxy's startup benchmark.
+ *
+ * Bounds are world-space AABBs stored as center and half extent. Frustum
+ * planes come from a D3D row-vector view-projection matrix (clip = p x M),
+ * normals pointing inside, 0 <= z <= w.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE__)
+#include <xmmintrin.h>
+#define DRAW_BATCH_SSE 1
+#endif
+
+enum DrawVisibility {
+    DRAW_OUTSIDE = 0,               // Entirely behind at least one plane
+    DRAW_INTERSECTING,              // Crosses a plane
+    DRAW_INSIDE                     // Inside all six planes
+};
+
+/**
+ * Per-frame bump allocator. Everything allocated from it lives until Reset;
+ * nothing is freed individually. Allocations are 16-byte aligned.
+ */
+class FrameArena {
+private:
+    uint8_t* m_base = nullptr;
+    size_t m_size = 0;
+    size_t m_used = 0;
+
+public:
+    ~FrameArena() { free(m_base); }
+
+    bool Init(size_t size) {
+        m_base = (uint8_t*)malloc(size + 15);
+        m_size = m_base ? size : 0;
+        m_used = 0;
+        return m_base != nullptr;
+    }
+
+    // Null when the arena is full
+    void* Alloc(size_t bytes) {
+        uint8_t* aligned = (uint8_t*)(((uintptr_t)m_base + 15) & ~(uintptr_t)15);
+        size_t start = (m_used + 15) & ~(size_t)15;
+        if (!m_base || start + bytes > m_size) return nullptr;
+        m_used = start + bytes;
+        return aligned + start;
+    }
+
+    void Reset() { m_used = 0; }
+    size_t Used() const { return m_used; }
+};
+
+/**
+ * One pass's draw records as parallel arrays, capacity padded to a multiple
+ * of 4 so the SIMD kernel can read whole groups. Grows by reallocating from
+ * the arena (the old arrays are abandoned until the arena resets).
+ */
+struct DrawBatch {
+    float* cx = nullptr;
+    float* cy = nullptr;
+    float* cz = nullptr;
+    float* ex = nullptr;
+    float* ey = nullptr;
+    float* ez = nullptr;
+    uint64_t* geometryId = nullptr;
+    uint32_t* stateIndex = nullptr; // Into the recorder's state snapshots
+    uint8_t* visibility = nullptr;  // DrawVisibility, filled by the cull
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+
+    void Clear() {
+        memset(this, 0, sizeof(*this));
+    }
+
+    // False when the arena can't hold a larger batch
+    bool Reserve(FrameArena& arena, uint32_t want) {
+        if (want <= capacity) return true;
+        uint32_t cap = capacity ? capacity * 2 : 256;
+        while (cap < want) cap *= 2;
+        float* f = (float*)arena.Alloc((size_t)cap * 6 * sizeof(float));
+        uint64_t* ids = (uint64_t*)arena.Alloc((size_t)cap * sizeof(uint64_t));
+        uint32_t* states = (uint32_t*)arena.Alloc((size_t)cap * sizeof(uint32_t));
+        uint8_t* vis = (uint8_t*)arena.Alloc(cap);
+        if (!f || !ids || !states || !vis) return false;
+        float* arrays[6] = { f, f + cap, f + cap * 2, f + cap * 3, f + cap * 4, f + cap * 5 };
+        float* old[6] = { cx, cy, cz, ex, ey, ez };
+        for (int a = 0; a < 6; a++) {
+            if (count) memcpy(arrays[a], old[a], count * sizeof(float));
+        }
+        if (count) {
+            memcpy(ids, geometryId, count * sizeof(uint64_t));
+            memcpy(states, stateIndex, count * sizeof(uint32_t));
+        }
+        cx = arrays[0]; cy = arrays[1]; cz = arrays[2];
+        ex = arrays[3]; ey = arrays[4]; ez = arrays[5];
+        geometryId = ids;
+        stateIndex = states;
+        visibility = vis;
+        capacity = cap;
+        return true;
+    }
+
+    // Caller has reserved room
+    inline void Push(const float* center, const float* extent, uint64_t id, uint32_t state) {
+        uint32_t i = count++;
+        cx[i] = center[0]; cy[i] = center[1]; cz[i] = center[2];
+        ex[i] = extent[0]; ey[i] = extent[1]; ez[i] = extent[2];
+        geometryId[i] = id;
+        stateIndex[i] = state;
+    }
+
+    // Pad the last group of 4 with empty boxes at the origin so the kernel never reads garbage
+    void PadToGroup() {
+        for (uint32_t i = count; i < capacity && (i & 3); i++) {
+            cx[i] = cy[i] = cz[i] = 0.0f;
+            ex[i] = ey[i] = ez[i] = 0.0f;
+        }
+    }
+};
+
+struct FrustumPlanes {
+    // Plane p: nx[p] * x + ny[p] * y + nz[p] * z + d[p] >= 0 inside
+    float nx[6], ny[6], nz[6], d[6];
+};
+
+// m = 16 floats, row-major D3D view-projection (row vectors)
+inline void ExtractFrustumPlanes(const float* m, FrustumPlanes* out) {
+    // Column j of the matrix is (m[j], m[4 + j], m[8 + j], m[12 + j])
+    static const int kCol[6] = { 0, 0, 1, 1, 2, 2 };
+    static const float kSign[6] = { 1.0f, -1.0f, 1.0f, -1.0f, 1.0f, -1.0f };
+    for (int p = 0; p < 6; p++) {
+        int c = kCol[p];
+        float s = kSign[p];
+        float a, b, cc, dd;
+        if (p == 4) {
+            // Near: z >= 0
+            a = m[2]; b = m[6]; cc = m[10]; dd = m[14];
+        } else {
+            // w +/- x, w +/- y, and far: w - z >= 0
+            a = m[3] + s * m[c];
+            b = m[7] + s * m[4 + c];
+            cc = m[11] + s * m[8 + c];
+            dd = m[15] + s * m[12 + c];
+        }
+        float len = sqrtf(a * a + b * b + cc * cc);
+        float inv = len > 0.0f ? 1.0f / len : 0.0f;
+        out->nx[p] = a * inv;
+        out->ny[p] = b * inv;
+        out->nz[p] = cc * inv;
+        out->d[p] = dd * inv;
+    }
+}
+
+// One box against the frustum: the test a draw hook would make inline
+inline DrawVisibility ClassifyBox(const FrustumPlanes& f, float cx, float cy, float cz, float ex, float ey, float ez) {
+    DrawVisibility result = DRAW_INSIDE;
+    for (int p = 0; p < 6; p++) {
+        float dist = f.nx[p] * cx + f.ny[p] * cy + f.nz[p] * cz + f.d[p];
+        float radius = fabsf(f.nx[p]) * ex + fabsf(f.ny[p]) * ey + fabsf(f.nz[p]) * ez;
+        if (dist < -radius) return DRAW_OUTSIDE;
+        if (dist < radius) result = DRAW_INTERSECTING;
+    }
+    return result;
+}
+
+// Scalar reference over a batch
+inline void ClassifyBatchScalar(const FrustumPlanes& f, DrawBatch& b) {
+    for (uint32_t i = 0; i < b.count; i++) {
+        b.visibility[i] = (uint8_t)ClassifyBox(f, b.cx[i], b.cy[i], b.cz[i], b.ex[i], b.ey[i], b.ez[i]);
+    }
+}
+
+// Four boxes per iteration. The SSE path adds the plane terms in a different order than
+// ClassifyBox, so a box within rounding of a plane can come out one class apart from the
+// scalar path; everything else matches. proxy_bench checks this against ClassifyBatchScalar.
+inline void ClassifyBatch(const FrustumPlanes& f, DrawBatch& b) {
+#ifdef DRAW_BATCH_SSE
+    b.PadToGroup();
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    for (uint32_t i = 0; i < b.count; i += 4) {
+        __m128 cx = _mm_load_ps(b.cx + i), cy = _mm_load_ps(b.cy + i), cz = _mm_load_ps(b.cz + i);
+        __m128 ex = _mm_load_ps(b.ex + i), ey = _mm_load_ps(b.ey + i), ez = _mm_load_ps(b.ez + i);
+        __m128 outside = _mm_setzero_ps();
+        __m128 crossing = _mm_setzero_ps();
+        for (int p = 0; p < 6; p++) {
+            __m128 nx = _mm_set1_ps(f.nx[p]), ny = _mm_set1_ps(f.ny[p]), nz = _mm_set1_ps(f.nz[p]);
+            __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)),
+                                     _mm_add_ps(_mm_mul_ps(nz, cz), _mm_set1_ps(f.d[p])));
+            __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(signMask, nx), ex),
+                                                  _mm_mul_ps(_mm_andnot_ps(signMask, ny), ey)),
+                                       _mm_mul_ps(_mm_andnot_ps(signMask, nz), ez));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(dist, _mm_xor_ps(radius, signMask)));
+            crossing = _mm_or_ps(crossing, _mm_cmplt_ps(dist, radius));
+        }
+        int out = _mm_movemask_ps(outside);
+        int cross = _mm_movemask_ps(crossing);
+        uint32_t n = b.count - i < 4 ? b.count - i : 4;
+        for (uint32_t k = 0; k < n; k++) {
+            b.visibility[i + k] = (out >> k) & 1 ? DRAW_OUTSIDE : (cross >> k) & 1 ? DRAW_INTERSECTING : DRAW_INSIDE;
+        }
+    }
+#else
+    ClassifyBatchScalar(f, b);
+#endif
+}
+
+// World-space box of an object-space box under a row-vector world matrix (m = 16 floats)
+inline void TransformBox(const float* m, const float* center, const float* extent, float* outCenter, float* outExtent) {
+    for (int j = 0; j < 3; j++) {
+        outCenter[j] = center[0] * m[j] + center[1] * m[4 + j] + center[2] * m[8 + j] + m[12 + j];
+        outExtent[j] = extent[0] * fabsf(m[j]) + extent[1] * fabsf(m[4 + j]) + extent[2] * fabsf(m[8 + j]);
+    }
+}
@@ -0,0 +1,200 @@
+/**
+ * gpu_timer.h - D3D9 timestamp queries behind the GPU frame time
+ *
+ * Uses IDirect3DDevice9/IDirect3DQuery9 and the D3D constants, which must be
+ * declared before this header: the proxy includes it after d3d9.h, tests/
+ * after d3d9_standin.h, whose recording device stands in for the runtime.
+ */
+
+#pragma once
+
+#include <cstring>
+#include <algorithm>
+
+#include "proxy_math.h"
+
+void LogMsg(const char* fmt, ...);
+
+// Proxy-defined GPU regions, timed alongside the whole frame
+enum GpuRegion {
+    GPU_REGION_WORLD = 0,   // First to last world-class draw
+    GPU_REGION_UPLOADS,     // Compressed texture uploads at Present
+    GPU_REGION_COUNT
+};
+
+/**
+ * GPU timer - D3D9 timestamp queries around each frame and proxy regions.
+ *
+ * Queries live in a ring of frames and are read back several frames later with
+ * a non-blocking GetData, so the CPU never waits on the GPU; a frame whose
+ * results are still pending when its slot comes round again is dropped. If the
+ * runtime lacks timestamp queries the timer disables itself at init.
+ */
+class GpuTimer {
+private:
+    static const int kMaxLatency = 8;
+
+    struct FrameQueries {
+        IDirect3DQuery9* disjoint;
+        IDirect3DQuery9* freq;
+        IDirect3DQuery9* begin;
+        IDirect3DQuery9* end;
+        IDirect3DQuery9* regionBegin[GPU_REGION_COUNT];
+        IDirect3DQuery9* regionEnd[GPU_REGION_COUNT];
+        bool issued;
+        bool regionIssued[GPU_REGION_COUNT];
+    };
+
+    FrameQueries m_frames[kMaxLatency] = {};
+    int m_latency = 0;
+    int m_current = 0;
+    bool m_enabled = false;
+    bool m_inFrame = false;
+
+    void ReleaseFrame(FrameQueries& f) {
+        IDirect3DQuery9** all[] = { &f.disjoint, &f.freq, &f.begin, &f.end };
+        for (IDirect3DQuery9** q : all) {
+            if (*q) (*q)->Release();
+            *q = nullptr;
+        }
+        for (int r = 0; r < GPU_REGION_COUNT; r++) {
+            if (f.regionBegin[r]) f.regionBegin[r]->Release();
+            if (f.regionEnd[r]) f.regionEnd[r]->Release();
+            f.regionBegin[r] = f.regionEnd[r] = nullptr;
+        }
+    }
+
+    static bool GetTicks(IDirect3DQuery9* q, UINT64* ticks) {
+        return q->GetData(ticks, sizeof(UINT64), 0) == S_OK;
+    }
+
+    // Non-blocking readback of one frame; false while the GPU has not caught up
+    bool Collect(FrameQueries& f) {
+        BOOL disjoint = TRUE;
+        UINT64 freq = 0, begin = 0, end = 0;
+        if (f.disjoint->GetData(&disjoint, sizeof(disjoint), 0) != S_OK) return false;
+        if (f.freq->GetData(&freq, sizeof(freq), 0) != S_OK) return false;
+        if (!GetTicks(f.begin, &begin) || !GetTicks(f.end, &end)) return false;
+
+        f.issued = false;
+        if (disjoint || freq == 0) {
+            disjointFrames++;  // Clock changed mid-frame (power state, etc.)
+            return true;
+        }
+        lastFrameMs = (float)((double)(end - begin) * 1000.0 / (double)freq);
+        history.Add(lastFrameMs);
+        for (int r = 0; r < GPU_REGION_COUNT; r++) {
+            UINT64 rb = 0, re = 0;
+            if (f.regionIssued[r] && GetTicks(f.regionBegin[r], &rb) && GetTicks(f.regionEnd[r], &re) && re >= rb) {
+                regionMsTotal[r] += (double)(re - rb) * 1000.0 / (double)freq;
+            }
+        }
+        framesMeasured++;
+        return true;
+    }
+
+public:
+    // Statistics, reported in the periodic status
+    FrameTimeHistory history;
+    float lastFrameMs = 0.0f;
+    double regionMsTotal[GPU_REGION_COUNT] = {};  // Since last status
+    int framesMeasured = 0;                      // Since last status
+    int framesDropped = 0;                       // Results not ready when the slot was reused
+    int disjointFrames = 0;
+
+    bool Enabled() const { return m_enabled; }
+
+    bool Init(IDirect3DDevice9* device, int latency) {
+        m_latency = (std::max)(2, (std::min)(latency, kMaxLatency));
+
+        // A null output pointer only asks whether the query type is supported
+        if (FAILED(device->CreateQuery(D3DQUERYTYPE_TIMESTAMP, nullptr)) ||
+            FAILED(device->CreateQuery(D3DQUERYTYPE_TIMESTAMPDISJOINT, nullptr)) ||
+            FAILED(device->CreateQuery(D3DQUERYTYPE_TIMESTAMPFREQ, nullptr))) {
+            LogMsg("GpuTimer: timestamp queries not supported, disabled");
+            return false;
+        }
+
+        for (int i = 0; i < m_latency; i++) {
+            FrameQueries& f = m_frames[i];
+            bool ok = SUCCEEDED(device->CreateQuery(D3DQUERYTYPE_TIMESTAMPDISJOINT, &f.disjoint)) &&
+                      SUCCEEDED(device->CreateQuery(D3DQUERYTYPE_TIMESTAMPFREQ, &f.freq)) &&
+                      SUCCEEDED(device->CreateQuery(D3DQUERYTYPE_TIMESTAMP, &f.begin)) &&
+                      SUCCEEDED(device->CreateQuery(D3DQUERYTYPE_TIMESTAMP, &f.end));
+            for (int r = 0; ok && r < GPU_REGION_COUNT; r++) {
+                ok = SUCCEEDED(device->CreateQuery(D3DQUERYTYPE_TIMESTAMP, &f.regionBegin[r])) &&
+                     SUCCEEDED(device->CreateQuery(D3DQUERYTYPE_TIMESTAMP, &f.regionEnd[r]));
+            }
+            if (!ok) {
+                LogMsg("GpuTimer: CreateQuery failed, disabled");
+                Shutdown();
+                return false;
+            }
+        }
+        m_enabled = true;
+        LogMsg("GpuTimer: %d frames of timestamp queries in flight", m_latency);
+        return true;
+    }
+
+    void Shutdown() {
+        for (int i = 0; i < kMaxLatency; i++) ReleaseFrame(m_frames[i]);
+        m_enabled = false;
+        m_inFrame = false;
+    }
+
+    void BeginFrame() {
+        if (!m_enabled) return;
+        FrameQueries& f = m_frames[m_current];
+        if (f.issued && !Collect(f)) {
+            framesDropped++;
+            f.issued = false;
+        }
+        memset(f.regionIssued, 0, sizeof(f.regionIssued));
+        f.disjoint->Issue(D3DISSUE_BEGIN);
+        f.begin->Issue(D3DISSUE_END);
+        m_inFrame = true;
+    }
+
+    // Regions may end several times per frame; the last end wins
+    void BeginRegion(GpuRegion region) {
+        if (!m_inFrame) return;
+        FrameQueries& f = m_frames[m_current];
+        if (f.regionIssued[region]) return;
+        f.regionBegin[region]->Issue(D3DISSUE_END);
+        f.regionEnd[region]->Issue(D3DISSUE_END);
+        f.regionIssued[region] = true;
+    }
+
+    void EndRegion(GpuRegion region) {
+        if (!m_inFrame || !m_frames[m_current].regionIssued[region]) return;
+        m_frames[m_current].regionEnd[region]->Issue(D3DISSUE_END);
+    }
+
+    void EndFrame() {
+        if (!m_inFrame) return;
+        FrameQueries& f = m_frames[m_current];
+        f.end->Issue(D3DISSUE_END);
+        f.freq->Issue(D3DISSUE_END);
+        f.disjoint->Issue(D3DISSUE_END);
+        f.issued = true;
+        m_inFrame = false;
+
+        // Read back whatever older frames have finished
+        for (int i = 1; i < m_latency; i++) {
+            FrameQueries& old = m_frames[(m_current + i) % m_latency];
+            if (old.issued) Collect(old);
+        }
+        m_current = (m_current + 1) % m_latency;
+    }
+
+    void LogStatus() {
+        if (!m_enabled) return;
+        LogMsg("  GPU: last %.2f ms, median %.2f ms over %d frames; world %.2f ms/frame, uploads %.3f ms/frame; %d dropped, %d disjoint",
+               lastFrameMs, history.Median(), framesMeasured,
+               framesMeasured ? regionMsTotal[GPU_REGION_WORLD] / framesMeasured : 0.0,
+               framesMeasured ? regionMsTotal[GPU_REGION_UPLOADS] / framesMeasured : 0.0,
+               framesDropped, disjointFrames);
+        memset(regionMsTotal, 0, sizeof(regionMsTotal));
+        framesMeasured = 0;
+    }
+};
@@ -0,0 +1,18 @@
+/**
+ * proxy_log.h - Log line output behind LogMsg
+ *
+ * Portable so bench/ times the same formatting and flush the proxy pays for
+ * each log line.
+ */
+
+#pragma once
+
+#include <cstdarg>
+#include <cstdio>
+
+// One line, flushed so the log survives a crash
+inline void WriteLogLine(FILE* f, const char* fmt, va_list args) {
+    vfprintf(f, fmt, args);
+    fputc('\n', f);
+    fflush(f);
+}
@@ -0,0 +1,225 @@
+/**
+ * proxy_math.h - Matrix math and frame bookkeeping used by the proxy
+ *
+ * Portable (no Windows dependencies) so bench/ can time the exact functions
+ * the proxy runs. D3DMATRIX comes from d3d9.h when the proxy includes this
+ * after it; otherwise an identical definition is provided here.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#ifndef D3DMATRIX_DEFINED
+// Same layout as d3d9types.h
+typedef struct _D3DMATRIX {
+    union {
+        struct {
+            float _11, _12, _13, _14;
+            float _21, _22, _23, _24;
+            float _31, _32, _33, _34;
+            float _41, _42, _43, _44;
+        };
+        float m[4][4];
+    };
+} D3DMATRIX;
+#define D3DMATRIX_DEFINED
+#endif
+
+// Check if matrix values are valid
+inline bool LooksLikeMatrix(const float* data) {
+    float sum = 0;
+    for (int i = 0; i < 16; i++) {
+        if (!std::isfinite(data[i])) return false;
+        sum += fabsf(data[i]);
+    }
+    if (sum < 0.001f || sum > 100000.0f) return false;
+    return true;
+}
+
+// Extract FOV from projection matrix
+inline float ExtractFOV(const D3DMATRIX& proj) {
+    if (fabsf(proj._22) < 0.001f) return 0;
+    return 2.0f * atanf(1.0f / proj._22);
+}
+
+// Check if matrix looks like projection
+inline bool LooksLikeProjection(const D3DMATRIX& m, float minFOV, float maxFOV) {
+    // Check for typical projection structure
+    if (fabsf(m._12) > 0.01f || fabsf(m._13) > 0.01f || fabsf(m._14) > 0.01f) return false;
+    if (fabsf(m._21) > 0.01f || fabsf(m._23) > 0.01f || fabsf(m._24) > 0.01f) return false;
+    if (fabsf(m._31) > 0.01f || fabsf(m._32) > 0.01f) return false;
+    if (fabsf(m._11) < 0.01f || fabsf(m._22) < 0.01f) return false;
+
+    float fov = ExtractFOV(m);
+    if (fov < minFOV || fov > maxFOV) return false;
+
+    return true;
+}
+
+// Create a standard perspective projection matrix
+inline void CreateProjectionMatrix(D3DMATRIX* out, float fovY, float aspect, float zNear, float zFar) {
+    float yScale = 1.0f / tanf(fovY / 2.0f);
+    float xScale = yScale / aspect;
+    memset(out, 0, sizeof(D3DMATRIX));
+    out->_11 = xScale;
+    out->_22 = yScale;
+    out->_33 = zFar / (zFar - zNear);
+    out->_34 = 1.0f;
+    out->_43 = -zNear * zFar / (zFar - zNear);
+}
+
+// Create an identity matrix
+inline void CreateIdentityMatrix(D3DMATRIX* out) {
+    memset(out, 0, sizeof(D3DMATRIX));
+    out->_11 = out->_22 = out->_33 = out->_44 = 1.0f;
+}
+
+// out = a * b (row-vector convention, out may not alias a or b)
+inline void MultiplyMatrix(D3DMATRIX* out, const D3DMATRIX& a, const D3DMATRIX& b) {
+    for (int r = 0; r < 4; r++) {
+        for (int c = 0; c < 4; c++) {
+            out->m[r][c] = a.m[r][0] * b.m[0][c] + a.m[r][1] * b.m[1][c] +
+                           a.m[r][2] * b.m[2][c] + a.m[r][3] * b.m[3][c];
+        }
+    }
+}
+
+// General 4x4 inverse by cofactors; returns false for singular matrices
+inline bool InvertMatrix(D3DMATRIX* out, const D3DMATRIX& in) {
+    const float* m = &in._11;
+    double inv[16];
+    inv[0]  =  m[5]*m[10]*m[15] - m[5]*m[11]*m[14] - m[9]*m[6]*m[15] + m[9]*m[7]*m[14] + m[13]*m[6]*m[11] - m[13]*m[7]*m[10];
+    inv[4]  = -m[4]*m[10]*m[15] + m[4]*m[11]*m[14] + m[8]*m[6]*m[15] - m[8]*m[7]*m[14] - m[12]*m[6]*m[11] + m[12]*m[7]*m[10];
+    inv[8]  =  m[4]*m[9]*m[15]  - m[4]*m[11]*m[13] - m[8]*m[5]*m[15] + m[8]*m[7]*m[13] + m[12]*m[5]*m[11] - m[12]*m[7]*m[9];
+    inv[12] = -m[4]*m[9]*m[14]  + m[4]*m[10]*m[13] + m[8]*m[5]*m[14] - m[8]*m[6]*m[13] - m[12]*m[5]*m[10] + m[12]*m[6]*m[9];
+    inv[1]  = -m[1]*m[10]*m[15] + m[1]*m[11]*m[14] + m[9]*m[2]*m[15] - m[9]*m[3]*m[14] - m[13]*m[2]*m[11] + m[13]*m[3]*m[10];
+    inv[5]  =  m[0]*m[10]*m[15] - m[0]*m[11]*m[14] - m[8]*m[2]*m[15] + m[8]*m[3]*m[14] + m[12]*m[2]*m[11] - m[12]*m[3]*m[10];
+    inv[9]  = -m[0]*m[9]*m[15]  + m[0]*m[11]*m[13] + m[8]*m[1]*m[15] - m[8]*m[3]*m[13] - m[12]*m[1]*m[11] + m[12]*m[3]*m[9];
+    inv[13] =  m[0]*m[9]*m[14]  - m[0]*m[10]*m[13] - m[8]*m[1]*m[14] + m[8]*m[2]*m[13] + m[12]*m[1]*m[10] - m[12]*m[2]*m[9];
+    inv[2]  =  m[1]*m[6]*m[15]  - m[1]*m[7]*m[14]  - m[5]*m[2]*m[15] + m[5]*m[3]*m[14] + m[13]*m[2]*m[7]  - m[13]*m[3]*m[6];
+    inv[6]  = -m[0]*m[6]*m[15]  + m[0]*m[7]*m[14]  + m[4]*m[2]*m[15] - m[4]*m[3]*m[14] - m[12]*m[2]*m[7]  + m[12]*m[3]*m[6];
+    inv[10] =  m[0]*m[5]*m[15]  - m[0]*m[7]*m[13]  - m[4]*m[1]*m[15] + m[4]*m[3]*m[13] + m[12]*m[1]*m[7]  - m[12]*m[3]*m[5];
+    inv[14] = -m[0]*m[5]*m[14]  + m[0]*m[6]*m[13]  + m[4]*m[1]*m[14] - m[4]*m[2]*m[13] - m[12]*m[1]*m[6]  + m[12]*m[2]*m[5];
+    inv[3]  = -m[1]*m[6]*m[11]  + m[1]*m[7]*m[10]  + m[5]*m[2]*m[11] - m[5]*m[3]*m[10] - m[9]*m[2]*m[7]   + m[9]*m[3]*m[6];
+    inv[7]  =  m[0]*m[6]*m[11]  - m[0]*m[7]*m[10]  - m[4]*m[2]*m[11] + m[4]*m[3]*m[10] + m[8]*m[2]*m[7]   - m[8]*m[3]*m[6];
+    inv[11] = -m[0]*m[5]*m[11]  + m[0]*m[7]*m[9]   + m[4]*m[1]*m[11] - m[4]*m[3]*m[9]  - m[8]*m[1]*m[7]   + m[8]*m[3]*m[5];
+    inv[15] =  m[0]*m[5]*m[10]  - m[0]*m[6]*m[9]   - m[4]*m[1]*m[10] + m[4]*m[2]*m[9]  + m[8]*m[1]*m[6]   - m[8]*m[2]*m[5];
+
+    double det = m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8] + m[3] * inv[12];
+    if (fabs(det) < 1e-12) return false;
+
+    double invDet = 1.0 / det;
+    float* o = &out->_11;
+    for (int i = 0; i < 16; i++) o[i] = (float)(inv[i] * invDet);
+    return true;
+}
+
+// Column-major shader registers (4 float4s) -> row-major D3DMATRIX
+inline void TransposeFromRegisters(D3DMATRIX* out, const float* regs) {
+    for (int r = 0; r < 4; r++) {
+        for (int c = 0; c < 4; c++) {
+            out->m[r][c] = regs[c * 4 + r];
+        }
+    }
+}
+
+// True when every element of a is within eps (relative for large values) of b
+inline bool MatricesNearlyEqual(const D3DMATRIX& a, const D3DMATRIX& b, float eps) {
+    const float* pa = &a._11;
+    const float* pb = &b._11;
+    for (int i = 0; i < 16; i++) {
+        float mag = fabsf(pb[i]);
+        float tol = eps * (mag > 1.0f ? mag : 1.0f);
+        if (fabsf(pa[i] - pb[i]) > tol) return false;
+    }
+    return true;
+}
+
+// 64-bit finalizer (splitmix64) used to build geometry IDs
+inline uint64_t HashMix64(uint64_t x) {
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Check if matrix looks like view matrix (orthonormal rotation + translation)
+inline bool LooksLikeView(const D3DMATRIX& m) {
+    float row0len = sqrtf(m._11*m._11 + m._12*m._12 + m._13*m._13);
+    float row1len = sqrtf(m._21*m._21 + m._22*m._22 + m._23*m._23);
+    float row2len = sqrtf(m._31*m._31 + m._32*m._32 + m._33*m._33);
+
+    if (fabsf(row0len - 1.0f) > 0.1f) return false;
+    if (fabsf(row1len - 1.0f) > 0.1f) return false;
+    if (fabsf(row2len - 1.0f) > 0.1f) return false;
+
+    if (fabsf(m._14) > 0.01f || fabsf(m._24) > 0.01f || fabsf(m._34) > 0.01f) return false;
+    if (fabsf(m._44 - 1.0f) > 0.01f) return false;
+
+    return true;
+}
+
+// Check if matrix could be ViewProjection (has projection-like characteristics but rotation too)
+inline bool LooksLikeViewProjection(const D3DMATRIX& m) {
+    // ViewProj will have large values due to projection multiplication
+    // Check for non-zero values in typical projection positions
+    if (fabsf(m._34) < 0.5f) return false;  // Perspective divide indicator
+    if (fabsf(m._44) > 0.1f) return false;  // Should be ~0 for perspective
+
+    // Should have some rotation component
+    float magnitude = sqrtf(m._11*m._11 + m._12*m._12 + m._13*m._13);
+    if (magnitude < 0.1f) return false;
+
+    return true;
+}
+
+// Try to extract View from ViewProjection by removing projection component
+inline void ExtractViewFromViewProjection(const D3DMATRIX& vp, D3DMATRIX* viewOut) {
+    CreateIdentityMatrix(viewOut);
+
+    // The ViewProjection combines View and Projection
+    // We need to approximately invert the projection influence
+    // For a typical projection, _11 and _22 contain the FOV scaling
+
+    float r0len = sqrtf(vp._11*vp._11 + vp._12*vp._12 + vp._13*vp._13);
+    float r1len = sqrtf(vp._21*vp._21 + vp._22*vp._22 + vp._23*vp._23);
+    float r2len = sqrtf(vp._31*vp._31 + vp._32*vp._32 + vp._33*vp._33);
+
+    if (r0len > 0.001f && r1len > 0.001f && r2len > 0.001f) {
+        // Normalize to approximate rotation
+        viewOut->_11 = vp._11 / r0len; viewOut->_12 = vp._12 / r0len; viewOut->_13 = vp._13 / r0len;
+        viewOut->_21 = vp._21 / r1len; viewOut->_22 = vp._22 / r1len; viewOut->_23 = vp._23 / r1len;
+        viewOut->_31 = vp._31 / r2len; viewOut->_32 = vp._32 / r2len; viewOut->_33 = vp._33 / r2len;
+
+        // Translation approximation
+        viewOut->_41 = vp._14 / r0len;
+        viewOut->_42 = vp._24 / r1len;
+        viewOut->_43 = vp._34 / r2len;
+    }
+}
+
+// Rolling window of frame times with a median, used to decide what a hitch is
+struct FrameTimeHistory {
+    static const int SIZE = 64;
+    float samples[SIZE] = {};
+    int count = 0;
+    int next = 0;
+
+    void Add(float ms) {
+        samples[next] = ms;
+        next = (next + 1) % SIZE;
+        if (count < SIZE) count++;
+    }
+
+    float Median() const {
+        if (count == 0) return 0.0f;
+        float sorted[SIZE];
+        memcpy(sorted, samples, count * sizeof(float));
+        std::nth_element(sorted, sorted + count / 2, sorted + count);
+        return sorted[count / 2];
+    }
+};
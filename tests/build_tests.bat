@@ -0,0 +1,5 @@
+@echo off
+rem Builds and runs the unit tests. Run from a VS developer prompt.
+cd /d "%~dp0"
+cl /nologo /O2 /EHsc /std:c++17 gpu_timer_test.cpp /Fe:gpu_timer_test.exe || exit /b 1
+gpu_timer_test.exe
@@ -0,0 +1,7 @@
+#!/bin/sh
+# Builds and runs the unit tests on Linux/macOS.
+set -e
+cd "$(dirname "$0")"
+CXX=${CXX:-g++}
+$CXX -O2 -std=c++17 -Wall -o gpu_timer_test gpu_timer_test.cpp
+./gpu_timer_test
@@ -0,0 +1,147 @@
+/**
+ * d3d9_standin.h - The slice of the D3D9 API gpu_timer.h uses, plus a
+ * recording device to drive it without a GPU
+ *
+ * RecordingDevice logs every query it creates and every Issue, and answers
+ * GetData from a scripted GPU. The test advances the GPU clock by hand;
+ * a timestamp issued with D3DISSUE_END reads the clock at that moment, and
+ * every result becomes available gpuLagFrames Presents after its issue.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+typedef int32_t HRESULT;
+typedef int BOOL;
+typedef uint32_t DWORD;
+typedef uint64_t UINT64;
+typedef unsigned int UINT;
+
+#define TRUE 1
+#define FALSE 0
+#define S_OK ((HRESULT)0)
+#define S_FALSE ((HRESULT)1)
+#define E_FAIL ((HRESULT)0x80004005u)
+#define D3DERR_NOTAVAILABLE ((HRESULT)0x8876086Au)
+#define SUCCEEDED(hr) ((HRESULT)(hr) >= 0)
+#define FAILED(hr) ((HRESULT)(hr) < 0)
+
+#define D3DISSUE_END (1 << 0)
+#define D3DISSUE_BEGIN (1 << 1)
+
+enum D3DQUERYTYPE {
+    D3DQUERYTYPE_TIMESTAMP = 10,
+    D3DQUERYTYPE_TIMESTAMPDISJOINT = 11,
+    D3DQUERYTYPE_TIMESTAMPFREQ = 12
+};
+
+class IDirect3DQuery9 {
+public:
+    virtual ~IDirect3DQuery9() {}
+    virtual unsigned long AddRef() = 0;
+    virtual unsigned long Release() = 0;
+    virtual D3DQUERYTYPE GetType() = 0;
+    virtual HRESULT Issue(DWORD flags) = 0;
+    virtual HRESULT GetData(void* data, DWORD size, DWORD flags) = 0;
+};
+
+class IDirect3DDevice9 {
+public:
+    virtual ~IDirect3DDevice9() {}
+    virtual HRESULT CreateQuery(D3DQUERYTYPE type, IDirect3DQuery9** query) = 0;
+};
+
+class RecordedQuery;
+
+class RecordingDevice : public IDirect3DDevice9 {
+public:
+    struct IssueRecord {
+        int query;                  // Creation order
+        D3DQUERYTYPE type;
+        DWORD flags;
+    };
+
+    // Script
+    bool supportsTimestamps = true;
+    int createsBeforeFailure = -1;  // Query creations that succeed before one fails, -1 = never
+    int gpuLagFrames = 1;
+    UINT64 frequency = 1000000;     // Ticks per second
+    bool disjoint = false;          // Reported by disjoint queries ended while set
+
+    // Recorded
+    std::vector<IssueRecord> issues;
+    int created = 0;
+    int live = 0;                   // Queries not yet released
+
+    // GPU state
+    UINT64 clock = 0;
+    int frame = 0;
+
+    void Advance(double ms) { clock += (UINT64)(ms * (double)frequency / 1000.0 + 0.5); }
+    void Present() { frame++; }
+
+    HRESULT CreateQuery(D3DQUERYTYPE type, IDirect3DQuery9** query) override;
+};
+
+class RecordedQuery : public IDirect3DQuery9 {
+private:
+    RecordingDevice* m_device;
+    D3DQUERYTYPE m_type;
+    int m_id;
+    unsigned long m_refs = 1;
+    bool m_ended = false;
+    int m_readyFrame = 0;
+    UINT64 m_value = 0;
+
+public:
+    RecordedQuery(RecordingDevice* device, D3DQUERYTYPE type, int id) : m_device(device), m_type(type), m_id(id) {
+        device->live++;
+    }
+    ~RecordedQuery() override { m_device->live--; }
+
+    unsigned long AddRef() override { return ++m_refs; }
+    unsigned long Release() override {
+        unsigned long count = --m_refs;
+        if (count == 0) delete this;
+        return count;
+    }
+    D3DQUERYTYPE GetType() override { return m_type; }
+
+    HRESULT Issue(DWORD flags) override {
+        m_device->issues.push_back({ m_id, m_type, flags });
+        if (!(flags & D3DISSUE_END)) return S_OK;
+        m_ended = true;
+        m_readyFrame = m_device->frame + m_device->gpuLagFrames;
+        switch (m_type) {
+        case D3DQUERYTYPE_TIMESTAMP: m_value = m_device->clock; break;
+        case D3DQUERYTYPE_TIMESTAMPFREQ: m_value = m_device->frequency; break;
+        case D3DQUERYTYPE_TIMESTAMPDISJOINT: m_value = m_device->disjoint ? 1 : 0; break;
+        }
+        return S_OK;
+    }
+
+    HRESULT GetData(void* data, DWORD size, DWORD flags) override {
+        if (!m_ended || m_device->frame < m_readyFrame) return S_FALSE;
+        if (m_type == D3DQUERYTYPE_TIMESTAMPDISJOINT) {
+            BOOL value = (BOOL)m_value;
+            if (size != sizeof(value)) return E_FAIL;
+            memcpy(data, &value, sizeof(value));
+        } else {
+            if (size != sizeof(m_value)) return E_FAIL;
+            memcpy(data, &m_value, sizeof(m_value));
+        }
+        return S_OK;
+    }
+};
+
+// A null output pointer only asks whether the type is supported, as on the real runtime
+inline HRESULT RecordingDevice::CreateQuery(D3DQUERYTYPE type, IDirect3DQuery9** query) {
+    if (!supportsTimestamps) return D3DERR_NOTAVAILABLE;
+    if (!query) return S_OK;
+    if (createsBeforeFailure >= 0 && created >= createsBeforeFailure) return E_FAIL;
+    *query = new RecordedQuery(this, type, created++);
+    return S_OK;
+}
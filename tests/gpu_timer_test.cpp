@@ -0,0 +1,200 @@
+/**
+ * gpu_timer_test - GpuTimer against the recording stand-in device
+ *
+ * Drives frames through the proxy's GpuTimer (gpu_timer.h) with a scripted
+ * GPU clock and checks the frame and region times it reports, the order it
+ * issues its queries in, and how it handles results that arrive late, frames
+ * the GPU marks disjoint, and runtimes without timestamp queries.
+ *
+ * Usage: gpu_timer_test [-v]      Exit code is the number of failed checks.
+ */
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <cmath>
+
+#include "d3d9_standin.h"
+#include "../gpu_timer.h"
+
+static bool g_verbose = false;
+static int g_failures = 0;
+
+void LogMsg(const char* fmt, ...) {
+    if (!g_verbose) return;
+    va_list args;
+    va_start(args, fmt);
+    printf("    log: ");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            g_failures++; \
+        } \
+    } while (0)
+
+#define CHECK_NEAR(a, b) CHECK(fabs((double)(a) - (double)(b)) < 1.0e-3)
+
+// One frame of frameMs GPU time, worldMs of it inside the world region
+static void RunFrame(GpuTimer& timer, RecordingDevice& device, double frameMs, double worldMs = 0.0) {
+    timer.BeginFrame();
+    if (worldMs > 0.0) {
+        timer.BeginRegion(GPU_REGION_WORLD);
+        device.Advance(worldMs);
+        timer.EndRegion(GPU_REGION_WORLD);
+    }
+    device.Advance(frameMs - worldMs);
+    timer.EndFrame();
+    device.Present();
+}
+
+static void TestUnsupported() {
+    RecordingDevice device;
+    device.supportsTimestamps = false;
+    GpuTimer timer;
+    CHECK(!timer.Init(&device, 3));
+    CHECK(!timer.Enabled());
+    RunFrame(timer, device, 10.0);
+    CHECK(device.issues.empty());
+    CHECK(device.live == 0);
+}
+
+static void TestCreateFailure() {
+    RecordingDevice device;
+    device.createsBeforeFailure = 9;    // Fails partway through the second frame's queries
+    GpuTimer timer;
+    CHECK(!timer.Init(&device, 3));
+    CHECK(!timer.Enabled());
+    CHECK(device.live == 0);
+}
+
+static void TestIssueOrder() {
+    RecordingDevice device;
+    GpuTimer timer;
+    CHECK(timer.Init(&device, 3));
+    RunFrame(timer, device, 10.0);
+    size_t n = device.issues.size();
+    CHECK(n == 5);
+    if (n != 5) return;
+    // Disjoint brackets the frame; frequency is read at its end
+    CHECK(device.issues[0].type == D3DQUERYTYPE_TIMESTAMPDISJOINT && device.issues[0].flags == D3DISSUE_BEGIN);
+    CHECK(device.issues[1].type == D3DQUERYTYPE_TIMESTAMP && device.issues[1].flags == D3DISSUE_END);
+    CHECK(device.issues[2].type == D3DQUERYTYPE_TIMESTAMP && device.issues[2].flags == D3DISSUE_END);
+    CHECK(device.issues[3].type == D3DQUERYTYPE_TIMESTAMPFREQ && device.issues[3].flags == D3DISSUE_END);
+    CHECK(device.issues[4].type == D3DQUERYTYPE_TIMESTAMPDISJOINT && device.issues[4].flags == D3DISSUE_END);
+    timer.Shutdown();
+}
+
+static void TestFrameTimes() {
+    RecordingDevice device;
+    GpuTimer timer;
+    CHECK(timer.Init(&device, 3));
+    for (int i = 0; i < 10; i++) RunFrame(timer, device, 8.0, 5.0);
+    // One frame of GPU lag: the last frame is still outstanding
+    CHECK(timer.framesMeasured == 9);
+    CHECK(timer.framesDropped == 0);
+    CHECK(timer.disjointFrames == 0);
+    CHECK_NEAR(timer.lastFrameMs, 8.0);
+    CHECK_NEAR(timer.history.Median(), 8.0);
+    CHECK_NEAR(timer.regionMsTotal[GPU_REGION_WORLD] / timer.framesMeasured, 5.0);
+    CHECK_NEAR(timer.regionMsTotal[GPU_REGION_UPLOADS], 0.0);
+
+    timer.LogStatus();
+    CHECK(timer.framesMeasured == 0);
+    CHECK_NEAR(timer.regionMsTotal[GPU_REGION_WORLD], 0.0);
+    timer.Shutdown();
+}
+
+static void TestRegionEndsTwice() {
+    RecordingDevice device;
+    GpuTimer timer;
+    CHECK(timer.Init(&device, 3));
+    timer.BeginFrame();
+    timer.BeginRegion(GPU_REGION_WORLD);
+    device.Advance(2.0);
+    timer.EndRegion(GPU_REGION_WORLD);
+    device.Advance(1.0);
+    timer.BeginRegion(GPU_REGION_WORLD);    // Already begun this frame: ignored
+    device.Advance(2.0);
+    timer.EndRegion(GPU_REGION_WORLD);      // The last end wins
+    device.Advance(1.0);
+    timer.EndFrame();
+    device.Present();
+    RunFrame(timer, device, 6.0);
+    CHECK(timer.framesMeasured == 1);
+    CHECK_NEAR(timer.lastFrameMs, 6.0);
+    CHECK_NEAR(timer.regionMsTotal[GPU_REGION_WORLD], 5.0);
+    timer.Shutdown();
+}
+
+static void TestLateResults() {
+    RecordingDevice device;
+    device.gpuLagFrames = 3;            // Longer than the ring
+    GpuTimer timer;
+    CHECK(timer.Init(&device, 2));
+    for (int i = 0; i < 6; i++) RunFrame(timer, device, 10.0);
+    CHECK(timer.framesMeasured == 0);
+    CHECK(timer.framesDropped == 4);    // Every frame whose slot came round again
+    timer.Shutdown();
+}
+
+static void TestDisjoint() {
+    RecordingDevice device;
+    GpuTimer timer;
+    CHECK(timer.Init(&device, 3));
+    RunFrame(timer, device, 10.0);
+    device.disjoint = true;
+    RunFrame(timer, device, 10.0);
+    device.disjoint = false;
+    RunFrame(timer, device, 10.0);
+    RunFrame(timer, device, 10.0);
+    CHECK(timer.disjointFrames == 1);
+    CHECK(timer.framesMeasured == 2);
+    timer.Shutdown();
+}
+
+static void TestShutdown() {
+    RecordingDevice device;
+    GpuTimer timer;
+    CHECK(timer.Init(&device, 4));
+    CHECK(device.live == 4 * (4 + 2 * GPU_REGION_COUNT));
+    for (int i = 0; i < 3; i++) RunFrame(timer, device, 10.0);
+    timer.Shutdown();
+    CHECK(device.live == 0);
+    CHECK(!timer.Enabled());
+    size_t issued = device.issues.size();
+    RunFrame(timer, device, 10.0);
+    CHECK(device.issues.size() == issued);
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) g_verbose = true;
+    }
+
+    struct {
+        const char* name;
+        void (*run)();
+    } tests[] = {
+        { "unsupported", TestUnsupported },
+        { "create_failure", TestCreateFailure },
+        { "issue_order", TestIssueOrder },
+        { "frame_times", TestFrameTimes },
+        { "region_ends_twice", TestRegionEndsTwice },
+        { "late_results", TestLateResults },
+        { "disjoint", TestDisjoint },
+        { "shutdown", TestShutdown },
+    };
+    for (auto& test : tests) {
+        int before = g_failures;
+        test.run();
+        printf("%-20s %s\n", test.name, g_failures == before ? "ok" : "FAILED");
+    }
+    printf("%d check(s) failed\n", g_failures);
+    return g_failures;
+}
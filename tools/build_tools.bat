@@ -0,0 +1,6 @@
+@echo off
+rem Builds the offline capture tools. Run from a 64-bit (x64) VS developer prompt
+rem so multi-GB captures can be memory-mapped.
+cd /d "%~dp0"
+cl /nologo /O2 /EHsc /std:c++17 reg_heatmap.cpp /Fe:reg_heatmap.exe
+cl /nologo /O2 /EHsc /std:c++17 detector_tune.cpp /Fe:detector_tune.exe
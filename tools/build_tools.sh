@@ -0,0 +1,7 @@
+#!/bin/sh
+# Builds the offline capture tools on Linux/macOS.
+set -e
+cd "$(dirname "$0")"
+CXX=${CXX:-g++}
+$CXX -O2 -std=c++17 -Wall -o reg_heatmap reg_heatmap.cpp
+$CXX -O2 -std=c++17 -Wall -o detector_tune detector_tune.cpp
@@ -0,0 +1,298 @@
+/**
+ * detector_tune - Grid search over the view matrix detector thresholds
+ *
+ * Replays a corpus of captures (capture_format.h) through the detection core
+ * (camera_detect.h) the way the proxy uses it: the first c5-c8 upload per
+ * frame classified VIEW_WORLD becomes the camera. Each parameter set is scored
+ * against an offline oracle and the Pareto-optimal sets are printed as an
+ * INI fragment for camera_proxy.ini.
+ *
+ * Oracle (independent of the tuned thresholds): strictly rigid view matrices
+ * (unit, mutually orthogonal rows to 1e-3, w exact to 1e-4, translation off
+ * the origin) are linked frame to frame into tracks when their translations
+ * lie within 5% of the distance from the origin (+50 units). The frame's
+ * camera is the first upload on a track that lasts two frames or more and
+ * moves at some point; UI and screen-space views never move.
+ *
+ * Usage: detector_tune <capture.bin> [more captures...] [-o tuned.ini]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "../camera_detect.h"
+#include "../capture_format.h"
+
+static const uint32_t kViewRegister = 5;
+
+// One c5-c8 upload, in capture order
+struct Candidate {
+    float m[16];
+    uint32_t frame;                 // Frame index across the whole corpus
+};
+
+struct Corpus {
+    std::vector<Candidate> candidates;
+    std::vector<uint32_t> frameStart;   // First candidate of each frame, plus a sentinel
+    std::vector<int> oracle;            // Per frame: candidate index of the true camera, -1 = none
+    std::vector<uint8_t> onset;         // Per frame: oracle camera present after a frame without one
+};
+
+struct Result {
+    DetectParams params;
+    double accuracy;                // Frames where the detector picked the oracle's camera (or agreed there was none)
+    double falseAccepts;            // Frames with a camera picked where the oracle has a different or no camera
+    double lockLatency;             // Mean frames from a camera onset until the detector first agrees
+    double nsPerUpload;
+    bool pareto;
+};
+
+static bool StrictView(const float* m, float* translation) {
+    for (int r = 0; r < 3; r++) {
+        const float* a = m + r * 4;
+        if (fabsf(a[0] * a[0] + a[1] * a[1] + a[2] * a[2] - 1.0f) > 1e-3f) return false;
+        if (fabsf(a[3]) > 1e-4f) return false;
+        for (int s = r + 1; s < 3; s++) {
+            const float* b = m + s * 4;
+            if (fabsf(a[0] * b[0] + a[1] * b[1] + a[2] * b[2]) > 1e-3f) return false;
+        }
+    }
+    if (fabsf(m[15] - 1.0f) > 1e-4f) return false;
+    *translation = sqrtf(m[12] * m[12] + m[13] * m[13] + m[14] * m[14]);
+    return *translation > 1.0f;
+}
+
+static bool LoadCapture(const char* path, Corpus* corpus, uint32_t* frameBase) {
+    CaptureReader reader;
+    if (!reader.Open(path)) {
+        fprintf(stderr, "%s: cannot open or not a capture file\n", path);
+        return false;
+    }
+    uint32_t frame = *frameBase;
+    corpus->frameStart.push_back((uint32_t)corpus->candidates.size());
+    CaptureRecord r;
+    while (reader.Next(&r)) {
+        if (r.type == CAP_FRAME) {
+            frame++;
+            corpus->frameStart.push_back((uint32_t)corpus->candidates.size());
+        } else if (r.type == CAP_VS_CONSTANTS && r.arg <= kViewRegister && r.arg + r.count >= kViewRegister + 4) {
+            Candidate c;
+            memcpy(c.m, r.data + (kViewRegister - r.arg) * 4, sizeof(c.m));
+            c.frame = frame;
+            corpus->candidates.push_back(c);
+        }
+    }
+    // Drop the trailing partial frame's start; its uploads are folded into the last frame
+    corpus->frameStart.pop_back();
+    *frameBase = frame;
+    return true;
+}
+
+static void BuildOracle(Corpus* corpus) {
+    size_t frames = corpus->frameStart.size();
+    corpus->frameStart.push_back((uint32_t)corpus->candidates.size());
+
+    // Link strict candidates frame to frame into tracks; a track is a 3D camera
+    // only if its matrix ever changes (UI/screen views upload the same one forever)
+    std::vector<int> track(corpus->candidates.size(), -1);
+    std::vector<uint8_t> trackMoves;
+    std::vector<uint32_t> trackLength;
+    std::vector<int> previous, current;
+    for (size_t f = 0; f < frames; f++) {
+        current.clear();
+        for (uint32_t i = corpus->frameStart[f]; i < corpus->frameStart[f + 1]; i++) {
+            float ta;
+            const float* a = corpus->candidates[i].m;
+            if (!StrictView(a, &ta)) continue;
+            current.push_back((int)i);
+
+            int best = -1;
+            float bestDist = 0.05f * ta + 50.0f;
+            for (int j : previous) {
+                const float* b = corpus->candidates[j].m;
+                float dx = a[12] - b[12], dy = a[13] - b[13], dz = a[14] - b[14];
+                float d = sqrtf(dx * dx + dy * dy + dz * dz);
+                if (d < bestDist) {
+                    bestDist = d;
+                    best = j;
+                }
+            }
+            if (best >= 0) {
+                track[i] = track[best];
+                trackMoves[track[i]] |= memcmp(a, corpus->candidates[best].m, sizeof(float) * 16) != 0;
+            } else {
+                track[i] = (int)trackMoves.size();
+                trackMoves.push_back(0);
+                trackLength.push_back(0);
+            }
+            trackLength[track[i]]++;
+        }
+        previous.swap(current);
+    }
+
+    corpus->oracle.assign(frames, -1);
+    corpus->onset.assign(frames, 0);
+    for (size_t f = 0; f < frames; f++) {
+        for (uint32_t i = corpus->frameStart[f]; i < corpus->frameStart[f + 1]; i++) {
+            int t = track[i];
+            if (t >= 0 && trackMoves[t] && trackLength[t] >= 2) {
+                corpus->oracle[f] = (int)i;
+                break;
+            }
+        }
+        corpus->onset[f] = corpus->oracle[f] >= 0 && (f == 0 || corpus->oracle[f - 1] < 0);
+    }
+}
+
+static Result Evaluate(const Corpus& corpus, const DetectParams& params) {
+    size_t frames = corpus.oracle.size();
+    std::vector<int> picked(frames, -1);
+
+    // Timed part: exactly the per-upload work the proxy does
+    auto start = std::chrono::steady_clock::now();
+    for (size_t f = 0; f < frames; f++) {
+        for (uint32_t i = corpus.frameStart[f]; i < corpus.frameStart[f + 1]; i++) {
+            if (ClassifyViewMatrix(corpus.candidates[i].m, params) == VIEW_WORLD && picked[f] < 0) {
+                picked[f] = (int)i;
+            }
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    Result r = {};
+    r.params = params;
+    size_t correct = 0, falseAccepts = 0, onsets = 0;
+    double latency = 0.0;
+    for (size_t f = 0; f < frames; f++) {
+        if (picked[f] == corpus.oracle[f]) correct++;
+        else if (picked[f] >= 0) falseAccepts++;
+
+        if (corpus.onset[f]) {
+            // Frames until the detector agrees, capped at the end of this camera run
+            size_t g = f;
+            while (g < frames && corpus.oracle[g] >= 0 && picked[g] != corpus.oracle[g]) g++;
+            latency += (double)(g - f);
+            onsets++;
+        }
+    }
+    r.accuracy = frames ? (double)correct / frames : 0.0;
+    r.falseAccepts = frames ? (double)falseAccepts / frames : 0.0;
+    r.lockLatency = onsets ? latency / onsets : 0.0;
+    r.nsPerUpload = corpus.candidates.empty() ? 0.0 : ns / corpus.candidates.size();
+    return r;
+}
+
+// a dominates b: no worse on every objective and better on at least one
+static bool Dominates(const Result& a, const Result& b) {
+    // Timings within 5% of each other are run-to-run noise, not a difference
+    double nsTolerance = 0.05 * (std::max)(a.nsPerUpload, b.nsPerUpload);
+    bool nsNoWorse = a.nsPerUpload <= b.nsPerUpload + nsTolerance;
+    bool nsBetter = a.nsPerUpload < b.nsPerUpload - nsTolerance;
+    bool noWorse = a.accuracy >= b.accuracy && a.lockLatency <= b.lockLatency && nsNoWorse;
+    bool better = a.accuracy > b.accuracy || a.lockLatency < b.lockLatency || nsBetter;
+    return noWorse && better;
+}
+
+int main(int argc, char** argv) {
+    std::vector<const char*> inputs;
+    const char* outPath = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) outPath = argv[++i];
+        else inputs.push_back(argv[i]);
+    }
+    if (inputs.empty()) {
+        fprintf(stderr, "usage: %s <capture.bin> [more captures...] [-o tuned.ini]\n", argv[0]);
+        return 1;
+    }
+
+    Corpus corpus;
+    uint32_t frameBase = 0;
+    for (const char* path : inputs) {
+        if (!LoadCapture(path, &corpus, &frameBase)) return 1;
+    }
+    BuildOracle(&corpus);
+    size_t cameraFrames = 0;
+    for (int o : corpus.oracle) cameraFrames += o >= 0;
+    printf("%zu captures, %zu frames (%zu with an oracle camera), %zu c5-c8 uploads\n",
+           inputs.size(), corpus.oracle.size(), cameraFrames, corpus.candidates.size());
+
+    const float normGrid[] = { 0.01f, 0.02f, 0.05f, 0.1f, 0.15f, 0.2f, 0.3f };
+    const float wGrid[] = { 0.0001f, 0.001f, 0.01f, 0.05f };
+    const float translationGrid[] = { 0.0f, 1.0f, 10.0f, 25.0f, 50.0f, 100.0f, 200.0f };
+
+    std::vector<Result> results;
+    for (float n : normGrid) {
+        for (float w : wGrid) {
+            for (float t : translationGrid) {
+                DetectParams p;
+                p.normTolerance = n;
+                p.wTolerance = w;
+                p.minTranslation = t;
+                Evaluate(corpus, p);   // Warm-up pass so timings are comparable
+                results.push_back(Evaluate(corpus, p));
+            }
+        }
+    }
+
+    for (Result& a : results) {
+        a.pareto = true;
+        for (const Result& b : results) {
+            if (Dominates(b, a)) {
+                a.pareto = false;
+                break;
+            }
+        }
+    }
+    std::sort(results.begin(), results.end(), [](const Result& a, const Result& b) {
+        if (a.accuracy != b.accuracy) return a.accuracy > b.accuracy;
+        if (a.lockLatency != b.lockLatency) return a.lockLatency < b.lockLatency;
+        return a.nsPerUpload < b.nsPerUpload;
+    });
+
+    DetectParams defaults;
+    Result current = Evaluate(corpus, defaults);
+    printf("\nCurrent defaults: norm %.3f w %.4f trans %.0f -> accuracy %.2f%%, false accepts %.2f%%, lock %.2f frames, %.2f ns/upload\n",
+           defaults.normTolerance, defaults.wTolerance, defaults.minTranslation,
+           current.accuracy * 100.0, current.falseAccepts * 100.0, current.lockLatency, current.nsPerUpload);
+
+    printf("\nPareto set (accuracy, lock latency, ns/upload):\n");
+    printf("   norm      w    trans  accuracy  false-acc  lock(frames)  ns/upload\n");
+    for (const Result& r : results) {
+        if (!r.pareto) continue;
+        printf("  %5.3f  %6.4f  %5.0f  %7.2f%%  %8.2f%%  %12.2f  %9.2f\n", r.params.normTolerance, r.params.wTolerance,
+               r.params.minTranslation, r.accuracy * 100.0, r.falseAccepts * 100.0, r.lockLatency, r.nsPerUpload);
+    }
+
+    // INI fragment: the most accurate Pareto set active, the rest as commented alternatives
+    FILE* out = outPath ? fopen(outPath, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "%s: cannot write\n", outPath);
+        return 1;
+    }
+    if (!outPath) printf("\n");
+    fprintf(out, "; detector_tune over %zu frames from %zu capture(s)\n", corpus.oracle.size(), inputs.size());
+    fprintf(out, "[CameraProxy]\n");
+    bool first = true;
+    int written = 0;
+    for (const Result& r : results) {
+        if (!r.pareto || written++ == 8) continue;
+        const char* prefix = first ? "" : ";";
+        fprintf(out, "%s; accuracy %.2f%%, lock %.2f frames, %.2f ns/upload\n", first ? "" : "\n",
+                r.accuracy * 100.0, r.lockLatency, r.nsPerUpload);
+        fprintf(out, "%sViewNormTolerance=%g\n", prefix, r.params.normTolerance);
+        fprintf(out, "%sViewWTolerance=%g\n", prefix, r.params.wTolerance);
+        fprintf(out, "%sMinViewTranslation=%g\n", prefix, r.params.minTranslation);
+        first = false;
+    }
+    if (outPath) {
+        fclose(out);
+        printf("\nINI fragment written to %s\n", outPath);
+    }
+    return 0;
+}
@@ -0,0 +1,219 @@
+/**
+ * reg_heatmap - Vertex shader constant register heatmap for capture files
+ *
+ * Reads a camera_proxy_capture.bin (capture_format.h) and reports, per
+ * register, how often it is written and how often the write is redundant
+ * (same value already in the register), the distribution of upload run
+ * lengths, per-shader upload statistics, and which 4-register windows pass
+ * the view matrix test (camera_detect.h).
+ *
+ * Usage: reg_heatmap <capture.bin> [csv prefix]
+ *   Prints a compact table; with a prefix also writes
+ *   <prefix>_registers.csv, <prefix>_shaders.csv and <prefix>_frames.csv.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "../camera_detect.h"
+#include "../capture_format.h"
+
+static const int kRegisters = 256;
+
+struct RegisterStats {
+    uint64_t writes = 0;
+    uint64_t redundant = 0;
+    uint64_t viewWorld = 0;         // Window starting here passed as a 3D camera
+    uint64_t viewSmall = 0;         // Window starting here is view-shaped but near the origin
+};
+
+struct ShaderStats {
+    uint32_t id = 0;
+    uint64_t binds = 0;
+    uint64_t uploads = 0;
+    uint64_t registersWritten = 0;
+    uint64_t redundant = 0;
+    uint64_t draws = 0;
+};
+
+struct FrameStats {
+    uint32_t frame;
+    uint32_t uploads;
+    uint32_t registersWritten;
+    uint32_t redundant;
+    uint32_t draws;
+    uint32_t viewWorld;
+};
+
+// Run lengths bucketed as 1, 2, 3, 4, 5-8, 9-16, 17-32, 33+
+static int RunBucket(uint32_t count) {
+    if (count <= 4) return count ? count - 1 : 0;
+    if (count <= 8) return 4;
+    if (count <= 16) return 5;
+    if (count <= 32) return 6;
+    return 7;
+}
+static const char* kRunBucketNames[] = { "1", "2", "3", "4", "5-8", "9-16", "17-32", "33+" };
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <capture.bin> [csv prefix]\n", argv[0]);
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    CaptureReader reader;
+    if (!reader.Open(argv[1])) {
+        fprintf(stderr, "%s: cannot open or not a capture file\n", argv[1]);
+        return 1;
+    }
+
+    DetectParams params;
+    RegisterStats regs[kRegisters];
+    float shadow[kRegisters][4];
+    bool known[kRegisters] = {};
+    uint64_t runs[8] = {};
+    uint64_t uploads = 0, registersWritten = 0, redundantTotal = 0;
+    std::unordered_map<uint32_t, ShaderStats> shaders;
+    std::vector<FrameStats> frames;
+    FrameStats frame = {};
+    ShaderStats* shader = &shaders[0];
+
+    CaptureRecord r;
+    while (reader.Next(&r)) {
+        switch (r.type) {
+            case CAP_FRAME:
+                frame.frame = r.arg;
+                frames.push_back(frame);
+                frame = FrameStats();
+                break;
+
+            case CAP_VERTEX_SHADER:
+                shader = &shaders[r.arg];
+                shader->id = r.arg;
+                shader->binds++;
+                break;
+
+            case CAP_DRAW:
+                shader->draws++;
+                frame.draws++;
+                break;
+
+            case CAP_VS_CONSTANTS: {
+                uploads++;
+                frame.uploads++;
+                shader->uploads++;
+                runs[RunBucket(r.count)]++;
+                for (uint32_t i = 0; i < r.count; i++) {
+                    uint32_t reg = r.arg + i;
+                    if (reg >= kRegisters) break;
+                    const float* v = r.data + i * 4;
+                    bool same = known[reg] && memcmp(shadow[reg], v, 16) == 0;
+                    regs[reg].writes++;
+                    registersWritten++;
+                    frame.registersWritten++;
+                    shader->registersWritten++;
+                    if (same) {
+                        regs[reg].redundant++;
+                        redundantTotal++;
+                        frame.redundant++;
+                        shader->redundant++;
+                    } else {
+                        memcpy(shadow[reg], v, 16);
+                        known[reg] = true;
+                    }
+
+                    // Every 4-register window fully inside this upload is a view candidate
+                    if (i + 4 <= r.count && reg + 4 <= kRegisters) {
+                        ViewVerdict verdict = ClassifyViewMatrix(v, params);
+                        if (verdict == VIEW_WORLD) {
+                            regs[reg].viewWorld++;
+                            frame.viewWorld++;
+                        } else if (verdict == VIEW_SMALL_TRANSLATION) {
+                            regs[reg].viewSmall++;
+                        }
+                    }
+                }
+                break;
+            }
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t frameCount = frames.empty() ? 1 : frames.size();
+
+    printf("%s: %.1f MB, %zu frames, %llu uploads, %llu registers written (%.1f%% redundant), %.2f s (%.0f MB/s)\n",
+           argv[1], reader.Size() / (1024.0 * 1024.0), frames.size(), (unsigned long long)uploads,
+           (unsigned long long)registersWritten, registersWritten ? 100.0 * redundantTotal / registersWritten : 0.0,
+           seconds, seconds > 0.0 ? reader.Size() / (1024.0 * 1024.0) / seconds : 0.0);
+
+    printf("\nUpload run lengths (float4 registers per SetVertexShaderConstantF):\n ");
+    for (int b = 0; b < 8; b++) {
+        printf(" %s:%.1f%%", kRunBucketNames[b], uploads ? 100.0 * runs[b] / uploads : 0.0);
+    }
+    printf("\n\nRegisters (written at least once):\n");
+    printf("  reg   writes/frame  redundant  view-world  view-small\n");
+    for (int reg = 0; reg < kRegisters; reg++) {
+        const RegisterStats& s = regs[reg];
+        if (!s.writes) continue;
+        printf("  c%-4d %12.1f  %8.1f%%  %10llu  %10llu\n", reg, (double)s.writes / frameCount,
+               100.0 * s.redundant / s.writes, (unsigned long long)s.viewWorld, (unsigned long long)s.viewSmall);
+    }
+
+    std::vector<ShaderStats> sorted;
+    for (auto& kv : shaders) {
+        if (kv.second.uploads || kv.second.draws) sorted.push_back(kv.second);
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const ShaderStats& a, const ShaderStats& b) {
+                  return a.registersWritten != b.registersWritten ? a.registersWritten > b.registersWritten : a.id < b.id;
+              });
+    printf("\nTop shaders by registers written:\n");
+    printf("  shader       binds/frame  uploads/frame  regs/frame  redundant  draws/frame\n");
+    for (size_t i = 0; i < sorted.size() && i < 16; i++) {
+        const ShaderStats& s = sorted[i];
+        printf("  %08x  %12.1f  %13.1f  %10.1f  %8.1f%%  %11.1f\n", s.id, (double)s.binds / frameCount,
+               (double)s.uploads / frameCount, (double)s.registersWritten / frameCount,
+               s.registersWritten ? 100.0 * s.redundant / s.registersWritten : 0.0, (double)s.draws / frameCount);
+    }
+
+    if (argc >= 3) {
+        std::string prefix = argv[2];
+        FILE* f = fopen((prefix + "_registers.csv").c_str(), "w");
+        if (f) {
+            fprintf(f, "register,writes,redundant,writes_per_frame,view_world,view_small\n");
+            for (int reg = 0; reg < kRegisters; reg++) {
+                const RegisterStats& s = regs[reg];
+                fprintf(f, "%d,%llu,%llu,%.3f,%llu,%llu\n", reg, (unsigned long long)s.writes,
+                        (unsigned long long)s.redundant, (double)s.writes / frameCount,
+                        (unsigned long long)s.viewWorld, (unsigned long long)s.viewSmall);
+            }
+            fclose(f);
+        }
+        f = fopen((prefix + "_shaders.csv").c_str(), "w");
+        if (f) {
+            fprintf(f, "shader,binds,uploads,registers_written,redundant,draws\n");
+            for (const ShaderStats& s : sorted) {
+                fprintf(f, "%08x,%llu,%llu,%llu,%llu,%llu\n", s.id, (unsigned long long)s.binds,
+                        (unsigned long long)s.uploads, (unsigned long long)s.registersWritten,
+                        (unsigned long long)s.redundant, (unsigned long long)s.draws);
+            }
+            fclose(f);
+        }
+        f = fopen((prefix + "_frames.csv").c_str(), "w");
+        if (f) {
+            fprintf(f, "frame,uploads,registers_written,redundant,draws,view_world\n");
+            for (const FrameStats& s : frames) {
+                fprintf(f, "%u,%u,%u,%u,%u,%u\n", s.frame, s.uploads, s.registersWritten, s.redundant, s.draws, s.viewWorld);
+            }
+            fclose(f);
+        }
+        printf("\nCSV written to %s_{registers,shaders,frames}.csv\n", prefix.c_str());
+    }
+    return 0;
+}